@@ -95,7 +95,21 @@ panfrost_shader_compile(struct pipe_screen *pscreen,
         struct util_dynarray binary;
 
         util_dynarray_init(&binary, NULL);
-        screen->vtbl.compile_shader(s, &inputs, &binary, &state->info);
+
+        /* shader-db wants the compiler statistics, so always compile */
+        bool use_cache = screen->disk_cache && !inputs.shaderdb;
+        cache_key cache_key;
+
+        if (use_cache)
+                panfrost_disk_cache_compute_key(screen, s, &inputs, &state->key, cache_key);
+
+        if (!use_cache || !panfrost_disk_cache_retrieve(screen, cache_key, &binary, &state->info)) {
+                util_dynarray_clear(&binary);
+                screen->vtbl.compile_shader(s, &inputs, &binary, &state->info);
+
+                if (use_cache)
+                        panfrost_disk_cache_store(screen, cache_key, &binary, &state->info);
+        }
 
         if (binary.size) {
                 state->bin = panfrost_pool_take_ref(shader_pool,
@@ -1148,7 +1148,7 @@ panfrost_upload_ssbo_sysval(struct panfrost_batch *batch,
 
         panfrost_batch_write_rsrc(batch, rsrc, st);
 
-        util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+        util_range_add(&rsrc->base, &rsrc->tc.valid_buffer_range,
                         sb.buffer_offset, sb.buffer_size);
 
         /* Upload address and size as sysval */
@@ -1310,7 +1310,7 @@ panfrost_upload_sysvals(struct panfrost_batch *batch,
                         struct panfrost_resource *rsrc = pan_resource(target->buffer);
                         unsigned offset = panfrost_xfb_offset(stride, target);
 
-                        util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                        util_range_add(&rsrc->base, &rsrc->tc.valid_buffer_range,
                                 offset, target->buffer_size - offset);
 
                         panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_VERTEX);
@@ -1441,13 +1441,12 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
                         unsigned *pushed_words)
 {
         struct panfrost_context *ctx = batch->ctx;
-        struct panfrost_shader_variants *all = ctx->shader[stage];
+        struct panfrost_shader_state *ss = panfrost_get_shader_state(ctx, stage);
 
-        if (!all)
+        if (!ss)
                 return 0;
 
         struct panfrost_constant_buffer *buf = &ctx->constant_buffer[stage];
-        struct panfrost_shader_state *ss = &all->variants[all->active_variant];
 
         /* Allocate room for the sysval and the uniforms */
         size_t sys_size = sizeof(float) * 4 * ss->info.sysvals.sysval_count;
@@ -1567,8 +1566,8 @@ panfrost_emit_shared_memory(struct panfrost_batch *batch,
 {
         struct panfrost_context *ctx = batch->ctx;
         struct panfrost_device *dev = pan_device(ctx->base.screen);
-        struct panfrost_shader_variants *all = ctx->shader[PIPE_SHADER_COMPUTE];
-        struct panfrost_shader_state *ss = &all->variants[all->active_variant];
+        struct panfrost_shader_state *ss =
+                panfrost_get_shader_state(ctx, PIPE_SHADER_COMPUTE);
         struct panfrost_ptr t =
                 pan_pool_alloc_desc(&batch->pool.base, LOCAL_STORAGE);
 
@@ -2239,7 +2238,7 @@ panfrost_emit_streamout(struct panfrost_batch *batch,
                 cfg.stride = stride;
                 cfg.size = MIN2(max_size, expected_size) + (offset & 63);
 
-                util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                util_range_add(&rsrc->base, &rsrc->tc.valid_buffer_range,
                                 offset, cfg.size);
         }
 }
@@ -2825,23 +2824,81 @@ emit_fragment_job(struct panfrost_batch *batch, const struct pan_fb_info *pfb)
         return transfer.gpu;
 }
 
-// TODO: Check that we don't go past CS_EXTRACT
-// TODO: Maybe we need an explicit jump back?
+#if PAN_ARCH <= 9
 static void
-wrap_csf(struct panfrost_bo *bo, pan_command_stream *s)
+emit_write_timestamp(struct panfrost_batch *batch,
+                     struct pan_scoreboard *scoreboard,
+                     mali_ptr address)
 {
-        assert((void *)s->ptr <= bo->ptr.cpu + bo->size);
+        struct panfrost_ptr job =
+                pan_pool_alloc_desc(&batch->pool.base, WRITE_VALUE_JOB);
 
-        if ((void *)s->ptr >= bo->ptr.cpu + bo->size / 2)
-                s->ptr = bo->ptr.cpu;
+        pan_section_pack(job.cpu, WRITE_VALUE_JOB, PAYLOAD, cfg) {
+                cfg.address = address;
+                cfg.type = MALI_WRITE_VALUE_TYPE_SYSTEM_TIMESTAMP;
+        }
+
+        panfrost_add_job(&batch->pool.base, scoreboard,
+                         MALI_JOB_TYPE_WRITE_VALUE, false, false, 0, 0,
+                         &job, false);
+}
+
+/* Timestamps written from the job chain are sampled when the job runs, which
+ * is good enough for the start of a time elapsed query since nothing of the
+ * query has run yet */
+
+static void
+emit_timestamp(struct panfrost_batch *batch, mali_ptr address)
+{
+        emit_write_timestamp(batch, &batch->scoreboard, address);
+        batch->writes_timestamp = true;
+}
+
+static mali_ptr
+emit_timestamps(struct panfrost_batch *batch)
+{
+        struct pan_scoreboard scoreboard = { 0 };
+
+        util_dynarray_foreach(&batch->timestamps, mali_ptr, address)
+                emit_write_timestamp(batch, &scoreboard, *address);
+
+        return scoreboard.first_job;
 }
+#endif
 
-// todo this seems inefficient
-#define W wrap_csf(cs->bo, &cs->cs)
+/* Make sure that there is space for size bytes of commands in the ring
+ * buffer. Submission is asynchronous, so before wrapping back to the start of
+ * the ring we have to wait for the GPU to consume everything already
+ * submitted. The end of the ring is cleared to NOPs, so that stale commands
+ * from an earlier pass are not executed again. */
+static void
+panfrost_cs_reserve(struct panfrost_device *dev, struct panfrost_cs *cs,
+                    unsigned size)
+{
+        struct panfrost_bo *bo = cs->bo;
+        void *ptr = cs->cs.ptr;
+        void *end = bo->ptr.cpu + bo->size;
+
+        assert(size <= bo->size);
+
+        if (ptr + size <= end)
+                return;
+
+        dev->mali.cs_wait(&dev->mali, &cs->base, cs->base.last_insert);
+
+        memset(ptr, 0, end - ptr);
+        cs->cs.ptr = bo->ptr.cpu;
+}
+
+/* Upper bound on the size of the commands emit_csf_queue adds around the
+ * batch command stream */
+#define CSF_QUEUE_OVERHEAD (32 * 8)
 
 // TODO: Rewrite this!
 static void
-emit_csf_queue(struct panfrost_cs *cs, struct panfrost_bo *bo, pan_command_stream s)
+emit_csf_queue(struct panfrost_device *dev, struct panfrost_cs *cs,
+               struct panfrost_bo *bo, pan_command_stream s,
+               struct panfrost_cs *wait)
 {
         // TODO clean up ifdef
 #if PAN_ARCH >= 10
@@ -2851,43 +2908,58 @@ emit_csf_queue(struct panfrost_cs *cs, struct panfrost_bo *bo, pan_command_strea
 
         pan_command_stream *c = &cs->cs;
 
-        /* First, do some waiting at the start of the job */
+        unsigned length = (void *)s.ptr - bo->ptr.cpu;
+        panfrost_cs_reserve(dev, cs, length + CSF_QUEUE_OVERHEAD);
+
+        /* Wait for the work last submitted to the other queue. This keeps
+         * the ordering between queues now that the CPU does not wait for
+         * each batch to complete. */
+        if (wait) {
+                // TODO: this assumes SAME_VA
+                pan_emit_cs_48(c, 0x48, wait->event_ptr);
+                pan_emit_cs_48(c, 0x4a, wait->seqnum);
+                // TODO genxmlify... this is a 64-bit EVWAIT instruction
+                pan_emit_cs_ins(c, 53, 0x484a10000000);
+        }
+
+        /* Once the other queue is done, clean and invalidate the L2 and
+         * load/store caches and wait for the flush before starting any job.
+         * The jobs of this queue then see everything the other queue wrote,
+         * which is what the CPU used to ensure by waiting for the vertex
+         * queue to go idle before each submit. */
 
         // #0x1, #0xffffe0, #0xffffe1 also seen
-        pan_emit_cs_32(c, 0x54, 0); W;
-        // TODO genxmlify
-        pan_emit_cs_ins(c, 0x24, 0x540000000233ULL); W;
-        // TODO: What does this need to be?
-        pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; } W;
+        pan_emit_cs_32(c, 0x54, 0);
+        // TODO genxmlify... this is a FLUSH_CACHE2 instruction
+        pan_emit_cs_ins(c, 0x24, 0x540000000233ULL);
+        pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; }
 
         /* This should eventually be changed to a call (see three commeneted
-         * lines), but copying to the main buffer makes debugging easier.
-         * TODO what happens if this wraps? */
-        unsigned length = (void *)s.ptr - bo->ptr.cpu;
+         * lines), but copying to the main buffer makes debugging easier. */
         memcpy(c->ptr, bo->ptr.cpu, length);
         c->ptr += length / 8;
 
-        //pan_emit_cs_48(c, 0x48, bo->ptr.gpu); W;
-        //pan_emit_cs_32(c, 0x4a, (void *)s.ptr - bo->ptr.cpu); W;
+        //pan_emit_cs_48(c, 0x48, bo->ptr.gpu);
+        //pan_emit_cs_32(c, 0x4a, (void *)s.ptr - bo->ptr.cpu);
         //pan_pack_ins(c, CS_CALL, cfg) { cfg.address = 0x48; cfg.length = 0x4a; }
 
         /* TODO define... this is tiler|idvs */
         if (cs->mask & 12) {
-                pan_pack_ins(c, CS_FLUSH_TILER, _) { } W;
-                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 2; } W;
+                pan_pack_ins(c, CS_FLUSH_TILER, _) { }
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 2; }
         } else {
                 // This could I think be optimised to 0xf80211 rather than 0x233
                 // TODO: Does this need to run for vertex jobs?
                 // What about when doing transform feedback?
-                pan_emit_cs_32(c, 0x54, 0); W;
-                pan_emit_cs_ins(c, 0x24, 0x540000000233ULL); W;
+                pan_emit_cs_32(c, 0x54, 0);
+                pan_emit_cs_ins(c, 0x24, 0x540000000233ULL);
         }
 
-        pan_emit_cs_48(c, 0x48, cs->event_ptr); W;
+        pan_emit_cs_48(c, 0x48, cs->event_ptr);
         // TODO: What about overflow... just use EVADD instead?
-        pan_emit_cs_48(c, 0x4a, ++cs->seqnum + 1); W;
+        pan_emit_cs_48(c, 0x4a, ++cs->seqnum + 1);
         // TODO genxmlify...  this is a 64-bit EVSTR instruction
-        pan_emit_cs_ins(c, 52, 0x01484a00040001); W;
+        pan_emit_cs_ins(c, 52, 0x01484a00040001);
 #endif
 }
 
@@ -2895,22 +2967,15 @@ emit_csf_queue(struct panfrost_cs *cs, struct panfrost_bo *bo, pan_command_strea
 static void
 emit_csf_toplevel(struct panfrost_batch *batch)
 {
-        emit_csf_queue(&batch->ctx->kbase_cs_vertex, batch->cs_vertex_bo, batch->cs_vertex);
-
-        // TODO: this is duplicated from emit_csf_queue
-        if (batch->cs_fragment.ptr == batch->cs_fragment_bo->ptr.cpu)
-                return;
-
-        uint64_t vertex_seqnum = batch->ctx->kbase_cs_vertex.seqnum;
-        // TODO: this assumes SAME_VA
-        mali_ptr seqnum_ptr = (uintptr_t) batch->ctx->kbase_cs_vertex.event_ptr;
-
-        pan_emit_cs_48(&batch->ctx->kbase_cs_fragment.cs, 0x48, seqnum_ptr);
-        pan_emit_cs_48(&batch->ctx->kbase_cs_fragment.cs, 0x4a, vertex_seqnum);
-        // TODO genxmlify... this is a 64-bit EVWAIT instruction
-        pan_emit_cs_ins(&batch->ctx->kbase_cs_fragment.cs, 53, 0x484a10000000);
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
 
-        emit_csf_queue(&batch->ctx->kbase_cs_fragment, batch->cs_fragment_bo, batch->cs_fragment);
+        /* Vertex jobs may read resources written by the previous fragment
+         * job, and the fragment job needs the vertex job's tiler output */
+        emit_csf_queue(dev, &ctx->kbase_cs_vertex, batch->cs_vertex_bo,
+                       batch->cs_vertex, &ctx->kbase_cs_fragment);
+        emit_csf_queue(dev, &ctx->kbase_cs_fragment, batch->cs_fragment_bo,
+                       batch->cs_fragment, &ctx->kbase_cs_vertex);
 }
 
 static void
@@ -2919,11 +2984,11 @@ init_cs(struct panfrost_context *ctx, struct panfrost_cs *cs)
         struct panfrost_device *dev = pan_device(ctx->base.screen);
         pan_command_stream *c = &cs->cs;
 
-        pan_pack_ins(c, CS_SET_ITERATOR, cfg) { cfg.iterator = cs->mask; } W;
-        pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 2; } W;
+        pan_pack_ins(c, CS_SET_ITERATOR, cfg) { cfg.iterator = cs->mask; }
+        pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 2; }
 
         // 16 bytes
-        dev->mali.cs_submit(&dev->mali, &cs->base, 16, NULL, 0);
+        dev->mali.cs_submit(&dev->mali, &cs->base, 16, NULL, 0, NULL, 0);
         //dev->mali.cs_wait(&dev->mali, &cs->base, 16);
 }
 
@@ -3706,7 +3771,7 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
                 return;
 
         struct panfrost_shader_state *vs = panfrost_get_shader_state(ctx, PIPE_SHADER_VERTEX);
-        struct panfrost_shader_variants v = { .variants = vs->xfb };
+        struct panfrost_shader_variants v = { .variants = { vs->xfb } };
 
         vs->xfb->stream_output = vs->stream_output;
 
@@ -3716,6 +3781,7 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
         mali_ptr saved_push = batch->push_uniforms[PIPE_SHADER_VERTEX];
 
         ctx->shader[PIPE_SHADER_VERTEX] = &v;
+        ctx->shader_variant[PIPE_SHADER_VERTEX] = vs->xfb;
         batch->rsd[PIPE_SHADER_VERTEX] = panfrost_emit_compute_shader_meta(batch, PIPE_SHADER_VERTEX);
 
 #if PAN_ARCH >= 9
@@ -3777,6 +3843,7 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
 #endif
 
         ctx->shader[PIPE_SHADER_VERTEX] = saved_vs;
+        ctx->shader_variant[PIPE_SHADER_VERTEX] = vs;
         batch->rsd[PIPE_SHADER_VERTEX] = saved_rsd;
         batch->uniform_buffers[PIPE_SHADER_VERTEX] = saved_ubo;
         batch->push_uniforms[PIPE_SHADER_VERTEX] = saved_push;
@@ -3802,6 +3869,10 @@ panfrost_direct_draw(struct panfrost_batch *batch,
             ((ctx->active_prim == PIPE_PRIM_POINTS) ^
              (info->mode       == PIPE_PRIM_POINTS))) {
 
+                if ((ctx->active_prim == PIPE_PRIM_POINTS) ^
+                    (info->mode       == PIPE_PRIM_POINTS))
+                        ctx->shader_key_dirty |= BITFIELD_BIT(PIPE_SHADER_FRAGMENT);
+
                 ctx->active_prim = info->mode;
                 panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
         }
@@ -3972,22 +4043,20 @@ panfrost_direct_draw(struct panfrost_batch *batch,
 static void
 panfrost_indirect_draw(struct panfrost_batch *batch,
                        const struct pipe_draw_info *info,
-                       unsigned drawid_offset,
+                       unsigned drawid,
                        const struct pipe_draw_indirect_info *indirect,
+                       unsigned draw_index,
                        const struct pipe_draw_start_count_bias *draw)
 {
-        /* Indirect draw count and multi-draw not supported. */
-        assert(indirect->draw_count == 1 && !indirect->indirect_draw_count);
-
         struct panfrost_context *ctx = batch->ctx;
         struct panfrost_device *dev = pan_device(ctx->base.screen);
 
-        /* TODO: update statistics (see panfrost_statistics_record()) */
-        /* TODO: Increment transform feedback offsets */
+        /* Statistics and transform feedback offsets are computed on the CPU,
+         * those draws are emulated by panfrost_draw_vbo() */
         assert(ctx->streamout.num_targets == 0);
 
         ctx->active_prim = info->mode;
-        ctx->drawid = drawid_offset;
+        ctx->drawid = drawid;
         ctx->indirect_draw = true;
 
         struct panfrost_shader_state *vs = panfrost_get_shader_state(ctx, PIPE_SHADER_VERTEX);
@@ -4086,9 +4155,25 @@ panfrost_indirect_draw(struct panfrost_batch *batch,
 
         panfrost_batch_read_rsrc(batch, draw_buf, PIPE_SHADER_VERTEX);
 
+        /* With an indirect draw count, the patch job turns draws past the
+         * count into no-ops */
+        mali_ptr draw_count_buf = 0;
+
+        if (indirect->indirect_draw_count) {
+                struct panfrost_resource *count_buf =
+                        pan_resource(indirect->indirect_draw_count);
+
+                panfrost_batch_read_rsrc(batch, count_buf, PIPE_SHADER_VERTEX);
+                draw_count_buf = count_buf->image.data.bo->ptr.gpu +
+                                 indirect->indirect_draw_count_offset;
+        }
+
         struct pan_indirect_draw_info draw_info = {
                 .last_indirect_draw = batch->indirect_draw_job_id,
-                .draw_buf = draw_buf->image.data.bo->ptr.gpu + indirect->offset,
+                .draw_buf = draw_buf->image.data.bo->ptr.gpu + indirect->offset +
+                            (draw_index * indirect->stride),
+                .draw_count_buf = draw_count_buf,
+                .draw_index = draw_index,
                 .index_buf = index_buf ? index_buf->ptr.gpu : 0,
                 .first_vertex_sysval = ctx->first_vertex_sysval_ptr,
                 .base_vertex_sysval = ctx->base_vertex_sysval_ptr,
@@ -4125,7 +4210,7 @@ panfrost_indirect_draw(struct panfrost_batch *batch,
         if (idvs) {
                 panfrost_add_job(&batch->pool.base, &batch->scoreboard,
                                  MALI_JOB_TYPE_INDEXED_VERTEX, false, false,
-                                 0, 0, &tiler, false);
+                                 batch->indirect_draw_job_id, 0, &tiler, false);
         } else {
                 panfrost_emit_vertex_tiler_jobs(batch, &vertex, &tiler);
         }
@@ -4163,8 +4248,12 @@ panfrost_draw_vbo(struct pipe_context *pipe,
         if (!panfrost_render_condition_check(ctx))
                 return;
 
-        /* Emulate indirect draws unless we're using the experimental path */
-        if ((!(dev->debug & PAN_DBG_INDIRECT) || !PAN_GPU_INDIRECTS) && indirect && indirect->buffer) {
+        /* Indirect draws are patched on the GPU where supported. Transform
+         * feedback and primitives generated queries need the vertex count on
+         * the CPU, so emulate those by reading back the draw parameters. */
+        if (indirect && indirect->buffer &&
+            (!PAN_GPU_INDIRECTS || (dev->debug & PAN_DBG_NO_INDIRECT) ||
+             ctx->streamout.num_targets || ctx->prims_generated_queries)) {
                 assert(num_draws == 1);
                 util_draw_indirect(pipe, info, indirect);
                 return;
@@ -4217,7 +4306,17 @@ panfrost_draw_vbo(struct pipe_context *pipe,
                         return;
                 }
 
-                panfrost_indirect_draw(batch, info, drawid_offset, indirect, &draws[0]);
+                for (unsigned i = 0; i < indirect->draw_count; i++) {
+                        if (unlikely(batch->scoreboard.job_index > 10000)) {
+                                batch = panfrost_get_fresh_batch_for_fbo(ctx, "Too many draws");
+                                batch->viewport = panfrost_emit_viewport(batch);
+                        }
+
+                        ctx->dirty |= PAN_DIRTY_PARAMS | PAN_DIRTY_DRAWID;
+                        panfrost_indirect_draw(batch, info, drawid_offset + i,
+                                               indirect, i, &draws[0]);
+                }
+
                 return;
 #endif
         }
@@ -4253,7 +4352,7 @@ panfrost_launch_grid(struct pipe_context *pipe,
         struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
 
         struct panfrost_shader_state *cs =
-                &ctx->shader[PIPE_SHADER_COMPUTE]->variants[0];
+                panfrost_get_shader_state(ctx, PIPE_SHADER_COMPUTE);
 
         /* Indirect dispatch can't handle workgroup local storage since that
          * would require dynamic memory allocation. Bail in this case. */
@@ -4606,10 +4705,7 @@ panfrost_create_sampler_view(
         struct pipe_resource *texture,
         const struct pipe_sampler_view *template)
 {
-        struct panfrost_context *ctx = pan_context(pctx);
-        struct panfrost_sampler_view *so = rzalloc(pctx, struct panfrost_sampler_view);
-
-        pan_legalize_afbc_format(ctx, pan_resource(texture), template->format);
+        struct panfrost_sampler_view *so = rzalloc(NULL, struct panfrost_sampler_view);
 
         pipe_reference(NULL, &texture->reference);
 
@@ -4618,8 +4714,9 @@ panfrost_create_sampler_view(
         so->base.reference.count = 1;
         so->base.context = pctx;
 
-        panfrost_create_sampler_view_bo(so, pctx, texture);
-
+        /* The descriptor is created on first use, as this may be called from
+         * the application thread of a threaded context, and the resource
+         * needs legalizing for AFBC when bound anyway */
         return (struct pipe_sampler_view *) so;
 }
 
@@ -5002,6 +5099,9 @@ GENX(panfrost_cmdstream_screen_init)(struct panfrost_screen *screen)
 #if PAN_ARCH >= 10
         screen->vtbl.emit_csf_toplevel = emit_csf_toplevel;
         screen->vtbl.init_cs = init_cs;
+#else
+        screen->vtbl.emit_timestamp = emit_timestamp;
+        screen->vtbl.emit_timestamps = emit_timestamps;
 #endif
 
         GENX(pan_blitter_init)(dev, &screen->blitter.bin_pool.base,
@@ -49,10 +49,10 @@ panfrost_create_compute_state(
         so->req_input_mem = cso->req_input_mem;
 
         struct panfrost_shader_state *v = calloc(1, sizeof(*v));
-        so->variants = v;
-
-        so->variant_count = 1;
-        so->active_variant = 0;
+        v->so = so;
+        util_queue_fence_init(&v->ready);
+        util_queue_fence_init(&v->job);
+        so->variants[0] = v;
 
         nir_shader *deserialized = NULL;
 
@@ -70,8 +70,18 @@ panfrost_create_compute_state(
                 assert(cso->ir_type == PIPE_SHADER_IR_NIR && "TGSI kernels unsupported");
         }
 
-        panfrost_shader_compile(pctx->screen, &ctx->shaders, &ctx->descs,
-                                deserialized ?: cso->prog, v);
+        if (ctx->tc) {
+                /* We are on the application thread, which can't use the
+                 * context pools, so compile on the compiler queue */
+                so->nir = deserialized ?: (nir_shader *) cso->prog;
+                util_queue_add_job(&screen->compiler.queue, v, &v->job,
+                                   panfrost_compile_variant_job, NULL, 0);
+                util_queue_fence_wait(&v->job);
+                so->nir = NULL;
+        } else {
+                panfrost_shader_compile(pctx->screen, &ctx->shaders, &ctx->descs,
+                                        deserialized ?: cso->prog, v);
+        }
 
         /* There are no variants so we won't need the NIR again */
         ralloc_free(deserialized);
@@ -83,7 +93,10 @@ static void
 panfrost_bind_compute_state(struct pipe_context *pipe, void *cso)
 {
         struct panfrost_context *ctx = pan_context(pipe);
-        ctx->shader[PIPE_SHADER_COMPUTE] = cso;
+        struct panfrost_shader_variants *so = cso;
+
+        ctx->shader[PIPE_SHADER_COMPUTE] = so;
+        ctx->shader_variant[PIPE_SHADER_COMPUTE] = so ? so->variants[0] : NULL;
 }
 
 static void
@@ -92,7 +105,9 @@ panfrost_delete_compute_state(struct pipe_context *pipe, void *cso)
         struct panfrost_shader_variants *so =
                 (struct panfrost_shader_variants *)cso;
 
-        free(so->variants);
+        util_queue_fence_destroy(&so->variants[0]->ready);
+        util_queue_fence_destroy(&so->variants[0]->job);
+        free(so->variants[0]);
         free(cso);
 }
 
@@ -120,7 +135,7 @@ panfrost_set_global_binding(struct pipe_context *pctx,
                 struct panfrost_resource *rsrc = pan_resource(resources[i]);
                 panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_COMPUTE);
 
-                util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                util_range_add(&rsrc->base, &rsrc->tc.valid_buffer_range,
                                 0, rsrc->base.width0);
 
                 /* The handle points to uint32_t, but space is allocated for 64 bits */
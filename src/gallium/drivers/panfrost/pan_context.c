@@ -223,6 +223,7 @@ panfrost_bind_rasterizer_state(
 {
         struct panfrost_context *ctx = pan_context(pctx);
         ctx->rasterizer = hwcso;
+        ctx->shader_key_dirty |= BITFIELD_BIT(PIPE_SHADER_FRAGMENT);
 
         /* We can assume rasterizer is always dirty, the dependencies are
          * too intricate to bother tracking in detail. However we could
@@ -290,73 +291,6 @@ panfrost_bind_vertex_elements_state(
         ctx->dirty |= PAN_DIRTY_VERTEX;
 }
 
-static void *
-panfrost_create_shader_state(
-        struct pipe_context *pctx,
-        const struct pipe_shader_state *cso)
-{
-        struct panfrost_shader_variants *so = CALLOC_STRUCT(panfrost_shader_variants);
-        struct panfrost_device *dev = pan_device(pctx->screen);
-
-        simple_mtx_init(&so->lock, mtx_plain);
-
-        so->stream_output = cso->stream_output;
-
-        if (cso->type == PIPE_SHADER_IR_TGSI)
-                so->nir = tgsi_to_nir(cso->tokens, pctx->screen, false);
-        else
-                so->nir = cso->ir.nir;
-
-        /* Fix linkage early */
-        if (so->nir->info.stage == MESA_SHADER_VERTEX) {
-                so->fixed_varying_mask =
-                        (so->nir->info.outputs_written & BITFIELD_MASK(VARYING_SLOT_VAR0)) &
-                        ~VARYING_BIT_POS & ~VARYING_BIT_PSIZ;
-        }
-
-        /* Precompile for shader-db if we need to */
-        if (unlikely(dev->debug & PAN_DBG_PRECOMPILE)) {
-                struct panfrost_context *ctx = pan_context(pctx);
-
-                struct panfrost_shader_state state = { 0 };
-
-                panfrost_shader_compile(pctx->screen,
-                                        &ctx->shaders, &ctx->descs,
-                                        so->nir, &state);
-        }
-
-        return so;
-}
-
-static void
-panfrost_delete_shader_state(
-        struct pipe_context *pctx,
-        void *so)
-{
-        struct panfrost_shader_variants *cso = (struct panfrost_shader_variants *) so;
-
-        ralloc_free(cso->nir);
-
-        for (unsigned i = 0; i < cso->variant_count; ++i) {
-                struct panfrost_shader_state *shader_state = &cso->variants[i];
-                panfrost_bo_unreference(shader_state->bin.bo);
-                panfrost_bo_unreference(shader_state->state.bo);
-                panfrost_bo_unreference(shader_state->linkage.bo);
-
-                if (shader_state->xfb) {
-                        panfrost_bo_unreference(shader_state->xfb->bin.bo);
-                        panfrost_bo_unreference(shader_state->xfb->state.bo);
-                        panfrost_bo_unreference(shader_state->xfb->linkage.bo);
-                        free(shader_state->xfb);
-                }
-        }
-
-        simple_mtx_destroy(&cso->lock);
-
-        free(cso->variants);
-        free(so);
-}
-
 static void
 panfrost_bind_sampler_states(
         struct pipe_context *pctx,
@@ -460,49 +394,150 @@ update_so_info(struct pipe_stream_output_info *so_info,
 	return so_outputs;
 }
 
-static unsigned
-panfrost_new_variant_locked(
-        struct panfrost_context *ctx,
-        struct panfrost_shader_variants *variants,
-        struct panfrost_shader_key *key)
+/* Compiles a variant claimed by the calling thread, uploading to the given
+ * pools, and wakes up anyone waiting on it */
+
+static void
+panfrost_compile_variant(struct pipe_screen *pscreen,
+                         struct panfrost_pool *shader_pool,
+                         struct panfrost_pool *desc_pool,
+                         struct panfrost_shader_state *shader_state)
+{
+        struct panfrost_shader_variants *variants = shader_state->so;
+
+        panfrost_shader_compile(pscreen, shader_pool, desc_pool,
+                                variants->nir, shader_state);
+
+        /* Fixup the stream out information */
+        shader_state->stream_output = variants->stream_output;
+        shader_state->so_mask =
+                update_so_info(&shader_state->stream_output,
+                               shader_state->info.outputs_written);
+
+        util_queue_fence_signal(&shader_state->ready);
+}
+
+static bool
+panfrost_claim_variant(struct panfrost_shader_state *shader_state)
 {
-        unsigned variant = variants->variant_count++;
+        return p_atomic_cmpxchg(&shader_state->claimed, 0, 1) == 0;
+}
 
-        if (variants->variant_count > variants->variant_space) {
-                unsigned old_space = variants->variant_space;
+void
+panfrost_compile_variant_job(void *job, void *gdata, int thread_index)
+{
+        struct panfrost_shader_state *shader_state = job;
+        struct panfrost_screen *screen = gdata;
 
-                variants->variant_space *= 2;
-                if (variants->variant_space == 0)
-                        variants->variant_space = 1;
+        /* A context may have needed the variant before we got to it */
+        if (!panfrost_claim_variant(shader_state))
+                return;
 
-                /* Arbitrary limit to stop runaway programs from
-                 * creating an unbounded number of shader variants. */
-                assert(variants->variant_space < 1024);
+        panfrost_compile_variant(&screen->base,
+                                 &screen->compiler.bin_pools[thread_index],
+                                 &screen->compiler.desc_pools[thread_index],
+                                 shader_state);
+}
 
-                unsigned msize = sizeof(struct panfrost_shader_state);
-                variants->variants = realloc(variants->variants,
-                                             variants->variant_space * msize);
+static struct panfrost_shader_state *
+panfrost_find_variant(struct panfrost_shader_variants *variants,
+                      const struct panfrost_shader_key *key, uint32_t hash)
+{
+        unsigned bucket = hash & (PAN_SHADER_VARIANT_BUCKETS - 1);
 
-                memset(&variants->variants[old_space], 0,
-                       (variants->variant_space - old_space) * msize);
+        for (struct panfrost_shader_state *v = p_atomic_read(&variants->variants[bucket]);
+             v != NULL; v = v->next) {
+                if (v->key_hash == hash && memcmp(key, &v->key, sizeof(*key)) == 0)
+                        return v;
         }
 
-        variants->variants[variant].key = *key;
+        return NULL;
+}
 
-        struct panfrost_shader_state *shader_state = &variants->variants[variant];
+static struct panfrost_shader_state *
+panfrost_alloc_variant(struct panfrost_shader_variants *variants,
+                       const struct panfrost_shader_key *key, uint32_t hash)
+{
+        struct panfrost_shader_state *shader_state =
+                calloc(1, sizeof(*shader_state));
 
-        /* We finally have a variant, so compile it */
-        panfrost_shader_compile(ctx->base.screen,
-                                &ctx->shaders, &ctx->descs,
-                                variants->nir, shader_state);
+        shader_state->key = *key;
+        shader_state->key_hash = hash;
+        shader_state->so = variants;
 
-        /* Fixup the stream out information */
-        shader_state->stream_output = variants->stream_output;
-        shader_state->so_mask =
-                update_so_info(&shader_state->stream_output,
-                               shader_state->info.outputs_written);
+        util_queue_fence_init(&shader_state->ready);
+        util_queue_fence_reset(&shader_state->ready);
+        util_queue_fence_init(&shader_state->job);
 
-        return variant;
+        return shader_state;
+}
+
+static void
+panfrost_free_variant(struct panfrost_shader_state *shader_state)
+{
+        panfrost_bo_unreference(shader_state->bin.bo);
+        panfrost_bo_unreference(shader_state->state.bo);
+        panfrost_bo_unreference(shader_state->linkage.bo);
+
+        if (shader_state->xfb) {
+                panfrost_bo_unreference(shader_state->xfb->bin.bo);
+                panfrost_bo_unreference(shader_state->xfb->state.bo);
+                panfrost_bo_unreference(shader_state->xfb->linkage.bo);
+                free(shader_state->xfb);
+        }
+
+        util_queue_fence_destroy(&shader_state->ready);
+        util_queue_fence_destroy(&shader_state->job);
+        free(shader_state);
+}
+
+/* Adds an uncompiled variant, which is compiled by whoever claims it first.
+ * Returns NULL if the CSO has no variant slots left. */
+
+static struct panfrost_shader_state *
+panfrost_new_variant_locked(struct panfrost_shader_variants *variants,
+                            const struct panfrost_shader_key *key, uint32_t hash)
+{
+        if (variants->variant_count >= PAN_MAX_SHADER_VARIANTS)
+                return NULL;
+
+        struct panfrost_shader_state *shader_state =
+                panfrost_alloc_variant(variants, key, hash);
+
+        unsigned bucket = hash & (PAN_SHADER_VARIANT_BUCKETS - 1);
+        shader_state->next = variants->variants[bucket];
+        variants->variant_count++;
+
+        /* Publish the fully initialized variant to lock-free readers */
+        p_atomic_set(&variants->variants[bucket], shader_state);
+
+        return shader_state;
+}
+
+/* Compiles a variant only this context will use, replacing the previous one.
+ * Batches hold references on the shader BOs, so in-flight draws are not
+ * affected by the eviction. */
+
+static struct panfrost_shader_state *
+panfrost_overflow_variant(struct panfrost_context *ctx,
+                          enum pipe_shader_type type,
+                          struct panfrost_shader_variants *variants,
+                          const struct panfrost_shader_key *key, uint32_t hash)
+{
+        perf_debug_ctx(ctx, "Shader ran out of variant slots, evicting");
+
+        if (ctx->overflow_variant[type])
+                panfrost_free_variant(ctx->overflow_variant[type]);
+
+        struct panfrost_shader_state *shader_state =
+                panfrost_alloc_variant(variants, key, hash);
+
+        p_atomic_set(&shader_state->claimed, 1);
+        panfrost_compile_variant(ctx->base.screen, &ctx->shaders, &ctx->descs,
+                                 shader_state);
+
+        ctx->overflow_variant[type] = shader_state;
+        return shader_state;
 }
 
 static void
@@ -513,6 +548,8 @@ panfrost_bind_shader_state(
 {
         struct panfrost_context *ctx = pan_context(pctx);
         ctx->shader[type] = hwcso;
+        ctx->shader_variant[type] = NULL;
+        ctx->shader_key_dirty |= BITFIELD_BIT(type);
 
         ctx->dirty |= PAN_DIRTY_TLS_SIZE;
         ctx->dirty_shader[type] |= PAN_DIRTY_STAGE_SHADER;
@@ -537,34 +574,155 @@ panfrost_update_shader_variant(struct panfrost_context *ctx,
         if (!ctx->shader[type])
                 return;
 
+        /* Nothing the key depends on changed since the last selection */
+        if (!(ctx->shader_key_dirty & BITFIELD_BIT(type)) &&
+            ctx->shader_variant[type])
+                return;
+
         /* Match the appropriate variant */
-        signed variant = -1;
         struct panfrost_shader_variants *variants = ctx->shader[type];
 
-        simple_mtx_lock(&variants->lock);
-
         struct panfrost_shader_key key = {
                 .fixed_varying_mask = variants->fixed_varying_mask
         };
 
         panfrost_build_key(ctx, &key, variants->nir);
+        ctx->shader_key_dirty &= ~BITFIELD_BIT(type);
 
-        for (unsigned i = 0; i < variants->variant_count; ++i) {
-                if (memcmp(&key, &variants->variants[i].key, sizeof(key)) == 0) {
-                        variant = i;
-                        break;
+        /* State was rebound without changing the key */
+        if (ctx->shader_variant[type] &&
+            memcmp(&key, &ctx->shader_key[type], sizeof(key)) == 0)
+                return;
+
+        uint32_t hash = _mesa_hash_data(&key, sizeof(key));
+
+        ctx->shader_key[type] = key;
+
+        struct panfrost_shader_state *shader_state =
+                panfrost_find_variant(variants, &key, hash);
+
+        if (!shader_state) {
+                simple_mtx_lock(&variants->lock);
+
+                /* Another context may have added it in the meantime */
+                shader_state = panfrost_find_variant(variants, &key, hash);
+
+                if (!shader_state)
+                        shader_state = panfrost_new_variant_locked(variants, &key, hash);
+
+                simple_mtx_unlock(&variants->lock);
+        }
+
+        if (!shader_state) {
+                ctx->shader_variant[type] =
+                        panfrost_overflow_variant(ctx, type, variants, &key, hash);
+                return;
+        }
+
+        /* Compile the variant here unless a background job already started
+         * on it, in which case only wait for that job */
+        if (!util_queue_fence_is_signalled(&shader_state->ready)) {
+                if (panfrost_claim_variant(shader_state)) {
+                        panfrost_compile_variant(ctx->base.screen,
+                                                 &ctx->shaders, &ctx->descs,
+                                                 shader_state);
+                } else {
+                        util_queue_fence_wait(&shader_state->ready);
                 }
         }
 
-        if (variant == -1)
-                variant = panfrost_new_variant_locked(ctx, variants, &key);
+        ctx->shader_variant[type] = shader_state;
+}
+
+static void *
+panfrost_create_shader_state(
+        struct pipe_context *pctx,
+        const struct pipe_shader_state *cso)
+{
+        struct panfrost_shader_variants *so = CALLOC_STRUCT(panfrost_shader_variants);
+        struct panfrost_screen *screen = pan_screen(pctx->screen);
+        struct panfrost_device *dev = pan_device(pctx->screen);
+
+        simple_mtx_init(&so->lock, mtx_plain);
+
+        so->stream_output = cso->stream_output;
+
+        if (cso->type == PIPE_SHADER_IR_TGSI)
+                so->nir = tgsi_to_nir(cso->tokens, pctx->screen, false);
+        else
+                so->nir = cso->ir.nir;
+
+        /* Fix linkage early */
+        if (so->nir->info.stage == MESA_SHADER_VERTEX) {
+                so->fixed_varying_mask =
+                        (so->nir->info.outputs_written & BITFIELD_MASK(VARYING_SLOT_VAR0)) &
+                        ~VARYING_BIT_POS & ~VARYING_BIT_PSIZ;
+        }
+
+        /* Precompile for shader-db if we need to */
+        if (unlikely(dev->debug & PAN_DBG_PRECOMPILE)) {
+                struct panfrost_context *ctx = pan_context(pctx);
+
+                struct panfrost_shader_state state = { 0 };
 
-        variants->active_variant = variant;
+                panfrost_shader_compile(pctx->screen,
+                                        &ctx->shaders, &ctx->descs,
+                                        so->nir, &state);
+        } else if (util_queue_is_initialized(&screen->compiler.queue)) {
+                /* Start compiling the variant most likely to be bound: a
+                 * single render target with no lowered rasterizer state. The
+                 * key layout must match panfrost_build_key. */
+                struct panfrost_shader_key key = {
+                        .fixed_varying_mask = so->fixed_varying_mask
+                };
+
+                if (so->nir->info.stage == MESA_SHADER_FRAGMENT)
+                        key.fs.nr_cbufs = 1;
+
+                struct panfrost_shader_state *shader_state =
+                        panfrost_new_variant_locked(so, &key,
+                                                    _mesa_hash_data(&key, sizeof(key)));
+
+                util_queue_add_job(&screen->compiler.queue, shader_state,
+                                   &shader_state->job,
+                                   panfrost_compile_variant_job, NULL, 0);
+        }
 
-        /* TODO: it would be more efficient to release the lock before
-         * compiling instead of after, but that can race if thread A compiles a
-         * variant while thread B searches for that same variant */
-        simple_mtx_unlock(&variants->lock);
+        return so;
+}
+
+static void
+panfrost_delete_shader_state(
+        struct pipe_context *pctx,
+        void *so)
+{
+        struct panfrost_screen *screen = pan_screen(pctx->screen);
+        struct panfrost_shader_variants *cso = (struct panfrost_shader_variants *) so;
+
+        struct panfrost_shader_state *next;
+
+        for (unsigned i = 0; i < PAN_SHADER_VARIANT_BUCKETS; ++i) {
+                for (struct panfrost_shader_state *shader_state = cso->variants[i];
+                     shader_state != NULL; shader_state = next) {
+                        next = shader_state->next;
+
+                        /* Either remove the background job or let it finish.
+                         * If the variant was claimed, it is compiled by now. */
+                        if (!util_queue_fence_is_signalled(&shader_state->job))
+                                util_queue_drop_job(&screen->compiler.queue, &shader_state->job);
+
+                        if (p_atomic_read(&shader_state->claimed))
+                                util_queue_fence_wait(&shader_state->ready);
+
+                        panfrost_free_variant(shader_state);
+                }
+        }
+
+        ralloc_free(cso->nir);
+
+        simple_mtx_destroy(&cso->lock);
+
+        free(so);
 }
 
 static void
@@ -574,6 +732,7 @@ panfrost_bind_vs_state(struct pipe_context *pctx, void *hwcso)
 
         /* Fragment shaders are linked with vertex shaders */
         struct panfrost_context *ctx = pan_context(pctx);
+        ctx->shader_key_dirty |= BITFIELD_BIT(PIPE_SHADER_FRAGMENT);
         panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
 }
 
@@ -652,9 +811,15 @@ panfrost_set_sampler_views(
                 struct pipe_sampler_view *view = views ? views[i] : NULL;
                 unsigned p = i + start_slot;
 
-                if (view)
+                if (view) {
                         new_nr = p + 1;
 
+                        /* Views are created on the application thread with
+                         * a threaded context, so legalize them here */
+                        pan_legalize_afbc_format(ctx, pan_resource(view->texture),
+                                                 view->format);
+                }
+
                 if (take_ownership) {
                         pipe_sampler_view_reference((struct pipe_sampler_view **)&ctx->sampler_views[shader][p],
                                                     NULL);
@@ -710,8 +875,21 @@ panfrost_set_framebuffer_state(struct pipe_context *pctx,
 {
         struct panfrost_context *ctx = pan_context(pctx);
 
+        for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                if (fb->cbufs[i]) {
+                        pan_legalize_afbc_format(ctx, pan_resource(fb->cbufs[i]->texture),
+                                                 fb->cbufs[i]->format);
+                }
+        }
+
+        if (fb->zsbuf) {
+                pan_legalize_afbc_format(ctx, pan_resource(fb->zsbuf->texture),
+                                         fb->zsbuf->format);
+        }
+
         util_copy_framebuffer_state(&ctx->pipe_framebuffer, fb);
         ctx->batch = NULL;
+        ctx->shader_key_dirty |= BITFIELD_BIT(PIPE_SHADER_FRAGMENT);
 
         /* Hot draw call path needs the mask of active render targets */
         ctx->fb_rt_mask = 0;
@@ -822,7 +1000,11 @@ panfrost_destroy(struct pipe_context *pipe)
         struct panfrost_device *dev = pan_device(panfrost->base.screen);
 
         if (dev->kbase) {
-                dev->mali.syncobj_destroy(&dev->mali, panfrost->syncobj_kbase);
+                util_dynarray_foreach(&panfrost->syncobjs_kbase,
+                                      struct kbase_syncobj *, o)
+                        dev->mali.syncobj_destroy(&dev->mali, *o);
+
+                util_dynarray_fini(&panfrost->syncobjs_kbase);
         } else {
                 // TODO: upstream this
                 drmSyncobjDestroy(dev->fd, panfrost->syncobj);
@@ -831,7 +1013,13 @@ panfrost_destroy(struct pipe_context *pipe)
         if (dev->kbase && dev->mali.context_create)
                 dev->mali.context_destroy(&dev->mali, panfrost->kbase_ctx);
 
-        _mesa_hash_table_destroy(panfrost->writers, NULL);
+        _mesa_hash_table_destroy(panfrost->access, NULL);
+        util_dynarray_fini(&panfrost->free_access);
+
+        for (unsigned i = 0; i < PIPE_SHADER_TYPES; ++i) {
+                if (panfrost->overflow_variant[i])
+                        panfrost_free_variant(panfrost->overflow_variant[i]);
+        }
 
         if (panfrost->blitter)
                 util_blitter_destroy(panfrost->blitter);
@@ -850,7 +1038,7 @@ panfrost_create_query(struct pipe_context *pipe,
                       unsigned type,
                       unsigned index)
 {
-        struct panfrost_query *q = rzalloc(pipe, struct panfrost_query);
+        struct panfrost_query *q = rzalloc(NULL, struct panfrost_query);
 
         q->type = type;
         q->index = index;
@@ -869,6 +1057,27 @@ panfrost_destroy_query(struct pipe_context *pipe, struct pipe_query *q)
         ralloc_free(q);
 }
 
+/* Timer queries are written to a buffer holding the start and end timestamps.
+ * Writing the buffer from the current batch orders it after the batches of
+ * earlier uses of the query. */
+
+static struct panfrost_batch *
+panfrost_get_timer_query_batch(struct panfrost_context *ctx,
+                               struct panfrost_query *query)
+{
+        struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
+
+        if (!query->rsrc) {
+                query->rsrc = pipe_buffer_create(ctx->base.screen,
+                                PIPE_BIND_QUERY_BUFFER, 0,
+                                2 * sizeof(uint64_t));
+        }
+
+        panfrost_batch_write_rsrc(batch, pan_resource(query->rsrc),
+                                  PIPE_SHADER_FRAGMENT);
+        return batch;
+}
+
 static bool
 panfrost_begin_query(struct pipe_context *pipe, struct pipe_query *q)
 {
@@ -904,13 +1113,28 @@ panfrost_begin_query(struct pipe_context *pipe, struct pipe_query *q)
 
         case PIPE_QUERY_PRIMITIVES_GENERATED:
                 query->start = ctx->prims_generated;
+                ctx->prims_generated_queries++;
                 break;
         case PIPE_QUERY_PRIMITIVES_EMITTED:
                 query->start = ctx->tf_prims_generated;
                 break;
 
+        case PIPE_QUERY_TIME_ELAPSED:
+                if (panfrost_has_gpu_timestamps(dev)) {
+                        struct panfrost_batch *batch =
+                                panfrost_get_timer_query_batch(ctx, query);
+                        struct panfrost_resource *rsrc =
+                                pan_resource(query->rsrc);
+
+                        pan_screen(ctx->base.screen)->vtbl.emit_timestamp(batch,
+                                        rsrc->image.data.bo->ptr.gpu);
+                } else {
+                        query->start = pipe->screen->get_timestamp(pipe->screen);
+                }
+                break;
+
         default:
-                /* TODO: timestamp queries, etc? */
+                /* TODO: pipeline statistics queries, etc? */
                 break;
         }
 
@@ -921,6 +1145,7 @@ static bool
 panfrost_end_query(struct pipe_context *pipe, struct pipe_query *q)
 {
         struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
         struct panfrost_query *query = (struct panfrost_query *) q;
 
         switch (query->type) {
@@ -932,10 +1157,30 @@ panfrost_end_query(struct pipe_context *pipe, struct pipe_query *q)
                 break;
         case PIPE_QUERY_PRIMITIVES_GENERATED:
                 query->end = ctx->prims_generated;
+                assert(ctx->prims_generated_queries > 0);
+                ctx->prims_generated_queries--;
                 break;
         case PIPE_QUERY_PRIMITIVES_EMITTED:
                 query->end = ctx->tf_prims_generated;
                 break;
+
+        /* The end timestamp is written once the batch is done, rather than
+         * from its job chain, so it covers every job of the batch */
+        case PIPE_QUERY_TIMESTAMP:
+        case PIPE_QUERY_TIME_ELAPSED:
+                if (panfrost_has_gpu_timestamps(dev)) {
+                        struct panfrost_batch *batch =
+                                panfrost_get_timer_query_batch(ctx, query);
+                        struct panfrost_resource *rsrc =
+                                pan_resource(query->rsrc);
+                        mali_ptr end = rsrc->image.data.bo->ptr.gpu +
+                                       sizeof(uint64_t);
+
+                        util_dynarray_append(&batch->timestamps, mali_ptr, end);
+                } else {
+                        query->end = pipe->screen->get_timestamp(pipe->screen);
+                }
+                break;
         }
 
         return true;
@@ -956,7 +1201,11 @@ panfrost_get_query_result(struct pipe_context *pipe,
         case PIPE_QUERY_OCCLUSION_COUNTER:
         case PIPE_QUERY_OCCLUSION_PREDICATE:
         case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE:
-                panfrost_flush_writer(ctx, rsrc, "Occlusion query");
+                /* Once flushed, the threaded context may call us from the
+                 * application thread, so only the wait is allowed */
+                if (!query->base.flushed)
+                        panfrost_flush_writer(ctx, rsrc, "Occlusion query");
+
                 panfrost_bo_wait(rsrc->image.data.bo, INT64_MAX, false);
 
                 /* Read back the query results */
@@ -979,10 +1228,45 @@ panfrost_get_query_result(struct pipe_context *pipe,
 
         case PIPE_QUERY_PRIMITIVES_GENERATED:
         case PIPE_QUERY_PRIMITIVES_EMITTED:
-                panfrost_flush_all_batches(ctx, "Primitive count query");
+                if (!query->base.flushed)
+                        panfrost_flush_all_batches(ctx, "Primitive count query");
+
                 vresult->u64 = query->end - query->start;
                 break;
 
+        case PIPE_QUERY_TIMESTAMP:
+        case PIPE_QUERY_TIME_ELAPSED: {
+                if (!panfrost_has_gpu_timestamps(dev)) {
+                        vresult->u64 = query->end - query->start;
+                        break;
+                }
+
+                if (!query->base.flushed)
+                        panfrost_flush_writer(ctx, rsrc, "Timer query");
+
+                /* Results are resolved on the CPU once the batch completes,
+                 * so without wait this never blocks on the GPU */
+                if (!panfrost_bo_wait(rsrc->image.data.bo,
+                                      wait ? INT64_MAX : 0, false))
+                        return false;
+
+                uint64_t *ts = (uint64_t *) rsrc->image.data.bo->ptr.cpu;
+                uint64_t ticks = ts[1];
+
+                if (query->type == PIPE_QUERY_TIME_ELAPSED)
+                        ticks -= ts[0];
+
+                vresult->u64 = panfrost_timestamp_to_ns(dev, ticks);
+                break;
+        }
+
+        /* Timestamps are always converted to nanoseconds, and the system
+         * counter keeps running across power management */
+        case PIPE_QUERY_TIMESTAMP_DISJOINT:
+                vresult->timestamp_disjoint.frequency = 1000000000;
+                vresult->timestamp_disjoint.disjoint = false;
+                break;
+
         default:
                 /* TODO: more queries */
                 break;
@@ -1020,7 +1304,7 @@ panfrost_create_stream_output_target(struct pipe_context *pctx,
 {
         struct pipe_stream_output_target *target;
 
-        target = &rzalloc(pctx, struct panfrost_streamout_target)->base;
+        target = &rzalloc(NULL, struct panfrost_streamout_target)->base;
 
         if (!target)
                 return NULL;
@@ -1180,8 +1464,9 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
 
         ctx->blitter = util_blitter_create(gallium);
 
-        ctx->writers = _mesa_hash_table_create(gallium, _mesa_hash_pointer,
-                                                        _mesa_key_pointer_equal);
+        ctx->access = _mesa_hash_table_create(gallium, _mesa_hash_pointer,
+                                              _mesa_key_pointer_equal);
+        util_dynarray_init(&ctx->free_access, ctx->access);
 
         assert(ctx->blitter);
 
@@ -1202,14 +1487,33 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
         int ASSERTED ret;
 
         /* Create a syncobj in a signaled state. Will be updated to point to the
-         * last queued job out_sync every time we submit a new job.
+         * last queued job out_sync every time we submit a new job. On kbase,
+         * every batch has its own syncobj instead.
          */
         if (dev->kbase) {
-                ctx->syncobj_kbase = dev->mali.syncobj_create(&dev->mali);
+                util_dynarray_init(&ctx->syncobjs_kbase, NULL);
         } else {
                 ret = drmSyncobjCreate(dev->fd, DRM_SYNCOBJ_CREATE_SIGNALED, &ctx->syncobj);
                 assert(!ret && ctx->syncobj);
         }
 
-        return gallium;
+        /* Shader CSOs created from the application thread are compiled on
+         * the compiler queue, except for shader-db precompiles which use the
+         * context pools. Clover is not supported either. */
+        if (!(flags & PIPE_CONTEXT_PREFER_THREADED) ||
+            (flags & PIPE_CONTEXT_COMPUTE_ONLY) ||
+            (dev->debug & PAN_DBG_PRECOMPILE) ||
+            !util_queue_is_initialized(&pan_screen(screen)->compiler.queue))
+                return gallium;
+
+        /* Without create_fence, flushes stay synchronous. Idle buffers are
+         * mapped unsynchronized from the application thread. */
+        return threaded_context_create(gallium,
+                                       &pan_screen(screen)->transfer_pool,
+                                       panfrost_replace_buffer_storage,
+                                       &(struct threaded_context_options) {
+                                               .is_resource_busy =
+                                                       panfrost_resource_is_busy,
+                                       },
+                                       &ctx->tc);
 }
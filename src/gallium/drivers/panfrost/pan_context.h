@@ -42,8 +42,10 @@
 #include "pipe/p_screen.h"
 #include "pipe/p_state.h"
 #include "util/u_blitter.h"
+#include "util/disk_cache.h"
 #include "util/hash_table.h"
 #include "util/simple_mtx.h"
+#include "util/u_queue.h"
 
 #include "midgard/midgard_compile.h"
 #include "compiler/shader_enums.h"
@@ -89,6 +91,9 @@ struct panfrost_constant_buffer {
 };
 
 struct panfrost_query {
+        /* Must be first, for the threaded context */
+        struct threaded_query base;
+
         /* Passthrough from Gallium */
         unsigned type;
         unsigned index;
@@ -109,7 +114,10 @@ struct panfrost_query {
 struct pipe_fence_handle {
         struct pipe_reference reference;
         uint32_t syncobj;
-        struct kbase_syncobj *kbase;
+
+        /* kbase: syncobjs of the batches the fence waits for */
+        struct util_dynarray kbase;
+
         bool signaled;
 };
 
@@ -123,6 +131,33 @@ struct panfrost_streamout {
         unsigned num_targets;
 };
 
+/* Variants bundle together to form the backing CSO, bundling multiple
+ * shaders with varying emulated features baked in
+ */
+struct panfrost_fs_key {
+        /* Number of colour buffers */
+        unsigned nr_cbufs;
+
+        /* Midgard shaders that read the tilebuffer must be keyed for
+         * non-blendable formats
+         */
+        enum pipe_format rt_formats[8];
+
+        /* From rasterize state, to lower point sprites */
+        uint16_t sprite_coord_enable;
+
+        /* User clip plane lowering */
+        uint8_t clip_plane_enable;
+};
+
+struct panfrost_shader_key {
+        /* Valhall needs special handling for desktop GL varyings */
+        uint32_t fixed_varying_mask;
+
+        /* If we need vertex shader keys, union it in */
+        struct panfrost_fs_key fs;
+};
+
 // TODO: This struct is a mess
 struct panfrost_cs {
         struct kbase_cs base;
@@ -138,6 +173,9 @@ struct panfrost_context {
         /* Gallium context */
         struct pipe_context base;
 
+        /* Threaded context wrapping this one, or NULL if not threaded */
+        struct threaded_context *tc;
+
         /* Dirty global state */
         enum pan_dirty_3d dirty;
 
@@ -149,7 +187,14 @@ struct panfrost_context {
 
         /* Sync obj used to keep track of in-flight jobs. */
         uint32_t syncobj;
-        struct kbase_syncobj *syncobj_kbase;
+
+        /* kbase: syncobjs of the submitted batches that were not signaled
+         * the last time we checked, one per batch */
+        struct util_dynarray syncobjs_kbase;
+
+        /* kbase: leave the jobs of submitted batches queued, to be kicked
+         * together once all batches of a flush are submitted */
+        bool kbase_defer_kick;
 
         /* Set of 32 batches. When the set is full, the LRU entry (the batch
          * with the smallest seqnum) is flushed to free a slot.
@@ -162,8 +207,13 @@ struct panfrost_context {
                 BITSET_DECLARE(active, PAN_MAX_BATCHES);
         } batches;
 
-        /* Map from resources to panfrost_batches */
-        struct hash_table *writers;
+        /* Map from resources to the struct panfrost_rsrc_access describing
+         * which batches use them. Resources may be shared between contexts,
+         * so this cannot live in the resource itself. */
+        struct hash_table *access;
+
+        /* Unused panfrost_rsrc_access records, recycled rather than freed */
+        struct util_dynarray free_access;
 
         /* Bound job batch */
         struct panfrost_batch *batch;
@@ -175,6 +225,7 @@ struct panfrost_context {
         struct panfrost_streamout streamout;
 
         bool active_queries;
+        unsigned prims_generated_queries;
         uint64_t prims_generated;
         uint64_t tf_prims_generated;
         struct panfrost_query *occlusion_query;
@@ -200,6 +251,20 @@ struct panfrost_context {
         struct panfrost_shader_variants *shader[PIPE_SHADER_TYPES];
         struct panfrost_vertex_state *vertex;
 
+        /* Variants of the bound shaders selected for this context's state.
+         * Kept here rather than in the CSO, which is shared between
+         * contexts. */
+        struct panfrost_shader_state *shader_variant[PIPE_SHADER_TYPES];
+
+        /* Keys of the selected variants. Only stages in shader_key_dirty
+         * (a bitmask of pipe_shader_type) need their key rebuilt. */
+        struct panfrost_shader_key shader_key[PIPE_SHADER_TYPES];
+        unsigned shader_key_dirty;
+
+        /* Variants owned by this context, compiled once their CSO ran out of
+         * variant slots. Replaced on the next such compile. */
+        struct panfrost_shader_state *overflow_variant[PIPE_SHADER_TYPES];
+
         struct pipe_vertex_buffer vertex_buffers[PIPE_MAX_ATTRIBS];
         uint32_t vb_mask;
 
@@ -271,33 +336,6 @@ struct pan_linkage {
 
 #define RSD_WORDS 16
 
-/* Variants bundle together to form the backing CSO, bundling multiple
- * shaders with varying emulated features baked in
- */
-struct panfrost_fs_key {
-        /* Number of colour buffers */
-        unsigned nr_cbufs;
-
-        /* Midgard shaders that read the tilebuffer must be keyed for
-         * non-blendable formats
-         */
-        enum pipe_format rt_formats[8];
-
-        /* From rasterize state, to lower point sprites */
-        uint16_t sprite_coord_enable;
-
-        /* User clip plane lowering */
-        uint8_t clip_plane_enable;
-};
-
-struct panfrost_shader_key {
-        /* Valhall needs special handling for desktop GL varyings */
-        uint32_t fixed_varying_mask;
-
-        /* If we need vertex shader keys, union it in */
-        struct panfrost_fs_key fs;
-};
-
 /* A shader state corresponds to the actual, current variant of the shader */
 struct panfrost_shader_state {
         /* Respectively, shader binary and Renderer State Descriptor */
@@ -321,8 +359,33 @@ struct panfrost_shader_state {
 
         /* Mask of state that dirties the sysvals */
         unsigned dirty_3d, dirty_shader;
+
+        /* Hash of the key, checked before comparing keys */
+        uint32_t key_hash;
+
+        /* CSO this is a variant of, and the next older variant in its hash
+         * bucket */
+        struct panfrost_shader_variants *so;
+        struct panfrost_shader_state *next;
+
+        /* Set by whichever thread compiles the variant, either a compiler
+         * queue worker or the first context binding it. Signaled once the
+         * variant is compiled. */
+        int claimed;
+        struct util_queue_fence ready;
+
+        /* Background compile job, if one was queued */
+        struct util_queue_fence job;
 };
 
+/* Must be a power of two */
+#define PAN_SHADER_VARIANT_BUCKETS 16
+
+/* Arbitrary limit to stop runaway programs from creating an unbounded number
+ * of shader variants. Past it, variants are compiled per-context and evicted
+ * on the next miss. */
+#define PAN_MAX_SHADER_VARIANTS 512
+
 /* A collection of varyings (the CSO) */
 struct panfrost_shader_variants {
         nir_shader *nir;
@@ -332,12 +395,15 @@ struct panfrost_shader_variants {
                 unsigned req_input_mem;
         };
 
-        /** Lock for the variants array */
+        /** Lock serializing insertions into the variants table */
         simple_mtx_t lock;
 
-        struct panfrost_shader_state *variants;
-        unsigned variant_space;
-
+        /* Hash table of variants, indexed by the low bits of the key hash.
+         * Each bucket is a singly linked list, newest first. Variants are
+         * only ever prepended, and the bucket heads are published with
+         * release semantics, so lookups walk the lists without taking the
+         * lock. Compute shaders have a single variant in the first bucket. */
+        struct panfrost_shader_state *variants[PAN_SHADER_VARIANT_BUCKETS];
         unsigned variant_count;
 
         /* On vertex shaders, bit mask of special desktop-only varyings to link
@@ -345,9 +411,6 @@ struct panfrost_shader_variants {
          * shaders for desktop GL.
          */
         uint32_t fixed_varying_mask;
-
-        /* The current active variant */
-        unsigned active_variant;
 };
 
 /** (Vertex buffer index, divisor) tuple that will become an Attribute Buffer
@@ -385,12 +448,10 @@ static inline struct panfrost_shader_state *
 panfrost_get_shader_state(struct panfrost_context *ctx,
                           enum pipe_shader_type st)
 {
-        struct panfrost_shader_variants *all = ctx->shader[st];
-
-        if (!all)
+        if (!ctx->shader[st])
                 return NULL;
 
-        return &all->variants[all->active_variant];
+        return ctx->shader_variant[st];
 }
 
 struct pipe_context *
@@ -414,6 +475,9 @@ panfrost_render_condition_check(struct panfrost_context *ctx);
 void
 panfrost_update_shader_variant(struct panfrost_context *ctx,
                                enum pipe_shader_type type);
+
+void
+panfrost_compile_variant_job(void *job, void *gdata, int thread_index);
 void
 panfrost_shader_compile(struct pipe_screen *pscreen,
                         struct panfrost_pool *shader_pool,
@@ -421,6 +485,28 @@ panfrost_shader_compile(struct pipe_screen *pscreen,
                         const nir_shader *ir,
                         struct panfrost_shader_state *state);
 
+void
+panfrost_disk_cache_init(struct panfrost_screen *screen);
+
+void
+panfrost_disk_cache_compute_key(struct panfrost_screen *screen,
+                                const nir_shader *nir,
+                                const struct panfrost_compile_inputs *inputs,
+                                const struct panfrost_shader_key *key,
+                                cache_key cache_key);
+
+bool
+panfrost_disk_cache_retrieve(struct panfrost_screen *screen,
+                             const cache_key cache_key,
+                             struct util_dynarray *binary,
+                             struct pan_shader_info *info);
+
+void
+panfrost_disk_cache_store(struct panfrost_screen *screen,
+                          const cache_key cache_key,
+                          const struct util_dynarray *binary,
+                          const struct pan_shader_info *info);
+
 void
 panfrost_analyze_sysvals(struct panfrost_shader_state *ss);
 
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2022 Icecream95
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "compiler/nir/nir.h"
+#include "compiler/nir/nir_serialize.h"
+#include "util/blob.h"
+#include "util/disk_cache.h"
+#include "util/mesa-sha1.h"
+
+#include "pan_context.h"
+#include "pan_screen.h"
+#include "pan_util.h"
+
+/* Compiled variants are cached on disk, keyed on the NIR handed to the
+ * backend compiler (after variant lowering) and the compile inputs that
+ * depend on the variant key and the GPU. The compiler is linked into the
+ * driver, so the driver build-id covers it. Entries hold the pan_shader_info,
+ * sysval layout included, followed by the binary. */
+
+void
+panfrost_disk_cache_compute_key(struct panfrost_screen *screen,
+                                const nir_shader *nir,
+                                const struct panfrost_compile_inputs *inputs,
+                                const struct panfrost_shader_key *key,
+                                cache_key cache_key)
+{
+        struct blob blob;
+        blob_init(&blob);
+
+        nir_serialize(&blob, nir, true);
+
+        /* Field by field, since the structures have padding */
+        blob_write_uint32(&blob, inputs->gpu_id);
+        blob_write_uint32(&blob, inputs->fixed_sysval_ubo);
+        blob_write_uint8(&blob, inputs->no_idvs);
+        blob_write_uint32(&blob, inputs->fixed_varying_mask);
+        blob_write_bytes(&blob, inputs->rt_formats, sizeof(inputs->rt_formats));
+
+        blob_write_uint32(&blob, key->fixed_varying_mask);
+        blob_write_uint32(&blob, key->fs.nr_cbufs);
+        blob_write_bytes(&blob, key->fs.rt_formats, sizeof(key->fs.rt_formats));
+        blob_write_uint16(&blob, key->fs.sprite_coord_enable);
+        blob_write_uint8(&blob, key->fs.clip_plane_enable);
+
+        disk_cache_compute_key(screen->disk_cache, blob.data, blob.size,
+                               cache_key);
+        blob_finish(&blob);
+}
+
+bool
+panfrost_disk_cache_retrieve(struct panfrost_screen *screen,
+                             const cache_key cache_key,
+                             struct util_dynarray *binary,
+                             struct pan_shader_info *info)
+{
+        struct panfrost_device *dev = &screen->dev;
+        size_t size;
+        void *buffer = disk_cache_get(screen->disk_cache, cache_key, &size);
+
+        if (dev->debug & PAN_DBG_DISK_CACHE) {
+                char sha1[41];
+                _mesa_sha1_format(sha1, cache_key);
+                fprintf(stderr, "[mesa disk cache] retrieving %s: %s\n",
+                        sha1, buffer ? "found" : "missing");
+        }
+
+        if (!buffer)
+                return false;
+
+        struct blob_reader blob;
+        blob_reader_init(&blob, buffer, size);
+
+        blob_copy_bytes(&blob, info, sizeof(*info));
+        uint32_t binary_size = blob_read_uint32(&blob);
+        const void *data = blob_read_bytes(&blob, binary_size);
+
+        /* Truncated or corrupt entries are treated as misses */
+        bool ok = !blob.overrun && blob.current == blob.end;
+
+        if (ok && binary_size)
+                memcpy(util_dynarray_grow_bytes(binary, binary_size, 1), data, binary_size);
+
+        free(buffer);
+        return ok;
+}
+
+void
+panfrost_disk_cache_store(struct panfrost_screen *screen,
+                          const cache_key cache_key,
+                          const struct util_dynarray *binary,
+                          const struct pan_shader_info *info)
+{
+        struct panfrost_device *dev = &screen->dev;
+
+        if (dev->debug & PAN_DBG_DISK_CACHE) {
+                char sha1[41];
+                _mesa_sha1_format(sha1, cache_key);
+                fprintf(stderr, "[mesa disk cache] storing %s\n", sha1);
+        }
+
+        struct blob blob;
+        blob_init(&blob);
+
+        blob_write_bytes(&blob, info, sizeof(*info));
+        blob_write_uint32(&blob, binary->size);
+        blob_write_bytes(&blob, binary->data, binary->size);
+
+        disk_cache_put(screen->disk_cache, cache_key, blob.data, blob.size, NULL);
+        blob_finish(&blob);
+}
+
+void
+panfrost_disk_cache_init(struct panfrost_screen *screen)
+{
+#ifdef ENABLE_SHADER_CACHE
+        struct panfrost_device *dev = &screen->dev;
+        struct mesa_sha1 ctx;
+        unsigned char sha1[20];
+        char timestamp[41];
+
+        _mesa_sha1_init(&ctx);
+
+        if (!disk_cache_get_function_identifier(panfrost_disk_cache_init, &ctx))
+                return;
+
+        _mesa_sha1_final(&ctx, sha1);
+        _mesa_sha1_format(timestamp, sha1);
+
+        char renderer[32];
+        snprintf(renderer, sizeof(renderer), "panfrost_%04x", dev->gpu_id);
+
+        screen->disk_cache = disk_cache_create(renderer, timestamp, 0);
+#endif
+}
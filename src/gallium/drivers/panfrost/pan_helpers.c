@@ -251,7 +251,7 @@ panfrost_track_image_access(struct panfrost_batch *batch,
                 BITSET_SET(rsrc->valid.data, level);
 
                 if (is_buffer) {
-                        util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                        util_range_add(&rsrc->base, &rsrc->tc.valid_buffer_range,
                                         0, rsrc->base.width0);
                 }
         } else {
@@ -37,6 +37,7 @@
 #include "util/u_pack_color.h"
 #include "util/rounding.h"
 #include "util/u_framebuffer.h"
+#include "util/os_time.h"
 #include "pan_util.h"
 #include "decode.h"
 
@@ -79,8 +80,8 @@ panfrost_batch_init(struct panfrost_context *ctx,
         batch->maxx = batch->maxy = 0;
 
         util_copy_framebuffer_state(&batch->key, key);
-        batch->resources =_mesa_set_create(NULL, _mesa_hash_pointer,
-                                          _mesa_key_pointer_equal);
+        util_dynarray_init(&batch->resources, NULL);
+        util_dynarray_init(&batch->timestamps, NULL);
 
         /* Preallocate the main pool, since every batch has at least one job
          * structure so it will be used */
@@ -123,20 +124,33 @@ panfrost_batch_cleanup(struct panfrost_context *ctx, struct panfrost_batch *batc
                 panfrost_bo_unreference(bo);
         }
 
-        set_foreach_remove(batch->resources, entry) {
-                struct panfrost_resource *rsrc = (void *) entry->key;
+        util_dynarray_foreach(&batch->resources,
+                              struct panfrost_rsrc_access *, it) {
+                struct panfrost_rsrc_access *access = *it;
+                struct panfrost_resource *rsrc = access->rsrc;
 
-                if (_mesa_hash_table_search(ctx->writers, rsrc)) {
-                        _mesa_hash_table_remove_key(ctx->writers, rsrc);
+                if (access->writer == batch_idx) {
+                        access->writer = -1;
                         rsrc->track.nr_writers--;
                 }
 
+                access->users &= ~BITFIELD_BIT(batch_idx);
                 rsrc->track.nr_users--;
 
+                /* The resource may go away with our reference, so drop the
+                 * record keyed on it first */
+                if (!access->users) {
+                        _mesa_hash_table_remove_key(ctx->access, rsrc);
+                        util_dynarray_append(&ctx->free_access,
+                                             struct panfrost_rsrc_access *,
+                                             access);
+                }
+
                 pipe_resource_reference((struct pipe_resource **) &rsrc, NULL);
         }
 
-        _mesa_set_destroy(batch->resources, NULL);
+        util_dynarray_fini(&batch->resources);
+        util_dynarray_fini(&batch->timestamps);
         panfrost_pool_cleanup(&batch->pool);
         panfrost_pool_cleanup(&batch->invisible_pool);
 
@@ -232,19 +246,56 @@ panfrost_get_fresh_batch_for_fbo(struct panfrost_context *ctx, const char *reaso
         return batch;
 }
 
+static struct panfrost_rsrc_access *
+panfrost_get_rsrc_access(struct panfrost_context *ctx,
+                         struct panfrost_resource *rsrc)
+{
+        struct hash_entry *entry = _mesa_hash_table_search(ctx->access, rsrc);
+        return entry ? entry->data : NULL;
+}
+
 static void
 panfrost_batch_update_access(struct panfrost_batch *batch,
                              struct panfrost_resource *rsrc, bool writes)
 {
         struct panfrost_context *ctx = batch->ctx;
-        uint32_t batch_idx = panfrost_batch_idx(batch);
-        struct hash_entry *entry = _mesa_hash_table_search(ctx->writers, rsrc);
-        struct panfrost_batch *writer = entry ? entry->data : NULL;
-        bool found = false;
+        int batch_idx = panfrost_batch_idx(batch);
+        uint32_t batch_bit = BITFIELD_BIT(batch_idx);
+        uint32_t hash = _mesa_hash_pointer(rsrc);
+        struct hash_entry *entry =
+                _mesa_hash_table_search_pre_hashed(ctx->access, hash, rsrc);
+        struct panfrost_rsrc_access *access;
 
-        _mesa_set_search_or_add(batch->resources, rsrc, &found);
+        if (entry) {
+                access = entry->data;
+
+                /* Already accessed the same way by this batch. Since a
+                 * writer is the only user, there is nothing to flush. */
+                if ((access->users & batch_bit) &&
+                    (!writes || access->writer == batch_idx))
+                        return;
+        } else {
+                if (ctx->free_access.size) {
+                        access = util_dynarray_pop(&ctx->free_access,
+                                                   struct panfrost_rsrc_access *);
+                } else {
+                        access = ralloc(ctx->access, struct panfrost_rsrc_access);
+                }
+
+                *access = (struct panfrost_rsrc_access) {
+                        .rsrc = rsrc,
+                        .writer = -1,
+                };
+
+                _mesa_hash_table_insert_pre_hashed(ctx->access, hash, rsrc,
+                                                   access);
+        }
+
+        if (!(access->users & batch_bit)) {
+                access->users |= batch_bit;
+                util_dynarray_append(&batch->resources,
+                                     struct panfrost_rsrc_access *, access);
 
-        if (!found) {
                 /* Cache number of batches accessing a resource */
                 rsrc->track.nr_users++;
 
@@ -252,24 +303,18 @@ panfrost_batch_update_access(struct panfrost_batch *batch,
                 pipe_reference(NULL, &rsrc->base.reference);
         }
 
-        /* Flush users if required */
-        if (writes || ((writer != NULL) && (writer != batch))) {
-                unsigned i;
-                foreach_batch(ctx, i) {
-                        struct panfrost_batch *batch = &ctx->batches.slots[i];
+        /* Flush users if required. Our own bit keeps the record alive while
+         * the other batches are cleaned up. */
+        if (writes || (access->writer >= 0 && access->writer != batch_idx)) {
+                uint32_t others = access->users & ~batch_bit;
 
-                        /* Skip the entry if this our batch. */
-                        if (i == batch_idx)
-                                continue;
-
-                        /* Submit if it's a user */
-                        if (_mesa_set_search(batch->resources, rsrc))
-                                panfrost_batch_submit(ctx, batch);
-                }
+                u_foreach_bit(i, others)
+                        panfrost_batch_submit(ctx, &ctx->batches.slots[i]);
         }
 
-        if (writes) {
-                _mesa_hash_table_insert(ctx->writers, rsrc, batch);
+        if (writes && access->writer != batch_idx) {
+                assert(access->writer < 0);
+                access->writer = batch_idx;
                 rsrc->track.nr_writers++;
         }
 }
@@ -575,57 +620,15 @@ pandecode_cs_bo(struct panfrost_bo *bo, unsigned gpu_id)
         pandecode_cs(bo->ptr.gpu, bo->size, gpu_id);
 }
 
-static int
-panfrost_batch_submit_kbase(struct panfrost_device *dev,
-                            struct drm_panfrost_submit *submit,
-                            struct kbase_syncobj *syncobj)
-{
-        dev->mali.handle_events(&dev->mali);
-
-        int atom = dev->mali.submit(&dev->mali,
-                                    submit->jc,
-                                    submit->requirements,
-                                    syncobj,
-                                    (int32_t *)(uintptr_t) submit->bo_handles,
-                                    submit->bo_handle_count);
-
-        if (atom == -1) {
-                errno = EINVAL;
-                return -1;
-        }
+/* Collect the handles of all BOs accessed by the batch, to be freed by the
+ * caller */
 
-        return 0;
-}
-
-static int
-panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
-                            mali_ptr first_job_desc,
-                            uint32_t reqs,
-                            uint32_t in_sync,
-                            uint32_t out_sync)
+static uint32_t *
+panfrost_batch_get_bo_handles(struct panfrost_batch *batch, uint32_t *count)
 {
-        struct panfrost_context *ctx = batch->ctx;
-        struct pipe_context *gallium = (struct pipe_context *) ctx;
-        struct panfrost_device *dev = pan_device(gallium->screen);
-        struct drm_panfrost_submit submit = {0,};
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
         uint32_t *bo_handles;
-        int ret;
-
-        /* If we trace, we always need a syncobj, so make one of our own if we
-         * weren't given one to use. Remember that we did so, so we can free it
-         * after we're done but preventing double-frees if we were given a
-         * syncobj */
-
-        if (!out_sync && dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
-                out_sync = ctx->syncobj;
-
-        submit.out_sync = out_sync;
-        submit.jc = first_job_desc;
-        submit.requirements = reqs;
-        if (in_sync) {
-                submit.in_syncs = (u64)(uintptr_t)(&in_sync);
-                submit.in_sync_count = 1;
-        }
+        uint32_t n = 0;
 
         bo_handles = calloc(panfrost_pool_num_bos(&batch->pool) +
                             panfrost_pool_num_bos(&batch->invisible_pool) +
@@ -640,8 +643,8 @@ panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
                 if (!flags[i])
                         continue;
 
-                assert(submit.bo_handle_count < batch->num_bos);
-                bo_handles[submit.bo_handle_count++] = i;
+                assert(n < batch->num_bos);
+                bo_handles[n++] = i;
 
                 /* Update the BO access flags so that panfrost_bo_wait() knows
                  * about all pending accesses.
@@ -655,26 +658,60 @@ panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
                 bo->gpu_access |= flags[i] & (PAN_BO_ACCESS_RW);
         }
 
-        panfrost_pool_get_bo_handles(&batch->pool, bo_handles + submit.bo_handle_count);
-        submit.bo_handle_count += panfrost_pool_num_bos(&batch->pool);
-        panfrost_pool_get_bo_handles(&batch->invisible_pool, bo_handles + submit.bo_handle_count);
-        submit.bo_handle_count += panfrost_pool_num_bos(&batch->invisible_pool);
+        panfrost_pool_get_bo_handles(&batch->pool, bo_handles + n);
+        n += panfrost_pool_num_bos(&batch->pool);
+        panfrost_pool_get_bo_handles(&batch->invisible_pool, bo_handles + n);
+        n += panfrost_pool_num_bos(&batch->invisible_pool);
 
         /* Add the tiler heap to the list of accessed BOs if the batch has at
          * least one tiler job. Tiler heap is written by tiler jobs and read
          * by fragment jobs (the polygon list is coming from this heap).
          */
         if (batch->scoreboard.first_tiler)
-                bo_handles[submit.bo_handle_count++] = dev->tiler_heap->gem_handle;
+                bo_handles[n++] = dev->tiler_heap->gem_handle;
 
         /* Always used on Bifrost, occassionally used on Midgard */
-        bo_handles[submit.bo_handle_count++] = dev->sample_positions->gem_handle;
+        bo_handles[n++] = dev->sample_positions->gem_handle;
+
+        *count = n;
+        return bo_handles;
+}
+
+static int
+panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
+                            mali_ptr first_job_desc,
+                            uint32_t reqs,
+                            uint32_t in_sync,
+                            uint32_t out_sync)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_device *dev = pan_device(gallium->screen);
+        struct drm_panfrost_submit submit = {0,};
+        uint32_t *bo_handles;
+        int ret;
+
+        /* If we trace, we always need a syncobj, so make one of our own if we
+         * weren't given one to use. Remember that we did so, so we can free it
+         * after we're done but preventing double-frees if we were given a
+         * syncobj */
+
+        if (!out_sync && dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
+                out_sync = ctx->syncobj;
+
+        submit.out_sync = out_sync;
+        submit.jc = first_job_desc;
+        submit.requirements = reqs;
+        if (in_sync) {
+                submit.in_syncs = (u64)(uintptr_t)(&in_sync);
+                submit.in_sync_count = 1;
+        }
+
+        bo_handles = panfrost_batch_get_bo_handles(batch, &submit.bo_handle_count);
 
         submit.bo_handles = (u64) (uintptr_t) bo_handles;
         if (ctx->is_noop)
                 ret = 0;
-        else if (dev->kbase)
-                ret = panfrost_batch_submit_kbase(dev, &submit, ctx->syncobj_kbase);
         else
                 ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
         free(bo_handles);
@@ -685,11 +722,7 @@ panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
         /* Trace the job if we're doing that */
         if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)) {
                 /* Wait so we can get errors reported back */
-                if (dev->kbase)
-                        dev->mali.syncobj_wait(&dev->mali, ctx->syncobj_kbase);
-                else
-                        drmSyncobjWait(dev->fd, &out_sync, 1,
-                                       INT64_MAX, 0, NULL);
+                drmSyncobjWait(dev->fd, &out_sync, 1, INT64_MAX, 0, NULL);
 
                 if (dev->debug & PAN_DBG_TRACE)
                         pandecode_jc(submit.jc, dev->gpu_id);
@@ -759,6 +792,98 @@ done:
         return ret;
 }
 
+/* Queue the vertex/tiler and fragment jobs of a batch as kbase atoms, with a
+ * data dependency between them. The atoms are only kicked to the kernel
+ * straight away if the context is not accumulating batches. */
+
+static int
+panfrost_batch_submit_kbase(struct panfrost_batch *batch,
+                            const struct pan_fb_info *fb)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct pipe_screen *pscreen = ctx->base.screen;
+        struct panfrost_screen *screen = pan_screen(pscreen);
+        struct panfrost_device *dev = pan_device(pscreen);
+        struct kbase_atom atoms[3];
+        unsigned num_atoms = 0;
+        uint32_t num_handles;
+        int ret = 0;
+
+        /* Both atoms are queued at once, so there is no need for the submit
+         * lock to keep tiler jobs from other contexts out from between
+         * them */
+        int32_t *handles = (int32_t *)
+                panfrost_batch_get_bo_handles(batch, &num_handles);
+
+        if (batch->scoreboard.first_job) {
+                atoms[num_atoms++] = (struct kbase_atom) {
+                        .va = batch->scoreboard.first_job,
+                        .req = batch->writes_timestamp ?
+                               KBASE_JD_REQ_CYCLE_COUNT : 0,
+                        .dep = -1,
+                };
+        }
+
+        if (panfrost_has_fragment_job(batch)) {
+                atoms[num_atoms] = (struct kbase_atom) {
+                        .va = screen->vtbl.emit_fragment_job(batch, fb),
+                        .req = PANFROST_JD_REQ_FS,
+                        .dep = num_atoms ? 0 : -1,
+                };
+                ++num_atoms;
+        }
+
+        /* End timestamps are written by a separate chain depending on the
+         * last atom, so they are only sampled once the batch is done */
+        if (batch->timestamps.size) {
+                atoms[num_atoms] = (struct kbase_atom) {
+                        .va = screen->vtbl.emit_timestamps(batch),
+                        .req = KBASE_JD_REQ_CYCLE_COUNT,
+                        .dep = (int) num_atoms - 1,
+                };
+                ++num_atoms;
+        }
+
+        for (unsigned i = 0; i < num_atoms; ++i) {
+                atoms[i].o = batch->syncobj_kbase;
+                atoms[i].handles = handles;
+                atoms[i].num_handles = num_handles;
+        }
+
+        if (!ctx->is_noop) {
+                /* Free up atom numbers of completed jobs */
+                dev->mali.handle_events(&dev->mali);
+
+                if (dev->mali.submit_atoms(&dev->mali, atoms, num_atoms,
+                                           !ctx->kbase_defer_kick) == -1)
+                        ret = EINVAL;
+        }
+
+        free(handles);
+
+        if (ret || !(dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)))
+                return ret;
+
+        /* Wait so we can get errors reported back, this also kicks the
+         * atoms */
+        dev->mali.syncobj_wait(&dev->mali, batch->syncobj_kbase,
+                               OS_TIMEOUT_INFINITE);
+
+        for (unsigned i = 0; i < num_atoms; ++i) {
+                if (dev->debug & PAN_DBG_TRACE)
+                        pandecode_jc(atoms[i].va, dev->gpu_id);
+
+                if (dev->debug & PAN_DBG_DUMP)
+                        pandecode_dump_mappings();
+
+                /* Jobs won't be complete if blackhole rendering, that's ok */
+                if (!ctx->is_noop && dev->debug & PAN_DBG_SYNC)
+                        pandecode_abort_on_fault(atoms[i].va, dev->gpu_id);
+        }
+
+        return 0;
+}
+
 static int
 panfrost_batch_submit_csf(struct panfrost_batch *batch,
                           const struct pan_fb_info *fb)
@@ -785,29 +910,45 @@ panfrost_batch_submit_csf(struct panfrost_batch *batch,
         // TODO: Make a new debug flag?
         bool log = (dev->debug & PAN_DBG_PERF);
 
-        // TODO: We need better synchronisation than a single fake syncobj!
+        /* Debugging needs the results of the batch, so wait for it */
+        bool sync = dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC | PAN_DBG_TILER);
+
+        /* The vertex queue waits for the previous fragment job and flushes
+         * the caches itself, see emit_csf_queue. Debug options still wait
+         * for it to go idle on the CPU, so that ordering bugs in the queues
+         * can be told apart by turning them on. */
+        if (sync)
+                dev->mali.cs_wait_idle(&dev->mali, &ctx->kbase_cs_vertex.base);
 
-        // sigh... so for some reason we need to wait for the GPU to be
-        // powered off before starting the vertex job?
-        // Perhaps the fragment job does not do enough cleanup work at the
-        // end, leaving caches dirty?
-        dev->mali.cs_wait_idle(&dev->mali, &ctx->kbase_cs_vertex.base);
+        /* The fragment queue waits for the vertex queue, so the BOs only
+         * need to be kept alive until the last queue used completes */
+        uint32_t num_handles;
+        uint32_t *handles = panfrost_batch_get_bo_handles(batch, &num_handles);
+        bool has_frag = fs_offset != ctx->kbase_cs_fragment.base.last_insert;
 
         if (log)
                 printf("About to submit\n");
         dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset,
-                            ctx->syncobj_kbase, ctx->kbase_cs_vertex.seqnum);
+                            batch->syncobj_kbase, ctx->kbase_cs_vertex.seqnum,
+                            (int32_t *) handles, has_frag ? 0 : num_handles);
 
         dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset,
-                            ctx->syncobj_kbase, ctx->kbase_cs_fragment.seqnum);
+                            batch->syncobj_kbase, ctx->kbase_cs_fragment.seqnum,
+                            (int32_t *) handles, has_frag ? num_handles : 0);
 
-        if (log)
-                printf("Wait vertex\n");
-        dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset);
+        free(handles);
 
-        if (log)
-                printf("Wait fragment\n");
-        dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset);
+        /* Completion is otherwise tracked through the queue seqnums, which
+         * lets the CPU record the next batch while this one executes */
+        if (sync) {
+                if (log)
+                        printf("Wait vertex\n");
+                dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset);
+
+                if (log)
+                        printf("Wait fragment\n");
+                dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset);
+        }
 
         if (dev->debug & PAN_DBG_TILER) {
                 fflush(stdout);
@@ -868,6 +1009,30 @@ panfrost_emit_tile_map(struct panfrost_batch *batch, struct pan_fb_info *fb)
         }
 }
 
+/* Remember the syncobj of a submitted batch for fences, dropping those of
+ * batches which have completed since */
+
+static void
+panfrost_track_syncobj_kbase(struct panfrost_context *ctx,
+                             struct kbase_syncobj *syncobj)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct util_dynarray *syncobjs = &ctx->syncobjs_kbase;
+        struct kbase_syncobj **objs = util_dynarray_begin(syncobjs);
+        unsigned count = util_dynarray_num_elements(syncobjs, struct kbase_syncobj *);
+        unsigned kept = 0;
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (dev->mali.syncobj_signaled(&dev->mali, objs[i]))
+                        dev->mali.syncobj_destroy(&dev->mali, objs[i]);
+                else
+                        objs[kept++] = objs[i];
+        }
+
+        syncobjs->size = kept * sizeof(struct kbase_syncobj *);
+        util_dynarray_append(syncobjs, struct kbase_syncobj *, syncobj);
+}
+
 static void
 panfrost_batch_submit(struct panfrost_context *ctx,
                       struct panfrost_batch *batch)
@@ -878,7 +1043,8 @@ panfrost_batch_submit(struct panfrost_context *ctx,
         int ret;
 
         /* Nothing to do! */
-        if (!batch->scoreboard.first_job && !batch->clear)
+        if (!batch->scoreboard.first_job && !batch->clear &&
+            !batch->timestamps.size)
                 goto out;
 
         if (batch->key.zsbuf && panfrost_has_fragment_job(batch)) {
@@ -918,11 +1084,21 @@ panfrost_batch_submit(struct panfrost_context *ctx,
         if (batch->scoreboard.first_tiler || batch->clear)
                 screen->vtbl.emit_fbd(batch, &fb);
 
+        /* Each batch gets its own syncobj, so that waits only depend on the
+         * work they need */
+        if (dev->kbase)
+                batch->syncobj_kbase = dev->mali.syncobj_create(&dev->mali);
+
         /* TODO: Don't hardcode the arch number */
-        if (dev->arch < 10)
-                ret = panfrost_batch_submit_jobs(batch, &fb, 0, ctx->syncobj);
-        else
+        if (dev->arch >= 10)
                 ret = panfrost_batch_submit_csf(batch, &fb);
+        else if (dev->kbase)
+                ret = panfrost_batch_submit_kbase(batch, &fb);
+        else
+                ret = panfrost_batch_submit_jobs(batch, &fb, 0, ctx->syncobj);
+
+        if (dev->kbase)
+                panfrost_track_syncobj_kbase(ctx, batch->syncobj_kbase);
 
         if (ret)
                 fprintf(stderr, "panfrost_batch_submit failed: %d\n", ret);
@@ -951,9 +1127,31 @@ out:
 
 /* Submit all batches */
 
+/* When flushing several batches at once on kbase, queue all of their jobs
+ * and submit them with a single ioctl at the end */
+
+static void
+panfrost_begin_batched_submit(struct panfrost_context *ctx)
+{
+        ctx->kbase_defer_kick = true;
+}
+
+static void
+panfrost_end_batched_submit(struct panfrost_context *ctx)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        ctx->kbase_defer_kick = false;
+
+        if (dev->kbase && dev->mali.kick)
+                dev->mali.kick(&dev->mali);
+}
+
 void
 panfrost_flush_all_batches(struct panfrost_context *ctx, const char *reason)
 {
+        panfrost_begin_batched_submit(ctx);
+
         struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
         panfrost_batch_submit(ctx, batch);
 
@@ -965,6 +1163,8 @@ panfrost_flush_all_batches(struct panfrost_context *ctx, const char *reason)
                         panfrost_batch_submit(ctx, &ctx->batches.slots[i]);
                 }
         }
+
+        panfrost_end_batched_submit(ctx);
 }
 
 void
@@ -972,11 +1172,11 @@ panfrost_flush_writer(struct panfrost_context *ctx,
                       struct panfrost_resource *rsrc,
                       const char *reason)
 {
-        struct hash_entry *entry = _mesa_hash_table_search(ctx->writers, rsrc);
+        struct panfrost_rsrc_access *access = panfrost_get_rsrc_access(ctx, rsrc);
 
-        if (entry) {
+        if (access && access->writer >= 0) {
                 perf_debug_ctx(ctx, "Flushing writer due to: %s", reason);
-                panfrost_batch_submit(ctx, entry->data);
+                panfrost_batch_submit(ctx, &ctx->batches.slots[access->writer]);
         }
 }
 
@@ -985,16 +1185,22 @@ panfrost_flush_batches_accessing_rsrc(struct panfrost_context *ctx,
                                       struct panfrost_resource *rsrc,
                                       const char *reason)
 {
-        unsigned i;
-        foreach_batch(ctx, i) {
-                struct panfrost_batch *batch = &ctx->batches.slots[i];
+        struct panfrost_rsrc_access *access = panfrost_get_rsrc_access(ctx, rsrc);
 
-                if (!_mesa_set_search(batch->resources, rsrc))
-                        continue;
+        if (!access)
+                return;
+
+        /* The record is recycled once the last user is cleaned up */
+        uint32_t users = access->users;
+
+        panfrost_begin_batched_submit(ctx);
 
+        u_foreach_bit(i, users) {
                 perf_debug_ctx(ctx, "Flushing user due to: %s", reason);
-                panfrost_batch_submit(ctx, batch);
+                panfrost_batch_submit(ctx, &ctx->batches.slots[i]);
         }
+
+        panfrost_end_batched_submit(ctx);
 }
 
 void
@@ -89,6 +89,20 @@ pan_tristate_is_defined(struct pan_tristate state)
         return (state.v != PAN_TRISTATE_DONTCARE);
 }
 
+/* Batches of a context accessing a resource, as slot indices. Reads from a
+ * batch other than the writer flush the writer, and writes flush every other
+ * user, so a resource with a writer has no other user. */
+
+struct panfrost_rsrc_access {
+        struct panfrost_resource *rsrc;
+
+        /* Bitmask of batch slots reading or writing the resource */
+        uint32_t users;
+
+        /* Batch slot writing the resource, or -1 */
+        int writer;
+};
+
 /* A panfrost_batch corresponds to a bound FBO we're rendering to,
  * collecting over multiple draws. */
 
@@ -202,8 +216,15 @@ struct panfrost_batch {
         struct pan_tristate sprite_coord_origin;
         struct pan_tristate first_provoking_vertex;
 
-        /* Referenced resources */
-        struct set *resources;
+        /* Referenced resources, as struct panfrost_rsrc_access pointers */
+        struct util_dynarray resources;
+
+        /* GPU addresses to write the system timestamp to once all other jobs
+         * of the batch complete */
+        struct util_dynarray timestamps;
+
+        /* Whether the vertex/tiler job chain writes timestamps itself */
+        bool writes_timestamp;
 
         /* Command stream pointers for CSF Valhall */
         // TODO: Is using a separate BO required?
@@ -212,6 +233,9 @@ struct panfrost_batch {
 
         pan_command_stream cs_vertex;
         pan_command_stream cs_fragment;
+
+        /* kbase: signaled when the batch completes */
+        struct kbase_syncobj *syncobj_kbase;
 };
 
 /* Functions for managing the above */
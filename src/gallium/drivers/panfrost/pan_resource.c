@@ -45,6 +45,7 @@
 #include "util/u_transfer_helper.h"
 #include "util/u_gen_mipmap.h"
 #include "util/u_drm.h"
+#include "util/u_cpu_detect.h"
 
 #include "pan_bo.h"
 #include "pan_context.h"
@@ -80,6 +81,10 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
         pipe_reference_init(&prsc->reference, 1);
         prsc->screen = pscreen;
 
+        threaded_resource_init(prsc, false);
+        rsc->tc.is_shared = true;
+        simple_mtx_init(&rsc->map_lock, mtx_plain);
+
         uint64_t mod = whandle->modifier == DRM_FORMAT_MOD_INVALID ?
                        DRM_FORMAT_MOD_LINEAR : whandle->modifier;
         enum mali_texture_dimension dim =
@@ -125,6 +130,11 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
 
         rsc->modifier_constant = true;
 
+        if (templat->target == PIPE_BUFFER) {
+                rsc->tc.buffer_id_unique =
+                        util_idalloc_mt_alloc(&pan_screen(pscreen)->buffer_ids);
+        }
+
         BITSET_SET(rsc->valid.data, 0);
         panfrost_resource_set_damage_region(pscreen, &rsc->base, 0, NULL);
 
@@ -149,6 +159,9 @@ panfrost_resource_get_handle(struct pipe_screen *pscreen,
         struct renderonly_scanout *scanout;
         struct pipe_resource *cur = pt;
 
+        /* Queued blits may still change the layout we are about to export */
+        threaded_context_unwrap_sync(ctx);
+
         /* Even though panfrost doesn't support multi-planar formats, we
          * can get here through GBM, which does. Walk the list of planes
          * to find the right one.
@@ -163,6 +176,7 @@ panfrost_resource_get_handle(struct pipe_screen *pscreen,
 
         handle->modifier = rsrc->image.layout.modifier;
         rsrc->modifier_constant = true;
+        rsrc->tc.is_shared = true;
 
         if (handle->type == WINSYS_HANDLE_TYPE_KMS && dev->ro) {
                 return renderonly_get_handle(scanout, handle);
@@ -196,6 +210,8 @@ panfrost_resource_get_param(struct pipe_screen *pscreen,
         struct pipe_resource *cur;
         unsigned count;
 
+        threaded_context_unwrap_sync(pctx);
+
         switch (param) {
         case PIPE_RESOURCE_PARAM_STRIDE:
                 *value = panfrost_get_legacy_stride(&rsrc->image.layout, level);
@@ -232,11 +248,10 @@ panfrost_create_surface(struct pipe_context *pipe,
                         struct pipe_resource *pt,
                         const struct pipe_surface *surf_tmpl)
 {
-        struct panfrost_context *ctx = pan_context(pipe);
         struct pipe_surface *ps = NULL;
 
-        pan_legalize_afbc_format(ctx, pan_resource(pt), surf_tmpl->format);
-
+        /* Surfaces are legalized for AFBC when bound, as the threaded context
+         * creates them from the application thread */
         ps = CALLOC_STRUCT(pipe_surface);
 
         if (ps) {
@@ -508,6 +523,8 @@ panfrost_resource_init_afbc_headers(struct panfrost_resource *pres)
                         }
                 }
         }
+
+        panfrost_bo_mem_clean(pres->image.data.bo, 0, pres->image.data.bo->size);
 }
 
 void
@@ -632,7 +649,13 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
 
         pipe_reference_init(&so->base.reference, 1);
 
-        util_range_init(&so->valid_buffer_range);
+        threaded_resource_init(&so->base, false);
+        simple_mtx_init(&so->map_lock, mtx_plain);
+
+        if (template->target == PIPE_BUFFER) {
+                so->tc.buffer_id_unique =
+                        util_idalloc_mt_alloc(&pan_screen(screen)->buffer_ids);
+        }
 
         if (template->bind & PAN_BIND_SHARED_MASK) {
                 /* For compatibility with older consumers that may not be
@@ -731,10 +754,21 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
                 }
         } else {
                 /* We create a BO immediately but don't bother mapping, since we don't
-                 * care to map e.g. FBOs which the CPU probably won't touch */
+                 * care to map e.g. FBOs which the CPU probably won't touch.
+                 * Buffers are the exception: the threaded context maps them
+                 * from the application thread, where mmapping lazily would
+                 * race with the driver thread. */
+                uint32_t flags =
+                        template->target == PIPE_BUFFER ? 0 : PAN_BO_DELAY_MMAP;
+
+                /* Staging resources are mostly read back by the CPU (GL maps
+                 * all *_READ buffer usages to staging), which is very slow
+                 * from write-combined memory */
+                if (template->usage == PIPE_USAGE_STAGING)
+                        flags |= PAN_BO_CACHEABLE;
 
                 so->image.data.bo =
-                        panfrost_bo_create(dev, so->image.layout.data_size, PAN_BO_DELAY_MMAP, label);
+                        panfrost_bo_create(dev, so->image.layout.data_size, flags, label);
 
                 so->constant_stencil = true;
         }
@@ -799,7 +833,13 @@ panfrost_resource_destroy(struct pipe_screen *screen,
         free(rsrc->index_cache);
         free(rsrc->damage.tile_map.data);
 
-        util_range_destroy(&rsrc->valid_buffer_range);
+        if (rsrc->tc.buffer_id_unique) {
+                util_idalloc_mt_free(&pan_screen(screen)->buffer_ids,
+                                     rsrc->tc.buffer_id_unique);
+        }
+
+        simple_mtx_destroy(&rsrc->map_lock);
+        threaded_resource_deinit(pt);
         free(rsrc);
 }
 
@@ -831,6 +871,7 @@ pan_alloc_staging(struct panfrost_context *ctx, struct panfrost_resource *rsc,
         tmpl.last_level = 0;
         tmpl.bind |= PIPE_BIND_LINEAR;
         tmpl.bind &= ~PAN_BIND_SHARED_MASK;
+        tmpl.usage = PIPE_USAGE_STAGING;
 
         struct pipe_resource *pstaging =
                 pctx->screen->resource_create(pctx->screen, &tmpl);
@@ -894,10 +935,118 @@ pan_blit_to_staging(struct pipe_context *pctx, struct panfrost_transfer *trans)
         panfrost_blit(pctx, &blit);
 }
 
+/* Transfers below this size are converted on the calling thread, since waking
+ * the workers would cost more than it saves. Larger transfers are split into
+ * bands of whole tile rows of at least this size each. */
+#define PAN_TILING_JOB_SIZE (512 * 1024)
+
+struct panfrost_tiling_job {
+        struct util_queue_fence fence;
+
+        void *tiled, *linear;
+        unsigned x, y, w, h;
+        uint32_t tiled_stride, linear_stride;
+        enum pipe_format format;
+        bool store;
+};
+
+static void
+panfrost_tiling_job_execute(void *data, void *gdata, int thread_index)
+{
+        struct panfrost_tiling_job *job = data;
+
+        if (job->store) {
+                panfrost_store_tiled_image(job->tiled, job->linear,
+                                           job->x, job->y, job->w, job->h,
+                                           job->tiled_stride,
+                                           job->linear_stride, job->format);
+        } else {
+                panfrost_load_tiled_image(job->linear, job->tiled,
+                                          job->x, job->y, job->w, job->h,
+                                          job->linear_stride,
+                                          job->tiled_stride, job->format);
+        }
+}
+
+/* Tiles are independent, so a layer can be split into bands of tile rows and
+ * converted in parallel. The calling thread takes the last band and then
+ * waits for the others. */
+static void
+panfrost_access_tiled_layer(struct panfrost_screen *screen,
+                            void *tiled, void *linear,
+                            const struct pipe_box *box,
+                            uint32_t tiled_stride, uint32_t linear_stride,
+                            enum pipe_format format, bool store)
+{
+        struct util_queue *queue = &screen->tiling_queue;
+        unsigned block_h = util_format_get_blockheight(format);
+
+        /* Block formats use 4x4 tiles of blocks, see pan_tiling.c */
+        unsigned tile_h = util_format_get_blockwidth(format) > 1 ?
+                          4 * block_h : 16;
+        unsigned first_row = box->y / tile_h;
+        unsigned last_row = DIV_ROUND_UP(box->y + box->height, tile_h);
+        unsigned rows = last_row - first_row;
+        uint64_t size = (uint64_t) linear_stride *
+                        DIV_ROUND_UP(box->height, block_h);
+        unsigned count = 1;
+
+        if (util_queue_is_initialized(queue) && size >= 2 * PAN_TILING_JOB_SIZE) {
+                count = MIN3(size / PAN_TILING_JOB_SIZE, rows,
+                             queue->num_threads + 1);
+        }
+
+        struct panfrost_tiling_job jobs[count];
+        unsigned rows_per_job = DIV_ROUND_UP(rows, count);
+        unsigned y = box->y;
+
+        for (unsigned i = 0; i < count; ++i) {
+                unsigned end = MIN2((first_row + (i + 1) * rows_per_job) * tile_h,
+                                    box->y + box->height);
+
+                jobs[i] = (struct panfrost_tiling_job) {
+                        .tiled = tiled,
+                        .linear = (uint8_t *) linear +
+                                  ((y - box->y) / block_h) * linear_stride,
+                        .x = box->x,
+                        .y = y,
+                        .w = box->width,
+                        .h = end - y,
+                        .tiled_stride = tiled_stride,
+                        .linear_stride = linear_stride,
+                        .format = format,
+                        .store = store,
+                };
+
+                y = end;
+
+                /* Rounding may leave nothing for the last jobs */
+                if (!jobs[i].h) {
+                        count = i;
+                        break;
+                }
+        }
+
+        for (unsigned i = 0; i + 1 < count; ++i) {
+                util_queue_fence_init(&jobs[i].fence);
+                util_queue_add_job(queue, &jobs[i], &jobs[i].fence,
+                                   panfrost_tiling_job_execute, NULL, 0);
+        }
+
+        if (count)
+                panfrost_tiling_job_execute(&jobs[count - 1], NULL, 0);
+
+        for (unsigned i = 0; i + 1 < count; ++i) {
+                util_queue_fence_wait(&jobs[i].fence);
+                util_queue_fence_destroy(&jobs[i].fence);
+        }
+}
+
 static void
 panfrost_load_tiled_images(struct panfrost_transfer *transfer,
                            struct panfrost_resource *rsrc)
 {
+        struct panfrost_screen *screen = pan_screen(rsrc->base.screen);
         struct pipe_transfer *ptrans = &transfer->base;
         unsigned level = ptrans->level;
 
@@ -919,11 +1068,10 @@ panfrost_load_tiled_images(struct panfrost_transfer *transfer,
                                rsrc->image.layout.slices[level].offset +
                                (z + ptrans->box.z) * stride;
 
-                panfrost_load_tiled_image(dst, map, ptrans->box.x,
-                                          ptrans->box.y, ptrans->box.width,
-                                          ptrans->box.height, ptrans->stride,
-                                          rsrc->image.layout.slices[level].row_stride,
-                                          rsrc->image.layout.format);
+                panfrost_access_tiled_layer(screen, map, dst, &ptrans->box,
+                                            rsrc->image.layout.slices[level].row_stride,
+                                            ptrans->stride,
+                                            rsrc->image.layout.format, false);
         }
 }
 
@@ -931,6 +1079,7 @@ static void
 panfrost_store_tiled_images(struct panfrost_transfer *transfer,
                             struct panfrost_resource *rsrc)
 {
+        struct panfrost_screen *screen = pan_screen(rsrc->base.screen);
         struct panfrost_bo *bo = rsrc->image.data.bo;
         struct pipe_transfer *ptrans = &transfer->base;
         unsigned level = ptrans->level;
@@ -945,14 +1094,99 @@ panfrost_store_tiled_images(struct panfrost_transfer *transfer,
                                rsrc->image.layout.slices[level].offset +
                                (z + ptrans->box.z) * stride;
 
-                panfrost_store_tiled_image(map, src,
-                                ptrans->box.x, ptrans->box.y,
-                                ptrans->box.width, ptrans->box.height,
-                                rsrc->image.layout.slices[level].row_stride,
-                                ptrans->stride, rsrc->image.layout.format);
+                panfrost_access_tiled_layer(screen, map, src, &ptrans->box,
+                                            rsrc->image.layout.slices[level].row_stride,
+                                            ptrans->stride,
+                                            rsrc->image.layout.format, true);
         }
 }
 
+/* Byte ranges of a resource to copy when shadowing it for a CPU write. Only
+ * the valid range of a buffer has defined contents, and the mapped range
+ * doesn't need preserving if the caller discards it. Returns the number of
+ * ranges, at most two. */
+
+static unsigned
+panfrost_shadow_ranges(const struct panfrost_resource *rsrc, unsigned usage,
+                       const struct pipe_box *box, size_t ranges[2][2])
+{
+        if (rsrc->base.target != PIPE_BUFFER) {
+                ranges[0][0] = 0;
+                ranges[0][1] = rsrc->image.data.bo->size;
+                return 1;
+        }
+
+        size_t start = rsrc->tc.valid_buffer_range.start;
+        size_t end = rsrc->tc.valid_buffer_range.end;
+        unsigned count = 0;
+
+        if (!(usage & PIPE_MAP_DISCARD_RANGE)) {
+                if (start < end) {
+                        ranges[count][0] = start;
+                        ranges[count++][1] = end;
+                }
+
+                return count;
+        }
+
+        size_t box_start = box->x;
+        size_t box_end = box->x + box->width;
+
+        if (start < MIN2(end, box_start)) {
+                ranges[count][0] = start;
+                ranges[count++][1] = MIN2(end, box_start);
+        }
+
+        if (MAX2(start, box_end) < end) {
+                ranges[count][0] = MAX2(start, box_end);
+                ranges[count++][1] = end;
+        }
+
+        return count;
+}
+
+/* Byte range of a linear resource covered by a box of the given level.
+ * Returns the offset and writes the length. */
+
+static size_t
+panfrost_linear_range(const struct panfrost_resource *rsrc, unsigned level,
+                      const struct pipe_box *box, size_t *length)
+{
+        enum pipe_format format = rsrc->image.layout.format;
+        unsigned bytes_per_block = util_format_get_blocksize(format);
+        unsigned row_stride = rsrc->image.layout.slices[level].row_stride;
+        unsigned layer_stride =
+                panfrost_get_layer_stride(&rsrc->image.layout, level);
+        struct pipe_box box_blocks;
+
+        u_box_pixels_to_blocks(&box_blocks, box, format);
+
+        *length = (box->depth - 1) * layer_stride
+                  + (box_blocks.height - 1) * row_stride
+                  + box_blocks.width * bytes_per_block;
+
+        return rsrc->image.layout.slices[level].offset
+               + box->z * layer_stride
+               + box_blocks.y * row_stride
+               + box_blocks.x * bytes_per_block;
+}
+
+/* Replaces the storage of a resource, taking ownership of the new BO. Pending
+ * batches keep the old BO alive, but swapping it out invalidates them. */
+
+static void
+panfrost_resource_swap_bo(struct panfrost_context *ctx,
+                          struct panfrost_resource *rsrc,
+                          struct panfrost_bo *newbo,
+                          const char *reason)
+{
+        panfrost_bo_unreference(rsrc->image.data.bo);
+        rsrc->image.data.bo = newbo;
+
+        /* Flush the batches accessing the resource but do not wait for them */
+        panfrost_flush_batches_accessing_rsrc(ctx, rsrc, reason);
+}
+
 static void *
 panfrost_ptr_map(struct pipe_context *pctx,
                       struct pipe_resource *resource,
@@ -972,7 +1206,18 @@ panfrost_ptr_map(struct pipe_context *pctx,
         if ((usage & PIPE_MAP_DIRECTLY) && rsrc->image.layout.modifier != DRM_FORMAT_MOD_LINEAR)
                 return NULL;
 
-        struct panfrost_transfer *transfer = rzalloc(pctx, struct panfrost_transfer);
+        /* Direct, persistent writes create holes in time for
+         * caching... I don't know if this is actually possible but we
+         * should still get it right */
+
+        unsigned dpw = PIPE_MAP_DIRECTLY | PIPE_MAP_WRITE | PIPE_MAP_PERSISTENT;
+
+        if ((usage & dpw) == dpw && rsrc->index_cache)
+                return NULL;
+
+        /* Not parented to the context, since the threaded context maps
+         * buffers unsynchronized from the application thread */
+        struct panfrost_transfer *transfer = rzalloc(NULL, struct panfrost_transfer);
         transfer->base.level = level;
         transfer->base.usage = usage;
         transfer->base.box = *box;
@@ -1013,35 +1258,69 @@ panfrost_ptr_map(struct pipe_context *pctx,
                 }
 
                 panfrost_bo_mmap(staging->image.data.bo);
+
+                if (usage & PIPE_MAP_READ) {
+                        panfrost_bo_mem_invalidate(staging->image.data.bo, 0,
+                                                   staging->image.data.bo->size);
+                }
                 return staging->image.data.bo->ptr.cpu;
         }
 
+        /* Agree on the BO with shadowing on the driver thread, see map_lock */
+        bool tc_buffer = ctx->tc && resource->target == PIPE_BUFFER;
+
+        if (tc_buffer) {
+                simple_mtx_lock(&rsrc->map_lock);
+                bo = rsrc->image.data.bo;
+        }
+
         /* If we haven't already mmaped, now's the time */
         panfrost_bo_mmap(bo);
 
         if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
                 pandecode_inject_mmap(bo->ptr.gpu, bo->ptr.cpu, bo->size, NULL);
 
-        bool create_new_bo = usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE;
-        bool copy_resource = false;
+        /* The threaded context asks us not to swap the storage of buffers it
+         * maps, it invalidates them itself with replace_buffer_storage. Maps
+         * of the driver thread, like buffer_subdata and copies, may still
+         * shadow a buffer as long as no CPU mapping points at the current
+         * storage. The threaded context also does its own valid range
+         * tracking when it asks us not to.
+         */
+        bool can_shadow = !(usage & TC_TRANSFER_MAP_NO_INVALIDATE) &&
+                          !(tc_buffer && rsrc->map_count);
+
+        bool uninitialized = resource->target == PIPE_BUFFER &&
+                !(usage & TC_TRANSFER_MAP_NO_INFER_UNSYNCHRONIZED) &&
+                !util_ranges_intersect(&rsrc->tc.valid_buffer_range,
+                                       box->x, box->x + box->width);
 
-        if (!create_new_bo &&
+        bool create_new_bo = can_shadow &&
+                             (usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE);
+        size_t copy_ranges[2][2];
+        unsigned copy_range_count = 0;
+
+        if (can_shadow && !create_new_bo &&
             !(usage & PIPE_MAP_UNSYNCHRONIZED) &&
             (usage & PIPE_MAP_WRITE) &&
-            !(resource->target == PIPE_BUFFER
-              && !util_ranges_intersect(&rsrc->valid_buffer_range, box->x, box->x + box->width)) &&
+            !uninitialized &&
             rsrc->track.nr_users > 0) {
 
                 /* When a resource to be modified is already being used by a
-                 * pending batch, it is often faster to copy the whole BO than
-                 * to flush and split the frame in two.
+                 * pending batch, it is often faster to copy the BO than to
+                 * flush and split the frame in two. Only the parts the CPU
+                 * won't overwrite are copied, which is nothing when updating
+                 * the whole valid range of a buffer.
                  */
+                copy_range_count =
+                        panfrost_shadow_ranges(rsrc, usage, box, copy_ranges);
 
-                panfrost_flush_writer(ctx, rsrc, "Shadow resource creation");
-                panfrost_bo_wait(bo, INT64_MAX, false);
+                if (copy_range_count) {
+                        panfrost_flush_writer(ctx, rsrc, "Shadow resource creation");
+                        panfrost_bo_wait(bo, INT64_MAX, false);
+                }
 
                 create_new_bo = true;
-                copy_resource = true;
         }
 
         if (create_new_bo) {
@@ -1068,19 +1347,20 @@ panfrost_ptr_map(struct pipe_context *pctx,
                                                            flags, bo->label);
 
                         if (newbo) {
-                                if (copy_resource)
-                                        memcpy(newbo->ptr.cpu, rsrc->image.data.bo->ptr.cpu, bo->size);
-
-                                panfrost_bo_unreference(bo);
-                                rsrc->image.data.bo = newbo;
+                                for (unsigned i = 0; i < copy_range_count; ++i) {
+                                        size_t start = copy_ranges[i][0];
+                                        size_t size = copy_ranges[i][1] - start;
+
+                                        panfrost_bo_mem_invalidate(bo, start, size);
+                                        memcpy(newbo->ptr.cpu + start,
+                                               bo->ptr.cpu + start, size);
+                                        panfrost_bo_mem_clean(newbo, start, size);
+                                }
 
-                                /* Swapping out the BO will invalidate batches
-                                 * accessing this resource, flush them but do
-                                 * not wait for them.
-                                 */
-                                panfrost_flush_batches_accessing_rsrc(ctx, rsrc, "Resource shadowing");
+                                panfrost_resource_swap_bo(ctx, rsrc, newbo,
+                                                          "Resource shadowing");
 
-	                        if (!copy_resource &&
+	                        if (!copy_range_count &&
                                     drm_is_afbc(rsrc->image.layout.modifier))
                                         panfrost_resource_init_afbc_headers(rsrc);
 
@@ -1094,9 +1374,7 @@ panfrost_ptr_map(struct pipe_context *pctx,
                                 panfrost_bo_wait(bo, INT64_MAX, true);
                         }
                 }
-        } else if ((usage & PIPE_MAP_WRITE)
-                   && resource->target == PIPE_BUFFER
-                   && !util_ranges_intersect(&rsrc->valid_buffer_range, box->x, box->x + box->width)) {
+        } else if ((usage & PIPE_MAP_WRITE) && uninitialized) {
                 /* No flush for writes to uninitialized */
         } else if (!(usage & PIPE_MAP_UNSYNCHRONIZED)) {
                 if (usage & PIPE_MAP_WRITE) {
@@ -1108,6 +1386,11 @@ panfrost_ptr_map(struct pipe_context *pctx,
                 }
         }
 
+        if (tc_buffer) {
+                rsrc->map_count++;
+                simple_mtx_unlock(&rsrc->map_lock);
+        }
+
         /* For access to compressed textures, we want the (x, y, w, h)
          * region-of-interest in blocks, not pixels. Then we compute the stride
          * between rows of blocks as the width in blocks times the width per
@@ -1121,39 +1404,37 @@ panfrost_ptr_map(struct pipe_context *pctx,
                 transfer->base.layer_stride = transfer->base.stride * box_blocks.height;
                 transfer->map = ralloc_size(transfer, transfer->base.layer_stride * box->depth);
 
-                if (usage & PIPE_MAP_READ)
+                if (usage & PIPE_MAP_READ) {
+                        panfrost_bo_mem_invalidate(bo, 0, bo->size);
                         panfrost_load_tiled_images(transfer, rsrc);
+                }
 
                 return transfer->map;
         } else {
                 assert (rsrc->image.layout.modifier == DRM_FORMAT_MOD_LINEAR);
 
-                /* Direct, persistent writes create holes in time for
-                 * caching... I don't know if this is actually possible but we
-                 * should still get it right */
-
-                unsigned dpw = PIPE_MAP_DIRECTLY | PIPE_MAP_WRITE | PIPE_MAP_PERSISTENT;
-
-                if ((usage & dpw) == dpw && rsrc->index_cache)
-                        return NULL;
-
                 transfer->base.stride = rsrc->image.layout.slices[level].row_stride;
                 transfer->base.layer_stride =
                         panfrost_get_layer_stride(&rsrc->image.layout, level);
 
                 /* By mapping direct-write, we're implicitly already
-                 * initialized (maybe), so be conservative */
+                 * initialized (maybe), so be conservative. Maps from the
+                 * application thread leave this to the unmap, which is
+                 * always called on the driver thread. */
 
-                if (usage & PIPE_MAP_WRITE) {
+                if ((usage & PIPE_MAP_WRITE) &&
+                    !(usage & TC_TRANSFER_MAP_THREADED_UNSYNC)) {
                         BITSET_SET(rsrc->valid.data, level);
                         panfrost_minmax_cache_invalidate(rsrc->index_cache, &transfer->base);
                 }
 
-                return bo->ptr.cpu
-                       + rsrc->image.layout.slices[level].offset
-                       + box->z * transfer->base.layer_stride
-                       + box_blocks.y * rsrc->image.layout.slices[level].row_stride
-                       + box_blocks.x * bytes_per_block;
+                size_t length;
+                size_t offset = panfrost_linear_range(rsrc, level, box, &length);
+
+                if (usage & PIPE_MAP_READ)
+                        panfrost_bo_mem_invalidate(bo, offset, length);
+
+                return bo->ptr.cpu + offset;
         }
 }
 
@@ -1282,6 +1563,17 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
         if (transfer->usage & PIPE_MAP_WRITE)
                 prsrc->valid.crc = false;
 
+        if ((transfer->usage & PIPE_MAP_WRITE) &&
+            (transfer->usage & TC_TRANSFER_MAP_THREADED_UNSYNC))
+                BITSET_SET(prsrc->valid.data, transfer->level);
+
+        if (pan_context(pctx)->tc && transfer->resource->target == PIPE_BUFFER) {
+                simple_mtx_lock(&prsrc->map_lock);
+                assert(prsrc->map_count);
+                prsrc->map_count--;
+                simple_mtx_unlock(&prsrc->map_lock);
+        }
+
         /* AFBC will use a staging resource. `initialized` will be set when the
          * fragment job is created; this is deferred to prevent useless surface
          * reloads that can cascade into DATA_INVALID_FAULTs due to reading
@@ -1289,6 +1581,11 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
 
         if (trans->staging.rsrc) {
                 if (transfer->usage & PIPE_MAP_WRITE) {
+                        struct panfrost_bo *staging_bo =
+                                pan_resource(trans->staging.rsrc)->image.data.bo;
+
+                        panfrost_bo_mem_clean(staging_bo, 0, staging_bo->size);
+
                         if (panfrost_should_linear_convert(dev, prsrc, transfer)) {
 
                                 panfrost_bo_unreference(prsrc->image.data.bo);
@@ -1340,15 +1637,35 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
                                                 trans->map,
                                                 transfer->stride,
                                                 0, 0);
+                                        panfrost_bo_mem_clean(bo,
+                                                              prsrc->image.layout.slices[0].offset,
+                                                              prsrc->image.layout.slices[0].size);
                                 } else {
+                                        unsigned stride =
+                                                panfrost_get_layer_stride(&prsrc->image.layout,
+                                                                          transfer->level);
+
                                         panfrost_store_tiled_images(trans, prsrc);
+                                        panfrost_bo_mem_clean(bo,
+                                                              prsrc->image.layout.slices[transfer->level].offset +
+                                                              transfer->box.z * stride,
+                                                              transfer->box.depth * stride);
                                 }
                         }
                 }
+        } else if ((transfer->usage & PIPE_MAP_WRITE) &&
+                   !(transfer->usage & PIPE_MAP_FLUSH_EXPLICIT)) {
+                /* Direct linear map: write back what the CPU may have
+                 * written, explicit flushes are cleaned as they come */
+                size_t length;
+                size_t offset = panfrost_linear_range(prsrc, transfer->level,
+                                                      &transfer->box, &length);
+
+                panfrost_bo_mem_clean(prsrc->image.data.bo, offset, length);
         }
 
 
-        util_range_add(&prsrc->base, &prsrc->valid_buffer_range,
+        util_range_add(&prsrc->base, &prsrc->tc.valid_buffer_range,
                        transfer->box.x,
                        transfer->box.x + transfer->box.width);
 
@@ -1366,15 +1683,87 @@ panfrost_ptr_flush_region(struct pipe_context *pctx,
                                struct pipe_transfer *transfer,
                                const struct pipe_box *box)
 {
+        struct panfrost_transfer *trans = pan_transfer(transfer);
         struct panfrost_resource *rsc = pan_resource(transfer->resource);
 
         if (transfer->resource->target == PIPE_BUFFER) {
-                util_range_add(&rsc->base, &rsc->valid_buffer_range,
+                util_range_add(&rsc->base, &rsc->tc.valid_buffer_range,
                                transfer->box.x + box->x,
                                transfer->box.x + box->x + box->width);
         } else {
                 BITSET_SET(rsc->valid.data, transfer->level);
         }
+
+        /* Staged and tiled writes are written back at unmap */
+        if (!trans->map && !trans->staging.rsrc) {
+                struct pipe_box flushed = *box;
+                size_t length;
+
+                flushed.x += transfer->box.x;
+                flushed.y += transfer->box.y;
+                flushed.z += transfer->box.z;
+
+                size_t offset = panfrost_linear_range(rsc, transfer->level,
+                                                      &flushed, &length);
+
+                panfrost_bo_mem_clean(rsc->image.data.bo, offset, length);
+        }
+}
+
+/* The threaded context invalidates busy buffers by creating a new one on the
+ * application thread, whose storage we adopt here as if we had shadowed the
+ * buffer ourselves. Descriptors are re-emitted with the new address, so
+ * there is nothing to rebind. */
+
+void
+panfrost_replace_buffer_storage(struct pipe_context *pctx,
+                                struct pipe_resource *dst,
+                                struct pipe_resource *src,
+                                unsigned num_rebinds,
+                                uint32_t rebind_mask,
+                                uint32_t delete_buffer_id)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_resource *rsrc = pan_resource(dst);
+        struct panfrost_bo *bo = pan_resource(src)->image.data.bo;
+
+        assert(dst->target == PIPE_BUFFER && src->target == PIPE_BUFFER);
+        assert(!(rsrc->image.data.bo->flags & PAN_BO_SHARED));
+
+        panfrost_dirty_state_all(ctx);
+
+        panfrost_bo_reference(bo);
+
+        simple_mtx_lock(&rsrc->map_lock);
+        panfrost_resource_swap_bo(ctx, rsrc, bo, "Buffer invalidation");
+        simple_mtx_unlock(&rsrc->map_lock);
+
+        if (delete_buffer_id) {
+                util_idalloc_mt_free(&pan_screen(pctx->screen)->buffer_ids,
+                                     delete_buffer_id);
+        }
+}
+
+/* Called by the threaded context from the application thread, once no
+ * unflushed call of its own references the buffer. Batches of the driver
+ * thread that were not submitted yet still count as busy. */
+
+bool
+panfrost_resource_is_busy(struct pipe_screen *screen,
+                          struct pipe_resource *resource,
+                          unsigned usage)
+{
+        struct panfrost_resource *rsrc = pan_resource(resource);
+        bool write = usage & PIPE_MAP_WRITE;
+
+        if (write ? rsrc->track.nr_users : rsrc->track.nr_writers)
+                return true;
+
+        simple_mtx_lock(&rsrc->map_lock);
+        bool idle = panfrost_bo_wait(rsrc->image.data.bo, 0, write);
+        simple_mtx_unlock(&rsrc->map_lock);
+
+        return !idle;
 }
 
 static void
@@ -1480,11 +1869,30 @@ panfrost_resource_screen_init(struct pipe_screen *pscreen)
         pscreen->transfer_helper = u_transfer_helper_create(&transfer_vtbl,
                                         true, false,
                                         fake_rgtc, true, false);
+
+        util_idalloc_mt_init_tc(&pan_screen(pscreen)->buffer_ids);
+
+        /* Leave a core for the application thread that is waiting anyway */
+        unsigned threads =
+                debug_get_num_option("PAN_TILING_THREADS",
+                                     MIN2(util_get_cpu_caps()->nr_cpus, 4) - 1);
+
+        if (threads) {
+                util_queue_init(&pan_screen(pscreen)->tiling_queue, "pantile",
+                                64, threads, UTIL_QUEUE_INIT_RESIZE_IF_FULL,
+                                NULL);
+        }
 }
 void
 panfrost_resource_screen_destroy(struct pipe_screen *pscreen)
 {
+        struct util_queue *queue = &pan_screen(pscreen)->tiling_queue;
+
+        if (util_queue_is_initialized(queue))
+                util_queue_destroy(queue);
+
         u_transfer_helper_destroy(pscreen->transfer_helper);
+        util_idalloc_mt_fini(&pan_screen(pscreen)->buffer_ids);
 }
 
 void
@@ -30,7 +30,9 @@
 #include "pan_minmax_cache.h"
 #include "pan_texture.h"
 #include "drm-uapi/drm.h"
+#include "util/simple_mtx.h"
 #include "util/u_range.h"
+#include "util/u_threaded_context.h"
 
 #define LAYOUT_CONVERT_THRESHOLD 8
 #define PAN_MAX_BATCHES 32
@@ -39,7 +41,13 @@
                               PIPE_BIND_SHARED)
 
 struct panfrost_resource {
-        struct pipe_resource base;
+        /* The threaded context subclasses resources too, so it has to come
+         * first. Its valid_buffer_range is shared with the driver. */
+        union {
+                struct pipe_resource base;
+                struct threaded_resource tc;
+        };
+
         struct {
                 struct pipe_scissor_state extent;
                 struct {
@@ -65,8 +73,6 @@ struct panfrost_resource {
 
         struct panfrost_resource *separate_stencil;
 
-        struct util_range valid_buffer_range;
-
         /* Description of the resource layout */
         struct pan_image image;
 
@@ -91,6 +97,13 @@ struct panfrost_resource {
         /* The stencil value if constant_stencil is set */
         uint8_t stencil_value;
 
+        /* With a threaded context, the application thread maps buffers
+         * unsynchronized behind the back of the driver thread, so the storage
+         * of a buffer is only shadowed while it has no live CPU mapping. The
+         * lock makes the BO and the mapping count agree between threads. */
+        simple_mtx_t map_lock;
+        unsigned map_count;
+
         /* Cached min/max values for index buffers */
         struct panfrost_minmax_cache *index_cache;
         struct sw_displaytarget *dt;
@@ -104,7 +117,11 @@ pan_resource(struct pipe_resource *p)
 }
 
 struct panfrost_transfer {
-        struct pipe_transfer base;
+        union {
+                struct pipe_transfer base;
+                struct threaded_transfer tc;
+        };
+
         void *map;
         struct {
                 struct pipe_resource *rsrc;
@@ -124,6 +141,19 @@ void panfrost_resource_screen_destroy(struct pipe_screen *screen);
 
 void panfrost_resource_context_init(struct pipe_context *pctx);
 
+void
+panfrost_replace_buffer_storage(struct pipe_context *pctx,
+                                struct pipe_resource *dst,
+                                struct pipe_resource *src,
+                                unsigned num_rebinds,
+                                uint32_t rebind_mask,
+                                uint32_t delete_buffer_id);
+
+bool
+panfrost_resource_is_busy(struct pipe_screen *screen,
+                          struct pipe_resource *resource,
+                          unsigned usage);
+
 /* Blitting */
 
 void
@@ -34,6 +34,8 @@
 #include "util/u_screen.h"
 #include "util/os_time.h"
 #include "util/u_process.h"
+#include "util/u_cpu_detect.h"
+#include "util/disk_cache.h"
 #include "pipe/p_defines.h"
 #include "pipe/p_screen.h"
 #include "draw/draw_context.h"
@@ -67,11 +69,12 @@ static const struct debug_named_value panfrost_debug_options[] = {
         {"noafbc",    PAN_DBG_NO_AFBC,  "Disable AFBC support"},
         {"nocrc",     PAN_DBG_NO_CRC,   "Disable transaction elimination"},
         {"msaa16",    PAN_DBG_MSAA16,   "Enable MSAA 8x and 16x support"},
-        {"indirect",  PAN_DBG_INDIRECT, "Use experimental compute kernel for indirect draws"},
+        {"noindirect", PAN_DBG_NO_INDIRECT, "Emulate indirect draws on the CPU"},
         {"linear",    PAN_DBG_LINEAR,   "Force linear textures"},
         {"nocache",   PAN_DBG_NO_CACHE, "Disable BO cache"},
         {"dump",      PAN_DBG_DUMP,     "Dump all graphics memory"},
         {"tiler",     PAN_DBG_TILER,    "Decode the tiler heap"},
+        {"diskcache", PAN_DBG_DISK_CACHE, "Print on-disk shader cache lookups and stores"},
         DEBUG_NAMED_VALUE_END
 };
 
@@ -210,8 +213,12 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_TEXTURE_BUFFER_OFFSET_ALIGNMENT:
                 return 64;
 
+        /* Without GPU timestamps, timer queries are sampled on the CPU */
         case PIPE_CAP_QUERY_TIMESTAMP:
-                return is_gl3;
+                return is_gl3 || panfrost_has_gpu_timestamps(dev);
+
+        case PIPE_CAP_QUERY_TIME_ELAPSED:
+                return panfrost_has_gpu_timestamps(dev);
 
         /* TODO: Where does this req come from in practice? */
         case PIPE_CAP_VERTEX_BUFFER_STRIDE_4BYTE_ALIGNED_ONLY:
@@ -312,6 +319,8 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
                 return 0;
 
         case PIPE_CAP_DRAW_INDIRECT:
+        case PIPE_CAP_MULTI_DRAW_INDIRECT:
+        case PIPE_CAP_MULTI_DRAW_INDIRECT_PARAMS:
                 return has_heap;
 
         case PIPE_CAP_START_INSTANCE:
@@ -733,6 +742,55 @@ panfrost_get_compute_param(struct pipe_screen *pscreen, enum pipe_shader_ir ir_t
 	return 0;
 }
 
+static void
+panfrost_compiler_queue_init(struct panfrost_screen *screen)
+{
+        struct panfrost_device *dev = &screen->dev;
+
+        /* Leave a core for the application thread and one for the tiling
+         * workers */
+        unsigned threads =
+                debug_get_num_option("PAN_COMPILER_THREADS",
+                                     CLAMP(util_get_cpu_caps()->nr_cpus - 2, 0, 2));
+
+        if (!threads)
+                return;
+
+        if (!util_queue_init(&screen->compiler.queue, "pansh", 64, threads,
+                             UTIL_QUEUE_INIT_RESIZE_IF_FULL, screen))
+                return;
+
+        screen->compiler.num_threads = threads;
+        screen->compiler.bin_pools = calloc(threads, sizeof(struct panfrost_pool));
+        screen->compiler.desc_pools = calloc(threads, sizeof(struct panfrost_pool));
+
+        for (unsigned i = 0; i < threads; ++i) {
+                panfrost_pool_init(&screen->compiler.bin_pools[i], NULL, dev,
+                                   PAN_BO_EXECUTE, 4096, "Shaders", false, false);
+                panfrost_pool_init(&screen->compiler.desc_pools[i], NULL, dev,
+                                   0, 4096, "Descriptors", false, false);
+        }
+}
+
+static void
+panfrost_compiler_queue_destroy(struct panfrost_screen *screen)
+{
+        if (!util_queue_is_initialized(&screen->compiler.queue))
+                return;
+
+        /* Variants still queued belong to live CSOs, whose deletion drops
+         * the jobs, so only in-flight compiles are left to finish here */
+        util_queue_destroy(&screen->compiler.queue);
+
+        for (unsigned i = 0; i < screen->compiler.num_threads; ++i) {
+                panfrost_pool_cleanup(&screen->compiler.bin_pools[i]);
+                panfrost_pool_cleanup(&screen->compiler.desc_pools[i]);
+        }
+
+        free(screen->compiler.bin_pools);
+        free(screen->compiler.desc_pools);
+}
+
 static void
 panfrost_destroy_screen(struct pipe_screen *pscreen)
 {
@@ -740,6 +798,9 @@ panfrost_destroy_screen(struct pipe_screen *pscreen)
         struct panfrost_screen *screen = pan_screen(pscreen);
 
         panfrost_resource_screen_destroy(pscreen);
+        panfrost_compiler_queue_destroy(screen);
+        disk_cache_destroy(screen->disk_cache);
+        slab_destroy_parent(&screen->transfer_pool);
         panfrost_pool_cleanup(&screen->indirect_draw.bin_pool);
         panfrost_pool_cleanup(&screen->blitter.bin_pool);
         panfrost_pool_cleanup(&screen->blitter.desc_pool);
@@ -754,9 +815,24 @@ panfrost_destroy_screen(struct pipe_screen *pscreen)
         ralloc_free(pscreen);
 }
 
+static struct disk_cache *
+panfrost_get_disk_shader_cache(struct pipe_screen *pscreen)
+{
+        return pan_screen(pscreen)->disk_cache;
+}
+
+/* Must be in the same time base as the results of timestamp queries */
+
 static uint64_t
 panfrost_get_timestamp(struct pipe_screen *_screen)
 {
+        struct panfrost_device *dev = pan_device(_screen);
+
+        if (panfrost_has_gpu_timestamps(dev)) {
+                return panfrost_timestamp_to_ns(dev,
+                                panfrost_query_system_timestamp());
+        }
+
         return os_time_get_nano();
 }
 
@@ -769,10 +845,15 @@ panfrost_fence_reference(struct pipe_screen *pscreen,
         struct pipe_fence_handle *old = *ptr;
 
         if (pipe_reference(&old->reference, &fence->reference)) {
-                if (dev->kbase)
-                        dev->mali.syncobj_destroy(&dev->mali, old->kbase);
-                else
+                if (dev->kbase) {
+                        util_dynarray_foreach(&old->kbase,
+                                              struct kbase_syncobj *, o)
+                                dev->mali.syncobj_destroy(&dev->mali, *o);
+
+                        util_dynarray_fini(&old->kbase);
+                } else {
                         drmSyncobjDestroy(dev->fd, old->syncobj);
+                }
                 free(old);
         }
 
@@ -796,10 +877,18 @@ panfrost_fence_finish(struct pipe_screen *pscreen,
                 abs_timeout = INT64_MAX;
 
         if (dev->kbase) {
-                /* TODO: Use the timeout */
-                bool ret = dev->mali.syncobj_wait(&dev->mali, fence->kbase);
-                fence->signaled = ret;
-                return ret;
+                util_dynarray_foreach(&fence->kbase, struct kbase_syncobj *, o) {
+                        int64_t t = OS_TIMEOUT_INFINITE;
+
+                        if (abs_timeout != INT64_MAX)
+                                t = MAX2((int64_t) abs_timeout - os_time_get_nano(), 0);
+
+                        if (!dev->mali.syncobj_wait(&dev->mali, *o, t))
+                                return false;
+                }
+
+                fence->signaled = true;
+                return true;
         }
 
         ret = drmSyncobjWait(dev->fd, &fence->syncobj,
@@ -822,14 +911,18 @@ panfrost_fence_create(struct panfrost_context *ctx)
         int fd = -1, ret;
 
         if (dev->kbase) {
-                struct kbase_syncobj *new =
-                        dev->mali.syncobj_dup(&dev->mali, ctx->syncobj_kbase);
+                /* Wait for all batches submitted so far which were still
+                 * pending the last time the context checked */
+                util_dynarray_init(&f->kbase, NULL);
+
+                util_dynarray_foreach(&ctx->syncobjs_kbase,
+                                      struct kbase_syncobj *, o) {
+                        if (dev->mali.syncobj_signaled(&dev->mali, *o))
+                                continue;
 
-                /* The syncobj emulation code has different semantics to
-                 * normal syncobjs... so we need to swap the objects and set
-                 * the context's syncobj to the one returned from dup(). */
-                f->kbase = ctx->syncobj_kbase;
-                ctx->syncobj_kbase = new;
+                        dev->mali.syncobj_ref(&dev->mali, *o);
+                        util_dynarray_append(&f->kbase, struct kbase_syncobj *, *o);
+                }
 
                 pipe_reference_init(&f->reference, 1);
                 return f;
@@ -954,12 +1047,17 @@ panfrost_create_screen(int fd, struct renderonly *ro)
                panfrost_is_dmabuf_modifier_supported;
         screen->base.context_create = panfrost_create_context;
         screen->base.get_compiler_options = panfrost_screen_get_compiler_options;
+        screen->base.get_disk_shader_cache = panfrost_get_disk_shader_cache;
         screen->base.fence_reference = panfrost_fence_reference;
         screen->base.fence_finish = panfrost_fence_finish;
         screen->base.set_damage_region = panfrost_resource_set_damage_region;
         screen->base.flush_frontbuffer = panfrost_flush_frontbuffer;
 
         panfrost_resource_screen_init(&screen->base);
+        panfrost_disk_cache_init(screen);
+        panfrost_compiler_queue_init(screen);
+        slab_create_parent(&screen->transfer_pool,
+                           sizeof(struct threaded_transfer), 16);
         pan_blend_shaders_init(dev);
         panfrost_pool_init(&screen->indirect_draw.bin_pool, NULL, dev,
                            PAN_BO_EXECUTE, 65536, "Indirect draw shaders",
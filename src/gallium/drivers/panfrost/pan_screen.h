@@ -37,6 +37,9 @@
 #include "util/bitset.h"
 #include "util/set.h"
 #include "util/log.h"
+#include "util/u_queue.h"
+#include "util/slab.h"
+#include "util/u_idalloc.h"
 
 #include "pan_device.h"
 #include "pan_mempool.h"
@@ -67,6 +70,14 @@ struct panfrost_vtable {
         /* Emits a fragment job */
         mali_ptr (*emit_fragment_job)(struct panfrost_batch *, const struct pan_fb_info *);
 
+        /* Writes the system timestamp to an address from the vertex/tiler
+         * job chain (<= v9) */
+        void (*emit_timestamp)(struct panfrost_batch *, mali_ptr);
+
+        /* Emits a job chain writing the system timestamp to each address of
+         * batch->timestamps, returning its first job (<= v9) */
+        mali_ptr (*emit_timestamps)(struct panfrost_batch *);
+
         /* General destructor */
         void (*screen_destroy)(struct pipe_screen *);
 
@@ -113,6 +124,29 @@ struct panfrost_screen {
         } indirect_draw;
         struct sw_winsys *sw_winsys;
 
+        /* Workers converting large transfers to and from tiled layouts, not
+         * initialized if there is only one CPU to use */
+        struct util_queue tiling_queue;
+
+        /* Workers compiling shader variants ahead of their first bind, not
+         * initialized if there is only one CPU to use. Each thread uploads
+         * to its own pools, so the pools need no locking. */
+        struct {
+                struct util_queue queue;
+                unsigned num_threads;
+                struct panfrost_pool *bin_pools;
+                struct panfrost_pool *desc_pools;
+        } compiler;
+
+        /* On-disk cache of compiled shader variants, or NULL if disabled */
+        struct disk_cache *disk_cache;
+
+        /* Staging transfers of threaded contexts */
+        struct slab_parent_pool transfer_pool;
+
+        /* IDs of buffers, used by threaded contexts to track bindings */
+        struct util_idalloc_mt buffer_ids;
+
         struct panfrost_vtable vtbl;
 };
 
@@ -128,6 +162,16 @@ pan_device(struct pipe_screen *p)
         return &(pan_screen(p)->dev);
 }
 
+/* Timer queries are written by WRITE_VALUE jobs, which need the cycle counter
+ * running. Only kbase lets userspace request it, and CSF has no equivalent
+ * instruction yet */
+
+static inline bool
+panfrost_has_gpu_timestamps(const struct panfrost_device *dev)
+{
+        return dev->kbase && dev->arch <= 9 && dev->timestamp_frequency;
+}
+
 struct pipe_fence_handle *
 panfrost_fence_create(struct panfrost_context *ctx);
 
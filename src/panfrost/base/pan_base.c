@@ -32,14 +32,85 @@
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
 
 #include "util/macros.h"
+#include "util/bitset.h"
+#include "util/hash_table.h"
+#include "util/os_time.h"
 #include "pan_base.h"
 
+#include "drm-uapi/panfrost_drm.h"
+
 #include "mali_kbase_ioctl.h"
 
+struct kbase_import {
+        /* Key */
+        uint64_t dev;
+        uint64_t ino;
+
+        int handle;
+};
+
+static uint32_t
+kbase_import_hash(const void *key)
+{
+        return _mesa_hash_data(key, 2 * sizeof(uint64_t));
+}
+
+static bool
+kbase_import_equal(const void *a, const void *b)
+{
+        return !memcmp(a, b, 2 * sizeof(uint64_t));
+}
+
+#if defined(__aarch64__)
+
+/* Linux lets userspace clean and invalidate data cache lines by VA, which is
+ * much cheaper than a MEM_SYNC ioctl. Plain invalidation is privileged, so
+ * invalidate with clean+invalidate, which is equivalent as long as the CPU
+ * has not written to the range since the last clean. */
+
+static uintptr_t
+kbase_dcache_line_size(void)
+{
+        uint64_t ctr;
+        __asm__ volatile ("mrs %0, ctr_el0" : "=r" (ctr));
+
+        /* DminLine is the log2 of the number of words */
+        return 4 << ((ctr >> 16) & 0xf);
+}
+
+static void
+kbase_cache_clean(void *ptr, size_t size)
+{
+        uintptr_t line = kbase_dcache_line_size();
+        uintptr_t end = (uintptr_t) ptr + size;
+
+        for (uintptr_t p = (uintptr_t) ptr & ~(line - 1); p < end; p += line)
+                __asm__ volatile ("dc cvac, %0" :: "r" (p) : "memory");
+
+        __asm__ volatile ("dsb sy" ::: "memory");
+}
+
+static void
+kbase_cache_invalidate(void *ptr, size_t size)
+{
+        uintptr_t line = kbase_dcache_line_size();
+        uintptr_t end = (uintptr_t) ptr + size;
+
+        __asm__ volatile ("dsb sy" ::: "memory");
+
+        for (uintptr_t p = (uintptr_t) ptr & ~(line - 1); p < end; p += line)
+                __asm__ volatile ("dc civac, %0" :: "r" (p) : "memory");
+
+        __asm__ volatile ("dsb sy" ::: "memory");
+}
+
+#endif
+
 bool
 kbase_open(kbase k, int fd, unsigned cs_queue_count, bool verbose)
 {
@@ -49,6 +120,14 @@ kbase_open(kbase k, int fd, unsigned cs_queue_count, bool verbose)
         k->page_size = sysconf(_SC_PAGE_SIZE);
         k->verbose = verbose;
 
+        k->imports = _mesa_hash_table_create(NULL, kbase_import_hash,
+                                             kbase_import_equal);
+
+#if defined(__aarch64__)
+        k->cache_clean = kbase_cache_clean;
+        k->cache_invalidate = kbase_cache_invalidate;
+#endif
+
         struct kbase_ioctl_version_check ver = { 0 };
         int ret = ioctl(k->fd, KBASE_IOCTL_VERSION_CHECK, &ver);
         int ret2 = ioctl(k->fd, KBASE_IOCTL_VERSION_CHECK_RESERVED, &ver);
@@ -81,7 +160,6 @@ kbase_alloc_gem_handle_locked(kbase k, base_va va, int fd)
         for (unsigned i = 0; i < size; ++i) {
                 if (handles[i].fd == -2) {
                         handles[i] = h;
-                        pthread_mutex_unlock(&k->handle_lock);
                         return i;
                 }
         }
@@ -103,35 +181,307 @@ kbase_alloc_gem_handle(kbase k, base_va va, int fd)
         return ret;
 }
 
-void
-kbase_free_gem_handle(kbase k, int handle)
+/* Forget the dma-buf imported as handle, so that importing it again creates
+ * a new handle */
+static void
+kbase_import_remove_locked(kbase k, int fd, int handle)
 {
-        // TODO
-        return;
+        struct stat st;
 
-        pthread_mutex_lock(&k->handle_lock);
+        if (fstat(fd, &st) == -1)
+                return;
 
+        struct kbase_import key = {
+                .dev = st.st_dev,
+                .ino = st.st_ino,
+        };
+
+        struct hash_entry *e = _mesa_hash_table_search(k->imports, &key);
+
+        if (e && ((struct kbase_import *) e->data)->handle == handle) {
+                free(e->data);
+                _mesa_hash_table_remove(k->imports, e);
+        }
+}
+
+void
+kbase_free_gem_handle_locked(kbase k, int handle)
+{
         unsigned size = util_dynarray_num_elements(&k->gem_handles, kbase_handle);
 
         int fd;
 
-        if (handle >= size) {
-                pthread_mutex_unlock(&k->handle_lock);
+        if (handle >= size)
                 return;
-        }
 
         if (handle + 1 < size) {
                 kbase_handle *ptr = util_dynarray_element(&k->gem_handles, kbase_handle, handle);
                 fd = ptr->fd;
-                ptr->fd = -2;
+                *ptr = (kbase_handle) { .fd = -2 };
         } else {
                 fd = (util_dynarray_pop(&k->gem_handles, kbase_handle)).fd;
         }
 
-        if (fd != -1)
+        if (fd >= 0) {
+                kbase_import_remove_locked(k, fd, handle);
                 close(fd);
+        }
+}
+
+void
+kbase_free_gem_handle(kbase k, int handle)
+{
+        pthread_mutex_lock(&k->handle_lock);
+        kbase_free_gem_handle_locked(k, handle);
+        pthread_mutex_unlock(&k->handle_lock);
+}
+
+/* Look up the handle for an already imported dma-buf, filling in st for
+ * kbase_import_add_locked. Returns -1 if the buffer is not known yet, or -2
+ * if it could not be identified, in which case st is not filled in and the
+ * import must not be added. */
+int
+kbase_import_lookup_locked(kbase k, int fd, struct stat *st)
+{
+        if (fstat(fd, st) == -1) {
+                perror("fstat(dma-buf)");
+                return -2;
+        }
+
+        struct kbase_import key = {
+                .dev = st->st_dev,
+                .ino = st->st_ino,
+        };
+
+        struct hash_entry *e = _mesa_hash_table_search(k->imports, &key);
+
+        return e ? ((struct kbase_import *) e->data)->handle : -1;
+}
+
+void
+kbase_import_add_locked(kbase k, const struct stat *st, int handle)
+{
+        struct kbase_import *imp = malloc(sizeof(*imp));
+
+        if (!imp)
+                return;
+
+        *imp = (struct kbase_import) {
+                .dev = st->st_dev,
+                .ino = st->st_ino,
+                .handle = handle,
+        };
+
+        _mesa_hash_table_insert(k->imports, imp, imp);
+}
+
+static void
+kbase_import_free(struct hash_entry *e)
+{
+        free(e->data);
+}
+
+void
+kbase_imports_destroy(kbase k)
+{
+        _mesa_hash_table_destroy(k->imports, kbase_import_free);
+        k->imports = NULL;
+}
+
+struct kbase_slab {
+        struct kbase_slab *next;
+        struct base_ptr ptr;
+
+        bool exec;
+        unsigned size_class;
+        unsigned block_size;
+        unsigned num_blocks;
+        unsigned num_free;
+
+        /* Assumes pages of at least 4 KB */
+        BITSET_DECLARE(free, KBASE_SLAB_SIZE / 4096);
+};
+
+/* Returns the slab size class to use for an allocation, or -1 if it should
+ * get its own kernel allocation */
+static int
+kbase_slab_class(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
+{
+        bool exec = !(pan_flags & PANFROST_BO_NOEXEC);
+
+        /* Only plain memory with the default flags is shared. Executable
+         * memory needs special alignment on the oldest kernels, and cache
+         * maintenance works on whole kernel allocations. */
+        if (mali_flags || (pan_flags & (PANFROST_BO_HEAP | KBASE_BO_CACHED_CPU)) ||
+            (exec && k->api == 0))
+                return -1;
+
+        for (unsigned c = 0; c < KBASE_SLAB_CLASSES; ++c) {
+                size_t block_size = (size_t) k->page_size << c;
+
+                /* Keep at least a few blocks per slab */
+                if (block_size * 4 > KBASE_SLAB_SIZE)
+                        break;
+
+                if (size <= block_size)
+                        return c;
+        }
+
+        return -1;
+}
+
+/* Free memory from k->alloc. SAME_VA memory is released by the kernel once
+ * the CPU mapping is gone, anything else has to be freed explicitly. */
+static void
+kbase_free_memory(kbase k, base_va va, void *cpu, size_t size)
+{
+        if ((uintptr_t) cpu != va)
+                k->free(k, va);
+
+        if (cpu)
+                munmap(cpu, size);
+}
+
+static struct base_ptr
+kbase_slab_alloc_locked(kbase k, bool exec, unsigned size_class,
+                        struct kbase_slab **out)
+{
+        struct kbase_slab **list = &k->slabs[exec][size_class];
+        struct kbase_slab *slab;
+
+        for (slab = *list; slab; slab = slab->next) {
+                if (slab->num_free)
+                        break;
+        }
+
+        if (!slab) {
+                slab = calloc(1, sizeof(*slab));
+                if (!slab)
+                        return (struct base_ptr) {0};
+
+                slab->ptr = k->alloc(k, KBASE_SLAB_SIZE,
+                                     exec ? 0 : PANFROST_BO_NOEXEC, 0);
+
+                if (!slab->ptr.gpu) {
+                        free(slab);
+                        return (struct base_ptr) {0};
+                }
+
+                slab->exec = exec;
+                slab->size_class = size_class;
+                slab->block_size = k->page_size << size_class;
+                slab->num_blocks = KBASE_SLAB_SIZE / slab->block_size;
+                slab->num_free = slab->num_blocks;
+                BITSET_SET_RANGE(slab->free, 0, slab->num_blocks - 1);
+
+                slab->next = *list;
+                *list = slab;
+        }
+
+        unsigned block = BITSET_FFS(slab->free) - 1;
+        BITSET_CLEAR(slab->free, block);
+        --slab->num_free;
+
+        *out = slab;
+
+        size_t offset = (size_t) block * slab->block_size;
+
+        return (struct base_ptr) {
+                .cpu = (uint8_t *) slab->ptr.cpu + offset,
+                .gpu = slab->ptr.gpu + offset,
+        };
+}
+
+static void
+kbase_slab_free_locked(kbase k, struct kbase_slab *slab, base_va va)
+{
+        unsigned block = (va - slab->ptr.gpu) / slab->block_size;
+
+        assert(!BITSET_TEST(slab->free, block));
+        BITSET_SET(slab->free, block);
+
+        if (++slab->num_free < slab->num_blocks)
+                return;
+
+        /* The slab is now empty. Keep it if it is the only one with free
+         * blocks in its class, to avoid thrashing when a single BO is
+         * repeatedly allocated and freed, otherwise give it back. */
+        struct kbase_slab **list = &k->slabs[slab->exec][slab->size_class];
+        struct kbase_slab **prev = NULL;
+        bool other_free = false;
+
+        for (struct kbase_slab **it = list; *it; it = &(*it)->next) {
+                if (*it == slab)
+                        prev = it;
+                else if ((*it)->num_free)
+                        other_free = true;
+        }
+
+        if (!other_free)
+                return;
+
+        assert(prev);
+        *prev = slab->next;
+
+        kbase_free_memory(k, slab->ptr.gpu, slab->ptr.cpu, KBASE_SLAB_SIZE);
+        free(slab);
+}
+
+/* Allocate a BO and a GEM handle for it. Small BOs are sub-allocated from
+ * slabs, saving an ioctl and mmap for each and keeping the number of kernel
+ * allocations down. Returns the handle, or -1 on failure. */
+int
+kbase_alloc_bo(kbase k, size_t size, unsigned pan_flags,
+               unsigned mali_flags, struct base_ptr *ptr)
+{
+        int size_class = kbase_slab_class(k, size, pan_flags, mali_flags);
+        struct kbase_slab *slab = NULL;
+        struct base_ptr p;
+
+        if (size_class < 0)
+                p = k->alloc(k, size, pan_flags, mali_flags);
+
+        pthread_mutex_lock(&k->handle_lock);
+
+        if (size_class >= 0) {
+                bool exec = !(pan_flags & PANFROST_BO_NOEXEC);
+                p = kbase_slab_alloc_locked(k, exec, size_class, &slab);
+        }
+
+        if (!p.gpu) {
+                pthread_mutex_unlock(&k->handle_lock);
+                return -1;
+        }
+
+        int handle = kbase_alloc_gem_handle_locked(k, p.gpu, -1);
+        util_dynarray_element(&k->gem_handles, kbase_handle, handle)->slab = slab;
 
         pthread_mutex_unlock(&k->handle_lock);
+
+        *ptr = p;
+        return handle;
+}
+
+/* Called on close, once all BOs are gone */
+void
+kbase_free_slabs(kbase k)
+{
+        for (unsigned e = 0; e < 2; ++e) {
+                for (unsigned c = 0; c < KBASE_SLAB_CLASSES; ++c) {
+                        struct kbase_slab *slab = k->slabs[e][c];
+
+                        while (slab) {
+                                struct kbase_slab *next = slab->next;
+
+                                kbase_free_memory(k, slab->ptr.gpu, slab->ptr.cpu,
+                                                  KBASE_SLAB_SIZE);
+                                free(slab);
+                                slab = next;
+                        }
+
+                        k->slabs[e][c] = NULL;
+                }
+        }
 }
 
 kbase_handle
@@ -154,20 +504,106 @@ kbase_gem_handle_get(kbase k, int handle)
 int
 kbase_wait_bo(kbase k, int handle, int64_t timeout_ns, bool wait_readers)
 {
+        int64_t end = os_time_get_absolute_timeout(timeout_ns);
+        if (end == OS_TIMEOUT_INFINITE)
+                end = INT64_MAX;
+
+        /* The BO might be used by atoms which are still queued */
+        if (k->kick)
+                k->kick(k);
+
         for (;;) {
                 pthread_mutex_lock(&k->handle_lock);
                 if (handle >= util_dynarray_num_elements(&k->gem_handles, kbase_handle)) {
+                        pthread_mutex_unlock(&k->handle_lock);
                         errno = EINVAL;
                         return -1;
                 }
                 kbase_handle *ptr = util_dynarray_element(&k->gem_handles, kbase_handle, handle);
-                if (!ptr->use_count)
+                unsigned use_count = ptr->use_count;
+                pthread_mutex_unlock(&k->handle_lock);
+
+                if (!use_count)
                         return 0;
 
-                pthread_mutex_unlock(&k->handle_lock);
+                int64_t now = os_time_get_nano();
+                if (now >= end) {
+                        errno = ETIMEDOUT;
+                        return -1;
+                }
 
-                /* TODO: We can't just keep waiting against the timeout... */
-                k->poll_event(k, timeout_ns);
+                /* Another thread might handle the event we are waiting
+                 * for, so don't sleep for too long at once */
+                k->poll_event(k, MIN2(end - now, 100 * 1000000));
                 k->handle_events(k);
         }
 }
+
+static void
+kbase_free_bo_memory(kbase k, kbase_handle *h, void *cpu, size_t size)
+{
+        if (h->slab)
+                kbase_slab_free_locked(k, h->slab, h->va);
+        else if (h->fd != -1)
+                /* Imports are mapped at their GPU address */
+                munmap((void *)(uintptr_t) h->va, size);
+        else
+                kbase_free_memory(k, h->va, cpu, size);
+}
+
+/* Free a BO allocated with k->alloc. If jobs still reference the BO, the free
+ * is deferred until they complete, so that the GPU does not fault on unmapped
+ * memory. */
+void
+kbase_free_bo(kbase k, int handle, void *cpu, size_t size)
+{
+        pthread_mutex_lock(&k->handle_lock);
+
+        unsigned count = util_dynarray_num_elements(&k->gem_handles, kbase_handle);
+
+        if (handle < count) {
+                kbase_handle *h = util_dynarray_element(&k->gem_handles, kbase_handle, handle);
+
+                if (h->use_count) {
+                        /* The handle is freed once the jobs complete, a new
+                         * import of the dma-buf must not pick it up */
+                        if (h->fd >= 0)
+                                kbase_import_remove_locked(k, h->fd, handle);
+
+                        h->free_pending = true;
+                        h->cpu = cpu;
+                        h->size = size;
+                        pthread_mutex_unlock(&k->handle_lock);
+                        return;
+                }
+
+                kbase_free_bo_memory(k, h, cpu, size);
+                kbase_free_gem_handle_locked(k, handle);
+        }
+
+        pthread_mutex_unlock(&k->handle_lock);
+}
+
+/* Drop one GPU use from each of the handles, once a job using them has
+ * completed */
+void
+kbase_release_handles_locked(kbase k, int32_t *handles, unsigned num_handles)
+{
+        for (unsigned i = 0; i < num_handles; ++i) {
+                int32_t h = handles[i];
+
+                /* Freeing a handle can shrink the array */
+                if (h >= util_dynarray_num_elements(&k->gem_handles, kbase_handle))
+                        continue;
+
+                kbase_handle *ptr = util_dynarray_element(&k->gem_handles,
+                                                          kbase_handle, h);
+
+                assert(ptr->use_count);
+                if (--ptr->use_count || !ptr->free_pending)
+                        continue;
+
+                kbase_free_bo_memory(k, ptr, ptr->cpu, ptr->size);
+                kbase_free_gem_handle_locked(k, h);
+        }
+}
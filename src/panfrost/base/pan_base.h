@@ -40,6 +40,10 @@ struct kbase_sync_link {
         struct kbase_sync_link *next; /* must be first */
         struct kbase_syncobj *o;
         uint64_t seqnum;
+
+        /* GEM handles used by the job, released when it completes */
+        int32_t *handles;
+        unsigned num_handles;
 };
 
 struct kbase_event_slot {
@@ -72,6 +76,41 @@ struct kbase_cs {
 struct kbase;
 typedef struct kbase *kbase;
 
+/* Allocation flag passed alongside the PANFROST_BO_* flags: map the BO
+ * CPU-cached. The caller is responsible for cache maintenance with
+ * cache_clean/cache_invalidate or mem_sync. Ignored by the oldest kernels. */
+#define KBASE_BO_CACHED_CPU (1u << 31)
+
+/* Small BOs are sub-allocated from slabs of this size, in power-of-two
+ * multiples of the page size up to KBASE_SLAB_CLASSES classes */
+#define KBASE_SLAB_SIZE (1 << 20)
+#define KBASE_SLAB_CLASSES 5
+
+struct kbase_slab;
+struct hash_table;
+struct stat;
+
+/* Atom requirement passed alongside PANFROST_JD_REQ_FS: keep the GPU cycle
+ * counter running while the atom executes, which the system timestamp written
+ * by WRITE_VALUE jobs also needs */
+#define KBASE_JD_REQ_CYCLE_COUNT (1u << 31)
+
+/* A job chain for <= v9 GPUs, submitted as a single kbase atom */
+struct kbase_atom {
+        uint64_t va;
+        unsigned req;
+
+        /* Index of an earlier atom in the same submit_atoms call which this
+         * atom has a data dependency on, or -1 */
+        int dep;
+
+        /* Signaled when the atom completes, may be NULL */
+        struct kbase_syncobj *o;
+
+        int32_t *handles;
+        unsigned num_handles;
+};
+
 #define KBASE_SLOT_COUNT 2
 
 typedef struct {
@@ -80,6 +119,15 @@ typedef struct {
         uint8_t use_count;
         /* For emulating implicit sync. TODO make this work on v10 */
         uint8_t last_access[KBASE_SLOT_COUNT];
+
+        /* The BO was freed while jobs were still using it, the memory is
+         * released once use_count drops to zero */
+        bool free_pending;
+        void *cpu;
+        size_t size;
+
+        /* The slab the BO was sub-allocated from, or NULL */
+        struct kbase_slab *slab;
 } kbase_handle;
 
 struct kbase {
@@ -108,9 +156,32 @@ struct kbase {
 
         pthread_mutex_t handle_lock;
 
+        /* Syncobj waits: event_seq is bumped whenever a syncobj is signaled,
+         * and waiters sleep on it with a futex. The thread holding
+         * poll_lock reads events from the kernel instead, and is woken up
+         * through wake_fd if another thread signals a syncobj. */
+        uint32_t event_seq;
+        unsigned event_waiters;
+        pthread_mutex_t poll_lock;
+        unsigned polling;
+        pthread_t poll_thread;
+        int wake_fd;
+
         struct util_dynarray gem_handles;
         struct util_dynarray atom_bos[256];
 
+        /* Imported dma-bufs, keyed by the device and inode of the buffer,
+         * protected by handle_lock */
+        struct hash_table *imports;
+
+        /* Slabs for small BOs, indexed by executable and size class,
+         * protected by handle_lock */
+        struct kbase_slab *slabs[2][KBASE_SLAB_CLASSES];
+
+        /* base_jd_atom_v2 waiting to be submitted by kick, protected by
+         * handle_lock */
+        struct util_dynarray atom_queue;
+
 
         void (*close)(kbase k);
 
@@ -124,6 +195,8 @@ struct kbase {
 
         int (*import_dmabuf)(kbase k, int fd);
 
+        /* Userspace cache maintenance of CPU-cached memory, NULL if the
+         * CPU does not allow it, in which case mem_sync has to be used */
         void (*cache_clean)(void *ptr, size_t size);
         void (*cache_invalidate)(void *ptr, size_t size);
 
@@ -134,6 +207,14 @@ struct kbase {
         int (*submit)(kbase k, uint64_t va, unsigned req,
                       struct kbase_syncobj *o,
                       int32_t *handles, unsigned num_handles);
+        /* Queue atoms for submission. The handles are marked as in use
+         * straight away, but the atoms only reach the kernel with the next
+         * kick, when the queue gets long or when something waits on a BO or
+         * syncobj. Returns the atom number of the last atom, or -1. */
+        int (*submit_atoms)(kbase k, const struct kbase_atom *atoms,
+                            unsigned count, bool kick);
+        /* Submit all queued atoms with a single ioctl */
+        bool (*kick)(kbase k);
 
         /* >= v10 GPUs */
         struct kbase_context *(*context_create)(kbase k);
@@ -143,17 +224,25 @@ struct kbase {
                                    base_va va, unsigned size);
         void (*cs_term)(kbase k, struct kbase_cs *cs, base_va va);
 
+        /* The handles are marked as in use until the queue seqnum passes
+         * seqnum */
         bool (*cs_submit)(kbase k, struct kbase_cs *cs, unsigned insert_offset,
-                          struct kbase_syncobj *o, uint64_t seqnum);
+                          struct kbase_syncobj *o, uint64_t seqnum,
+                          int32_t *handles, unsigned num_handles);
         bool (*cs_wait)(kbase k, struct kbase_cs *cs, unsigned extract_offset);
         void (*cs_wait_idle)(kbase k, struct kbase_cs *cs);
 
         /* syncobj functions */
         struct kbase_syncobj *(*syncobj_create)(kbase k);
         void (*syncobj_destroy)(kbase k, struct kbase_syncobj *o);
-        struct kbase_syncobj *(*syncobj_dup)(kbase k, struct kbase_syncobj *o);
-        /* TODO: timeout? (and for cs_wait) */
-        bool (*syncobj_wait)(kbase k, struct kbase_syncobj *o);
+        /* Take a reference, dropped with syncobj_destroy */
+        void (*syncobj_ref)(kbase k, struct kbase_syncobj *o);
+        /* Non-blocking check, does not process pending events */
+        bool (*syncobj_signaled)(kbase k, struct kbase_syncobj *o);
+        /* Relative timeout in nanoseconds, returns false if it expires.
+         * TODO: timeout for cs_wait */
+        bool (*syncobj_wait)(kbase k, struct kbase_syncobj *o,
+                             int64_t timeout_ns);
 
         void (*ctr_open)(kbase k);
         void (*ctr_set_enabled)(kbase k, bool enable);
@@ -171,10 +260,19 @@ bool kbase_open_new(kbase k);
 bool kbase_open_csf(kbase k);
 
 /* BO management */
+int kbase_alloc_bo(kbase k, size_t size, unsigned pan_flags,
+                   unsigned mali_flags, struct base_ptr *ptr);
 int kbase_alloc_gem_handle(kbase k, base_va va, int fd);
 int kbase_alloc_gem_handle_locked(kbase k, base_va va, int fd);
 void kbase_free_gem_handle(kbase k, int handle);
+void kbase_free_gem_handle_locked(kbase k, int handle);
+void kbase_free_slabs(kbase k);
+int kbase_import_lookup_locked(kbase k, int fd, struct stat *st);
+void kbase_import_add_locked(kbase k, const struct stat *st, int handle);
+void kbase_imports_destroy(kbase k);
 kbase_handle kbase_gem_handle_get(kbase k, int handle);
 int kbase_wait_bo(kbase k, int handle, int64_t timeout_ns, bool wait_readers);
+void kbase_free_bo(kbase k, int handle, void *cpu, size_t size);
+void kbase_release_handles_locked(kbase k, int32_t *handles, unsigned num_handles);
 
 #endif
@@ -31,15 +31,19 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <poll.h>
 #include <pthread.h>
 
 #include "util/macros.h"
+#include "util/futex.h"
 #include "util/u_atomic.h"
 #include "util/os_file.h"
+#include "util/os_time.h"
 
 #include "pan_base.h"
 
@@ -474,6 +478,8 @@ static struct kbase_op kbase_main[] = {
 static void
 kbase_close(kbase k)
 {
+        kbase_free_slabs(k);
+
         while (k->setup_state) {
                 unsigned i = k->setup_state - 1;
                 if (kbase_main[i].cleanup)
@@ -481,6 +487,15 @@ kbase_close(kbase k)
                 --k->setup_state;
         }
 
+#if PAN_BASE_API < 2
+        util_dynarray_fini(&k->atom_queue);
+#endif
+
+        close(k->wake_fd);
+
+        kbase_imports_destroy(k);
+
+        pthread_mutex_destroy(&k->poll_lock);
         pthread_mutex_destroy(&k->handle_lock);
 }
 
@@ -541,10 +556,10 @@ kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
                 if (PAN_BASE_API >= 1)
                         flags |= BASE_MEM_COHERENT_LOCAL;
 
-                /* TODO: What about heap BOs? */
-                /* ++difficulty_level */
-                //if (PAN_BASE_API >= 1)
-                //        flags |= BASE_MEM_CACHED_CPU;
+                /* Write-combined unless the caller asked otherwise, and is
+                 * then responsible for cache maintenance. */
+                if (PAN_BASE_API >= 1 && (pan_flags & KBASE_BO_CACHED_CPU))
+                        flags |= BASE_MEM_CACHED_CPU;
         }
 
         if (pan_flags & PANFROST_BO_HEAP) {
@@ -624,9 +639,6 @@ kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
 static void
 kbase_free(kbase k, base_va va)
 {
-        // TODO
-        return;
-
         struct kbase_ioctl_mem_free f = {
                 .gpu_addr = va
         };
@@ -640,22 +652,15 @@ kbase_free(kbase k, base_va va)
 static int
 kbase_import_dmabuf(kbase k, int fd)
 {
-        pthread_mutex_lock(&k->handle_lock);
-
-        unsigned size = util_dynarray_num_elements(&k->gem_handles, kbase_handle);
+        struct stat st;
 
-        kbase_handle *handles = util_dynarray_begin(&k->gem_handles);
-
-        for (unsigned i = 0; i < size; ++i) {
-                kbase_handle h = handles[i];
+        pthread_mutex_lock(&k->handle_lock);
 
-                if (h.fd == -1)
-                        continue;
+        int existing = kbase_import_lookup_locked(k, fd, &st);
 
-                if (os_same_file_description(h.fd, fd)) {
-                        pthread_mutex_unlock(&k->handle_lock);
-                        return i;
-                }
+        if (existing >= 0) {
+                pthread_mutex_unlock(&k->handle_lock);
+                return existing;
         }
 
         int dup = os_dupfd_cloexec(fd);
@@ -684,6 +689,9 @@ kbase_import_dmabuf(kbase k, int fd)
                                                MAP_SHARED, k->fd, import.out.gpu_va);
 
                 handle = kbase_alloc_gem_handle_locked(k, va, dup);
+
+                if (existing != -2)
+                        kbase_import_add_locked(k, &st, handle);
         }
 
         pthread_mutex_unlock(&k->handle_lock);
@@ -695,16 +703,8 @@ struct kbase_syncobj {
         /* Use kbase_syncobj_ref / kbase_syncobj_unref */
         unsigned ref_count;
 
-        /* syncobjs which are dup'd from this one */
-        pthread_mutex_t child_mtx;
-        unsigned child_count;
-        struct kbase_syncobj **children;
-
         /* How many jobs are still executing? */
         unsigned job_count;
-
-        /* Write a byte to this pipe when job_count hits zero */
-        int pipefd[2];
 };
 
 static struct kbase_syncobj *
@@ -714,12 +714,6 @@ kbase_syncobj_create(kbase k)
 
         o->ref_count = 1;
 
-        pthread_mutex_init(&o->child_mtx, NULL);
-
-        int ret = pipe2(o->pipefd, O_CLOEXEC | O_NONBLOCK);
-        if (ret == -1)
-                perror("pipe(o->pipefd)");
-
         return o;
 }
 
@@ -735,19 +729,8 @@ kbase_syncobj_ref(struct kbase_syncobj *o)
 static void
 kbase_syncobj_unref(struct kbase_syncobj *o)
 {
-        unsigned ret = p_atomic_dec_return(&o->ref_count);
-
-        if (!ret) {
-                close(o->pipefd[0]);
-                close(o->pipefd[1]);
-
-                for (unsigned i = 0; i < o->child_count; ++i)
-                        kbase_syncobj_unref(o->children[i]);
-
-                pthread_mutex_destroy(&o->child_mtx);
-                free(o->children);
+        if (!p_atomic_dec_return(&o->ref_count))
                 free(o);
-        }
 }
 
 static void
@@ -756,128 +739,135 @@ kbase_syncobj_destroy(kbase k, struct kbase_syncobj *o)
         kbase_syncobj_unref(o);
 }
 
-static struct kbase_syncobj *
-kbase_syncobj_dup(kbase k, struct kbase_syncobj *o)
+static void
+kbase_syncobj_get(kbase k, struct kbase_syncobj *o)
 {
-    struct kbase_syncobj *dup = kbase_syncobj_create(k);
-    if (!dup) {
-        return NULL;
-    }
-
-    kbase_syncobj_ref(dup);
-    pthread_mutex_lock(&o->child_mtx);
-
-    size_t new_count = o->child_count + 1;
-    struct kbase_syncobj **new_children = realloc(o->children, new_count * sizeof(*o->children));
-    if (new_children) {
-        o->children = new_children;
-        o->children[o->child_count] = dup;
-        o->child_count = new_count;
-    } else {
-        pthread_mutex_unlock(&o->child_mtx);
-        return NULL;
-    }
-
-    dup->job_count = o->job_count;
-    pthread_mutex_unlock(&o->child_mtx);
-
-    return dup;
+        kbase_syncobj_ref(o);
 }
 
-static void
-kbase_handle_events(kbase k);
-
 static bool
-kbase_syncobj_wait(kbase k, struct kbase_syncobj *o)
+kbase_syncobj_signaled(kbase k, struct kbase_syncobj *o)
 {
-        unsigned try_count = 0;
-
-        while (p_atomic_read(&o->job_count)) {
-
-                /* There are currently-executing jobs which reference this
-                 * syncobj, wait for an event. */
-
-                struct pollfd pfd[2] = {
-                        {
-                                .fd = k->fd,
-                                .events = POLLIN,
-                        },
-                        {
-                                .fd = o->pipefd[0],
-                                .events = POLLIN,
-                        },
-                };
+        return !p_atomic_read(&o->job_count);
+}
 
-                int ret = poll(pfd, 2, 200);
-                if (ret == -1)
-                        perror("poll(syncobj)");
+static void
+kbase_syncobj_inc_jobs(struct kbase_syncobj *o)
+{
+        p_atomic_inc(&o->job_count);
+}
 
-                if (ret == 0 && try_count > 10) {
-                        fprintf(stderr, "syncobj wait timeout, returning\n");
-                        return false;
-                }
+/* Wake up every thread in kbase_syncobj_wait, so that they can check whether
+ * their syncobj was signaled or take over reading events. This only makes
+ * syscalls when there is somebody to wake up. */
+static void
+kbase_syncobj_notify(kbase k)
+{
+        p_atomic_inc(&k->event_seq);
 
-                if (ret == 0) {
-                        ++try_count;
-                        fprintf(stderr, "syncobj wait timeout\n");
-                        continue;
-                }
+        if (p_atomic_read(&k->event_waiters))
+                futex_wake(&k->event_seq, INT_MAX);
 
-                if (pfd[0].revents)
-                        kbase_handle_events(k);
-        }
+        /* The thread reading events is blocked in poll rather than on the
+         * futex. There is no need to wake it if we are that thread, as it
+         * checks its syncobj after handling events. */
+        if (p_atomic_read(&k->polling) &&
+            !pthread_equal(k->poll_thread, pthread_self())) {
+                uint64_t one = 1;
 
-        return true;
+                if (write(k->wake_fd, &one, sizeof(one)) != sizeof(one))
+                        perror("write(wake_fd)");
+        }
 }
 
 static void
-kbase_syncobj_inc_jobs(struct kbase_syncobj *o)
+kbase_syncobj_dec_jobs(kbase k, struct kbase_syncobj *o)
 {
-        /* TODO: Avoid taking so many locks */
-        pthread_mutex_lock(&o->child_mtx);
-
-        /* Might as well not bother with the atomic, given the locking... */
-        if (p_atomic_inc_return(&o->job_count) == 1) {
-                /* This is the first job, make sure that the pipe is empty */
-                uint32_t data = 0;
-                int ret = read(o->pipefd[0], &data, 4);
-
-                if (ret == -1 && errno != EAGAIN)
-                        perror("read(o->pipdfd[0])");
-
-                /* We should never have more than one byte in the pipe at a
-                 * time */
-                if (ret > 1)
-                        fprintf(stderr, "syncobj pipe too large!\n");
-        }
-
-        for (unsigned i = 0; i < o->child_count; ++i)
-                kbase_syncobj_inc_jobs(o->children[i]);
-
-        pthread_mutex_unlock(&o->child_mtx);
+        if (!p_atomic_dec_return(&o->job_count))
+                kbase_syncobj_notify(k);
 }
 
 static void
-kbase_syncobj_dec_jobs(struct kbase_syncobj *o)
+kbase_handle_events(kbase k);
+
+/* Wait for a syncobj with a relative timeout in nanoseconds, which may be
+ * OS_TIMEOUT_INFINITE. Returns false on timeout.
+ *
+ * Only one waiter at a time reads events from the kernel, the others sleep
+ * on a futex until a syncobj is signaled or the reader gives up its role. */
+static bool
+kbase_syncobj_wait(kbase k, struct kbase_syncobj *o, int64_t timeout_ns)
 {
-        /* TODO: Avoid taking so many locks */
-        pthread_mutex_lock(&o->child_mtx);
+        int64_t end = os_time_get_absolute_timeout(timeout_ns);
+        if (end == OS_TIMEOUT_INFINITE)
+                end = INT64_MAX;
 
-        /* Might as well not bother with the atomic, given the locking... */
-        if (p_atomic_dec_return(&o->job_count) == 0) {
+        /* The jobs might still be waiting in the submit queue */
+        if (k->kick)
+                k->kick(k);
 
-                /* This was the last job, write a cookie into the pipe */
-                uint8_t data = 0xEE;
-                int ret = write(o->pipefd[1], &data, 1);
+        for (;;) {
+                /* Read the sequence number before checking the syncobj, so
+                 * that a signal in between makes the futex wait return
+                 * straight away */
+                uint32_t seq = p_atomic_read(&k->event_seq);
 
-                if (ret != 1)
-                        perror("write(o->pipdfd[1])");
-        }
+                if (!p_atomic_read(&o->job_count))
+                        return true;
+
+                int64_t now = os_time_get_nano();
+                if (now >= end)
+                        return false;
+
+                if (pthread_mutex_trylock(&k->poll_lock) == 0) {
+                        k->poll_thread = pthread_self();
+                        p_atomic_set(&k->polling, true);
+
+                        if (p_atomic_read(&o->job_count)) {
+                                int64_t t = end - now;
+
+                                struct pollfd pfd[2] = {
+                                        { .fd = k->fd, .events = POLLIN },
+                                        { .fd = k->wake_fd, .events = POLLIN },
+                                };
+
+                                struct timespec ts = {
+                                        .tv_sec = t / 1000000000,
+                                        .tv_nsec = t % 1000000000,
+                                };
+
+                                if (ppoll(pfd, 2, &ts, NULL) == -1 &&
+                                    errno != EINTR)
+                                        perror("poll(syncobj)");
 
-        for (unsigned i = 0; i < o->child_count; ++i)
-                kbase_syncobj_dec_jobs(o->children[i]);
+                                if (pfd[1].revents) {
+                                        uint64_t val;
+                                        if (read(k->wake_fd, &val, sizeof(val)) == -1 &&
+                                            errno != EAGAIN)
+                                                perror("read(wake_fd)");
+                                }
 
-        pthread_mutex_unlock(&o->child_mtx);
+                                if (pfd[0].revents)
+                                        kbase_handle_events(k);
+                        }
+
+                        p_atomic_set(&k->polling, false);
+                        pthread_mutex_unlock(&k->poll_lock);
+
+                        /* Let another waiter take over reading events */
+                        kbase_syncobj_notify(k);
+                } else {
+                        struct timespec ts = {
+                                .tv_sec = end / 1000000000,
+                                .tv_nsec = end % 1000000000,
+                        };
+
+                        p_atomic_inc(&k->event_waiters);
+                        futex_wait(&k->event_seq, seq,
+                                   end == INT64_MAX ? NULL : &ts);
+                        p_atomic_dec(&k->event_waiters);
+                }
+        }
 }
 
 static void
@@ -923,7 +913,7 @@ kbase_handle_events(kbase k)
                 struct kbase_syncobj *o = (void *)event.udata.blob[0];
 
                 if (o) {
-                        kbase_syncobj_dec_jobs(o);
+                        kbase_syncobj_dec_jobs(k, o);
                         kbase_syncobj_unref(o);
                 }
 
@@ -933,18 +923,10 @@ kbase_handle_events(kbase k)
 
                 pthread_mutex_lock(&k->handle_lock);
 
-                unsigned size = util_dynarray_num_elements(&k->gem_handles,
-                                                           kbase_handle);
-                kbase_handle *handle_data = util_dynarray_begin(&k->gem_handles);
-
                 struct util_dynarray *handles = k->atom_bos + event.atom_number;
 
-                util_dynarray_foreach(handles, int32_t, h) {
-                        if (*h >= size)
-                                continue;
-                        assert(handle_data[*h].use_count);
-                        --handle_data[*h].use_count;
-                }
+                kbase_release_handles_locked(k, util_dynarray_begin(handles),
+                                             util_dynarray_num_elements(handles, int32_t));
                 util_dynarray_fini(handles);
 
                 pthread_mutex_unlock(&k->handle_lock);
@@ -1042,7 +1024,13 @@ kbase_update_syncobjs(kbase k,
                 /* Remove the link if the syncobj is now signaled */
                 if (seqnum > link->seqnum) {
                         LOG("syncobj %p done!\n", link->o);
-                        kbase_syncobj_dec_jobs(link->o);
+                        if (link->o) {
+                                kbase_syncobj_dec_jobs(k, link->o);
+                                kbase_syncobj_unref(link->o);
+                        }
+                        kbase_release_handles_locked(k, link->handles,
+                                                     link->num_handles);
+                        free(link->handles);
                         *list = link->next;
                         if (&link->next == back)
                                 slot->back = list;
@@ -1060,6 +1048,10 @@ kbase_handle_events(kbase k)
 
         uint64_t *event_mem = k->event_mem.cpu;
 
+        /* The sync link lists are shared with kbase_cs_submit, and
+         * completing a link updates the handle use counts */
+        pthread_mutex_lock(&k->handle_lock);
+
         for (unsigned i = 0; i < k->event_slot_usage; ++i) {
                 uint64_t seqnum = event_mem[i * 2];
                 uint64_t cmp = k->event_slots[i].last;
@@ -1076,6 +1068,8 @@ kbase_handle_events(kbase k)
                         kbase_update_syncobjs(k, &k->event_slots[i], seqnum);
                 }
         }
+
+        pthread_mutex_unlock(&k->handle_lock);
 }
 #endif
 
@@ -1091,33 +1085,92 @@ kbase_latest_slot(uint8_t a, uint8_t b, uint8_t newest)
         return a;
 }
 
-static int
-kbase_submit(kbase k, uint64_t va, unsigned req,
-             struct kbase_syncobj *o,
-             int32_t *handles, unsigned num_handles)
+/* Submit all queued atoms with a single ioctl. Must be called with the
+ * handle lock held. */
+static bool
+kbase_kick_locked(kbase k)
 {
-        struct util_dynarray buf;
-        util_dynarray_init(&buf, NULL);
+        unsigned count = util_dynarray_num_elements(&k->atom_queue,
+                                                    struct base_jd_atom_v2);
+        struct base_jd_atom_v2 *atoms = util_dynarray_begin(&k->atom_queue);
+
+        if (!count)
+                return true;
+
+        struct kbase_ioctl_job_submit submit = {
+                .nr_atoms = count,
+                .stride = sizeof(*atoms),
+                .addr = (uintptr_t) atoms,
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_JOB_SUBMIT, &submit);
 
-        if (o) {
-                kbase_syncobj_ref(o);
-                kbase_syncobj_inc_jobs(o);
+        if (ret == -1)
+                perror("ioctl(KBASE_IOCTL_JOB_SUBMIT)");
+
+        for (unsigned i = 0; i < count; ++i) {
+                free((void *)(uintptr_t) atoms[i].extres_list);
+
+                if (ret != -1)
+                        continue;
+
+                /* No event will ever arrive for the atoms, so drop the
+                 * references they hold now. If the kernel accepted some of
+                 * the atoms before failing, their completion will release
+                 * the handles again, but there is no way to tell which were
+                 * accepted. */
+                struct kbase_syncobj *o = (void *)(uintptr_t) atoms[i].udata.blob[0];
+                if (o) {
+                        kbase_syncobj_dec_jobs(k, o);
+                        kbase_syncobj_unref(o);
+                }
+
+                struct util_dynarray *handles = k->atom_bos + atoms[i].atom_number;
+                kbase_release_handles_locked(k, util_dynarray_begin(handles),
+                                             util_dynarray_num_elements(handles, int32_t));
+                util_dynarray_fini(handles);
         }
 
-        memcpy(util_dynarray_resize(&buf, int32_t, num_handles),
-               handles, num_handles * sizeof(int32_t));
+        util_dynarray_clear(&k->atom_queue);
 
+        return ret != -1;
+}
+
+static bool
+kbase_kick(kbase k)
+{
         pthread_mutex_lock(&k->handle_lock);
+        bool ret = kbase_kick_locked(k);
+        pthread_mutex_unlock(&k->handle_lock);
+
+        return ret;
+}
+
+/* Queue a single atom, returning its atom number. Must be called with the
+ * handle lock held. */
+static uint8_t
+kbase_queue_atom_locked(kbase k, const struct kbase_atom *a, int data_dep)
+{
+        struct util_dynarray buf;
+        util_dynarray_init(&buf, NULL);
+
+        if (a->o) {
+                kbase_syncobj_ref(a->o);
+                kbase_syncobj_inc_jobs(a->o);
+        }
 
-        unsigned slot = (req & PANFROST_JD_REQ_FS) ? 0 : 1;
+        memcpy(util_dynarray_resize(&buf, int32_t, a->num_handles),
+               a->handles, a->num_handles * sizeof(int32_t));
+
+        unsigned slot = (a->req & PANFROST_JD_REQ_FS) ? 0 : 1;
         unsigned dep_slots[KBASE_SLOT_COUNT];
 
         uint8_t nr = k->atom_number++;
 
         struct base_jd_atom_v2 atom = {
-                .jc = va,
+                .jc = a->va,
                 .atom_number = nr,
-                .udata.blob[0] = (uintptr_t) o,
+                .udata.blob[0] = (uintptr_t) a->o,
         };
 
         for (unsigned i = 0; i < KBASE_SLOT_COUNT; ++i)
@@ -1134,8 +1187,8 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
         util_dynarray_init(&extres, NULL);
 
         /* Mark the BOs as in use */
-        for (unsigned i = 0; i < num_handles; ++i) {
-                int32_t h = handles[i];
+        for (unsigned i = 0; i < a->num_handles; ++i) {
+                int32_t h = a->handles[i];
                 assert(h < handle_buf_size);
                 assert(handle_buf[h].use_count < 255);
 
@@ -1154,46 +1207,98 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
                         util_dynarray_append(&extres, base_va, handle_buf[h].va);
         }
 
-        pthread_mutex_unlock(&k->handle_lock);
+        /* Explicit dependency on an atom from the same submit. The atom was
+         * submitted to the other slot, as there is never a need for a data
+         * dependency on the same slot. */
+        unsigned data_slot = slot ^ 1;
+        if (data_dep >= 0)
+                dep_slots[data_slot] = kbase_latest_slot(dep_slots[data_slot],
+                                                         data_dep, nr);
 
         assert(KBASE_SLOT_COUNT == 2);
-        if (dep_slots[0] != nr) {
-                atom.pre_dep[0].atom_id = dep_slots[0];
-                /* TODO: Use data dependencies?  */
-                atom.pre_dep[0].dependency_type = BASE_JD_DEP_TYPE_ORDER;
-        }
-        if (dep_slots[1] != nr) {
-                atom.pre_dep[1].atom_id = dep_slots[1];
-                atom.pre_dep[1].dependency_type = BASE_JD_DEP_TYPE_ORDER;
+        for (unsigned s = 0; s < KBASE_SLOT_COUNT; ++s) {
+                if (dep_slots[s] == nr)
+                        continue;
+
+                atom.pre_dep[s].atom_id = dep_slots[s];
+
+                /* A data dependency means that the atom is not run if the
+                 * one it depends on fails, e.g. no fragment job is run after
+                 * a faulting tiler job */
+                if (data_dep >= 0 && s == data_slot && dep_slots[s] == data_dep)
+                        atom.pre_dep[s].dependency_type = BASE_JD_DEP_TYPE_DATA;
+                else
+                        atom.pre_dep[s].dependency_type = BASE_JD_DEP_TYPE_ORDER;
         }
 
+        /* The list is freed after the atom is kicked */
         if (extres.size) {
                 atom.core_req |= BASE_JD_REQ_EXTERNAL_RESOURCES;
                 atom.nr_extres = util_dynarray_num_elements(&extres, base_va);
                 atom.extres_list = (uintptr_t) util_dynarray_begin(&extres);
         }
 
-        if (req & PANFROST_JD_REQ_FS)
+        if (a->req & PANFROST_JD_REQ_FS)
                 atom.core_req |= BASE_JD_REQ_FS;
         else
                 atom.core_req |= BASE_JD_REQ_CS | BASE_JD_REQ_T;
 
-        struct kbase_ioctl_job_submit submit = {
-                .nr_atoms = 1,
-                .stride = sizeof(atom),
-                .addr = (uintptr_t) &atom,
-        };
+        if (a->req & KBASE_JD_REQ_CYCLE_COUNT)
+                atom.core_req |= BASE_JD_REQ_PERMON;
 
-        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_JOB_SUBMIT, &submit);
+        util_dynarray_append(&k->atom_queue, struct base_jd_atom_v2, atom);
 
-        util_dynarray_fini(&extres);
+        return nr;
+}
 
-        if (ret == -1) {
-                perror("ioctl(KBASE_IOCTL_JOB_SUBMIT)");
-                return -1;
+/* Kick the queue automatically once it gets this long, so that the atom
+ * numbers in flight stay well below the limit of 256 */
+#define KBASE_ATOM_QUEUE_MAX 32
+
+static int
+kbase_submit_atoms(kbase k, const struct kbase_atom *atoms, unsigned count,
+                   bool kick)
+{
+        uint8_t nr[count];
+        int ret = -1;
+
+        pthread_mutex_lock(&k->handle_lock);
+
+        for (unsigned i = 0; i < count; ++i) {
+                int dep = atoms[i].dep;
+                assert(dep < (int) i);
+
+                nr[i] = kbase_queue_atom_locked(k, &atoms[i],
+                                                dep >= 0 ? nr[dep] : -1);
+                ret = nr[i];
+        }
+
+        if (kick || util_dynarray_num_elements(&k->atom_queue, struct base_jd_atom_v2)
+            >= KBASE_ATOM_QUEUE_MAX) {
+                if (!kbase_kick_locked(k))
+                        ret = -1;
         }
 
-        return atom.atom_number;
+        pthread_mutex_unlock(&k->handle_lock);
+
+        return ret;
+}
+
+static int
+kbase_submit(kbase k, uint64_t va, unsigned req,
+             struct kbase_syncobj *o,
+             int32_t *handles, unsigned num_handles)
+{
+        struct kbase_atom atom = {
+                .va = va,
+                .req = req,
+                .dep = -1,
+                .o = o,
+                .handles = handles,
+                .num_handles = num_handles,
+        };
+
+        return kbase_submit_atoms(k, &atom, 1, true);
 }
 
 #else
@@ -1305,17 +1410,66 @@ kbase_cs_term(kbase k, struct kbase_cs *cs, base_va va)
 
 static bool
 kbase_cs_submit(kbase k, struct kbase_cs *cs, unsigned insert_offset,
-                struct kbase_syncobj *o, uint64_t seqnum)
+                struct kbase_syncobj *o, uint64_t seqnum,
+                int32_t *handles, unsigned num_handles)
 {
         if (insert_offset == cs->last_insert)
                 return true;
 
+        /* Add the sync link before kicking the queue, so that the handles
+         * are already marked as in use if the job completes immediately */
+        if (o || num_handles) {
+                struct kbase_sync_link *link = malloc(sizeof(*link));
+                *link = (struct kbase_sync_link) {
+                        .o = o,
+                        .seqnum = seqnum,
+                        .next = NULL,
+                };
+
+                if (o) {
+                        kbase_syncobj_ref(o);
+                        kbase_syncobj_inc_jobs(o);
+                }
+
+                if (num_handles) {
+                        link->handles = malloc(num_handles * sizeof(*handles));
+                        memcpy(link->handles, handles,
+                               num_handles * sizeof(*handles));
+                        link->num_handles = num_handles;
+                }
+
+                pthread_mutex_lock(&k->handle_lock);
+
+                unsigned handle_buf_size = util_dynarray_num_elements(&k->gem_handles, kbase_handle);
+                kbase_handle *handle_buf = util_dynarray_begin(&k->gem_handles);
+
+                for (unsigned i = 0; i < num_handles; ++i) {
+                        int32_t h = handles[i];
+                        assert(h < handle_buf_size);
+                        assert(handle_buf[h].use_count < 255);
+                        ++handle_buf[h].use_count;
+                }
+
+                struct kbase_event_slot *slot =
+                        &k->event_slots[cs->event_mem_offset];
+
+                // TODO: Don't add multiple links to one queue
+                struct kbase_sync_link **list = slot->back;
+                slot->back = &link->next;
+
+                assert(!*list);
+                *list = link;
+
+                pthread_mutex_unlock(&k->handle_lock);
+        }
+
         __asm__ volatile ("dmb sy" ::: "memory");
 
         bool active = CS_READ_REGISTER(cs, CS_ACTIVE);
-        printf("active is %i\n", active);
+        LOG("active is %i\n", active);
 
         CS_WRITE_REGISTER(cs, CS_INSERT, insert_offset);
+        cs->last_insert = insert_offset;
 
         if (active) {
                 __asm__ volatile ("dmb sy" ::: "memory");
@@ -1323,7 +1477,7 @@ kbase_cs_submit(kbase k, struct kbase_cs *cs, unsigned insert_offset,
                 __asm__ volatile ("dmb sy" ::: "memory");
 
                 active = CS_READ_REGISTER(cs, CS_ACTIVE);
-                printf("active is now %i\n", active);
+                LOG("active is now %i\n", active);
         } else {
                 struct kbase_ioctl_cs_queue_kick kick = {
                         .buffer_gpu_addr = cs->va,
@@ -1347,29 +1501,6 @@ kbase_cs_submit(kbase k, struct kbase_cs *cs, unsigned insert_offset,
                 }
         }
 
-        if (o) {
-                kbase_syncobj_ref(o);
-                kbase_syncobj_inc_jobs(o);
-                // TODO: Don't add multiple links to one queue
-                struct kbase_sync_link *link = malloc(sizeof(*link));
-                *link = (struct kbase_sync_link) {
-                        .o = o,
-                        // TODO: Adjust this?
-                        .seqnum = seqnum,
-                        .next = NULL,
-                };
-
-                struct kbase_event_slot *slot =
-                        &k->event_slots[cs->event_mem_offset];
-
-                // TODO: Atomic operations?
-                struct kbase_sync_link **list = slot->back;
-                slot->back = &link->next;
-
-                assert(!*list);
-                *list = link;
-        }
-
         return true;
 }
 
@@ -1524,6 +1655,13 @@ kbase_open_csf
         k->api = PAN_BASE_API;
 
         pthread_mutex_init(&k->handle_lock, NULL);
+        pthread_mutex_init(&k->poll_lock, NULL);
+
+        k->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (k->wake_fd == -1) {
+                perror("eventfd");
+                return false;
+        }
 
         /* For later APIs, we've already checked the version in pan_base.c */
 #if PAN_BASE_API == 0
@@ -1544,7 +1682,11 @@ kbase_open_csf
         k->handle_events = kbase_handle_events;
 
 #if PAN_BASE_API < 2
+        util_dynarray_init(&k->atom_queue, NULL);
+
         k->submit = kbase_submit;
+        k->submit_atoms = kbase_submit_atoms;
+        k->kick = kbase_kick;
 #else
         k->context_create = kbase_context_create;
         k->context_destroy = kbase_context_destroy;
@@ -1558,7 +1700,8 @@ kbase_open_csf
 
         k->syncobj_create = kbase_syncobj_create;
         k->syncobj_destroy = kbase_syncobj_destroy;
-        k->syncobj_dup = kbase_syncobj_dup;
+        k->syncobj_ref = kbase_syncobj_get;
+        k->syncobj_signaled = kbase_syncobj_signaled;
         k->syncobj_wait = kbase_syncobj_wait;
 
         k->mem_sync = kbase_mem_sync;
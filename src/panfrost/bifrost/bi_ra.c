@@ -66,10 +66,13 @@ lcra_alloc_equations(unsigned node_count)
         l->node_count = node_count;
 
         l->linear = calloc(sizeof(l->linear[0]), node_count);
-        l->solutions = calloc(sizeof(l->solutions[0]), node_count);
         l->affinity = calloc(sizeof(l->affinity[0]), node_count);
 
-        memset(l->solutions, ~0, sizeof(l->solutions[0]) * node_count);
+        /* Constraints are tested a whole block at a time, so pad the
+         * solutions to whole blocks with unallocated nodes */
+        unsigned padded_count = NODEARRAY_DENSE_ALIGN(node_count);
+        l->solutions = calloc(sizeof(l->solutions[0]), padded_count);
+        memset(l->solutions, ~0, sizeof(l->solutions[0]) * padded_count);
 
         return l;
 }
@@ -111,46 +114,42 @@ lcra_add_node_interference(struct lcra_state *l, unsigned i, unsigned cmask_i, u
                 }
         }
 
-        /* Use dense arrays after adding 256 elements */
-        nodearray_orr(&l->linear[j], i, constraint_fw, 256, l->node_count);
-        nodearray_orr(&l->linear[i], j, constraint_bw, 256, l->node_count);
+        /* Use dense arrays after adding 64 blocks */
+        nodearray_orr(&l->linear[j], i, constraint_fw, 64, l->node_count);
+        nodearray_orr(&l->linear[i], j, constraint_bw, 64, l->node_count);
 }
 
-static bool
-lcra_test_linear(struct lcra_state *l, unsigned *solutions, unsigned i)
+/* Tests a block of constraints against the solutions of the corresponding
+ * nodes. There is deliberately no early exit, so that the loop is vectorised.
+ */
+static inline bool
+lcra_test_block(const nodearray_value *constraints, const unsigned *solutions,
+                unsigned constant)
 {
-        signed constant = solutions[i];
-
-        if (nodearray_is_sparse(&l->linear[i])) {
-                nodearray_sparse_foreach(&l->linear[i], elem) {
-                        unsigned j = nodearray_sparse_key(elem);
-                        nodearray_value constraint = nodearray_sparse_value(elem);
-
-                        if (solutions[j] == ~0) continue;
-
-                        signed lhs = constant - solutions[j];
-
-                        if (lhs < -7 || lhs > 7)
-                                continue;
+        unsigned conflicts = 0;
 
-                        if (constraint & (1 << (lhs + 7)))
-                                return false;
-                }
+        for (unsigned k = 0; k < NODEARRAY_BLOCK_SIZE; ++k) {
+                /* Bias in [-7, 7] offset to a bit index in [0, 14] */
+                unsigned bias = constant - solutions[k] + 7;
+                bool test = (solutions[k] != ~0) && (bias <= 14);
 
-                return true;
+                conflicts |= test ? (constraints[k] & (1 << bias)) : 0;
         }
 
-        nodearray_value *row = l->linear[i].dense;
-
-        for (unsigned j = 0; j < l->node_count; ++j) {
-                if (solutions[j] == ~0) continue;
+        return conflicts == 0;
+}
 
-                signed lhs = constant - solutions[j];
+static bool
+lcra_test_linear(struct lcra_state *l, unsigned *solutions, unsigned i)
+{
+        const nodearray *row = &l->linear[i];
+        unsigned constant = solutions[i];
 
-                if (lhs < -7 || lhs > 7)
-                        continue;
+        for (unsigned b = 0; b < nodearray_num_blocks(row); ++b) {
+                unsigned base = nodearray_block_base(row, b);
 
-                if (row[j] & (1 << (lhs + 7)))
+                if (!lcra_test_block(nodearray_block_values(row, b),
+                                     solutions + base, constant))
                         return false;
         }
 
@@ -192,14 +191,14 @@ static unsigned
 lcra_count_constraints(struct lcra_state *l, unsigned i)
 {
         unsigned count = 0;
-        nodearray *constraints = &l->linear[i];
+        const nodearray *constraints = &l->linear[i];
 
-        if (nodearray_is_sparse(constraints)) {
-                nodearray_sparse_foreach(constraints, elem)
-                        count += util_bitcount(nodearray_sparse_value(elem));
-        } else {
-                nodearray_dense_foreach_64(constraints, elem)
-                        count += util_bitcount64(*elem);
+        for (unsigned b = 0; b < nodearray_num_blocks(constraints); ++b) {
+                const uint64_t *values =
+                        (const uint64_t *)nodearray_block_values(constraints, b);
+
+                for (unsigned k = 0; k < sizeof(nodearray_block) / 8; ++k)
+                        count += util_bitcount64(values[k]);
         }
 
         return count;
@@ -556,31 +555,18 @@ bi_choose_spill_node(bi_context *ctx, struct lcra_state *l)
         unsigned best_benefit = 0.0;
         signed best_node = -1;
 
-        if (nodearray_is_sparse(&l->linear[l->spill_node])) {
-                nodearray_sparse_foreach(&l->linear[l->spill_node], elem) {
-                        unsigned i = nodearray_sparse_key(elem);
-                        unsigned constraint = nodearray_sparse_value(elem);
-
-                        /* Only spill nodes that interfere with the node failing
-                         * register allocation. It's pointless to spill anything else */
-                        if (!constraint) continue;
-
-                        if (BITSET_TEST(no_spill, i)) continue;
+        const nodearray *row = &l->linear[l->spill_node];
 
-                        unsigned benefit = lcra_count_constraints(l, i);
+        for (unsigned b = 0; b < nodearray_num_blocks(row); ++b) {
+                const nodearray_value *constraints = nodearray_block_values(row, b);
+                unsigned base = nodearray_block_base(row, b);
 
-                        if (benefit > best_benefit) {
-                                best_benefit = benefit;
-                                best_node = i;
-                        }
-                }
-        } else {
-                nodearray_value *row = l->linear[l->spill_node].dense;
+                for (unsigned k = 0; k < NODEARRAY_BLOCK_SIZE; ++k) {
+                        unsigned i = base + k;
 
-                for (unsigned i = 0; i < l->node_count; ++i) {
                         /* Only spill nodes that interfere with the node failing
                          * register allocation. It's pointless to spill anything else */
-                        if (!row[i]) continue;
+                        if (!constraints[k]) continue;
 
                         if (BITSET_TEST(no_spill, i)) continue;
 
@@ -27,17 +27,17 @@
  * When the number of elements is over a threshold (max_sparse), the dense mode
  * is used, and the nodearray is simply a container for an array.
  *
- * In sparse mode, the array has elements with a 24-bit node index and a value.
- * The nodes are always sorted, so that a binary search can be used to find
- * elements. Nonexistent elements are treated as zero.
+ * In sparse mode, the array stores blocks of sixteen adjacent values, along
+ * with a sorted array of 24-bit block indices so that a binary search can be
+ * used to find blocks. Adding a key allocates its neighbours as well, which
+ * suits the clustered node indices of interference graphs. Nonexistent
+ * elements are treated as zero.
  *
- * Function names follow ARM instruction names: orr does *elem |= value.
+ * Both modes are iterated block by block, with the block values contiguous in
+ * memory, so that users can write fixed-width loops over a block that the
+ * compiler vectorises.
  *
- * Although it's probably already fast enough, the datastructure could be sped
- * up a lot, especially when NEON is available, by making the sparse mode store
- * sixteen adjacent values, so that adding new keys also allocates nearby keys,
- * and to allow for vectorising iteration, as can be done when in the dense
- * mode.
+ * Function names follow ARM instruction names: orr does *elem |= value.
  */
 
 #ifndef __BIFROST_NODEARRAY_H
@@ -49,41 +49,34 @@
 extern "C" {
 #endif
 
-/* A value that may be stored in a nodearray element, used directly for dense
- * elements and included into sparse elements.
- */
+/* A value that may be stored in a nodearray element */
 typedef uint16_t nodearray_value;
 
 #define NODEARRAY_MAX_VALUE 0xffff
 
-/* Type storing sparse nodearray elements, consisting of a nodearray_value at
- * the bottom and a nodearray_key at the top.
- */
-typedef uint64_t nodearray_sparse;
+/* Number of adjacent values in a block */
+#define NODEARRAY_BLOCK_SIZE 16
+
+typedef struct {
+        nodearray_value values[NODEARRAY_BLOCK_SIZE];
+} nodearray_block;
 
 typedef struct {
         union {
-                nodearray_sparse *sparse;
+                nodearray_block *sparse;
                 nodearray_value *dense;
         };
+
+        /* In sparse mode, sorted block index of each block */
+        unsigned *keys;
+
+        /* Number of blocks in sparse mode, of values in dense mode */
         unsigned size;
         unsigned sparse_capacity;
 } nodearray;
 
-/* Align sizes to 16-bytes for SIMD purposes */
-#define NODEARRAY_DENSE_ALIGN(x) ALIGN_POT(x, 16)
-
-#define nodearray_sparse_foreach(buf, elem) \
-   for (nodearray_sparse *elem = (buf)->sparse; \
-        elem < (buf)->sparse + (buf)->size; elem++)
-
-#define nodearray_dense_foreach(buf, elem) \
-   for (nodearray_value *elem = (buf)->dense; \
-        elem < (buf)->dense + (buf)->size; elem++)
-
-#define nodearray_dense_foreach_64(buf, elem) \
-   for (uint64_t *elem = (uint64_t *)(buf)->dense; \
-        (nodearray_value *)elem < (buf)->dense + (buf)->size; elem++)
+/* Align dense sizes to whole blocks, which is also enough for SIMD */
+#define NODEARRAY_DENSE_ALIGN(x) ALIGN_POT(x, NODEARRAY_BLOCK_SIZE)
 
 static inline bool
 nodearray_is_sparse(const nodearray *a)
@@ -101,59 +94,64 @@ static inline void
 nodearray_reset(nodearray *a)
 {
         free(a->sparse);
+        free(a->keys);
         nodearray_init(a);
 }
 
-static inline nodearray_sparse
-nodearray_encode(unsigned key, nodearray_value value)
+static inline unsigned
+nodearray_num_blocks(const nodearray *a)
 {
-        static_assert(sizeof(nodearray_value) == sizeof(uint16_t), "sizes mismatch");
-        return ((nodearray_sparse) key << 16) | value;
+        if (nodearray_is_sparse(a))
+                return a->size;
+        else
+                return NODEARRAY_DENSE_ALIGN(a->size) / NODEARRAY_BLOCK_SIZE;
 }
 
+/* Key of the first value of the i'th block. Dense arrays are padded with
+ * zeroes up to a whole block, so keys up to NODEARRAY_DENSE_ALIGN(max) may be
+ * visited.
+ */
 static inline unsigned
-nodearray_sparse_key(const nodearray_sparse *elem)
+nodearray_block_base(const nodearray *a, unsigned i)
 {
-        static_assert(sizeof(nodearray_value) == sizeof(uint16_t), "sizes mismatch");
-        return *elem >> 16;
+        if (nodearray_is_sparse(a))
+                return a->keys[i] * NODEARRAY_BLOCK_SIZE;
+        else
+                return i * NODEARRAY_BLOCK_SIZE;
 }
 
-static inline nodearray_value
-nodearray_sparse_value(const nodearray_sparse *elem)
+static inline const nodearray_value *
+nodearray_block_values(const nodearray *a, unsigned i)
 {
-        return *elem & NODEARRAY_MAX_VALUE;
+        if (nodearray_is_sparse(a))
+                return a->sparse[i].values;
+        else
+                return a->dense + (i * NODEARRAY_BLOCK_SIZE);
 }
 
 static inline unsigned
-nodearray_sparse_search(const nodearray *a, nodearray_sparse key, nodearray_sparse **elem)
+nodearray_sparse_search(const nodearray *a, unsigned block)
 {
         assert(nodearray_is_sparse(a) && a->size);
 
-        nodearray_sparse *data = a->sparse;
-
-        /* Encode the key using the highest possible value, so that the
-         * matching node must be encoded lower than this
-         */
-        nodearray_sparse skey = nodearray_encode(key, NODEARRAY_MAX_VALUE);
-
+        const unsigned *keys = a->keys;
         unsigned left = 0;
         unsigned right = a->size - 1;
 
-        if (data[right] <= skey)
+        if (keys[right] <= block)
                 left = right;
 
         while (left != right) {
                 /* No need to worry about overflow, we couldn't have more than
-                 * 2^24 elements */
+                 * 2^24 blocks */
                 unsigned probe = (left + right + 1) / 2;
 
-                if (data[probe] > skey)
+                if (keys[probe] > block)
                         right = probe - 1;
                 else
                         left = probe;
         }
 
-        *elem = data + left;
         return left;
 }
 
@@ -168,78 +166,100 @@ nodearray_orr(nodearray *a, unsigned key, nodearray_value value,
                 return;
 
         if (nodearray_is_sparse(a)) {
+                unsigned block = key / NODEARRAY_BLOCK_SIZE;
+                unsigned lane = key % NODEARRAY_BLOCK_SIZE;
                 unsigned size = a->size;
                 unsigned left = 0;
 
                 if (size) {
-                        /* First, binary search for key */
-                        nodearray_sparse *elem;
-                        left = nodearray_sparse_search(a, key, &elem);
+                        /* First, binary search for the block */
+                        left = nodearray_sparse_search(a, block);
 
-                        if (nodearray_sparse_key(elem) == key) {
-                                *elem |= value;
+                        if (a->keys[left] == block) {
+                                a->sparse[left].values[lane] |= value;
                                 return;
                         }
 
                         /* We insert before `left`, so increment it if it's
                          * out of order */
-                        if (nodearray_sparse_key(elem) < key)
+                        if (a->keys[left] < block)
                                 ++left;
                 }
 
-                if (size < max_sparse && (size + 1) < max / 4) {
+                /* A sparse block takes a little more memory than the same
+                 * values in a dense array, so stay sparse while at most half
+                 * of the dense array would be used.
+                 */
+                if (size < max_sparse &&
+                    (size + 1) * NODEARRAY_BLOCK_SIZE * 2 <= max) {
                         /* We didn't find it, but we know where to insert it. */
-
-                        nodearray_sparse *data = a->sparse;
-                        nodearray_sparse *data_move = data + left;
-
-                        bool realloc = (++a->size) > a->sparse_capacity;
-
-                        if (realloc) {
-                                a->sparse_capacity = MIN2(MAX2(a->sparse_capacity * 2, 64), max / 4);
-
-                                a->sparse = (nodearray_sparse *)malloc(a->sparse_capacity * sizeof(nodearray_sparse));
-
-                                if (left)
-                                        memcpy(a->sparse, data, left * sizeof(nodearray_sparse));
+                        if (size == a->sparse_capacity) {
+                                a->sparse_capacity = MAX2(a->sparse_capacity * 2, 4);
+
+                                a->sparse = (nodearray_block *)
+                                        realloc(a->sparse, a->sparse_capacity *
+                                                sizeof(nodearray_block));
+                                a->keys = (unsigned *)
+                                        realloc(a->keys, a->sparse_capacity *
+                                                sizeof(unsigned));
                         }
 
-                        nodearray_sparse *elem = a->sparse + left;
-
-                        if (left != size)
-                                memmove(elem + 1, data_move, (size - left) * sizeof(nodearray_sparse));
-
-                        *elem = nodearray_encode(key, value);
+                        if (left != size) {
+                                memmove(a->sparse + left + 1, a->sparse + left,
+                                        (size - left) * sizeof(nodearray_block));
+                                memmove(a->keys + left + 1, a->keys + left,
+                                        (size - left) * sizeof(unsigned));
+                        }
 
-                        if (realloc)
-                                free(data);
+                        memset(&a->sparse[left], 0, sizeof(nodearray_block));
+                        a->sparse[left].values[lane] = value;
+                        a->keys[left] = block;
+                        a->size++;
 
                         return;
                 }
 
-                /* There are too many elements, so convert to a dense array */
+                /* There are too many blocks, so convert to a dense array */
                 nodearray old = *a;
 
                 a->dense = (nodearray_value *)calloc(NODEARRAY_DENSE_ALIGN(max), sizeof(nodearray_value));
+                a->keys = NULL;
                 a->size = max;
                 a->sparse_capacity = ~0U;
 
-                nodearray_value *data = a->dense;
-
-                nodearray_sparse_foreach(&old, x) {
-                        unsigned key = nodearray_sparse_key(x);
-                        nodearray_value value = nodearray_sparse_value(x);
+                for (unsigned i = 0; i < old.size; ++i) {
+                        assert(old.keys[i] * NODEARRAY_BLOCK_SIZE < max);
 
-                        assert(key < max);
-                        data[key] = value;
+                        memcpy(a->dense + old.keys[i] * NODEARRAY_BLOCK_SIZE,
+                               old.sparse[i].values, sizeof(nodearray_block));
                 }
 
                 free(old.sparse);
+                free(old.keys);
         }
 
         a->dense[key] |= value;
 }
 
+/* Reads a single element, mostly useful for testing */
+static inline nodearray_value
+nodearray_get(const nodearray *a, unsigned key)
+{
+        if (!nodearray_is_sparse(a))
+                return a->dense[key];
+
+        if (!a->size)
+                return 0;
+
+        unsigned block = key / NODEARRAY_BLOCK_SIZE;
+        unsigned i = nodearray_sparse_search(a, block);
+
+        if (a->keys[i] != block)
+                return 0;
+
+        return a->sparse[i].values[key % NODEARRAY_BLOCK_SIZE];
+}
+
 #ifdef __cplusplus
 } /* extern C */
 #endif
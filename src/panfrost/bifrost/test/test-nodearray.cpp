@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2022 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+#include "util/u_math.h"
+#include "nodearray.h"
+
+#include <chrono>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+/* Same threshold as the register allocator */
+#define MAX_SPARSE 64
+
+static void
+check_contents(const nodearray *a, const std::vector<nodearray_value> &ref)
+{
+   std::vector<bool> seen(NODEARRAY_DENSE_ALIGN(ref.size()));
+
+   for (unsigned i = 0; i < ref.size(); ++i)
+      ASSERT_EQ(nodearray_get(a, i), ref[i]) << "key " << i;
+
+   /* Every nonzero value must be visited exactly once by block iteration */
+   for (unsigned b = 0; b < nodearray_num_blocks(a); ++b) {
+      const nodearray_value *values = nodearray_block_values(a, b);
+      unsigned base = nodearray_block_base(a, b);
+
+      for (unsigned k = 0; k < NODEARRAY_BLOCK_SIZE; ++k) {
+         unsigned key = base + k;
+
+         ASSERT_LT(key, seen.size());
+         ASSERT_FALSE(seen[key]);
+         seen[key] = true;
+
+         ASSERT_EQ(values[k], key < ref.size() ? ref[key] : 0);
+      }
+   }
+
+   for (unsigned i = 0; i < ref.size(); ++i)
+      ASSERT_TRUE(seen[i] || !ref[i]) << "key " << i;
+}
+
+TEST(NodeArray, StartsEmpty)
+{
+   nodearray a;
+   nodearray_init(&a);
+
+   EXPECT_TRUE(nodearray_is_sparse(&a));
+   EXPECT_EQ(nodearray_num_blocks(&a), 0);
+   EXPECT_EQ(nodearray_get(&a, 1234), 0);
+
+   nodearray_reset(&a);
+}
+
+TEST(NodeArray, SparseBlocks)
+{
+   nodearray a;
+   nodearray_init(&a);
+
+   nodearray_orr(&a, 100, 0x1, MAX_SPARSE, 1000);
+   nodearray_orr(&a, 101, 0x2, MAX_SPARSE, 1000);
+   nodearray_orr(&a, 100, 0x4, MAX_SPARSE, 1000);
+   nodearray_orr(&a, 3, 0x8, MAX_SPARSE, 1000);
+   nodearray_orr(&a, 999, 0x10, MAX_SPARSE, 1000);
+
+   /* Zero values are never stored */
+   nodearray_orr(&a, 500, 0, MAX_SPARSE, 1000);
+
+   /* Neighbouring keys share a block */
+   ASSERT_TRUE(nodearray_is_sparse(&a));
+   EXPECT_EQ(nodearray_num_blocks(&a), 3);
+   EXPECT_EQ(nodearray_block_base(&a, 0), 0);
+   EXPECT_EQ(nodearray_block_base(&a, 1), 96);
+   EXPECT_EQ(nodearray_block_base(&a, 2), 992);
+
+   EXPECT_EQ(nodearray_get(&a, 100), 0x5);
+   EXPECT_EQ(nodearray_get(&a, 101), 0x2);
+   EXPECT_EQ(nodearray_get(&a, 102), 0);
+   EXPECT_EQ(nodearray_get(&a, 3), 0x8);
+   EXPECT_EQ(nodearray_get(&a, 999), 0x10);
+   EXPECT_EQ(nodearray_get(&a, 500), 0);
+
+   nodearray_reset(&a);
+}
+
+TEST(NodeArray, ConvertsToDense)
+{
+   const unsigned max = 4000;
+   std::vector<nodearray_value> ref(max);
+   nodearray a;
+   nodearray_init(&a);
+
+   /* One key per block until the sparse threshold is exceeded */
+   for (unsigned i = 0; i <= MAX_SPARSE; ++i) {
+      unsigned key = (i * NODEARRAY_BLOCK_SIZE) + (i % NODEARRAY_BLOCK_SIZE);
+      nodearray_value value = 1 << (i % 15);
+
+      nodearray_orr(&a, key, value, MAX_SPARSE, max);
+      ref[key] |= value;
+
+      EXPECT_EQ(nodearray_is_sparse(&a), i < MAX_SPARSE);
+   }
+
+   EXPECT_FALSE(nodearray_is_sparse(&a));
+   check_contents(&a, ref);
+
+   nodearray_reset(&a);
+}
+
+TEST(NodeArray, SmallArraysConvertEarly)
+{
+   /* Sparse blocks stop being worth it long before max_sparse */
+   nodearray a;
+   nodearray_init(&a);
+
+   nodearray_orr(&a, 0, 1, MAX_SPARSE, 40);
+   EXPECT_TRUE(nodearray_is_sparse(&a));
+
+   nodearray_orr(&a, 39, 1, MAX_SPARSE, 40);
+   EXPECT_FALSE(nodearray_is_sparse(&a));
+   EXPECT_EQ(nodearray_num_blocks(&a), 3);
+
+   nodearray_reset(&a);
+}
+
+TEST(NodeArray, MatchesReference)
+{
+   for (unsigned max : { 17u, 100u, 1000u, 5000u }) {
+      std::vector<nodearray_value> ref(max);
+      nodearray a;
+      nodearray_init(&a);
+
+      srand(max);
+
+      for (unsigned i = 0; i < 3 * max; ++i) {
+         /* Mostly clustered keys, like interfering live ranges */
+         unsigned key = (rand() % 4) ? (i / 3 + rand() % 32) % max :
+                        rand() % max;
+         nodearray_value value = rand() & NODEARRAY_MAX_VALUE;
+
+         nodearray_orr(&a, key, value, MAX_SPARSE, max);
+         ref[key] |= value;
+
+         if ((i % 97) == 0)
+            check_contents(&a, ref);
+      }
+
+      check_contents(&a, ref);
+      nodearray_reset(&a);
+   }
+}
+
+/* Interference graphs shaped like the ones of large compute kernels: most
+ * nodes are short lived and interfere with a window of recent nodes, and a few
+ * long lived nodes interfere with everything. Not run by default, use
+ * --gtest_also_run_disabled_tests to get the timings.
+ */
+TEST(NodeArray, DISABLED_Benchmark)
+{
+   for (unsigned node_count : { 512u, 4096u, 16384u }) {
+      const unsigned window = 48;
+      std::vector<nodearray> rows(node_count);
+
+      for (nodearray &row : rows)
+         nodearray_init(&row);
+
+      srand(node_count);
+
+      auto start = std::chrono::steady_clock::now();
+
+      for (unsigned i = 0; i < node_count; ++i) {
+         for (unsigned j = (i > window) ? (i - window) : 0; j < i; ++j) {
+            nodearray_value v = 1 << (rand() % 15);
+
+            nodearray_orr(&rows[i], j, v, MAX_SPARSE, node_count);
+            nodearray_orr(&rows[j], i, v, MAX_SPARSE, node_count);
+         }
+
+         if ((i % 64) == 0) {
+            for (unsigned j = 0; j < node_count; j += 8) {
+               if (i == j) continue;
+
+               nodearray_orr(&rows[i], j, 0x80, MAX_SPARSE, node_count);
+               nodearray_orr(&rows[j], i, 0x80, MAX_SPARSE, node_count);
+            }
+         }
+      }
+
+      auto built = std::chrono::steady_clock::now();
+      unsigned count = 0;
+
+      for (const nodearray &row : rows) {
+         for (unsigned b = 0; b < nodearray_num_blocks(&row); ++b) {
+            const nodearray_value *values = nodearray_block_values(&row, b);
+
+            for (unsigned k = 0; k < NODEARRAY_BLOCK_SIZE; ++k)
+               count += util_bitcount(values[k]);
+         }
+      }
+
+      auto end = std::chrono::steady_clock::now();
+
+      for (nodearray &row : rows)
+         nodearray_reset(&row);
+
+      printf("%5u nodes: build %8.3f ms, iterate %8.3f ms (%u bits)\n",
+             node_count,
+             std::chrono::duration<double, std::milli>(built - start).count(),
+             std::chrono::duration<double, std::milli>(end - built).count(),
+             count);
+   }
+}
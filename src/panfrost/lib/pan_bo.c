@@ -37,6 +37,7 @@
 
 #include "os/os_mman.h"
 
+#include "util/u_debug.h"
 #include "util/u_inlines.h"
 #include "util/u_math.h"
 #include "util/os_file.h"
@@ -77,12 +78,17 @@ panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
         if (dev->kbase) {
                 unsigned mali_flags = (flags & PAN_BO_EVENT) ? 0x8200f : 0;
 
-                struct base_ptr p = dev->mali.alloc(&dev->mali, size, create_bo.flags, mali_flags);
+                if (flags & PAN_BO_CACHEABLE)
+                        create_bo.flags |= KBASE_BO_CACHED_CPU;
 
-                if (p.gpu) {
+                struct base_ptr p;
+                int handle = kbase_alloc_bo(&dev->mali, size, create_bo.flags,
+                                            mali_flags, &p);
+
+                if (handle >= 0) {
                         cpu = p.cpu;
                         create_bo.offset = p.gpu;
-                        create_bo.handle = kbase_alloc_gem_handle(&dev->mali, p.gpu, -1);
+                        create_bo.handle = handle;
                         if (!cpu)
                                 abort();
                         ret = 0;
@@ -118,9 +124,7 @@ panfrost_bo_free(struct panfrost_bo *bo)
         int ret;
 
         if (dev->kbase) {
-                os_munmap(bo->ptr.cpu, bo->size);
-                dev->mali.free(&dev->mali, bo->ptr.gpu);
-                kbase_free_gem_handle(&dev->mali, bo->gem_handle);
+                kbase_free_bo(&dev->mali, bo->gem_handle, bo->ptr.cpu, bo->size);
                 ret = 0;
         } else {
                 ret = drmIoctl(bo->dev->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
@@ -206,86 +210,214 @@ pan_bucket_index(unsigned size)
         return (bucket_index - MIN_BO_CACHE_BUCKET);
 }
 
-static struct list_head *
+static struct panfrost_bo_cache_bucket *
 pan_bucket(struct panfrost_device *dev, unsigned size)
 {
         return &dev->bo_cache.buckets[pan_bucket_index(size)];
 }
 
-/* Tries to fetch a BO of sufficient size with the appropriate flags from the
- * BO cache. If it succeeds, it returns that BO and removes the BO from the
- * cache. If it fails, it returns NULL signaling the caller to allocate a new
- * BO. */
+/* Takes the oldest suitable BO out of its cache bucket, or returns NULL if
+ * there is none. Only the bucket of the requested size is locked, and the
+ * lock is never held while waiting: busy BOs are only detected with a zero
+ * timeout, and if we are allowed to wait, the BO is taken out of the cache
+ * first. */
 
 static struct panfrost_bo *
-panfrost_bo_cache_fetch(struct panfrost_device *dev,
-                        size_t size, uint32_t flags, const char *label,
-                        bool dontwait)
+panfrost_bo_cache_take(struct panfrost_device *dev,
+                       size_t size, uint32_t flags, bool dontwait)
 {
-        pthread_mutex_lock(&dev->bo_cache.lock);
-        struct list_head *bucket = pan_bucket(dev, size);
+        struct panfrost_bo_cache_bucket *bucket = pan_bucket(dev, size);
         struct panfrost_bo *bo = NULL;
+        bool busy = false;
+
+        pthread_mutex_lock(&bucket->lock);
 
         /* Iterate the bucket looking for something suitable */
-        list_for_each_entry_safe(struct panfrost_bo, entry, bucket,
-                                 bucket_link) {
+        list_for_each_entry(struct panfrost_bo, entry, &bucket->bos,
+                            bucket_link) {
                 if (entry->size < size || entry->flags != flags)
                         continue;
 
                 /* If the oldest BO in the cache is busy, likely so is
-                 * everything newer, so bail. */
-                if (!panfrost_bo_wait(entry, dontwait ? 0 : INT64_MAX,
-                                      PAN_BO_ACCESS_RW))
-                        break;
+                 * everything newer, so bail, unless we can wait for it. */
+                busy = !panfrost_bo_wait(entry, 0, PAN_BO_ACCESS_RW);
 
-                struct drm_panfrost_madvise madv = {
-                        .handle = entry->gem_handle,
-                        .madv = PANFROST_MADV_WILLNEED,
-                };
-                int ret;
+                if (busy && dontwait)
+                        break;
 
                 /* This one works, splice it out of the cache */
                 list_del(&entry->bucket_link);
-                list_del(&entry->lru_link);
+                bo = entry;
+                break;
+        }
 
-                ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
-                if (!ret && !madv.retained) {
-                        panfrost_bo_free(entry);
-                        continue;
+        pthread_mutex_unlock(&bucket->lock);
+
+        if (!bo)
+                return NULL;
+
+        p_atomic_add(&dev->bo_cache.size, -(int64_t) bo->size);
+
+        if (busy)
+                panfrost_bo_wait(bo, INT64_MAX, PAN_BO_ACCESS_RW);
+
+        return bo;
+}
+
+/* Tries to fetch a BO of sufficient size with the appropriate flags from the
+ * BO cache. If it succeeds, it returns that BO and removes the BO from the
+ * cache. If it fails, it returns NULL signaling the caller to allocate a new
+ * BO. */
+
+static struct panfrost_bo *
+panfrost_bo_cache_fetch(struct panfrost_device *dev,
+                        size_t size, uint32_t flags, const char *label,
+                        bool dontwait)
+{
+        struct panfrost_bo *bo;
+
+        while ((bo = panfrost_bo_cache_take(dev, size, flags, dontwait))) {
+                if (!dev->kbase) {
+                        struct drm_panfrost_madvise madv = {
+                                .handle = bo->gem_handle,
+                                .madv = PANFROST_MADV_WILLNEED,
+                        };
+
+                        /* The kernel purged this one, free it and keep
+                         * looking in the bucket */
+                        int ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
+                        if (!ret && !madv.retained) {
+                                panfrost_bo_free(bo);
+                                continue;
+                        }
                 }
+
                 /* Let's go! */
-                bo = entry;
                 bo->label = label;
                 break;
         }
-        pthread_mutex_unlock(&dev->bo_cache.lock);
 
         return bo;
 }
 
+/* Removes BOs from the cache, stale ones first, then the least recently used
+ * ones while the cache is over its size budget. Each bucket is only locked
+ * while BOs are taken out, they are freed afterwards. */
+
 static void
-panfrost_bo_cache_evict_stale_bos(struct panfrost_device *dev)
+panfrost_bo_cache_trim(struct panfrost_device *dev)
 {
         struct timespec time;
+        struct list_head evict;
 
+        list_inithead(&evict);
         clock_gettime(CLOCK_MONOTONIC, &time);
-        list_for_each_entry_safe(struct panfrost_bo, entry,
-                                 &dev->bo_cache.lru, lru_link) {
-                /* We want all entries that have been used more than 1 sec
-                 * ago to be dropped, others can be kept.
+
+        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i) {
+                struct panfrost_bo_cache_bucket *bucket = &dev->bo_cache.buckets[i];
+
+                pthread_mutex_lock(&bucket->lock);
+
+                /* Buckets are in LRU order. We want all entries that have
+                 * been used more than 1 sec ago to be dropped, others can be
+                 * kept.
                  * Note the <= 2 check and not <= 1. It's here to account for
                  * the fact that we're only testing ->tv_sec, not ->tv_nsec.
                  * That means we might keep entries that are between 1 and 2
                  * seconds old, but we don't really care, as long as unused BOs
                  * are dropped at some point.
                  */
-                if (time.tv_sec - entry->last_used <= 2)
+                list_for_each_entry_safe(struct panfrost_bo, entry,
+                                         &bucket->bos, bucket_link) {
+                        if (time.tv_sec - entry->last_used <= 2)
+                                break;
+
+                        list_del(&entry->bucket_link);
+                        list_addtail(&entry->bucket_link, &evict);
+                        p_atomic_add(&dev->bo_cache.size, -(int64_t) entry->size);
+                }
+
+                pthread_mutex_unlock(&bucket->lock);
+        }
+
+        while (p_atomic_read(&dev->bo_cache.size) > dev->bo_cache.max_size) {
+                struct panfrost_bo_cache_bucket *oldest = NULL;
+                time_t oldest_time = 0;
+
+                /* Find the bucket whose least recently used BO is oldest */
+                for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i) {
+                        struct panfrost_bo_cache_bucket *bucket = &dev->bo_cache.buckets[i];
+
+                        pthread_mutex_lock(&bucket->lock);
+
+                        if (!list_is_empty(&bucket->bos)) {
+                                struct panfrost_bo *first =
+                                        list_first_entry(&bucket->bos,
+                                                         struct panfrost_bo,
+                                                         bucket_link);
+
+                                if (!oldest || first->last_used < oldest_time) {
+                                        oldest = bucket;
+                                        oldest_time = first->last_used;
+                                }
+                        }
+
+                        pthread_mutex_unlock(&bucket->lock);
+                }
+
+                if (!oldest)
                         break;
 
-                list_del(&entry->bucket_link);
-                list_del(&entry->lru_link);
+                pthread_mutex_lock(&oldest->lock);
+
+                if (!list_is_empty(&oldest->bos)) {
+                        struct panfrost_bo *entry =
+                                list_first_entry(&oldest->bos,
+                                                 struct panfrost_bo,
+                                                 bucket_link);
+
+                        list_del(&entry->bucket_link);
+                        list_addtail(&entry->bucket_link, &evict);
+                        p_atomic_add(&dev->bo_cache.size, -(int64_t) entry->size);
+                }
+
+                pthread_mutex_unlock(&oldest->lock);
+        }
+
+        list_for_each_entry_safe(struct panfrost_bo, entry, &evict, bucket_link)
                 panfrost_bo_free(entry);
+}
+
+/* Background thread trimming the cache once a second, or straight away once
+ * the cache grows over its budget */
+
+static void *
+panfrost_bo_cache_trim_thread(void *data)
+{
+        struct panfrost_device *dev = data;
+
+        pthread_mutex_lock(&dev->bo_cache.trim_lock);
+
+        while (!dev->bo_cache.trim_stop) {
+                struct timespec deadline;
+
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += 1;
+
+                pthread_cond_timedwait(&dev->bo_cache.trim_cond,
+                                       &dev->bo_cache.trim_lock, &deadline);
+
+                if (dev->bo_cache.trim_stop)
+                        break;
+
+                pthread_mutex_unlock(&dev->bo_cache.trim_lock);
+                panfrost_bo_cache_trim(dev);
+                pthread_mutex_lock(&dev->bo_cache.trim_lock);
         }
+
+        pthread_mutex_unlock(&dev->bo_cache.trim_lock);
+
+        return NULL;
 }
 
 /* Tries to add a BO to the cache. Returns if it was
@@ -299,37 +431,39 @@ panfrost_bo_cache_put(struct panfrost_bo *bo)
         if (bo->flags & PAN_BO_SHARED || dev->debug & PAN_DBG_NO_CACHE)
                 return false;
 
-        /* Must be first */
-        pthread_mutex_lock(&dev->bo_cache.lock);
-
-        struct list_head *bucket = pan_bucket(dev, MAX2(bo->size, 4096));
-        struct drm_panfrost_madvise madv;
+        struct panfrost_bo_cache_bucket *bucket = pan_bucket(dev, MAX2(bo->size, 4096));
         struct timespec time;
 
-        madv.handle = bo->gem_handle;
-        madv.madv = PANFROST_MADV_DONTNEED;
-	madv.retained = 0;
-
-        drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
+        if (!dev->kbase) {
+                struct drm_panfrost_madvise madv = {
+                        .handle = bo->gem_handle,
+                        .madv = PANFROST_MADV_DONTNEED,
+                };
 
-        /* Add us to the bucket */
-        list_addtail(&bo->bucket_link, bucket);
+                drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
+        }
 
-        /* Add us to the LRU list and update the last_used field. */
-        list_addtail(&bo->lru_link, &dev->bo_cache.lru);
+        /* Update the last_used field for the LRU order. */
         clock_gettime(CLOCK_MONOTONIC, &time);
         bo->last_used = time.tv_sec;
 
-        /* Let's do some cleanup in the BO cache while we hold the
-         * lock.
-         */
-        panfrost_bo_cache_evict_stale_bos(dev);
-
         /* Update the label to help debug BO cache memory usage issues */
         bo->label = "Unused (BO cache)";
 
-        /* Must be last */
-        pthread_mutex_unlock(&dev->bo_cache.lock);
+        /* Add us to the bucket */
+        pthread_mutex_lock(&bucket->lock);
+        list_addtail(&bo->bucket_link, &bucket->bos);
+        pthread_mutex_unlock(&bucket->lock);
+
+        uint64_t size = p_atomic_add_return(&dev->bo_cache.size, bo->size);
+
+        /* Let's do some cleanup in the BO cache. Without the trimming
+         * thread, this has to happen inline. */
+        if (!dev->bo_cache.trim_thread_started)
+                panfrost_bo_cache_trim(dev);
+        else if (size > dev->bo_cache.max_size)
+                pthread_cond_signal(&dev->bo_cache.trim_cond);
+
         return true;
 }
 
@@ -343,18 +477,76 @@ void
 panfrost_bo_cache_evict_all(
                 struct panfrost_device *dev)
 {
-        pthread_mutex_lock(&dev->bo_cache.lock);
         for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i) {
-                struct list_head *bucket = &dev->bo_cache.buckets[i];
+                struct panfrost_bo_cache_bucket *bucket = &dev->bo_cache.buckets[i];
+
+                pthread_mutex_lock(&bucket->lock);
 
-                list_for_each_entry_safe(struct panfrost_bo, entry, bucket,
+                list_for_each_entry_safe(struct panfrost_bo, entry, &bucket->bos,
                                          bucket_link) {
                         list_del(&entry->bucket_link);
-                        list_del(&entry->lru_link);
+                        p_atomic_add(&dev->bo_cache.size, -(int64_t) entry->size);
                         panfrost_bo_free(entry);
                 }
+
+                pthread_mutex_unlock(&bucket->lock);
+        }
+}
+
+void
+panfrost_bo_cache_init(struct panfrost_device *dev)
+{
+        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i) {
+                pthread_mutex_init(&dev->bo_cache.buckets[i].lock, NULL);
+                list_inithead(&dev->bo_cache.buckets[i].bos);
+        }
+
+        dev->bo_cache.size = 0;
+        dev->bo_cache.max_size =
+                debug_get_num_option("PAN_BO_CACHE_MB", 128) * 1024 * 1024;
+
+        if (dev->debug & PAN_DBG_NO_CACHE)
+                return;
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&dev->bo_cache.trim_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pthread_mutex_init(&dev->bo_cache.trim_lock, NULL);
+        dev->bo_cache.trim_stop = false;
+
+        dev->bo_cache.trim_thread_started =
+                !pthread_create(&dev->bo_cache.trim_thread, NULL,
+                                panfrost_bo_cache_trim_thread, dev);
+
+        if (!dev->bo_cache.trim_thread_started) {
+                pthread_cond_destroy(&dev->bo_cache.trim_cond);
+                pthread_mutex_destroy(&dev->bo_cache.trim_lock);
+        }
+}
+
+void
+panfrost_bo_cache_fini(struct panfrost_device *dev)
+{
+        if (dev->bo_cache.trim_thread_started) {
+                pthread_mutex_lock(&dev->bo_cache.trim_lock);
+                dev->bo_cache.trim_stop = true;
+                pthread_cond_signal(&dev->bo_cache.trim_cond);
+                pthread_mutex_unlock(&dev->bo_cache.trim_lock);
+
+                pthread_join(dev->bo_cache.trim_thread, NULL);
+
+                pthread_cond_destroy(&dev->bo_cache.trim_cond);
+                pthread_mutex_destroy(&dev->bo_cache.trim_lock);
+                dev->bo_cache.trim_thread_started = false;
         }
-        pthread_mutex_unlock(&dev->bo_cache.lock);
+
+        panfrost_bo_cache_evict_all(dev);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i)
+                pthread_mutex_destroy(&dev->bo_cache.buckets[i].lock);
 }
 
 void
@@ -383,6 +575,55 @@ panfrost_bo_mmap(struct panfrost_bo *bo)
         }
 }
 
+/* CPU-cached mappings are only implemented for kbase, the panfrost kernel
+ * driver always maps write-combined */
+
+bool
+panfrost_bo_cacheable_supported(const struct panfrost_device *dev)
+{
+        return dev->kbase && dev->mali.api >= 1;
+}
+
+/* Write back CPU writes to a PAN_BO_CACHEABLE BO so the GPU sees them. No-op
+ * for other BOs. */
+
+void
+panfrost_bo_mem_clean(struct panfrost_bo *bo, size_t offset, size_t length)
+{
+        struct panfrost_device *dev = bo->dev;
+
+        if (!(bo->flags & PAN_BO_CACHEABLE) || !bo->ptr.cpu || !length)
+                return;
+
+        assert(offset + length <= bo->size);
+
+        if (dev->mali.cache_clean)
+                dev->mali.cache_clean(bo->ptr.cpu + offset, length);
+        else
+                dev->mali.mem_sync(&dev->mali, bo->ptr.gpu,
+                                   bo->ptr.cpu + offset, length, false);
+}
+
+/* Drop stale CPU cache lines of a PAN_BO_CACHEABLE BO so that GPU writes are
+ * visible. Must be called after the GPU is done writing. No-op for other BOs. */
+
+void
+panfrost_bo_mem_invalidate(struct panfrost_bo *bo, size_t offset, size_t length)
+{
+        struct panfrost_device *dev = bo->dev;
+
+        if (!(bo->flags & PAN_BO_CACHEABLE) || !bo->ptr.cpu || !length)
+                return;
+
+        assert(offset + length <= bo->size);
+
+        if (dev->mali.cache_invalidate)
+                dev->mali.cache_invalidate(bo->ptr.cpu + offset, length);
+        else
+                dev->mali.mem_sync(&dev->mali, bo->ptr.gpu,
+                                   bo->ptr.cpu + offset, length, true);
+}
+
 static void
 panfrost_bo_munmap(struct panfrost_bo *bo)
 {
@@ -416,6 +657,13 @@ panfrost_bo_create(struct panfrost_device *dev, size_t size,
         if (flags & PAN_BO_GROWABLE)
                 assert(flags & PAN_BO_INVISIBLE);
 
+        /* Fall back to write-combined memory, which needs no cache
+         * maintenance, and keep the flags BO cache lookups match on
+         * accurate */
+        if (!panfrost_bo_cacheable_supported(dev) ||
+            (flags & (PAN_BO_INVISIBLE | PAN_BO_EVENT)))
+                flags &= ~PAN_BO_CACHEABLE;
+
         /* Before creating a BO, we first want to check the cache but without
          * waiting for BO readiness (BOs in the cache can still be referenced
          * by jobs that are not finished yet).
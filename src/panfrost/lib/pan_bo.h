@@ -53,6 +53,13 @@
 /* Use event memory, required for CSF events to be signaled to the kernel */
 #define PAN_BO_EVENT              (1 << 5)
 
+/* Map the BO CPU-cached instead of write-combined, for buffers the CPU reads
+ * back. Writes must be cleaned with panfrost_bo_mem_clean() before the GPU
+ * reads them, and GPU writes invalidated with panfrost_bo_mem_invalidate()
+ * before the CPU reads them. Dropped when the kernel interface can't map
+ * cached, see panfrost_bo_cacheable_supported(). */
+#define PAN_BO_CACHEABLE          (1 << 6)
+
 /* GPU access flags */
 
 /* BO is either shared (can be accessed by more than one GPU batch) or private
@@ -84,12 +91,10 @@ struct panfrost_ptr {
 };
 
 struct panfrost_bo {
-        /* Must be first for casting */
+        /* Must be first for casting. Links the BO into its BO cache
+         * bucket, in LRU order. */
         struct list_head bucket_link;
 
-        /* Used to link the BO to the BO cache LRU list. */
-        struct list_head lru_link;
-
         /* Store the time this BO was use last, so the BO cache logic can evict
          * stale BOs.
          */
@@ -135,7 +140,17 @@ struct panfrost_bo *
 panfrost_bo_import(struct panfrost_device *dev, int fd);
 int
 panfrost_bo_export(struct panfrost_bo *bo);
+bool
+panfrost_bo_cacheable_supported(const struct panfrost_device *dev);
+void
+panfrost_bo_mem_clean(struct panfrost_bo *bo, size_t offset, size_t length);
+void
+panfrost_bo_mem_invalidate(struct panfrost_bo *bo, size_t offset, size_t length);
 void
 panfrost_bo_cache_evict_all(struct panfrost_device *dev);
+void
+panfrost_bo_cache_init(struct panfrost_device *dev);
+void
+panfrost_bo_cache_fini(struct panfrost_device *dev);
 
 #endif /* __PAN_BO_H__ */
@@ -61,6 +61,11 @@ extern "C" {
 /* Fencepost problem, hence the off-by-one */
 #define NR_BO_CACHE_BUCKETS (MAX_BO_CACHE_BUCKET - MIN_BO_CACHE_BUCKET + 1)
 
+struct panfrost_bo_cache_bucket {
+        pthread_mutex_t lock;
+        struct list_head bos;
+};
+
 struct pan_blitter {
         struct {
                 struct pan_pool *pool;
@@ -192,6 +197,9 @@ struct panfrost_device {
         const struct panfrost_model *model;
         bool has_afbc;
 
+        /* Frequency of the system timestamp in Hz, or 0 if unknown */
+        uint64_t timestamp_frequency;
+
         /* Table of formats, indexed by a PIPE format */
         const struct panfrost_format *formats;
 
@@ -209,20 +217,28 @@ struct panfrost_device {
         struct util_sparse_array bo_map;
 
         struct {
-                pthread_mutex_t lock;
-
-                /* List containing all cached BOs sorted in LRU (Least
-                 * Recently Used) order. This allows us to quickly evict BOs
-                 * that are more than 1 second old.
-                 */
-                struct list_head lru;
-
                 /* The BO cache is a set of buckets with power-of-two sizes
                  * ranging from 2^12 (4096, the page size) to
                  * 2^(12 + MAX_BO_CACHE_BUCKETS).
-                 * Each bucket is a linked list of free panfrost_bo objects. */
-
-                struct list_head buckets[NR_BO_CACHE_BUCKETS];
+                 * Each bucket is a linked list of free panfrost_bo objects,
+                 * sorted in LRU (Least Recently Used) order, with its own
+                 * lock so that threads allocating different sizes do not
+                 * contend. */
+
+                struct panfrost_bo_cache_bucket buckets[NR_BO_CACHE_BUCKETS];
+
+                /* Total size of the cached BOs, which is trimmed down to
+                 * max_size (PAN_BO_CACHE_MB) */
+                uint64_t size;
+                uint64_t max_size;
+
+                /* Background thread evicting stale BOs and trimming the
+                 * cache */
+                pthread_t trim_thread;
+                pthread_mutex_t trim_lock;
+                pthread_cond_t trim_cond;
+                bool trim_thread_started;
+                bool trim_stop;
         } bo_cache;
 
         struct pan_blitter blitter;
@@ -279,6 +295,21 @@ panfrost_query_sample_position(
 unsigned
 panfrost_query_l2_slices(struct panfrost_device *dev);
 
+uint64_t
+panfrost_query_system_timestamp(void);
+
+/* Convert system timestamp ticks to nanoseconds, without overflowing for
+ * large tick counts */
+
+static inline uint64_t
+panfrost_timestamp_to_ns(const struct panfrost_device *dev, uint64_t ticks)
+{
+        uint64_t freq = dev->timestamp_frequency;
+
+        return (ticks / freq) * 1000000000ull +
+               (ticks % freq) * 1000000000ull / freq;
+}
+
 static inline struct panfrost_bo *
 pan_lookup_bo(struct panfrost_device *dev, uint32_t gem_handle)
 {
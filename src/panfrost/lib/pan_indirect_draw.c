@@ -31,6 +31,7 @@
 #include "pan_pool.h"
 #include "pan_util.h"
 #include "compiler/nir/nir_builder.h"
+#include "util/u_dynarray.h"
 #include "util/u_memory.h"
 #include "util/macros.h"
 
@@ -51,6 +52,8 @@
 struct draw_data {
         nir_ssa_def *draw_buf;
         nir_ssa_def *draw_buf_stride;
+        nir_ssa_def *draw_count_ptr;
+        nir_ssa_def *draw_index;
         nir_ssa_def *index_buf;
         nir_ssa_def *restart_index;
         nir_ssa_def *vertex_count;
@@ -171,7 +174,9 @@ struct indirect_draw_inputs {
         mali_ptr attrib_bufs;
         mali_ptr attribs;
         mali_ptr varying_bufs;
-        uint32_t draw_count;
+
+        /* Index of the draw, draws at or past *draw_count_ptr are skipped */
+        uint32_t draw_index;
         uint32_t draw_buf_stride;
         uint32_t restart_index;
         uint32_t attrib_count;
@@ -296,6 +301,8 @@ extract_inputs(struct indirect_draw_shader_builder *builder)
         builder->draw.draw_ctx = get_input_field(b, draw_ctx);
         builder->draw.draw_buf = get_input_field(b, draw_buf);
         builder->draw.draw_buf_stride = get_input_field(b, draw_buf_stride);
+        builder->draw.draw_count_ptr = get_input_field(b, draw_count_ptr);
+        builder->draw.draw_index = get_input_field(b, draw_index);
 
         if (builder->index_size) {
                 builder->draw.index_buf = get_input_field(b, index_buf);
@@ -841,6 +848,13 @@ get_instance_size(struct indirect_draw_shader_builder *builder)
         nir_ssa_def *min = get_min_max_ctx_field(builder, min);
         nir_ssa_def *max = get_min_max_ctx_field(builder, max);
 
+        /* Reset the min/max context so the job chain can be replayed. */
+        store_global(b,
+                     get_address_imm(b, builder->draw.min_max_ctx,
+                                     offsetof(struct min_max_context, min)),
+                     nir_vec2(b, nir_imm_int(b, UINT32_MAX), nir_imm_int(b, 0)),
+                     2);
+
         /* We handle unaligned indices here to avoid the extra complexity in
          * the min/max search job.
          */
@@ -926,6 +940,29 @@ get_instance_size(struct indirect_draw_shader_builder *builder)
         builder->instance_size.raw = nir_iadd_imm(b, nir_usub_sat(b, max, min), 1);
 }
 
+/* Draws of a multi-draw past the draw count stored in memory are skipped. The
+ * count pointer is NULL when the draw count is known at record time.
+ */
+static nir_ssa_def *
+is_draw_skipped(struct indirect_draw_shader_builder *builder)
+{
+        nir_builder *b = &builder->b;
+        nir_ssa_def *count_ptr = builder->draw.draw_count_ptr;
+        nir_variable *skip =
+                nir_local_variable_create(b->impl, glsl_bool_type(), "skip");
+
+        nir_store_var(b, skip, nir_imm_false(b), 1);
+
+        IF (nir_ine(b, count_ptr, nir_imm_int64(b, 0))) {
+                nir_ssa_def *count = load_global(b, count_ptr, 1, 32);
+
+                nir_store_var(b, skip,
+                              nir_uge(b, builder->draw.draw_index, count), 1);
+        } ENDIF
+
+        return nir_load_var(b, skip);
+}
+
 /* Patch a draw sequence */
 
 static void
@@ -954,8 +991,11 @@ patch(struct indirect_draw_shader_builder *builder)
 
         nir_ssa_def *num_vertices =
                 nir_imul(b, builder->draw.vertex_count, builder->draw.instance_count);
+        nir_ssa_def *skip =
+                nir_ior(b, is_draw_skipped(builder),
+                        nir_ieq(b, num_vertices, nir_imm_int(b, 0)));
 
-        IF (nir_ieq(b, num_vertices, nir_imm_int(b, 0))) {
+        IF (skip) {
                 /* If there's nothing to draw, turn the vertex/tiler jobs into
                  * null jobs.
                  */
@@ -1011,7 +1051,10 @@ get_index_min_max(struct indirect_draw_shader_builder *builder)
 
         nir_ssa_def *draw_ptr = builder->draw.draw_buf;
 
-        builder->draw.vertex_count = get_draw_field(b, draw_ptr, count);
+        /* Skipped draws search an empty range */
+        builder->draw.vertex_count =
+                nir_bcsel(b, is_draw_skipped(builder), nir_imm_int(b, 0),
+                          get_draw_field(b, draw_ptr, count));
         builder->draw.vertex_start = get_draw_field(b, draw_ptr, start);
 
         nir_ssa_def *thread_id = nir_channel(b, nir_load_global_invocation_id(b, 32), 0);
@@ -1257,6 +1300,9 @@ panfrost_emit_index_min_max_search(struct pan_pool *pool,
                         pan_pool_upload_aligned(pool, inputs, sizeof(*inputs), 16);
         }
 
+        if (draw_info->jobs)
+                util_dynarray_append(draw_info->jobs, void *, job.cpu);
+
         return panfrost_add_job(pool, scoreboard, MALI_JOB_TYPE_COMPUTE,
                                 false, false, 0, 0, &job, false);
 }
@@ -1306,6 +1352,8 @@ GENX(panfrost_emit_indirect_draw)(struct pan_pool *pool,
                 .attribs = draw_info->attribs,
                 .varying_bufs = draw_info->varying_bufs,
                 .attrib_count = draw_info->attrib_count,
+                .draw_count_ptr = draw_info->draw_count_buf,
+                .draw_index = draw_info->draw_index,
         };
 
         if (draw_info->index_size) {
@@ -1349,11 +1397,23 @@ GENX(panfrost_emit_indirect_draw)(struct pan_pool *pool,
                 memcpy(ctx->cpu, &draw_ctx, sizeof(draw_ctx));
         }
 
+        if (draw_info->jobs)
+                util_dynarray_append(draw_info->jobs, void *, job.cpu);
+
         return panfrost_add_job(pool, scoreboard, MALI_JOB_TYPE_COMPUTE,
                                 false, true, local_dep, global_dep,
                                 &job, false);
 }
 
+void
+GENX(panfrost_reset_indirect_draw_ctx)(const struct panfrost_device *dev,
+                                       const struct panfrost_ptr *ctx)
+{
+        struct indirect_draw_context *draw_ctx = ctx->cpu;
+
+        draw_ctx->varying_mem = dev->indirect_draw_shaders.varying_heap->ptr.gpu;
+}
+
 void
 GENX(panfrost_init_indirect_draw_shaders)(struct panfrost_device *dev,
                                           struct pan_pool *bin_pool)
@@ -29,6 +29,7 @@
 struct pan_device;
 struct pan_scoreboard;
 struct pan_pool;
+struct util_dynarray;
 
 struct pan_indirect_draw_info {
         mali_ptr draw_buf;
@@ -46,6 +47,19 @@ struct pan_indirect_draw_info {
         unsigned flags;
         unsigned index_size;
         unsigned last_indirect_draw;
+
+        /* For multi-draws with a draw count read from memory, pointer to the
+         * uint32_t draw count, and index of this draw in the multi-draw. The
+         * draw is skipped if its index is not below the draw count.
+         */
+        mali_ptr draw_count_buf;
+        unsigned draw_index;
+
+        /* If not NULL, CPU pointers to the emitted jobs are appended to this
+         * array so the caller can reset their headers before replaying the
+         * job chain.
+         */
+        struct util_dynarray *jobs;
 };
 
 unsigned
@@ -54,6 +68,10 @@ GENX(panfrost_emit_indirect_draw)(struct pan_pool *pool,
                                   const struct pan_indirect_draw_info *draw_info,
                                   struct panfrost_ptr *ctx);
 
+void
+GENX(panfrost_reset_indirect_draw_ctx)(const struct panfrost_device *dev,
+                                       const struct panfrost_ptr *ctx);
+
 void
 GENX(panfrost_init_indirect_draw_shaders)(struct panfrost_device *dev,
                                           struct pan_pool *bin_pool);
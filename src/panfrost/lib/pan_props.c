@@ -272,6 +272,46 @@ panfrost_query_afbc(struct panfrost_device *dev, unsigned arch)
         return (arch >= 5) && (reg == 0);
 }
 
+/* The system timestamp written by WRITE_VALUE jobs comes from the SoC system
+ * counter, which also backs the CPU architected timer. The kernel doesn't
+ * report its frequency, but CNTFRQ is readable from userspace. Returns 0 if
+ * the frequency is unknown. */
+
+static uint64_t
+panfrost_query_timestamp_frequency(void)
+{
+#if defined(__aarch64__)
+        uint64_t freq;
+        __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+        return freq;
+#elif defined(__arm__)
+        uint32_t freq;
+        __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (freq));
+        return freq;
+#else
+        return 0;
+#endif
+}
+
+/* Read the current value of the system counter from the CPU, in the same time
+ * base as the timestamps written by the GPU. Returns 0 if unsupported. */
+
+uint64_t
+panfrost_query_system_timestamp(void)
+{
+#if defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r" (ticks));
+        return ticks;
+#elif defined(__arm__)
+        uint32_t lo, hi;
+        __asm__ volatile("isb; mrrc p15, 1, %0, %1, c14" : "=r" (lo), "=r" (hi));
+        return ((uint64_t) hi << 32) | lo;
+#else
+        return 0;
+#endif
+}
+
 void
 panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
 {
@@ -303,6 +343,7 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
         dev->compressed_formats = panfrost_query_compressed_formats(dev);
         dev->tiler_features = panfrost_query_tiler_features(dev);
         dev->has_afbc = panfrost_query_afbc(dev, dev->arch);
+        dev->timestamp_frequency = panfrost_query_timestamp_frequency();
 
         if (dev->arch <= 6)
                 dev->formats = panfrost_pipe_format_v6;
@@ -313,11 +354,7 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
 
         util_sparse_array_init(&dev->bo_map, sizeof(struct panfrost_bo), 512);
 
-        pthread_mutex_init(&dev->bo_cache.lock, NULL);
-        list_inithead(&dev->bo_cache.lru);
-
-        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i)
-                list_inithead(&dev->bo_cache.buckets[i]);
+        panfrost_bo_cache_init(dev);
 
         /* Initialize pandecode before we start allocating */
         if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
@@ -342,8 +379,7 @@ panfrost_close_device(struct panfrost_device *dev)
 {
         pthread_mutex_destroy(&dev->submit_lock);
         panfrost_bo_unreference(dev->tiler_heap);
-        panfrost_bo_cache_evict_all(dev);
-        pthread_mutex_destroy(&dev->bo_cache.lock);
+        panfrost_bo_cache_fini(dev);
         if (dev->kbase)
                 free(dev->kernel_version);
         else
@@ -43,11 +43,12 @@
 #define PAN_DBG_GL3             0x0100
 #define PAN_DBG_NO_AFBC         0x0200
 #define PAN_DBG_MSAA16          0x0400
-#define PAN_DBG_INDIRECT        0x0800
+#define PAN_DBG_NO_INDIRECT     0x0800
 #define PAN_DBG_LINEAR          0x1000
 #define PAN_DBG_NO_CACHE        0x2000
 #define PAN_DBG_DUMP            0x4000
 #define PAN_DBG_TILER           0x8000
+#define PAN_DBG_DISK_CACHE      0x10000
 
 struct panfrost_device;
 
@@ -27,8 +27,10 @@
 
 #include "pan_tiling.h"
 #include <stdbool.h>
+#include <string.h>
 #include "util/macros.h"
 #include "util/bitscan.h"
+#include "util/u_cpu_detect.h"
 
 /*
  * This file implements software encode/decode of u-interleaved textures.
@@ -197,6 +199,453 @@ TILED_ACCESS_TYPE(uint32_t, 2);
 TILED_ACCESS_TYPE(uint64_t, 3);
 TILED_ACCESS_TYPE(pan_uint128_t, 4);
 
+/* Vectorized paths for aligned full tiles. A 16x16 tile is made of 16 4x4
+ * blocks of 16 consecutive pixels each, ordered along the same curve as the
+ * pixels within them: the block at (bx, by) starts at pixel
+ * (bit_duplication[by] ^ space_4[bx]) * 16. Within a block, the 2x2 quads are
+ * stored (0, 0), (1, 0), (1, 1), (0, 1), and the pixels within a quad follow
+ * the same order. So a block is rows 0/1 of the left quad, then the right
+ * quad, then rows 2/3 of the right quad, then the left quad, with the second
+ * row of each quad reversed:
+ *
+ *    a0 b0 c0 d0                 a0 b0 b1 a1 | c0 d0 d1 c1 |
+ *    a1 b1 c1 d1     becomes     c2 d2 d3 c3 | a2 b2 b3 a3
+ *    a2 b2 c2 d2
+ *    a3 b3 c3 d3
+ *
+ * which is a handful of shuffles per block for every power-of-two format. The
+ * kernels below store (linear to tiled) and load (tiled to linear) a single
+ * block, the linear side of which may be arbitrarily aligned.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PAN_TILING_SIMD 1
+
+typedef __m128i pan_vec;
+
+static inline __m128i
+pan_loadu(const uint8_t *p)
+{
+   return _mm_loadu_si128((const __m128i *) p);
+}
+
+static inline void
+pan_storeu(uint8_t *p, __m128i v)
+{
+   _mm_storeu_si128((__m128i *) p, v);
+}
+
+/* Swap the two 64-bit pixels of a vector */
+static inline __m128i
+pan_swap64(__m128i v)
+{
+   return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+static inline __m128i
+pan_load32(const uint8_t *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return _mm_cvtsi32_si128(v);
+}
+
+static inline void
+pan_store32(uint8_t *p, __m128i v)
+{
+   uint32_t x = _mm_cvtsi128_si32(v);
+   memcpy(p, &x, sizeof(x));
+}
+
+/* Swap the bytes of each 16-bit lane */
+static inline __m128i
+pan_swap8(__m128i v)
+{
+   return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline void
+pan_store_block_8(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   __m128i r0 = pan_load32(l + 0 * stride);
+   __m128i r1 = pan_load32(l + 1 * stride);
+   __m128i r2 = pan_load32(l + 2 * stride);
+   __m128i r3 = pan_load32(l + 3 * stride);
+
+   __m128i top = _mm_unpacklo_epi16(r0, pan_swap8(r1));
+   __m128i bot = _mm_unpacklo_epi16(r2, pan_swap8(r3));
+   bot = _mm_shufflelo_epi16(bot, _MM_SHUFFLE(1, 0, 3, 2));
+
+   pan_storeu(t, _mm_unpacklo_epi64(top, bot));
+}
+
+static inline void
+pan_load_block_8(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   __m128i v = pan_loadu(t);
+
+   __m128i top = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 1, 2, 0));
+   __m128i bot = _mm_shufflelo_epi16(_mm_unpackhi_epi64(v, v),
+                                     _MM_SHUFFLE(1, 3, 0, 2));
+
+   pan_store32(l + 0 * stride, top);
+   pan_store32(l + 1 * stride, _mm_srli_si128(pan_swap8(top), 4));
+   pan_store32(l + 2 * stride, bot);
+   pan_store32(l + 3 * stride, _mm_srli_si128(pan_swap8(bot), 4));
+}
+
+static inline void
+pan_store_block_16(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   __m128i r0 = _mm_loadl_epi64((const __m128i *) (l + 0 * stride));
+   __m128i r1 = _mm_loadl_epi64((const __m128i *) (l + 1 * stride));
+   __m128i r2 = _mm_loadl_epi64((const __m128i *) (l + 2 * stride));
+   __m128i r3 = _mm_loadl_epi64((const __m128i *) (l + 3 * stride));
+
+   r1 = _mm_shufflelo_epi16(r1, _MM_SHUFFLE(2, 3, 0, 1));
+   r3 = _mm_shufflelo_epi16(r3, _MM_SHUFFLE(2, 3, 0, 1));
+
+   __m128i top = _mm_unpacklo_epi32(r0, r1);
+   __m128i bot = _mm_unpacklo_epi32(r2, r3);
+
+   pan_storeu(t + 0, top);
+   pan_storeu(t + 16, _mm_shuffle_epi32(bot, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+static inline void
+pan_load_block_16(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   __m128i top = _mm_shuffle_epi32(pan_loadu(t + 0), _MM_SHUFFLE(3, 1, 2, 0));
+   __m128i bot = _mm_shuffle_epi32(pan_loadu(t + 16), _MM_SHUFFLE(1, 3, 0, 2));
+
+   top = _mm_shufflehi_epi16(top, _MM_SHUFFLE(2, 3, 0, 1));
+   bot = _mm_shufflehi_epi16(bot, _MM_SHUFFLE(2, 3, 0, 1));
+
+   _mm_storel_epi64((__m128i *) (l + 0 * stride), top);
+   _mm_storel_epi64((__m128i *) (l + 1 * stride), _mm_unpackhi_epi64(top, top));
+   _mm_storel_epi64((__m128i *) (l + 2 * stride), bot);
+   _mm_storel_epi64((__m128i *) (l + 3 * stride), _mm_unpackhi_epi64(bot, bot));
+}
+
+static inline void
+pan_store_block_32(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   __m128i r0 = pan_loadu(l + 0 * stride);
+   __m128i r1 = pan_loadu(l + 1 * stride);
+   __m128i r2 = pan_loadu(l + 2 * stride);
+   __m128i r3 = pan_loadu(l + 3 * stride);
+
+   r1 = _mm_shuffle_epi32(r1, _MM_SHUFFLE(2, 3, 0, 1));
+   r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(2, 3, 0, 1));
+
+   pan_storeu(t + 0, _mm_unpacklo_epi64(r0, r1));
+   pan_storeu(t + 16, _mm_unpackhi_epi64(r0, r1));
+   pan_storeu(t + 32, _mm_unpackhi_epi64(r2, r3));
+   pan_storeu(t + 48, _mm_unpacklo_epi64(r2, r3));
+}
+
+static inline void
+pan_load_block_32(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   __m128i q00 = pan_loadu(t + 0);
+   __m128i q10 = pan_loadu(t + 16);
+   __m128i q11 = pan_loadu(t + 32);
+   __m128i q01 = pan_loadu(t + 48);
+
+   __m128i r1 = _mm_unpackhi_epi64(q00, q10);
+   __m128i r3 = _mm_unpackhi_epi64(q01, q11);
+
+   pan_storeu(l + 0 * stride, _mm_unpacklo_epi64(q00, q10));
+   pan_storeu(l + 1 * stride, _mm_shuffle_epi32(r1, _MM_SHUFFLE(2, 3, 0, 1)));
+   pan_storeu(l + 2 * stride, _mm_unpacklo_epi64(q01, q11));
+   pan_storeu(l + 3 * stride, _mm_shuffle_epi32(r3, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PAN_TILING_SIMD 1
+
+typedef uint8x16_t pan_vec;
+
+static inline uint8x16_t
+pan_loadu(const uint8_t *p)
+{
+   return vld1q_u8(p);
+}
+
+static inline void
+pan_storeu(uint8_t *p, uint8x16_t v)
+{
+   vst1q_u8(p, v);
+}
+
+/* Swap the two 64-bit pixels of a vector */
+static inline uint8x16_t
+pan_swap64(uint8x16_t v)
+{
+   return vextq_u8(v, v, 8);
+}
+static inline uint32x2_t
+pan_load32(const uint8_t *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return vdup_n_u32(v);
+}
+
+static inline void
+pan_store32(uint8_t *p, uint32x2_t v)
+{
+   uint32_t x = vget_lane_u32(v, 0);
+   memcpy(p, &x, sizeof(x));
+}
+
+/* Swap the bytes of each 16-bit lane */
+static inline uint16x4_t
+pan_swap8(uint32x2_t v)
+{
+   return vreinterpret_u16_u8(vrev16_u8(vreinterpret_u8_u32(v)));
+}
+
+static inline void
+pan_store_block_8(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   uint32x2_t r0 = pan_load32(l + 0 * stride);
+   uint32x2_t r1 = pan_load32(l + 1 * stride);
+   uint32x2_t r2 = pan_load32(l + 2 * stride);
+   uint32x2_t r3 = pan_load32(l + 3 * stride);
+
+   uint16x4_t top = vzip_u16(vreinterpret_u16_u32(r0), pan_swap8(r1)).val[0];
+   uint16x4_t bot = vzip_u16(vreinterpret_u16_u32(r2), pan_swap8(r3)).val[0];
+
+   uint32x2_t bot_swapped = vrev64_u32(vreinterpret_u32_u16(bot));
+
+   vst1q_u32((uint32_t *) t, vcombine_u32(vreinterpret_u32_u16(top), bot_swapped));
+}
+
+static inline void
+pan_load_block_8(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   uint32x4_t v = vld1q_u32((const uint32_t *) t);
+
+   uint16x4_t top = vreinterpret_u16_u32(vget_low_u32(v));
+   uint16x4_t bot = vreinterpret_u16_u32(vrev64_u32(vget_high_u32(v)));
+
+   uint16x4x2_t top_uzp = vuzp_u16(top, top);
+   uint16x4x2_t bot_uzp = vuzp_u16(bot, bot);
+
+   pan_store32(l + 0 * stride, vreinterpret_u32_u16(top_uzp.val[0]));
+   pan_store32(l + 1 * stride, vreinterpret_u32_u16(pan_swap8(vreinterpret_u32_u16(top_uzp.val[1]))));
+   pan_store32(l + 2 * stride, vreinterpret_u32_u16(bot_uzp.val[0]));
+   pan_store32(l + 3 * stride, vreinterpret_u32_u16(pan_swap8(vreinterpret_u32_u16(bot_uzp.val[1]))));
+}
+
+static inline void
+pan_store_block_16(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   uint16x4_t r0 = vld1_u16((const uint16_t *) (l + 0 * stride));
+   uint16x4_t r1 = vrev32_u16(vld1_u16((const uint16_t *) (l + 1 * stride)));
+   uint16x4_t r2 = vld1_u16((const uint16_t *) (l + 2 * stride));
+   uint16x4_t r3 = vrev32_u16(vld1_u16((const uint16_t *) (l + 3 * stride)));
+
+   uint32x2x2_t top = vzip_u32(vreinterpret_u32_u16(r0), vreinterpret_u32_u16(r1));
+   uint32x2x2_t bot = vzip_u32(vreinterpret_u32_u16(r2), vreinterpret_u32_u16(r3));
+
+   vst1q_u32((uint32_t *) (t + 0), vcombine_u32(top.val[0], top.val[1]));
+   vst1q_u32((uint32_t *) (t + 16), vcombine_u32(bot.val[1], bot.val[0]));
+}
+
+static inline void
+pan_load_block_16(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   uint32x4_t top = vld1q_u32((const uint32_t *) (t + 0));
+   uint32x4_t bot = vld1q_u32((const uint32_t *) (t + 16));
+
+   uint32x2x2_t top_uzp = vuzp_u32(vget_low_u32(top), vget_high_u32(top));
+   uint32x2x2_t bot_uzp = vuzp_u32(vget_high_u32(bot), vget_low_u32(bot));
+
+   vst1_u16((uint16_t *) (l + 0 * stride), vreinterpret_u16_u32(top_uzp.val[0]));
+   vst1_u16((uint16_t *) (l + 1 * stride), vrev32_u16(vreinterpret_u16_u32(top_uzp.val[1])));
+   vst1_u16((uint16_t *) (l + 2 * stride), vreinterpret_u16_u32(bot_uzp.val[0]));
+   vst1_u16((uint16_t *) (l + 3 * stride), vrev32_u16(vreinterpret_u16_u32(bot_uzp.val[1])));
+}
+
+static inline void
+pan_store_block_32(uint8_t *t, const uint8_t *l, uint32_t stride)
+{
+   uint32x4_t r0 = vld1q_u32((const uint32_t *) (l + 0 * stride));
+   uint32x4_t r1 = vrev64q_u32(vld1q_u32((const uint32_t *) (l + 1 * stride)));
+   uint32x4_t r2 = vld1q_u32((const uint32_t *) (l + 2 * stride));
+   uint32x4_t r3 = vrev64q_u32(vld1q_u32((const uint32_t *) (l + 3 * stride)));
+
+   vst1q_u32((uint32_t *) (t + 0), vcombine_u32(vget_low_u32(r0), vget_low_u32(r1)));
+   vst1q_u32((uint32_t *) (t + 16), vcombine_u32(vget_high_u32(r0), vget_high_u32(r1)));
+   vst1q_u32((uint32_t *) (t + 32), vcombine_u32(vget_high_u32(r2), vget_high_u32(r3)));
+   vst1q_u32((uint32_t *) (t + 48), vcombine_u32(vget_low_u32(r2), vget_low_u32(r3)));
+}
+
+static inline void
+pan_load_block_32(const uint8_t *t, uint8_t *l, uint32_t stride)
+{
+   uint32x4_t q00 = vld1q_u32((const uint32_t *) (t + 0));
+   uint32x4_t q10 = vld1q_u32((const uint32_t *) (t + 16));
+   uint32x4_t q11 = vld1q_u32((const uint32_t *) (t + 32));
+   uint32x4_t q01 = vld1q_u32((const uint32_t *) (t + 48));
+
+   uint32x4_t r1 = vcombine_u32(vget_high_u32(q00), vget_high_u32(q10));
+   uint32x4_t r3 = vcombine_u32(vget_high_u32(q01), vget_high_u32(q11));
+
+   vst1q_u32((uint32_t *) (l + 0 * stride), vcombine_u32(vget_low_u32(q00), vget_low_u32(q10)));
+   vst1q_u32((uint32_t *) (l + 1 * stride), vrev64q_u32(r1));
+   vst1q_u32((uint32_t *) (l + 2 * stride), vcombine_u32(vget_low_u32(q01), vget_low_u32(q11)));
+   vst1q_u32((uint32_t *) (l + 3 * stride), vrev64q_u32(r3));
+}
+
+#endif
+
+#ifdef PAN_TILING_SIMD
+
+/* 64bpp rows span two vectors, so only the second row of each quad needs
+ * shuffling, and 128bpp is a pure permutation of vectors. Both directions of
+ * the 64bpp case use the same involution.
+ */
+static inline void
+pan_access_block_64(uint8_t *t, uint8_t *l, uint32_t stride, bool is_store)
+{
+   static const struct { uint8_t row, col; } quads[8] = {
+      { 0, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 },
+      { 2, 1 }, { 3, 1 }, { 2, 0 }, { 3, 0 },
+   };
+
+   for (unsigned i = 0; i < 8; ++i) {
+      uint8_t *lin = l + quads[i].row * stride + quads[i].col * 16;
+
+      if (is_store) {
+         pan_vec v = pan_loadu(lin);
+         pan_storeu(t + i * 16, (quads[i].row & 1) ? pan_swap64(v) : v);
+      } else {
+         pan_vec v = pan_loadu(t + i * 16);
+         pan_storeu(lin, (quads[i].row & 1) ? pan_swap64(v) : v);
+      }
+   }
+}
+
+static inline void
+pan_access_block_128(uint8_t *t, uint8_t *l, uint32_t stride, bool is_store)
+{
+   static const struct { uint8_t x, y; } pixels[16] = {
+      { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 },
+      { 2, 0 }, { 3, 0 }, { 3, 1 }, { 2, 1 },
+      { 2, 2 }, { 3, 2 }, { 3, 3 }, { 2, 3 },
+      { 0, 2 }, { 1, 2 }, { 1, 3 }, { 0, 3 },
+   };
+
+   for (unsigned i = 0; i < 16; ++i) {
+      uint8_t *lin = l + pixels[i].y * stride + pixels[i].x * 16;
+
+      if (is_store)
+         pan_storeu(t + i * 16, pan_loadu(lin));
+      else
+         pan_storeu(lin, pan_loadu(t + i * 16));
+   }
+}
+
+static inline void
+pan_access_block_8(uint8_t *t, uint8_t *l, uint32_t stride, bool is_store)
+{
+   if (is_store)
+      pan_store_block_8(t, l, stride);
+   else
+      pan_load_block_8(t, l, stride);
+}
+
+static inline void
+pan_access_block_16(uint8_t *t, uint8_t *l, uint32_t stride, bool is_store)
+{
+   if (is_store)
+      pan_store_block_16(t, l, stride);
+   else
+      pan_load_block_16(t, l, stride);
+}
+
+static inline void
+pan_access_block_32(uint8_t *t, uint8_t *l, uint32_t stride, bool is_store)
+{
+   if (is_store)
+      pan_store_block_32(t, l, stride);
+   else
+      pan_load_block_32(t, l, stride);
+}
+
+/* Same contract as the scalar TILED_ACCESS_TYPE routines: dst is the tiled
+ * image and src the linear one regardless of direction, and the region is
+ * tile aligned. We walk the tiled image in memory order, one 4x4 block at a
+ * time.
+ */
+#define TILED_ACCESS_SIMD(bpp) \
+static void \
+panfrost_access_tiled_image_simd_##bpp \
+                              (void *dst, void *src, \
+                               unsigned sx, unsigned sy, \
+                               unsigned w, unsigned h, \
+                               uint32_t dst_stride, \
+                               uint32_t src_stride, \
+                               bool is_store) \
+{ \
+   const unsigned bytes = bpp / 8; \
+   for (unsigned ty = 0; ty < h; ty += TILE_HEIGHT) { \
+      uint8_t *tile = (uint8_t *) dst + ((sy + ty) >> 4) * dst_stride + \
+                      (sx >> 4) * PIXELS_PER_TILE * bytes; \
+      uint8_t *lin_row = (uint8_t *) src + ty * src_stride; \
+      for (unsigned tx = 0; tx < w; tx += TILE_WIDTH) { \
+         for (unsigned by = 0; by < 4; ++by) { \
+            for (unsigned bx = 0; bx < 4; ++bx) { \
+               unsigned block = bit_duplication[by] ^ space_4[bx]; \
+               uint8_t *t = tile + block * 16 * bytes; \
+               uint8_t *l = lin_row + (by * 4) * src_stride + \
+                            (tx + bx * 4) * bytes; \
+               pan_access_block_##bpp(t, l, src_stride, is_store); \
+            } \
+         } \
+         tile += PIXELS_PER_TILE * bytes; \
+      } \
+   } \
+}
+
+TILED_ACCESS_SIMD(8);
+TILED_ACCESS_SIMD(16);
+TILED_ACCESS_SIMD(32);
+TILED_ACCESS_SIMD(64);
+TILED_ACCESS_SIMD(128);
+
+#endif
+
+/* The vectorized paths are picked at runtime so a build for a baseline that
+ * happens to have the intrinsics still runs on CPUs without them. Tests may
+ * force the scalar paths to cross-check the two.
+ */
+static bool panfrost_tiling_simd_disabled = false;
+
+static bool
+panfrost_tiling_has_simd(void)
+{
+#if defined(PAN_TILING_SIMD) && defined(__SSE2__)
+   return util_get_cpu_caps()->has_sse2;
+#elif defined(PAN_TILING_SIMD) && defined(__ARM_NEON)
+   return util_get_cpu_caps()->has_neon;
+#else
+   return false;
+#endif
+}
+
+bool
+panfrost_tiling_set_simd(bool enable)
+{
+   panfrost_tiling_simd_disabled = !enable;
+   return panfrost_tiling_has_simd();
+}
+
 #define TILED_UNALIGNED_TYPE(pixel_t, is_store, tile_shift) { \
    const unsigned mask = (1 << tile_shift) - 1; \
    for (int y = sy, src_y = 0; src_y < h; ++y, ++src_y) { \
@@ -362,6 +811,23 @@ panfrost_access_tiled_image(void *dst, void *src,
       w -= dist;
    }
 
+#ifdef PAN_TILING_SIMD
+   if (!panfrost_tiling_simd_disabled && panfrost_tiling_has_simd()) {
+      if (bpp == 8)
+         panfrost_access_tiled_image_simd_8(dst, OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
+      else if (bpp == 16)
+         panfrost_access_tiled_image_simd_16(dst, OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
+      else if (bpp == 32)
+         panfrost_access_tiled_image_simd_32(dst, OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
+      else if (bpp == 64)
+         panfrost_access_tiled_image_simd_64(dst, OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
+      else if (bpp == 128)
+         panfrost_access_tiled_image_simd_128(dst, OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
+
+      return;
+   }
+#endif
+
    if (bpp == 8)
       panfrost_access_tiled_image_uint8_t(dst,  OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
    else if (bpp == 16)
@@ -27,6 +27,7 @@
 #ifndef H_PANFROST_TILING
 #define H_PANFROST_TILING
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <util/format/u_format.h>
 
@@ -74,6 +75,16 @@ void panfrost_store_tiled_image(void *dst, const void *src,
                                 uint32_t src_stride,
                                 enum pipe_format format);
 
+/**
+ * Allow or forbid the vectorized (SSE2/NEON) paths for aligned full tiles,
+ * which are otherwise used whenever the CPU supports them. Meant for tests
+ * comparing them with the scalar paths and for benchmarking.
+ *
+ * @enable Whether the vectorized paths may be used
+ * @return Whether a vectorized path exists for this build and CPU
+ */
+bool panfrost_tiling_set_simd(bool enable);
+
 
 #ifdef __cplusplus
 } /* extern C */
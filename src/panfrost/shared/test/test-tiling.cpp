@@ -23,6 +23,7 @@
 
 #include "pan_tiling.h"
 
+#include <chrono>
 #include <gtest/gtest.h>
 
 /*
@@ -277,3 +278,159 @@ TEST(UInterleavedTiling, PartialASTC)
    test_ldst(50, 40, 5, 4, 10,  8, 512, PIPE_FORMAT_ASTC_5x4);
    test_ldst(50, 50, 5, 5, 10, 10, 512, PIPE_FORMAT_ASTC_5x5);
 }
+
+/*
+ * Compare the vectorized full-tile paths with the scalar ones on random data.
+ * Unaligned regions are included, since the edges are still handled by the
+ * scalar code and must line up with the vectorized interior.
+ */
+static void
+test_simd(unsigned width, unsigned height, unsigned rx, unsigned ry,
+          unsigned rw, unsigned rh, unsigned linear_stride,
+          enum pipe_format format, bool store)
+{
+   unsigned bpp = util_format_get_blocksize(format);
+
+   unsigned tiled_width  = ALIGN_POT(width, 16);
+   unsigned tiled_height = ALIGN_POT(height, 16);
+   unsigned tiled_stride = tiled_width * 16 * bpp;
+
+   size_t tiled_size = bpp * tiled_width * tiled_height;
+   size_t linear_size = linear_stride * rh;
+
+   uint8_t *tiled[2], *linear[2];
+
+   for (unsigned i = 0; i < 2; ++i) {
+      tiled[i] = (uint8_t *) malloc(tiled_size);
+      linear[i] = (uint8_t *) malloc(linear_size);
+   }
+
+   srand(bpp * 1000 + rx * 10 + ry);
+
+   for (size_t i = 0; i < tiled_size; ++i)
+      tiled[0][i] = tiled[1][i] = rand();
+
+   for (size_t i = 0; i < linear_size; ++i)
+      linear[0][i] = linear[1][i] = rand();
+
+   for (unsigned i = 0; i < 2; ++i) {
+      panfrost_tiling_set_simd(i == 1);
+
+      if (store) {
+         panfrost_store_tiled_image(tiled[i], linear[i], rx, ry, rw, rh,
+                                    tiled_stride, linear_stride, format);
+      } else {
+         panfrost_load_tiled_image(linear[i], tiled[i], rx, ry, rw, rh,
+                                   linear_stride, tiled_stride, format);
+      }
+   }
+
+   panfrost_tiling_set_simd(true);
+
+   EXPECT_EQ(memcmp(tiled[0], tiled[1], tiled_size), 0);
+   EXPECT_EQ(memcmp(linear[0], linear[1], linear_size), 0);
+
+   for (unsigned i = 0; i < 2; ++i) {
+      free(tiled[i]);
+      free(linear[i]);
+   }
+}
+
+static const enum pipe_format simd_formats[] = {
+   PIPE_FORMAT_R8_UINT,
+   PIPE_FORMAT_R8G8_UINT,
+   PIPE_FORMAT_R32_UINT,
+   PIPE_FORMAT_R32G32_UINT,
+   PIPE_FORMAT_R32G32B32A32_UINT,
+};
+
+TEST(UInterleavedTiling, SIMDFullTiles)
+{
+   if (!panfrost_tiling_set_simd(true))
+      GTEST_SKIP() << "No vectorized tiling path for this CPU";
+
+   for (unsigned i = 0; i < ARRAY_SIZE(simd_formats); ++i) {
+      unsigned bpp = util_format_get_blocksize(simd_formats[i]);
+
+      test_simd(64, 48, 0, 0, 64, 48, 64 * bpp, simd_formats[i], true);
+      test_simd(64, 48, 0, 0, 64, 48, 64 * bpp, simd_formats[i], false);
+   }
+}
+
+TEST(UInterleavedTiling, SIMDPartialAccess)
+{
+   if (!panfrost_tiling_set_simd(true))
+      GTEST_SKIP() << "No vectorized tiling path for this CPU";
+
+   for (unsigned i = 0; i < ARRAY_SIZE(simd_formats); ++i) {
+      unsigned bpp = util_format_get_blocksize(simd_formats[i]);
+
+      /* Odd strides leave the linear rows unaligned */
+      test_simd(70, 50, 3, 5, 60, 40, 61 * bpp, simd_formats[i], true);
+      test_simd(70, 50, 3, 5, 60, 40, 61 * bpp, simd_formats[i], false);
+      test_simd(33, 33, 16, 16, 16, 16, 369 * bpp, simd_formats[i], true);
+      test_simd(33, 33, 16, 16, 16, 16, 369 * bpp, simd_formats[i], false);
+   }
+}
+
+/*
+ * Not a correctness test: report the throughput of full-tile loads and stores
+ * with and without the vectorized paths, to catch regressions by eye. Not run
+ * by default, use --gtest_also_run_disabled_tests to get the timings.
+ */
+static double
+benchmark(enum pipe_format format, bool store, bool simd)
+{
+   const unsigned size = 512, iterations = 8;
+   unsigned bpp = util_format_get_blocksize(format);
+   unsigned linear_stride = size * bpp;
+   unsigned tiled_stride = size * 16 * bpp;
+
+   void *tiled = calloc(bpp, size * size);
+   void *linear = calloc(bpp, size * size);
+
+   panfrost_tiling_set_simd(simd);
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (unsigned i = 0; i < iterations; ++i) {
+      if (store) {
+         panfrost_store_tiled_image(tiled, linear, 0, 0, size, size,
+                                    tiled_stride, linear_stride, format);
+      } else {
+         panfrost_load_tiled_image(linear, tiled, 0, 0, size, size,
+                                   linear_stride, tiled_stride, format);
+      }
+   }
+
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+   panfrost_tiling_set_simd(true);
+   free(tiled);
+   free(linear);
+
+   return ((double) bpp * size * size * iterations) / elapsed.count() / 1e9;
+}
+
+TEST(UInterleavedTiling, DISABLED_Benchmark)
+{
+   bool has_simd = panfrost_tiling_set_simd(true);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(simd_formats); ++i) {
+      enum pipe_format format = simd_formats[i];
+      unsigned bits = util_format_get_blocksizebits(format);
+
+      for (unsigned store = 0; store < 2; ++store) {
+         double scalar = benchmark(format, store, false);
+
+         if (has_simd) {
+            double simd = benchmark(format, store, true);
+            printf("%3u bpp %s: scalar %6.2f GB/s, simd %6.2f GB/s\n",
+                   bits, store ? "store" : "load ", scalar, simd);
+         } else {
+            printf("%3u bpp %s: scalar %6.2f GB/s\n",
+                   bits, store ? "store" : "load ", scalar);
+         }
+      }
+   }
+}
@@ -218,6 +218,14 @@ panvk_CreateDescriptorPool(VkDevice _device,
 
    pool->max.sets = pCreateInfo->maxSets;
 
+   util_dynarray_init(&pool->chunks, NULL);
+   list_inithead(&pool->sets);
+   list_inithead(&pool->free_sets);
+   panvk_bo_pool_init(&pool->desc_bo_pool);
+   panvk_pool_init(&pool->desc_ubo_pool, &device->physical_device->pdev,
+                   &pool->desc_bo_pool, 0, 64 * 1024, "Descriptor set",
+                   false);
+
    for (unsigned i = 0; i < pCreateInfo->poolSizeCount; ++i) {
       unsigned desc_count = pCreateInfo->pPoolSizes[i].descriptorCount;
 
@@ -264,6 +272,124 @@ panvk_CreateDescriptorPool(VkDevice _device,
    return VK_SUCCESS;
 }
 
+#define PANVK_DESC_POOL_CHUNK_SIZE (16 * 1024)
+
+static void *
+panvk_descriptor_pool_alloc_host(struct panvk_device *device,
+                                 struct panvk_descriptor_pool *pool,
+                                 size_t size)
+{
+   struct panvk_desc_pool_chunk *chunk = NULL;
+
+   size = ALIGN_POT(size, 8);
+
+   if (pool->chunks.size) {
+      chunk = util_dynarray_top_ptr(&pool->chunks,
+                                    struct panvk_desc_pool_chunk);
+   }
+
+   if (!chunk || pool->chunk_offset + size > chunk->size) {
+      size_t chunk_size = MAX2(size, PANVK_DESC_POOL_CHUNK_SIZE);
+      void *mem = vk_alloc(&device->vk.alloc, chunk_size, 8,
+                           VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+      if (!mem)
+         return NULL;
+
+      chunk = util_dynarray_grow(&pool->chunks,
+                                 struct panvk_desc_pool_chunk, 1);
+      chunk->mem = mem;
+      chunk->size = chunk_size;
+      pool->chunk_offset = 0;
+   }
+
+   void *ptr = (uint8_t *)chunk->mem + pool->chunk_offset;
+   pool->chunk_offset += size;
+   return ptr;
+}
+
+/* Returns zeroed host memory for a set and its descriptor arrays, along
+ * with its descriptor UBO. Memory of freed sets is reused when it fits,
+ * otherwise both come from the pool arenas. */
+struct panvk_descriptor_set *
+panvk_descriptor_pool_alloc_set(struct panvk_device *device,
+                                struct panvk_descriptor_pool *pool,
+                                size_t host_size, size_t desc_ubo_size)
+{
+   struct panvk_descriptor_set *set = NULL;
+
+   list_for_each_entry(struct panvk_descriptor_set, free_set,
+                       &pool->free_sets, link) {
+      if (free_set->host_size >= host_size &&
+          free_set->desc_ubo_capacity >= desc_ubo_size) {
+         set = free_set;
+         break;
+      }
+   }
+
+   if (set) {
+      list_del(&set->link);
+
+      size_t size = set->host_size;
+      size_t capacity = set->desc_ubo_capacity;
+      struct panfrost_ptr desc_ubo = set->desc_ubo;
+
+      memset(set, 0, size);
+      set->host_size = size;
+      set->desc_ubo_capacity = capacity;
+      set->desc_ubo = desc_ubo;
+   } else {
+      set = panvk_descriptor_pool_alloc_host(device, pool, host_size);
+      if (!set)
+         return NULL;
+
+      memset(set, 0, host_size);
+      set->host_size = host_size;
+
+      if (desc_ubo_size) {
+         set->desc_ubo = pan_pool_alloc_aligned(&pool->desc_ubo_pool.base,
+                                                desc_ubo_size, 16);
+         set->desc_ubo_capacity = desc_ubo_size;
+      }
+   }
+
+   if (desc_ubo_size)
+      memset(set->desc_ubo.cpu, 0, desc_ubo_size);
+
+   vk_object_base_init(&device->vk, &set->base, VK_OBJECT_TYPE_DESCRIPTOR_SET);
+   set->pool = pool;
+   list_addtail(&set->link, &pool->sets);
+   return set;
+}
+
+static void
+panvk_descriptor_pool_reset(struct panvk_device *device,
+                            struct panvk_descriptor_pool *pool)
+{
+   /* Object bases may hold debug names or private data */
+   list_for_each_entry(struct panvk_descriptor_set, set, &pool->sets, link)
+      vk_object_base_finish(&set->base);
+
+   list_inithead(&pool->sets);
+   list_inithead(&pool->free_sets);
+
+   /* Keep the first chunk around for the next sets */
+   unsigned nr_chunks =
+      util_dynarray_num_elements(&pool->chunks, struct panvk_desc_pool_chunk);
+
+   for (unsigned i = 1; i < nr_chunks; i++) {
+      vk_free(&device->vk.alloc,
+              util_dynarray_element(&pool->chunks,
+                                    struct panvk_desc_pool_chunk, i)->mem);
+   }
+
+   if (nr_chunks > 1)
+      pool->chunks.size = sizeof(struct panvk_desc_pool_chunk);
+
+   pool->chunk_offset = 0;
+   panvk_pool_reset(&pool->desc_ubo_pool);
+   memset(&pool->cur, 0, sizeof(pool->cur));
+}
+
 void
 panvk_DestroyDescriptorPool(VkDevice _device,
                             VkDescriptorPool _pool,
@@ -272,8 +398,21 @@ panvk_DestroyDescriptorPool(VkDevice _device,
    VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_descriptor_pool, pool, _pool);
 
-   if (pool)
-      vk_object_free(&device->vk, pAllocator, pool);
+   if (!pool)
+      return;
+
+   panvk_descriptor_pool_reset(device, pool);
+
+   if (pool->chunks.size) {
+      vk_free(&device->vk.alloc,
+              util_dynarray_element(&pool->chunks,
+                                    struct panvk_desc_pool_chunk, 0)->mem);
+   }
+
+   util_dynarray_fini(&pool->chunks);
+   panvk_pool_cleanup(&pool->desc_ubo_pool);
+   panvk_bo_pool_cleanup(&pool->desc_bo_pool);
+   vk_object_free(&device->vk, pAllocator, pool);
 }
 
 VkResult
@@ -281,8 +420,9 @@ panvk_ResetDescriptorPool(VkDevice _device,
                           VkDescriptorPool _pool,
                           VkDescriptorPoolResetFlags flags)
 {
+   VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_descriptor_pool, pool, _pool);
-   memset(&pool->cur, 0, sizeof(pool->cur));
+   panvk_descriptor_pool_reset(device, pool);
    return VK_SUCCESS;
 }
 
@@ -291,16 +431,9 @@ panvk_descriptor_set_destroy(struct panvk_device *device,
                              struct panvk_descriptor_pool *pool,
                              struct panvk_descriptor_set *set)
 {
-   vk_free(&device->vk.alloc, set->textures);
-   vk_free(&device->vk.alloc, set->samplers);
-   vk_free(&device->vk.alloc, set->ubos);
-   vk_free(&device->vk.alloc, set->dyn_ubos);
-   vk_free(&device->vk.alloc, set->dyn_ssbos);
-   vk_free(&device->vk.alloc, set->img_fmts);
-   vk_free(&device->vk.alloc, set->img_attrib_bufs);
-   if (set->desc_bo)
-      panfrost_bo_unreference(set->desc_bo);
-   vk_object_free(&device->vk, NULL, set);
+   vk_object_base_finish(&set->base);
+   list_del(&set->link);
+   list_add(&set->link, &pool->free_sets);
 }
 
 VkResult
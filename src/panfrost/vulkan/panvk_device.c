@@ -220,6 +220,8 @@ panvk_physical_device_finish(struct panvk_physical_device *device)
 {
    panvk_wsi_finish(device);
 
+   disk_cache_destroy(device->vk.disk_cache);
+
    panvk_arch_dispatch(device->pdev.arch, meta_cleanup, device);
    panfrost_close_device(&device->pdev);
    if (device->master_fd != -1)
@@ -345,6 +347,11 @@ panvk_physical_device_init(struct panvk_physical_device *device,
       goto fail_close_device;
    }
 
+   char buf[VK_UUID_SIZE * 2 + 1];
+   disk_cache_format_hex_id(buf, device->cache_uuid, VK_UUID_SIZE * 2);
+   device->vk.disk_cache = disk_cache_create(device->name, buf, 0);
+   device->vk.pipeline_cache_import_ops = panvk_cache_import_ops;
+
    vk_warn_non_conformant_implementation("panvk");
 
    panvk_get_driver_uuid(&device->device_uuid);
@@ -370,6 +377,7 @@ panvk_physical_device_init(struct panvk_physical_device *device,
    return VK_SUCCESS;
 
 fail_close_device:
+   disk_cache_destroy(device->vk.disk_cache);
    panfrost_close_device(&device->pdev);
 fail:
    if (fd != -1)
@@ -489,6 +497,11 @@ panvk_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
       .shaderSampledImageArrayDynamicIndexing = true,
       .shaderStorageBufferArrayDynamicIndexing = true,
       .shaderStorageImageArrayDynamicIndexing = true,
+      .occlusionQueryPrecise = true,
+      /* Only some statistics are counted at record time, the others
+       * would read 0
+       */
+      .pipelineStatisticsQuery = false,
    };
 
    const VkPhysicalDeviceVulkan11Features core_1_1 = {
@@ -547,7 +560,7 @@ panvk_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
       .uniformBufferStandardLayout        = false,
       .shaderSubgroupExtendedTypes        = false,
       .separateDepthStencilLayouts        = false,
-      .hostQueryReset                     = false,
+      .hostQueryReset                     = true,
       .timelineSemaphore                  = false,
       .bufferDeviceAddress                = false,
       .bufferDeviceAddressCaptureReplay   = false,
@@ -753,7 +766,10 @@ panvk_GetPhysicalDeviceProperties2(VkPhysicalDevice physicalDevice,
       .sampledImageStencilSampleCounts = sample_counts,
       .storageImageSampleCounts = VK_SAMPLE_COUNT_1_BIT,
       .maxSampleMaskWords = 1,
-      .timestampComputeAndGraphics = true,
+      /* The system timestamp written by the GPU only ticks while the cycle
+       * counter runs, and the DRM driver has no way to start it.
+       */
+      .timestampComputeAndGraphics = false,
       .timestampPeriod = 1,
       .maxClipDistances = 8,
       .maxCullDistances = 8,
@@ -838,7 +854,7 @@ panvk_GetPhysicalDeviceProperties2(VkPhysicalDevice physicalDevice,
 static const VkQueueFamilyProperties panvk_queue_family_properties = {
    .queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT,
    .queueCount = 1,
-   .timestampValidBits = 64,
+   .timestampValidBits = 0,
    .minImageTransferGranularity = { 1, 1, 1 },
 };
 
@@ -877,19 +893,39 @@ panvk_get_system_heap_size()
    return available_ram;
 }
 
+/* Memory type 0 is write-combined and coherent. When the kernel can map BOs
+ * CPU-cached, type 1 is cached but not coherent, for buffers the application
+ * reads back, relying on vkFlushMappedMemoryRanges() and
+ * vkInvalidateMappedMemoryRanges() for cache maintenance.
+ */
+#define PANVK_MEMORY_TYPE_CACHED 1
+
+static uint32_t
+panvk_memory_type_count(const struct panvk_physical_device *physical_device)
+{
+   return panfrost_bo_cacheable_supported(&physical_device->pdev) ? 2 : 1;
+}
+
 void
 panvk_GetPhysicalDeviceMemoryProperties2(VkPhysicalDevice physicalDevice,
                                          VkPhysicalDeviceMemoryProperties2 *pMemoryProperties)
 {
+   VK_FROM_HANDLE(panvk_physical_device, physical_device, physicalDevice);
+
    pMemoryProperties->memoryProperties = (VkPhysicalDeviceMemoryProperties) {
       .memoryHeapCount = 1,
       .memoryHeaps[0].size = panvk_get_system_heap_size(),
       .memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT,
-      .memoryTypeCount = 1,
+      .memoryTypeCount = panvk_memory_type_count(physical_device),
       .memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
       .memoryTypes[0].heapIndex = 0,
+      .memoryTypes[PANVK_MEMORY_TYPE_CACHED].propertyFlags =
+         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+         VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+      .memoryTypes[PANVK_MEMORY_TYPE_CACHED].heapIndex = 0,
    };
 }
 
@@ -1008,6 +1044,14 @@ panvk_CreateDevice(VkPhysicalDevice physicalDevice,
    const struct panfrost_device *pdev = &physical_device->pdev;
    vk_device_set_drm_fd(&device->vk, pdev->fd);
 
+   struct vk_pipeline_cache_create_info pcc_info = { };
+   device->mem_cache = vk_pipeline_cache_create(&device->vk, &pcc_info,
+                                                &device->vk.alloc);
+   if (!device->mem_cache) {
+      result = VK_ERROR_OUT_OF_HOST_MEMORY;
+      goto fail;
+   }
+
    for (unsigned i = 0; i < pCreateInfo->queueCreateInfoCount; i++) {
       const VkDeviceQueueCreateInfo *queue_create =
          &pCreateInfo->pQueueCreateInfos[i];
@@ -1045,6 +1089,9 @@ fail:
          vk_object_free(&device->vk, NULL, device->queues[i]);
    }
 
+   if (device->mem_cache)
+      vk_pipeline_cache_destroy(device->mem_cache, &device->vk.alloc);
+
    vk_free(&device->vk.alloc, device);
    return result;
 }
@@ -1064,6 +1111,7 @@ panvk_DestroyDevice(VkDevice _device, const VkAllocationCallbacks *pAllocator)
          vk_object_free(&device->vk, NULL, device->queues[i]);
    }
 
+   vk_pipeline_cache_destroy(device->mem_cache, &device->vk.alloc);
    vk_free(&device->vk.alloc, device);
 }
 
@@ -1194,8 +1242,13 @@ panvk_AllocateMemory(VkDevice _device,
       /* take ownership and close the fd */
       close(fd_info->fd);
    } else {
+      uint32_t flags = 0;
+
+      if (pAllocateInfo->memoryTypeIndex == PANVK_MEMORY_TYPE_CACHED)
+         flags |= PAN_BO_CACHEABLE;
+
       mem->bo = panfrost_bo_create(&device->physical_device->pdev,
-                                   pAllocateInfo->allocationSize, 0,
+                                   pAllocateInfo->allocationSize, flags,
                                    "User-requested memory");
    }
 
@@ -1255,11 +1308,29 @@ panvk_UnmapMemory(VkDevice _device, VkDeviceMemory _memory)
 {
 }
 
+static size_t
+panvk_mapped_range_size(const VkMappedMemoryRange *range)
+{
+   VK_FROM_HANDLE(panvk_device_memory, mem, range->memory);
+
+   if (range->size == VK_WHOLE_SIZE)
+      return mem->bo->size - range->offset;
+
+   return MIN2(range->size, mem->bo->size - range->offset);
+}
+
 VkResult
 panvk_FlushMappedMemoryRanges(VkDevice _device,
                               uint32_t memoryRangeCount,
                               const VkMappedMemoryRange *pMemoryRanges)
 {
+   for (uint32_t i = 0; i < memoryRangeCount; i++) {
+      VK_FROM_HANDLE(panvk_device_memory, mem, pMemoryRanges[i].memory);
+
+      panfrost_bo_mem_clean(mem->bo, pMemoryRanges[i].offset,
+                            panvk_mapped_range_size(&pMemoryRanges[i]));
+   }
+
    return VK_SUCCESS;
 }
 
@@ -1268,35 +1339,46 @@ panvk_InvalidateMappedMemoryRanges(VkDevice _device,
                                    uint32_t memoryRangeCount,
                                    const VkMappedMemoryRange *pMemoryRanges)
 {
+   for (uint32_t i = 0; i < memoryRangeCount; i++) {
+      VK_FROM_HANDLE(panvk_device_memory, mem, pMemoryRanges[i].memory);
+
+      panfrost_bo_mem_invalidate(mem->bo, pMemoryRanges[i].offset,
+                                 panvk_mapped_range_size(&pMemoryRanges[i]));
+   }
+
    return VK_SUCCESS;
 }
 
 void
-panvk_GetBufferMemoryRequirements2(VkDevice device,
+panvk_GetBufferMemoryRequirements2(VkDevice _device,
                                    const VkBufferMemoryRequirementsInfo2 *pInfo,
                                    VkMemoryRequirements2 *pMemoryRequirements)
 {
+   VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_buffer, buffer, pInfo->buffer);
 
    const uint64_t align = 64;
    const uint64_t size = align64(buffer->vk.size, align);
 
-   pMemoryRequirements->memoryRequirements.memoryTypeBits = 1;
+   pMemoryRequirements->memoryRequirements.memoryTypeBits =
+      BITFIELD_MASK(panvk_memory_type_count(device->physical_device));
    pMemoryRequirements->memoryRequirements.alignment = align;
    pMemoryRequirements->memoryRequirements.size = size;
 }
 
 void
-panvk_GetImageMemoryRequirements2(VkDevice device,
+panvk_GetImageMemoryRequirements2(VkDevice _device,
                                  const VkImageMemoryRequirementsInfo2 *pInfo,
                                  VkMemoryRequirements2 *pMemoryRequirements)
 {
+   VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_image, image, pInfo->image);
 
    const uint64_t align = 4096;
    const uint64_t size = panvk_image_get_total_size(image);
 
-   pMemoryRequirements->memoryRequirements.memoryTypeBits = 1;
+   pMemoryRequirements->memoryRequirements.memoryTypeBits =
+      BITFIELD_MASK(panvk_memory_type_count(device->physical_device));
    pMemoryRequirements->memoryRequirements.alignment = align;
    pMemoryRequirements->memoryRequirements.size = size;
 }
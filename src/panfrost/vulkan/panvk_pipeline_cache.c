@@ -22,6 +22,129 @@
  */
 
 /*
- * This file is a stub until we have a real pipeline cache. For now, the
- * pipeline cache functions are stubbed by the common Vulkan runtime.
+ * The VkPipelineCache entrypoints come from the common Vulkan runtime. This
+ * file implements the objects stored in it: compiled shaders, keyed by a
+ * SHA1 of everything panvk_per_arch(shader_create) depends on, along with
+ * the shader info and descriptor counts needed to emit them. Objects are
+ * serialized for vkGetPipelineCacheData() and for the disk cache.
  */
+
+#include "panvk_private.h"
+
+#include "util/blob.h"
+#include "util/mesa-sha1.h"
+
+static void
+panvk_shader_cache_destroy(struct vk_pipeline_cache_object *object)
+{
+   struct panvk_shader *shader =
+      container_of(object, struct panvk_shader, base);
+   struct panvk_device *dev =
+      container_of(object->device, struct panvk_device, vk);
+
+   util_dynarray_fini(&shader->binary);
+   vk_pipeline_cache_object_finish(&shader->base);
+   vk_free(&dev->vk.alloc, shader);
+}
+
+static bool
+panvk_shader_serialize(struct vk_pipeline_cache_object *object,
+                       struct blob *blob)
+{
+   struct panvk_shader *shader =
+      container_of(object, struct panvk_shader, base);
+
+   blob_write_bytes(blob, &shader->info, sizeof(shader->info));
+   blob_write_uint32(blob, shader->sysval_ubo);
+   blob_write_bytes(blob, &shader->local_size, sizeof(shader->local_size));
+   blob_write_uint8(blob, shader->has_img_access);
+   blob_write_uint32(blob, shader->binary.size);
+   blob_write_bytes(blob, shader->binary.data, shader->binary.size);
+
+   return !blob->out_of_memory;
+}
+
+static struct vk_pipeline_cache_object *
+panvk_shader_deserialize(struct vk_device *device,
+                         const void *key_data, size_t key_size,
+                         struct blob_reader *blob)
+{
+   struct panvk_device *dev = container_of(device, struct panvk_device, vk);
+
+   if (key_size != SHA1_DIGEST_LENGTH)
+      return NULL;
+
+   struct panvk_shader *shader = panvk_shader_alloc(dev, key_data);
+   if (!shader)
+      return NULL;
+
+   blob_copy_bytes(blob, &shader->info, sizeof(shader->info));
+   shader->sysval_ubo = blob_read_uint32(blob);
+   blob_copy_bytes(blob, &shader->local_size, sizeof(shader->local_size));
+   shader->has_img_access = blob_read_uint8(blob);
+
+   uint32_t binary_size = blob_read_uint32(blob);
+   const void *binary = blob_read_bytes(blob, binary_size);
+
+   if (blob->overrun) {
+      panvk_shader_destroy(dev, shader);
+      return NULL;
+   }
+
+   void *data = util_dynarray_grow_bytes(&shader->binary, 1, binary_size);
+   memcpy(data, binary, binary_size);
+
+   return &shader->base;
+}
+
+const struct vk_pipeline_cache_object_ops panvk_shader_ops = {
+   .serialize = panvk_shader_serialize,
+   .deserialize = panvk_shader_deserialize,
+   .destroy = panvk_shader_cache_destroy,
+};
+
+const struct vk_pipeline_cache_object_ops *const panvk_cache_import_ops[] = {
+   &panvk_shader_ops,
+   NULL,
+};
+
+struct panvk_shader *
+panvk_shader_alloc(struct panvk_device *dev, const unsigned char *sha1)
+{
+   struct panvk_shader *shader =
+      vk_zalloc(&dev->vk.alloc, sizeof(*shader), 8,
+                VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+   if (!shader)
+      return NULL;
+
+   memcpy(shader->sha1, sha1, sizeof(shader->sha1));
+   vk_pipeline_cache_object_init(&dev->vk, &shader->base, &panvk_shader_ops,
+                                 shader->sha1, sizeof(shader->sha1));
+   util_dynarray_init(&shader->binary, NULL);
+
+   return shader;
+}
+
+/* Returns a new reference to the cached shader, or NULL on a miss */
+struct panvk_shader *
+panvk_shader_cache_lookup(struct vk_pipeline_cache *cache,
+                          const unsigned char *sha1)
+{
+   struct vk_pipeline_cache_object *object =
+      vk_pipeline_cache_lookup_object(cache, sha1, SHA1_DIGEST_LENGTH,
+                                      &panvk_shader_ops, NULL);
+
+   return object ? container_of(object, struct panvk_shader, base) : NULL;
+}
+
+/* Consumes the reference to shader, and returns a reference to the shader
+ * now in the cache, which may be one another thread added first */
+struct panvk_shader *
+panvk_shader_cache_add(struct vk_pipeline_cache *cache,
+                       struct panvk_shader *shader)
+{
+   struct vk_pipeline_cache_object *object =
+      vk_pipeline_cache_add_object(cache, &shader->base);
+
+   return container_of(object, struct panvk_shader, base);
+}
@@ -59,6 +59,7 @@
 #include "vk_log.h"
 #include "vk_object.h"
 #include "vk_physical_device.h"
+#include "vk_pipeline_cache.h"
 #include "vk_pipeline_layout.h"
 #include "vk_queue.h"
 #include "vk_sync.h"
@@ -106,6 +107,7 @@ typedef uint32_t xcb_window_t;
 #define NUM_META_FS_KEYS 13
 #define PANVK_MAX_DRM_DEVICES 1
 #define MAX_VIEWS 8
+#define MAX_PIPELINE_STATISTICS 11
 
 #define NUM_DEPTH_CLEAR_PIPELINES 3
 
@@ -149,6 +151,13 @@ struct panvk_meta {
       struct panvk_pool desc_pool;
    } blitter;
 
+   /* Binary pool for the index min/max and draw patching shaders, whose
+    * uploads are serialized by the pan_indirect_draw.c lock.
+    */
+   struct {
+      struct panvk_pool bin_pool;
+   } indirect_draw;
+
    struct {
       struct {
          mali_ptr shader;
@@ -172,6 +181,9 @@ struct panvk_meta {
       struct {
          mali_ptr rsd;
       } fillbuf;
+      struct {
+         mali_ptr rsd;
+      } query_results[2]; /* plain, summed values */
    } copy;
 };
 
@@ -231,11 +243,6 @@ bool
 panvk_physical_device_extension_supported(struct panvk_physical_device *dev,
                                        const char *name);
 
-struct panvk_pipeline_cache {
-   struct vk_object_base base;
-   VkAllocationCallbacks alloc;
-};
-
 /* queue types */
 #define PANVK_QUEUE_GENERAL 0
 
@@ -259,6 +266,9 @@ struct panvk_device {
 
    struct panvk_physical_device *physical_device;
    int _lost;
+
+   /* Used when pipelines are created without a VkPipelineCache */
+   struct vk_pipeline_cache *mem_cache;
 };
 
 VkResult _panvk_device_set_lost(struct panvk_device *device,
@@ -296,9 +306,51 @@ struct panvk_batch {
    } tiler;
    struct pan_tls_info tlsinfo;
    unsigned wls_total_size;
+   struct {
+      /* Shared by all GPU-patched draws of the batch, tracks the varying
+       * heap allocation.
+       */
+      struct panfrost_ptr ctx;
+      unsigned job_id;
+
+      /* Descriptors that are not patched idempotently, and their initial
+       * content, restored before the batch is re-issued.
+       */
+      struct util_dynarray templs;
+      struct util_dynarray templ_data;
+   } indirect_draw;
+
+   /* Query results and availability written once the batch is complete,
+    * as struct panvk_query_write.
+    */
+   struct util_dynarray query_writes;
+
+   /* NULL job linking the job chain of the batch to the chain of the
+    * previous batches when they are submitted together, and the offset
+    * currently applied to the job indices of the batch.
+    */
+   struct panfrost_ptr link_job;
+   unsigned job_index_base;
    bool issued;
 };
 
+struct panvk_batch_templ {
+   void *cpu;
+   unsigned offset;
+   unsigned size;
+};
+
+struct panvk_query_write {
+   mali_ptr addr;
+   uint64_t value;
+
+   /* Write the GPU system timestamp instead of value */
+   bool timestamp;
+
+   /* Availability writes wait for the result writes emitted before them */
+   bool availability;
+};
+
 enum panvk_event_op_type {
    PANVK_EVENT_OP_SET,
    PANVK_EVENT_OP_RESET,
@@ -333,7 +385,15 @@ struct panvk_descriptor_set {
    void *img_attrib_bufs;
    uint32_t *img_fmts;
 
-   struct panfrost_bo *desc_bo;
+   struct panfrost_ptr desc_ubo;
+
+   /* Link in the pool's list of live or freed sets */
+   struct list_head link;
+
+   /* Host memory (starting with this struct) and descriptor UBO memory
+    * owned by the set, reused by a later set fitting in them once freed */
+   size_t host_size;
+   size_t desc_ubo_capacity;
 };
 
 #define MAX_SETS 4
@@ -480,13 +540,35 @@ struct panvk_desc_pool_counters {
    unsigned sets;
 };
 
+struct panvk_desc_pool_chunk {
+   void *mem;
+   size_t size;
+};
+
 struct panvk_descriptor_pool {
    struct vk_object_base base;
    struct panvk_desc_pool_counters max;
    struct panvk_desc_pool_counters cur;
-   struct panvk_descriptor_set *sets;
+
+   /* Host memory of the sets, handed out linearly from the last chunk.
+    * Resetting the pool rewinds to the first chunk. */
+   struct util_dynarray chunks;
+   size_t chunk_offset;
+
+   /* Live sets, and sets freed with vkFreeDescriptorSets() */
+   struct list_head sets;
+   struct list_head free_sets;
+
+   /* Backing of the descriptor UBOs */
+   struct panvk_bo_pool desc_bo_pool;
+   struct panvk_pool desc_ubo_pool;
 };
 
+struct panvk_descriptor_set *
+panvk_descriptor_pool_alloc_set(struct panvk_device *device,
+                                struct panvk_descriptor_pool *pool,
+                                size_t host_size, size_t desc_ubo_size);
+
 struct panvk_buffer {
    struct vk_buffer vk;
 
@@ -603,6 +685,11 @@ struct panvk_draw_info {
    unsigned instance_count;
    int vertex_offset;
    unsigned offset_start;
+
+   /* Vertex range is unknown on the CPU, descriptors are emitted as
+    * templates and patched by the indirect draw job.
+    */
+   bool indirect;
    uint32_t invocation[INVOCATION_DESC_WORDS];
    struct {
       mali_ptr varyings;
@@ -625,6 +712,7 @@ struct panvk_draw_info {
    const struct pan_tiler_context *tiler_ctx;
    mali_ptr fs_rsd;
    mali_ptr viewport;
+   mali_ptr occlusion;
    struct {
       struct panfrost_ptr vertex;
       struct panfrost_ptr tiler;
@@ -728,6 +816,17 @@ struct panvk_cmd_state {
    VkViewport viewport;
    VkRect2D scissor;
 
+   struct {
+      /* Per-core counters of the active occlusion query, or 0 */
+      mali_ptr occlusion;
+
+      /* Active pipeline statistics query. Statistics are accumulated at
+       * record time, indexed by VkQueryPipelineStatisticFlagBits bit.
+       */
+      const struct panvk_query_pool *stats_pool;
+      uint64_t stats[MAX_PIPELINE_STATISTICS];
+   } query;
+
    struct panvk_batch *batch;
 };
 
@@ -811,7 +910,39 @@ struct panvk_event {
    uint32_t syncobj;
 };
 
+struct panvk_query_pool {
+   struct vk_object_base base;
+   VkQueryType type;
+   VkQueryPipelineStatisticFlags pipeline_statistics;
+   uint32_t query_count;
+
+   /* Each query is a 64-bit availability word followed by result_count
+    * results, each stored as sum_count 64-bit values to be added together
+    * (occlusion counters are per-core).
+    */
+   uint32_t query_stride;
+   uint32_t result_count;
+   uint32_t sum_count;
+   struct panfrost_bo *bo;
+};
+
+static inline mali_ptr
+panvk_query_gpu_ptr(const struct panvk_query_pool *pool, uint32_t query)
+{
+   return pool->bo->ptr.gpu + (uint64_t)query * pool->query_stride;
+}
+
+static inline void *
+panvk_query_cpu_ptr(const struct panvk_query_pool *pool, uint32_t query)
+{
+   return pool->bo->ptr.cpu + (uint64_t)query * pool->query_stride;
+}
+
 struct panvk_shader {
+   /* Shaders are reference counted by the pipeline caches holding them */
+   struct vk_pipeline_cache_object base;
+   unsigned char sha1[20];
+
    struct pan_shader_info info;
    struct util_dynarray binary;
    unsigned sysval_ubo;
@@ -831,8 +962,21 @@ panvk_shader_create(struct panvk_device *dev,
 
 void
 panvk_shader_destroy(struct panvk_device *dev,
-                     struct panvk_shader *shader,
-                     const VkAllocationCallbacks *alloc);
+                     struct panvk_shader *shader);
+
+extern const struct vk_pipeline_cache_object_ops panvk_shader_ops;
+extern const struct vk_pipeline_cache_object_ops *const panvk_cache_import_ops[];
+
+struct panvk_shader *
+panvk_shader_alloc(struct panvk_device *dev, const unsigned char *sha1);
+
+struct panvk_shader *
+panvk_shader_cache_lookup(struct vk_pipeline_cache *cache,
+                          const unsigned char *sha1);
+
+struct panvk_shader *
+panvk_shader_cache_add(struct vk_pipeline_cache *cache,
+                       struct panvk_shader *shader);
 
 #define RSD_WORDS 16
 #define BLEND_DESC_WORDS 4
@@ -877,6 +1021,15 @@ struct panvk_pipeline {
       uint8_t rt_mask;
    } fs;
 
+   struct {
+      /* Index-Driven Vertex Shading: the vertex shader is split in a
+       * position and a varying shader run from a single job, so varyings
+       * are only shaded for vertices of primitives surviving culling.
+       */
+      bool idvs;
+      bool secondary_shader;
+   } vs;
+
    struct {
       struct pan_compute_dim local_size;
    } cs;
@@ -1073,9 +1226,9 @@ VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_event, base, VkEvent, VK_OBJECT_TYPE_EVENT)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_framebuffer, base, VkFramebuffer, VK_OBJECT_TYPE_FRAMEBUFFER)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_image, vk.base, VkImage, VK_OBJECT_TYPE_IMAGE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_image_view, vk.base, VkImageView, VK_OBJECT_TYPE_IMAGE_VIEW);
-VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline_cache, base, VkPipelineCache, VK_OBJECT_TYPE_PIPELINE_CACHE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline, base, VkPipeline, VK_OBJECT_TYPE_PIPELINE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline_layout, vk.base, VkPipelineLayout, VK_OBJECT_TYPE_PIPELINE_LAYOUT)
+VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_query_pool, base, VkQueryPool, VK_OBJECT_TYPE_QUERY_POOL)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_render_pass, base, VkRenderPass, VK_OBJECT_TYPE_RENDER_PASS)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_sampler, base, VkSampler, VK_OBJECT_TYPE_SAMPLER)
 
@@ -1090,6 +1243,9 @@ do { \
    } \
 } while (0)
 
+/* Index bounds are computed on the GPU where pan_indirect_draw.c is built */
+#define PANVK_GPU_INDIRECTS (PAN_ARCH == 7)
+
 #ifdef PAN_ARCH
 #if PAN_ARCH == 6
 #define panvk_per_arch(name) panvk_arch_name(name, v6)
@@ -1133,7 +1289,7 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                               unsigned sysval_ubo,
                               struct pan_blend_state *blend_state,
                               bool static_blend_constants,
-                              const VkAllocationCallbacks *alloc);
+                              struct vk_pipeline_cache *cache);
 struct nir_shader;
 
 bool
@@ -23,13 +23,66 @@
 
 #include "panvk_private.h"
 
+#include "pan_bo.h"
+
+#include "util/os_time.h"
+#include "util/u_atomic.h"
+
+#include <errno.h>
+#include <xf86drm.h>
+
+/* How long VK_QUERY_RESULT_WAIT_BIT waits for a query before giving up on
+ * the device */
+#define PANVK_QUERY_TIMEOUT_NS (5ull * 1000 * 1000 * 1000)
+
 VkResult
 panvk_CreateQueryPool(VkDevice _device,
                       const VkQueryPoolCreateInfo *pCreateInfo,
                       const VkAllocationCallbacks *pAllocator,
                       VkQueryPool *pQueryPool)
 {
-   panvk_stub();
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   struct panfrost_device *pdev = &device->physical_device->pdev;
+   struct panvk_query_pool *pool =
+      vk_object_zalloc(&device->vk, pAllocator, sizeof(*pool),
+                       VK_OBJECT_TYPE_QUERY_POOL);
+   if (!pool)
+      return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   pool->type = pCreateInfo->queryType;
+   pool->query_count = pCreateInfo->queryCount;
+
+   switch (pool->type) {
+   case VK_QUERY_TYPE_OCCLUSION:
+      /* The tiler DCD points to one counter per shader core */
+      pool->result_count = 1;
+      pool->sum_count = pdev->core_count;
+      break;
+   case VK_QUERY_TYPE_PIPELINE_STATISTICS:
+      pool->pipeline_statistics = pCreateInfo->pipelineStatistics;
+      pool->result_count = util_bitcount(pool->pipeline_statistics);
+      pool->sum_count = 1;
+      break;
+   case VK_QUERY_TYPE_TIMESTAMP:
+      /* timestampValidBits is 0, see panvk_queue_family_properties */
+      vk_object_free(&device->vk, pAllocator, pool);
+      return vk_errorf(device, VK_ERROR_FEATURE_NOT_PRESENT,
+                       "Timestamp queries are not supported");
+   default:
+      unreachable("Unsupported query type");
+   }
+
+   pool->query_stride =
+      sizeof(uint64_t) * (1 + pool->result_count * pool->sum_count);
+   pool->bo = panfrost_bo_create(pdev,
+                                 (size_t)pool->query_stride * pool->query_count,
+                                 0, "Query pool");
+   if (!pool->bo) {
+      vk_object_free(&device->vk, pAllocator, pool);
+      return vk_error(device, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+   }
+
+   *pQueryPool = panvk_query_pool_to_handle(pool);
    return VK_SUCCESS;
 }
 
@@ -38,7 +91,73 @@ panvk_DestroyQueryPool(VkDevice _device,
                        VkQueryPool _pool,
                        const VkAllocationCallbacks *pAllocator)
 {
-   panvk_stub();
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   VK_FROM_HANDLE(panvk_query_pool, pool, _pool);
+
+   if (!pool)
+      return;
+
+   panfrost_bo_unreference(pool->bo);
+   vk_object_free(&device->vk, pAllocator, pool);
+}
+
+void
+panvk_ResetQueryPool(VkDevice _device,
+                     VkQueryPool queryPool,
+                     uint32_t firstQuery,
+                     uint32_t queryCount)
+{
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   memset(panvk_query_cpu_ptr(pool, firstQuery), 0,
+          (size_t)pool->query_stride * queryCount);
+}
+
+static void
+panvk_write_query_value(void *dst, uint32_t idx, uint64_t value,
+                        VkQueryResultFlags flags)
+{
+   if (flags & VK_QUERY_RESULT_64_BIT)
+      ((uint64_t *)dst)[idx] = value;
+   else
+      ((uint32_t *)dst)[idx] = value;
+}
+
+/* The availability word is written by the job chain after the results,
+ * there's no per-query fence. Block on the queues until the work submitted so
+ * far is done, and back off if the query is still not available, as it may
+ * not be submitted yet.
+ */
+static VkResult
+panvk_query_wait_available(struct panvk_device *device, const uint64_t *src)
+{
+   const struct panfrost_device *pdev = &device->physical_device->pdev;
+   uint64_t abs_timeout = os_time_get_absolute_timeout(PANVK_QUERY_TIMEOUT_NS);
+
+   while (!p_atomic_read(src)) {
+      if (vk_device_is_lost(&device->vk))
+         return VK_ERROR_DEVICE_LOST;
+
+      if (os_time_get_nano() >= abs_timeout)
+         return vk_device_set_lost(&device->vk, "Query wait timed out");
+
+      for (unsigned f = 0; f < PANVK_MAX_QUEUE_FAMILIES; f++) {
+         for (unsigned q = 0; q < device->queue_count[f]; q++) {
+            uint32_t sync = device->queues[f][q].sync;
+            int ret = drmSyncobjWait(pdev->fd, &sync, 1, abs_timeout,
+                                     DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT,
+                                     NULL);
+
+            if (ret && ret != -ETIME)
+               return vk_device_set_lost(&device->vk, "Query wait failed");
+         }
+      }
+
+      if (!p_atomic_read(src))
+         os_time_sleep(100);
+   }
+
+   return VK_SUCCESS;
 }
 
 VkResult
@@ -51,54 +170,43 @@ panvk_GetQueryPoolResults(VkDevice _device,
                           VkDeviceSize stride,
                           VkQueryResultFlags flags)
 {
-   panvk_stub();
-   return VK_SUCCESS;
-}
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   VkResult result = VK_SUCCESS;
 
-void
-panvk_CmdCopyQueryPoolResults(VkCommandBuffer commandBuffer,
-                              VkQueryPool queryPool,
-                              uint32_t firstQuery,
-                              uint32_t queryCount,
-                              VkBuffer dstBuffer,
-                              VkDeviceSize dstOffset,
-                              VkDeviceSize stride,
-                              VkQueryResultFlags flags)
-{
-   panvk_stub();
-}
+   if (vk_device_is_lost(&device->vk))
+      return VK_ERROR_DEVICE_LOST;
 
-void
-panvk_CmdResetQueryPool(VkCommandBuffer commandBuffer,
-                        VkQueryPool queryPool,
-                        uint32_t firstQuery,
-                        uint32_t queryCount)
-{
-   panvk_stub();
-}
+   for (uint32_t i = 0; i < queryCount; i++) {
+      uint64_t *src = panvk_query_cpu_ptr(pool, firstQuery + i);
+      void *dst = pData + (i * stride);
 
-void
-panvk_CmdBeginQuery(VkCommandBuffer commandBuffer,
-                    VkQueryPool queryPool,
-                    uint32_t query,
-                    VkQueryControlFlags flags)
-{
-   panvk_stub();
-}
+      if (flags & VK_QUERY_RESULT_WAIT_BIT) {
+         VkResult ret = panvk_query_wait_available(device, src);
 
-void
-panvk_CmdEndQuery(VkCommandBuffer commandBuffer,
-                  VkQueryPool queryPool,
-                  uint32_t query)
-{
-   panvk_stub();
-}
+         if (ret != VK_SUCCESS)
+            return ret;
+      }
 
-void
-panvk_CmdWriteTimestamp2(VkCommandBuffer commandBuffer,
-                         VkPipelineStageFlags2 stage,
-                         VkQueryPool queryPool,
-                         uint32_t query)
-{
-   panvk_stub();
+      bool available = p_atomic_read(src) != 0;
+
+      bool write_results = available || (flags & VK_QUERY_RESULT_PARTIAL_BIT);
+      if (!available)
+         result = VK_NOT_READY;
+
+      for (uint32_t r = 0; write_results && r < pool->result_count; r++) {
+         const uint64_t *values = &src[1 + (r * pool->sum_count)];
+         uint64_t value = 0;
+
+         for (uint32_t c = 0; c < pool->sum_count; c++)
+            value += values[c];
+
+         panvk_write_query_value(dst, r, value, flags);
+      }
+
+      if (flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)
+         panvk_write_query_value(dst, pool->result_count, available, flags);
+   }
+
+   return result;
 }
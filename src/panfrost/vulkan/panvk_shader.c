@@ -32,9 +32,7 @@
 
 void
 panvk_shader_destroy(struct panvk_device *dev,
-                     struct panvk_shader *shader,
-                     const VkAllocationCallbacks *alloc)
+                     struct panvk_shader *shader)
 {
-   util_dynarray_fini(&shader->binary);
-   vk_free2(&dev->vk.alloc, alloc, shader);
+   vk_pipeline_cache_object_unref(&shader->base);
 }
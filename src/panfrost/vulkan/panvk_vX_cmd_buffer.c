@@ -34,6 +34,7 @@
 #include "pan_blitter.h"
 #include "pan_cs.h"
 #include "pan_encoder.h"
+#include "pan_indirect_draw.h"
 
 #include "util/rounding.h"
 #include "util/u_pack_color.h"
@@ -65,6 +66,37 @@ panvk_cmd_prepare_fragment_job(struct panvk_cmd_buffer *cmdbuf)
    util_dynarray_append(&batch->jobs, void *, job_ptr.cpu);
 }
 
+static void
+panvk_cmd_emit_query_writes(struct panvk_cmd_buffer *cmdbuf,
+                            struct panvk_batch *batch,
+                            const struct util_dynarray *writes)
+{
+   util_dynarray_foreach(writes, struct panvk_query_write, write) {
+      struct panfrost_ptr job =
+         pan_pool_alloc_desc(&cmdbuf->desc_pool.base, WRITE_VALUE_JOB);
+
+      pan_section_pack(job.cpu, WRITE_VALUE_JOB, PAYLOAD, cfg) {
+         cfg.address = write->addr;
+         cfg.type = write->timestamp ?
+                    MALI_WRITE_VALUE_TYPE_SYSTEM_TIMESTAMP :
+                    MALI_WRITE_VALUE_TYPE_IMMEDIATE_64;
+         cfg.immediate_value = write->value;
+      }
+
+      util_dynarray_append(&batch->jobs, void *, job.cpu);
+      panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
+                       MALI_JOB_TYPE_WRITE_VALUE, write->availability, false,
+                       0, 0, &job, false);
+   }
+}
+
+static void
+panvk_cmd_alloc_link_job(struct panvk_cmd_buffer *cmdbuf,
+                         struct panvk_batch *batch)
+{
+   batch->link_job = pan_pool_alloc_desc(&cmdbuf->desc_pool.base, JOB_HEADER);
+}
+
 void
 panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
 {
@@ -81,6 +113,18 @@ panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
    for (unsigned i = 0; i < fbinfo->rt_count; i++)
       clear |= fbinfo->rts[i].clear;
 
+   /* Query writes must land after all the work of the batch. If the batch
+    * has no other job, they can be emitted in the batch itself, otherwise
+    * they get their own batch, executed after the fragment job.
+    */
+   struct util_dynarray query_writes = batch->query_writes;
+   util_dynarray_init(&batch->query_writes, NULL);
+
+   if (query_writes.size && !clear && !batch->scoreboard.first_job) {
+      panvk_cmd_emit_query_writes(cmdbuf, batch, &query_writes);
+      util_dynarray_fini(&query_writes);
+   }
+
    if (!clear && !batch->scoreboard.first_job) {
       if (util_dynarray_num_elements(&batch->event_ops, struct panvk_event_op) == 0) {
          /* Content-less batch, let's drop it */
@@ -95,6 +139,7 @@ panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
          panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
                           MALI_JOB_TYPE_NULL, false, false, 0, 0,
                           &ptr, false);
+         panvk_cmd_alloc_link_job(cmdbuf, batch);
          list_addtail(&batch->node, &cmdbuf->batches);
       }
       cmdbuf->state.batch = NULL;
@@ -105,6 +150,9 @@ panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
 
    list_addtail(&batch->node, &cmdbuf->batches);
 
+   if (batch->scoreboard.first_job)
+      panvk_cmd_alloc_link_job(cmdbuf, batch);
+
    if (batch->scoreboard.first_tiler) {
       struct panfrost_ptr preload_jobs[2];
       unsigned num_preload_jobs =
@@ -141,6 +189,15 @@ panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
    }
 
    cmdbuf->state.batch = NULL;
+
+   if (query_writes.size) {
+      batch = panvk_cmd_open_batch(cmdbuf);
+      panvk_cmd_emit_query_writes(cmdbuf, batch, &query_writes);
+      panvk_cmd_alloc_link_job(cmdbuf, batch);
+      list_addtail(&batch->node, &cmdbuf->batches);
+      cmdbuf->state.batch = NULL;
+      util_dynarray_fini(&query_writes);
+   }
 }
 
 void
@@ -482,8 +539,19 @@ panvk_draw_prepare_varyings(struct panvk_cmd_buffer *cmdbuf,
    const struct panvk_pipeline *pipeline = panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
    struct panvk_varyings_info *varyings = &cmdbuf->state.varyings;
 
-   panvk_varyings_alloc(varyings, &cmdbuf->varying_pool.base,
-                        draw->padded_vertex_count * draw->instance_count);
+   if (draw->indirect) {
+      /* Varyings are allocated from the indirect draw heap by the patching
+       * job, which also fills the buffer and position/psiz pointers.
+       */
+      for (unsigned i = 0; i < panvk_varyings_buf_count(varyings); i++) {
+         varyings->buf[i].address = 0;
+         varyings->buf[i].cpu = NULL;
+         varyings->buf[i].size = 0;
+      }
+   } else {
+      panvk_varyings_alloc(varyings, &cmdbuf->varying_pool.base,
+                           draw->padded_vertex_count * draw->instance_count);
+   }
 
    unsigned buf_count = panvk_varyings_buf_count(varyings);
    struct panfrost_ptr bufs =
@@ -586,6 +654,23 @@ panvk_prepare_non_vs_attribs(struct panvk_cmd_buffer *cmdbuf,
    desc_state->non_vs_attribs = attribs.gpu;
 }
 
+static void
+panvk_batch_add_templ(struct panvk_batch *batch, void *cpu, unsigned size)
+{
+   struct panvk_batch_templ templ = {
+      .cpu = cpu,
+      .offset = batch->indirect_draw.templ_data.size,
+      .size = size,
+   };
+
+   void *data =
+      util_dynarray_grow_bytes(&batch->indirect_draw.templ_data, 1, size);
+
+   memcpy(data, cpu, size);
+   util_dynarray_append(&batch->indirect_draw.templs,
+                        struct panvk_batch_templ, templ);
+}
+
 static void
 panvk_draw_prepare_vs_attribs(struct panvk_cmd_buffer *cmdbuf,
                               struct panvk_draw_info *draw)
@@ -609,7 +694,11 @@ panvk_draw_prepare_vs_attribs(struct panvk_cmd_buffer *cmdbuf,
       return;
    }
 
-   unsigned attrib_buf_count = pipeline->attribs.buf_count * 2;
+   /* Templates for the indirect draw job have one buffer per attribute */
+   unsigned vs_buf_count = draw->indirect ?
+                           pipeline->attribs.attrib_count :
+                           pipeline->attribs.buf_count;
+   unsigned attrib_buf_count = vs_buf_count * 2;
    struct panfrost_ptr bufs =
       pan_pool_alloc_desc_array(&cmdbuf->desc_pool.base,
                                 attrib_buf_count + 1,
@@ -626,19 +715,31 @@ panvk_draw_prepare_vs_attribs(struct panvk_cmd_buffer *cmdbuf,
                                 cmdbuf->state.vb.bufs, cmdbuf->state.vb.count,
                                 attribs.cpu);
 
-   if (attrib_count > pipeline->attribs.buf_count) {
-      unsigned bufs_offset = pipeline->attribs.buf_count * pan_size(ATTRIBUTE_BUFFER) * 2;
-      unsigned attribs_offset = pipeline->attribs.buf_count * pan_size(ATTRIBUTE);
+   if (attrib_count > vs_buf_count) {
+      unsigned bufs_offset = vs_buf_count * pan_size(ATTRIBUTE_BUFFER) * 2;
+      unsigned attribs_offset = vs_buf_count * pan_size(ATTRIBUTE);
 
       panvk_fill_non_vs_attribs(cmdbuf, bind_point_state,
                                 bufs.cpu + bufs_offset, attribs.cpu + attribs_offset,
-                                pipeline->attribs.buf_count * 2);
+                                vs_buf_count * 2);
    }
 
    /* A NULL entry is needed to stop prefecting on Bifrost */
    memset(bufs.cpu + (pan_size(ATTRIBUTE_BUFFER) * attrib_buf_count), 0,
           pan_size(ATTRIBUTE_BUFFER));
 
+   /* The indirect draw job accumulates divisors and offsets into the
+    * instanced attribute descriptors, keep a copy to re-issue the batch.
+    */
+   if (draw->indirect && draw->instance_count > 1) {
+      struct panvk_batch *batch = cmdbuf->state.batch;
+
+      panvk_batch_add_templ(batch, bufs.cpu,
+                            pan_size(ATTRIBUTE_BUFFER) * attrib_buf_count);
+      panvk_batch_add_templ(batch, attribs.cpu,
+                            pan_size(ATTRIBUTE) * pipeline->attribs.attrib_count);
+   }
+
    desc_state->vs_attrib_bufs = bufs.gpu;
    desc_state->vs_attribs = attribs.gpu;
 }
@@ -697,6 +798,11 @@ panvk_draw_prepare_vertex_job(struct panvk_cmd_buffer *cmdbuf,
 {
    const struct panvk_pipeline *pipeline = panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
    struct panvk_batch *batch = cmdbuf->state.batch;
+
+   /* Vertices are shaded by the indexed vertex job */
+   if (pipeline->vs.idvs)
+      return;
+
    struct panfrost_ptr ptr =
       pan_pool_alloc_desc(&cmdbuf->desc_pool.base, COMPUTE_JOB);
 
@@ -711,12 +817,149 @@ panvk_draw_prepare_tiler_job(struct panvk_cmd_buffer *cmdbuf,
 {
    const struct panvk_pipeline *pipeline = panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
    struct panvk_batch *batch = cmdbuf->state.batch;
-   struct panfrost_ptr ptr =
-      pan_pool_alloc_desc(&cmdbuf->desc_pool.base, TILER_JOB);
+   struct panfrost_ptr ptr;
+
+   if (pipeline->vs.idvs) {
+      ptr = pan_pool_alloc_desc(&cmdbuf->desc_pool.base, INDEXED_VERTEX_JOB);
+      panvk_per_arch(emit_idvs_job)(pipeline, draw, ptr.cpu);
+   } else {
+      ptr = pan_pool_alloc_desc(&cmdbuf->desc_pool.base, TILER_JOB);
+      panvk_per_arch(emit_tiler_job)(pipeline, draw, ptr.cpu);
+   }
 
    util_dynarray_append(&batch->jobs, void *, ptr.cpu);
    draw->jobs.tiler = ptr;
-   panvk_per_arch(emit_tiler_job)(pipeline, draw, ptr.cpu);
+}
+
+#if PANVK_GPU_INDIRECTS
+static void
+panvk_draw_emit_indirect_job(struct panvk_cmd_buffer *cmdbuf,
+                             struct panvk_draw_info *draw)
+{
+   const struct panvk_pipeline *pipeline = panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
+   struct panvk_descriptor_state *desc_state =
+      panvk_cmd_get_desc_state(cmdbuf, GRAPHICS);
+   struct panvk_batch *batch = cmdbuf->state.batch;
+
+   /* The first index is already applied to the index pointer, and the first
+    * instance is handled on the CPU since it's known at record time.
+    */
+   const VkDrawIndexedIndirectCommand params = {
+      .indexCount = draw->index_count,
+      .instanceCount = draw->instance_count,
+      .vertexOffset = draw->vertex_offset,
+   };
+
+   struct pan_indirect_draw_info info = {
+      .last_indirect_draw = batch->indirect_draw.job_id,
+      .draw_buf = pan_pool_upload_aligned(&cmdbuf->desc_pool.base, &params,
+                                          sizeof(params), 4),
+      .index_buf = draw->indices,
+      .first_vertex_sysval = desc_state->sysvals_ptr ?
+                             desc_state->sysvals_ptr +
+                             offsetof(struct panvk_sysvals, first_vertex) : 0,
+      .vertex_job = draw->jobs.vertex.gpu,
+      .tiler_job = draw->jobs.tiler.gpu,
+      .attrib_bufs = draw->stages[MESA_SHADER_VERTEX].attribute_bufs,
+      .attribs = draw->stages[MESA_SHADER_VERTEX].attributes,
+      .attrib_count = pipeline->attribs.attrib_count,
+      .varying_bufs = draw->varying_bufs,
+      .index_size = draw->index_size / 8,
+      .jobs = &batch->jobs,
+   };
+
+   if (pipeline->ia.writes_point_size) {
+      info.flags |= PAN_INDIRECT_DRAW_HAS_PSIZ |
+                    PAN_INDIRECT_DRAW_UPDATE_PRIM_SIZE;
+   }
+
+   if (pipeline->ia.primitive_restart) {
+      info.restart_index = BITFIELD_MASK(draw->index_size);
+      info.flags |= PAN_INDIRECT_DRAW_PRIMITIVE_RESTART;
+   }
+
+   if (pipeline->vs.idvs)
+      info.flags |= PAN_INDIRECT_DRAW_IDVS;
+
+   batch->indirect_draw.job_id =
+      GENX(panfrost_emit_indirect_draw)(&cmdbuf->desc_pool.base,
+                                        &batch->scoreboard, &info,
+                                        &batch->indirect_draw.ctx);
+}
+#endif
+
+static void
+panvk_draw_invalidate_patched_descs(struct panvk_descriptor_state *desc_state)
+{
+   /* Descriptors patched by the indirect draw job can't be shared with
+    * other draws.
+    */
+   desc_state->sysvals_ptr = 0;
+   desc_state->ubos = 0;
+   desc_state->vs_attribs = desc_state->vs_attrib_bufs = 0;
+}
+
+static void
+panvk_cmd_add_pipeline_stat(struct panvk_cmd_buffer *cmdbuf,
+                            VkQueryPipelineStatisticFlagBits stat,
+                            uint64_t count)
+{
+   cmdbuf->state.query.stats[ffs(stat) - 1] += count;
+}
+
+static unsigned
+panvk_draw_prim_count(enum mali_draw_mode mode, unsigned count)
+{
+   switch (mode) {
+   case MALI_DRAW_MODE_POINTS:
+      return count;
+   case MALI_DRAW_MODE_LINES:
+      return count / 2;
+   case MALI_DRAW_MODE_LINE_STRIP:
+      return count > 1 ? count - 1 : 0;
+   case MALI_DRAW_MODE_LINE_LOOP:
+      return count > 1 ? count : 0;
+   case MALI_DRAW_MODE_TRIANGLES:
+      return count / 3;
+   case MALI_DRAW_MODE_TRIANGLE_STRIP:
+   case MALI_DRAW_MODE_TRIANGLE_FAN:
+      return count > 2 ? count - 2 : 0;
+   default:
+      unreachable("Invalid draw mode");
+   }
+}
+
+/* There are no pipeline statistics counters in the hardware, only the
+ * statistics that are known at record time are reported.
+ */
+static void
+panvk_draw_count_pipeline_stats(struct panvk_cmd_buffer *cmdbuf,
+                                const struct panvk_pipeline *pipeline,
+                                const struct panvk_draw_info *draw)
+{
+   if (!cmdbuf->state.query.stats_pool)
+      return;
+
+   unsigned count = draw->index_size ? draw->index_count : draw->vertex_count;
+   uint64_t vertices = (uint64_t)count * draw->instance_count;
+   uint64_t prims = (uint64_t)draw->instance_count *
+                    panvk_draw_prim_count(pipeline->ia.topology, count);
+
+   panvk_cmd_add_pipeline_stat(cmdbuf,
+                               VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT,
+                               vertices);
+   panvk_cmd_add_pipeline_stat(cmdbuf,
+                               VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT,
+                               prims);
+   panvk_cmd_add_pipeline_stat(cmdbuf,
+                               VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT,
+                               vertices);
+
+   if (pipeline->rast.enable) {
+      panvk_cmd_add_pipeline_stat(cmdbuf,
+                                  VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT,
+                                  prims);
+   }
 }
 
 static void
@@ -730,19 +973,32 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
       panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
 
    /* There are only 16 bits in the descriptor for the job ID, make sure all
-    * the 3 (2 in Bifrost) jobs in this draw are in the same batch.
+    * the jobs in this draw (up to 4 in Bifrost when the index bounds are
+    * computed on the GPU) are in the same batch.
     */
-   if (batch->scoreboard.job_index >= (UINT16_MAX - 3)) {
+   if (batch->scoreboard.job_index >= (UINT16_MAX - 5)) {
       panvk_per_arch(cmd_close_batch)(cmdbuf);
       panvk_cmd_preload_fb_after_batch_split(cmdbuf);
       batch = panvk_cmd_open_batch(cmdbuf);
    }
 
+   /* The position and varying shaders of an IDVS vertex shader are only run
+    * by the tiler. Vertex pipeline stores are not supported, so the vertex
+    * shader has no visible effect when rasterization is disabled.
+    */
+   if (pipeline->vs.idvs && !pipeline->rast.enable) {
+      panvk_draw_count_pipeline_stats(cmdbuf, pipeline, draw);
+      return;
+   }
+
    if (pipeline->rast.enable)
       panvk_per_arch(cmd_alloc_fb_desc)(cmdbuf);
 
    panvk_per_arch(cmd_alloc_tls_desc)(cmdbuf, true);
 
+   if (draw->indirect)
+      panvk_draw_invalidate_patched_descs(&bind_point_state->desc_state);
+
    panvk_cmd_prepare_draw_sysvals(cmdbuf, bind_point_state, draw);
    panvk_cmd_prepare_ubos(cmdbuf, bind_point_state);
    panvk_cmd_prepare_textures(cmdbuf, bind_point_state);
@@ -757,11 +1013,17 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
    draw->ubos = desc_state->ubos;
    draw->textures = desc_state->textures;
    draw->samplers = desc_state->samplers;
+   draw->occlusion = cmdbuf->state.query.occlusion;
 
    STATIC_ASSERT(sizeof(draw->invocation) >= sizeof(struct mali_invocation_packed));
-   panfrost_pack_work_groups_compute((struct mali_invocation_packed *)&draw->invocation,
-                                      1, draw->vertex_range, draw->instance_count,
-                                      1, 1, 1, true, false);
+   if (draw->indirect) {
+      /* Zero-ed invocation, the indirect draw job will update it */
+      memset(&draw->invocation, 0, sizeof(draw->invocation));
+   } else {
+      panfrost_pack_work_groups_compute((struct mali_invocation_packed *)&draw->invocation,
+                                         1, draw->vertex_range, draw->instance_count,
+                                         1, 1, 1, true, false);
+   }
 
    panvk_draw_prepare_fs_rsd(cmdbuf, draw);
    panvk_draw_prepare_varyings(cmdbuf, draw);
@@ -773,21 +1035,61 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
    batch->tlsinfo.tls.size = MAX2(pipeline->tls_size, batch->tlsinfo.tls.size);
    assert(!pipeline->wls_size);
 
-   unsigned vjob_id =
-      panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
-                       MALI_JOB_TYPE_VERTEX, false, false, 0, 0,
-                       &draw->jobs.vertex, false);
+#if PANVK_GPU_INDIRECTS
+   if (draw->indirect)
+      panvk_draw_emit_indirect_job(cmdbuf, draw);
+#endif
 
-   if (pipeline->rast.enable) {
+   /* GPU-patched draws must not start before their patch job is done */
+   unsigned patch_dep = draw->indirect ? batch->indirect_draw.job_id : 0;
+
+   if (pipeline->vs.idvs) {
       panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
-                       MALI_JOB_TYPE_TILER, false, false, vjob_id, 0,
+                       MALI_JOB_TYPE_INDEXED_VERTEX, false, false,
+                       patch_dep, 0,
                        &draw->jobs.tiler, false);
+   } else {
+      unsigned vjob_id =
+         panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
+                          MALI_JOB_TYPE_VERTEX, false, false, patch_dep, 0,
+                          &draw->jobs.vertex, false);
+
+      if (pipeline->rast.enable) {
+         panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
+                          MALI_JOB_TYPE_TILER, false, false, vjob_id, 0,
+                          &draw->jobs.tiler, false);
+      }
    }
 
+   if (draw->indirect)
+      panvk_draw_invalidate_patched_descs(desc_state);
+
+   panvk_draw_count_pipeline_stats(cmdbuf, pipeline, draw);
+
    /* Clear the dirty flags all at once */
    desc_state->dirty = cmdbuf->state.dirty = 0;
 }
 
+static unsigned
+panvk_draw_padded_vertex_count(struct panvk_cmd_buffer *cmdbuf,
+                               unsigned vertex_count,
+                               unsigned instance_count)
+{
+   const struct panvk_pipeline *pipeline =
+      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
+
+   if (instance_count == 1)
+      return vertex_count;
+
+   /* IDVS requires each instance to start on a new cache line in the
+    * position buffer. Positions are 16 bytes and cache lines 64 bytes.
+    */
+   if (pipeline->vs.idvs)
+      vertex_count = ALIGN_POT(vertex_count, 4);
+
+   return panfrost_padded_vertex_count(vertex_count);
+}
+
 void
 panvk_per_arch(CmdDraw)(VkCommandBuffer commandBuffer,
                         uint32_t vertexCount,
@@ -806,15 +1108,16 @@ panvk_per_arch(CmdDraw)(VkCommandBuffer commandBuffer,
       .vertex_range = vertexCount,
       .first_instance = firstInstance,
       .instance_count = instanceCount,
-      .padded_vertex_count = instanceCount > 1 ?
-                             panfrost_padded_vertex_count(vertexCount) :
-                             vertexCount,
+      .padded_vertex_count = panvk_draw_padded_vertex_count(cmdbuf,
+                                                            vertexCount,
+                                                            instanceCount),
       .offset_start = firstVertex,
    };
 
    panvk_cmd_draw(cmdbuf, &draw);
 }
 
+#if !PANVK_GPU_INDIRECTS
 static void
 panvk_index_minmax_search(struct panvk_cmd_buffer *cmdbuf,
                           uint32_t start, uint32_t count,
@@ -857,6 +1160,7 @@ panvk_index_minmax_search(struct panvk_cmd_buffer *cmdbuf,
       unreachable("Invalid index size");
    }
 }
+#endif
 
 void
 panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
@@ -867,19 +1171,10 @@ panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
                                uint32_t firstInstance)
 {
    VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
-   uint32_t min_vertex, max_vertex;
 
    if (instanceCount == 0 || indexCount == 0)
       return;
 
-   const struct panvk_pipeline *pipeline =
-      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
-   bool primitive_restart = pipeline->ia.primitive_restart;
-
-   panvk_index_minmax_search(cmdbuf, firstIndex, indexCount, primitive_restart,
-                             &min_vertex, &max_vertex);
-
-   unsigned vertex_range = max_vertex - min_vertex + 1;
    struct panvk_draw_info draw = {
       .index_size = cmdbuf->state.ib.index_size,
       .first_index = firstIndex,
@@ -887,17 +1182,35 @@ panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
       .vertex_offset = vertexOffset,
       .first_instance = firstInstance,
       .instance_count = instanceCount,
-      .vertex_range = vertex_range,
       .vertex_count = indexCount + abs(vertexOffset),
-      .padded_vertex_count = instanceCount > 1 ?
-                             panfrost_padded_vertex_count(vertex_range) :
-                             vertex_range,
-      .offset_start = min_vertex + vertexOffset,
       .indices = panvk_buffer_gpu_ptr(cmdbuf->state.ib.buffer,
                                       cmdbuf->state.ib.offset) +
                  (firstIndex * (cmdbuf->state.ib.index_size / 8)),
    };
 
+#if PANVK_GPU_INDIRECTS
+   /* The index bounds are computed by a compute pre-pass, which also patches
+    * the vertex count dependent fields of the draw descriptors.
+    */
+   draw.indirect = true;
+#else
+   const struct panvk_pipeline *pipeline =
+      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
+   bool primitive_restart = pipeline->ia.primitive_restart;
+   uint32_t min_vertex, max_vertex;
+
+   panvk_index_minmax_search(cmdbuf, firstIndex, indexCount, primitive_restart,
+                             &min_vertex, &max_vertex);
+
+   unsigned vertex_range = max_vertex - min_vertex + 1;
+
+   draw.vertex_range = vertex_range;
+   draw.padded_vertex_count = panvk_draw_padded_vertex_count(cmdbuf,
+                                                             vertex_range,
+                                                             instanceCount);
+   draw.offset_start = min_vertex + vertexOffset;
+#endif
+
    panvk_cmd_draw(cmdbuf, &draw);
 }
 
@@ -1079,6 +1392,9 @@ panvk_reset_cmdbuf(struct panvk_cmd_buffer *cmdbuf)
       list_del(&batch->node);
       util_dynarray_fini(&batch->jobs);
       util_dynarray_fini(&batch->event_ops);
+      util_dynarray_fini(&batch->indirect_draw.templs);
+      util_dynarray_fini(&batch->indirect_draw.templ_data);
+      util_dynarray_fini(&batch->query_writes);
 
       vk_free(&cmdbuf->pool->vk.alloc, batch);
    }
@@ -1105,6 +1421,9 @@ panvk_destroy_cmdbuf(struct panvk_cmd_buffer *cmdbuf)
       list_del(&batch->node);
       util_dynarray_fini(&batch->jobs);
       util_dynarray_fini(&batch->event_ops);
+      util_dynarray_fini(&batch->indirect_draw.templs);
+      util_dynarray_fini(&batch->indirect_draw.templ_data);
+      util_dynarray_fini(&batch->query_writes);
 
       vk_free(&cmdbuf->pool->vk.alloc, batch);
    }
@@ -1370,10 +1689,20 @@ panvk_per_arch(CmdDispatch)(VkCommandBuffer commandBuffer,
    dispatch.samplers = desc_state->samplers;
 
    panvk_per_arch(emit_compute_job)(pipeline, &dispatch, job.cpu);
+   util_dynarray_append(&batch->jobs, void *, job.cpu);
    panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
                     MALI_JOB_TYPE_COMPUTE, false, false, 0, 0,
                     &job, false);
 
+   if (cmdbuf->state.query.stats_pool) {
+      panvk_cmd_add_pipeline_stat(cmdbuf,
+                                  VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+                                  (uint64_t)x * y * z *
+                                  pipeline->cs.local_size.x *
+                                  pipeline->cs.local_size.y *
+                                  pipeline->cs.local_size.z);
+   }
+
    batch->tlsinfo.tls.size = pipeline->tls_size;
    batch->tlsinfo.wls.size = pipeline->wls_size;
    if (batch->tlsinfo.wls.size) {
@@ -165,6 +165,29 @@ panvk_emit_attrib_buf(const struct panvk_attribs_info *info,
    unsigned divisor =
       draw->padded_vertex_count * buf_info->instance_divisor;
 
+   if (draw->indirect) {
+      /* The padded vertex count is computed by the indirect draw job,
+       * which picks the final type and divisor. Instance-rate bindings
+       * with a zero divisor are turned into zero-stride arrays, and the
+       * raw divisor is stored in the continuation slot for the patching
+       * shader.
+       */
+      pan_pack(desc, ATTRIBUTE_BUFFER, cfg) {
+         cfg.type = MALI_ATTRIBUTE_TYPE_1D;
+         cfg.stride = buf_info->per_instance && !buf_info->instance_divisor ?
+                      0 : buf_info->stride;
+         cfg.pointer = addr;
+         cfg.size = size;
+      }
+
+      desc += pan_size(ATTRIBUTE_BUFFER);
+      pan_pack(desc, ATTRIBUTE_BUFFER_CONTINUATION_NPOT, cfg) {
+         cfg.divisor = buf_info->per_instance ?
+                       buf_info->instance_divisor : 0;
+      }
+      return;
+   }
+
    /* TODO: support instanced arrays */
    if (draw->instance_count <= 1) {
       pan_pack(desc, ATTRIBUTE_BUFFER, cfg) {
@@ -229,6 +252,16 @@ panvk_per_arch(emit_attrib_bufs)(const struct panvk_attribs_info *info,
 {
    struct mali_attribute_buffer_packed *buf = descs;
 
+   /* The indirect draw job expects one buffer per attribute */
+   if (draw->indirect) {
+      for (unsigned i = 0; i < info->attrib_count; i++) {
+         panvk_emit_attrib_buf(info, draw, bufs, buf_count,
+                               info->attrib[i].buf, buf);
+         buf += 2;
+      }
+      return;
+   }
+
    for (unsigned i = 0; i < info->buf_count; i++) {
       panvk_emit_attrib_buf(info, draw, bufs, buf_count, i, buf);
       buf += 2;
@@ -275,7 +308,7 @@ panvk_emit_attrib(const struct panvk_device *dev,
    const struct panvk_attrib_buf_info *buf_info = &attribs->buf[buf_idx];
 
    pan_pack(attrib, ATTRIBUTE, cfg) {
-      cfg.buffer_index = buf_idx * 2;
+      cfg.buffer_index = (draw->indirect ? idx : buf_idx) * 2;
       cfg.offset = attribs->attrib[idx].offset +
                    (bufs[buf_idx].address & 63);
 
@@ -365,20 +398,12 @@ panvk_per_arch(emit_ubos)(const struct panvk_pipeline *pipeline,
    }
 }
 
-void
-panvk_per_arch(emit_vertex_job)(const struct panvk_pipeline *pipeline,
-                                const struct panvk_draw_info *draw,
-                                void *job)
+static void
+panvk_emit_vertex_dcd(const struct panvk_pipeline *pipeline,
+                      const struct panvk_draw_info *draw,
+                      void *dcd)
 {
-   void *section = pan_section_ptr(job, COMPUTE_JOB, INVOCATION);
-
-   memcpy(section, &draw->invocation, pan_size(INVOCATION));
-
-   pan_section_pack(job, COMPUTE_JOB, PARAMETERS, cfg) {
-      cfg.job_task_split = 5;
-   }
-
-   pan_section_pack(job, COMPUTE_JOB, DRAW, cfg) {
+   pan_pack(dcd, DRAW, cfg) {
       cfg.state = pipeline->rsds[MESA_SHADER_VERTEX];
       cfg.attributes = draw->stages[MESA_SHADER_VERTEX].attributes;
       cfg.attribute_buffers = draw->stages[MESA_SHADER_VERTEX].attribute_bufs;
@@ -395,6 +420,23 @@ panvk_per_arch(emit_vertex_job)(const struct panvk_pipeline *pipeline,
    }
 }
 
+void
+panvk_per_arch(emit_vertex_job)(const struct panvk_pipeline *pipeline,
+                                const struct panvk_draw_info *draw,
+                                void *job)
+{
+   void *section = pan_section_ptr(job, COMPUTE_JOB, INVOCATION);
+
+   memcpy(section, &draw->invocation, pan_size(INVOCATION));
+
+   pan_section_pack(job, COMPUTE_JOB, PARAMETERS, cfg) {
+      cfg.job_task_split = 5;
+   }
+
+   section = pan_section_ptr(job, COMPUTE_JOB, DRAW);
+   panvk_emit_vertex_dcd(pipeline, draw, section);
+}
+
 void
 panvk_per_arch(emit_compute_job)(const struct panvk_pipeline *pipeline,
                                  const struct panvk_dispatch_info *dispatch,
@@ -442,6 +484,7 @@ panvk_emit_tiler_primitive(const struct panvk_pipeline *pipeline,
       if (pipeline->ia.primitive_restart)
          cfg.primitive_restart = MALI_PRIMITIVE_RESTART_IMPLICIT;
       cfg.job_task_split = 6;
+      cfg.secondary_shader = pipeline->vs.idvs && pipeline->vs.secondary_shader;
 
       if (draw->index_size) {
          cfg.index_count = draw->index_count;
@@ -511,7 +554,10 @@ panvk_emit_tiler_dcd(const struct panvk_pipeline *pipeline,
       cfg.textures = draw->textures;
       cfg.samplers = draw->samplers;
 
-      /* TODO: occlusion queries */
+      if (draw->occlusion) {
+         cfg.occlusion_query = MALI_OCCLUSION_MODE_COUNTER;
+         cfg.occlusion = draw->occlusion;
+      }
    }
 }
 
@@ -540,6 +586,20 @@ panvk_per_arch(emit_tiler_job)(const struct panvk_pipeline *pipeline,
    pan_section_pack(job, TILER_JOB, PADDING, padding);
 }
 
+void
+panvk_per_arch(emit_idvs_job)(const struct panvk_pipeline *pipeline,
+                              const struct panvk_draw_info *draw,
+                              void *job)
+{
+   /* The indexed vertex job is a tiler job followed by the vertex DCD */
+   STATIC_ASSERT(pan_section_offset(TILER_JOB, DRAW) ==
+                 pan_section_offset(INDEXED_VERTEX_JOB, FRAGMENT_DRAW));
+   panvk_per_arch(emit_tiler_job)(pipeline, draw, job);
+
+   void *section = pan_section_ptr(job, INDEXED_VERTEX_JOB, VERTEX_DRAW);
+   panvk_emit_vertex_dcd(pipeline, draw, section);
+}
+
 void
 panvk_per_arch(emit_viewport)(const VkViewport *viewport,
                               const VkRect2D *scissor,
@@ -231,6 +231,16 @@ panvk_write_sampler_desc_raw(struct panvk_descriptor_set *set,
                              uint32_t binding, uint32_t elem,
                              struct panvk_sampler *sampler);
 
+/* Places an array of the given size at the end of the set memory */
+static size_t
+panvk_desc_set_array(size_t *size, size_t array_size)
+{
+   size_t offset = ALIGN_POT(*size, 8);
+
+   *size = offset + array_size;
+   return offset;
+}
+
 static VkResult
 panvk_per_arch(descriptor_set_create)(struct panvk_device *device,
                                       struct panvk_descriptor_pool *pool,
@@ -239,81 +249,56 @@ panvk_per_arch(descriptor_set_create)(struct panvk_device *device,
 {
    struct panvk_descriptor_set *set;
 
-   /* TODO: Allocate from the pool! */
-   set = vk_object_zalloc(&device->vk, NULL,
-                          sizeof(struct panvk_descriptor_set),
-                          VK_OBJECT_TYPE_DESCRIPTOR_SET);
+   /* The set and all its descriptor arrays are a single allocation */
+   size_t size = sizeof(*set);
+   size_t ubos = panvk_desc_set_array(&size,
+                                      pan_size(UNIFORM_BUFFER) * layout->num_ubos);
+   size_t dyn_ubos = panvk_desc_set_array(&size,
+                                          sizeof(*set->dyn_ubos) * layout->num_dyn_ubos);
+   size_t dyn_ssbos = panvk_desc_set_array(&size,
+                                           sizeof(*set->dyn_ssbos) * layout->num_dyn_ssbos);
+   size_t samplers = panvk_desc_set_array(&size,
+                                          pan_size(SAMPLER) * layout->num_samplers);
+   size_t textures = panvk_desc_set_array(&size,
+                                          pan_size(TEXTURE) * layout->num_textures);
+   size_t img_fmts = panvk_desc_set_array(&size,
+                                          sizeof(*set->img_fmts) * layout->num_imgs);
+   size_t img_attrib_bufs = panvk_desc_set_array(&size,
+                                                 pan_size(ATTRIBUTE_BUFFER) * 2 * layout->num_imgs);
+
+   set = panvk_descriptor_pool_alloc_set(device, pool, size,
+                                         layout->desc_ubo_size);
    if (!set)
       return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
 
+   uint8_t *mem = (uint8_t *)set;
+
    set->layout = layout;
 
-   if (layout->num_ubos) {
-      set->ubos = vk_zalloc(&device->vk.alloc,
-                            pan_size(UNIFORM_BUFFER) * layout->num_ubos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->ubos)
-         goto err_free_set;
-   }
+   if (layout->num_ubos)
+      set->ubos = mem + ubos;
 
-   if (layout->num_dyn_ubos) {
-      set->dyn_ubos = vk_zalloc(&device->vk.alloc,
-                            sizeof(*set->dyn_ubos) * layout->num_dyn_ubos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->dyn_ubos)
-         goto err_free_set;
-   }
+   if (layout->num_dyn_ubos)
+      set->dyn_ubos = (struct panvk_buffer_desc *)(mem + dyn_ubos);
 
-   if (layout->num_dyn_ssbos) {
-      set->dyn_ssbos = vk_zalloc(&device->vk.alloc,
-                            sizeof(*set->dyn_ssbos) * layout->num_dyn_ssbos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->dyn_ssbos)
-         goto err_free_set;
-   }
+   if (layout->num_dyn_ssbos)
+      set->dyn_ssbos = (struct panvk_buffer_desc *)(mem + dyn_ssbos);
 
-   if (layout->num_samplers) {
-      set->samplers = vk_zalloc(&device->vk.alloc,
-                                pan_size(SAMPLER) * layout->num_samplers, 8,
-                                VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->samplers)
-         goto err_free_set;
-   }
+   if (layout->num_samplers)
+      set->samplers = mem + samplers;
 
-   if (layout->num_textures) {
-      set->textures =
-         vk_zalloc(&device->vk.alloc, pan_size(TEXTURE) * layout->num_textures,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->textures)
-         goto err_free_set;
-   }
+   if (layout->num_textures)
+      set->textures = mem + textures;
 
    if (layout->num_imgs) {
-      set->img_fmts =
-         vk_zalloc(&device->vk.alloc,
-                   sizeof(*set->img_fmts) * layout->num_imgs,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->img_fmts)
-         goto err_free_set;
-
-      set->img_attrib_bufs =
-         vk_zalloc(&device->vk.alloc,
-                   pan_size(ATTRIBUTE_BUFFER) * 2 * layout->num_imgs,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->img_attrib_bufs)
-         goto err_free_set;
+      set->img_fmts = (uint32_t *)(mem + img_fmts);
+      set->img_attrib_bufs = mem + img_attrib_bufs;
    }
 
    if (layout->desc_ubo_size) {
-      set->desc_bo = panfrost_bo_create(&device->physical_device->pdev,
-                                        layout->desc_ubo_size,
-                                        0, "Descriptor set");
-      if (!set->desc_bo)
-         goto err_free_set;
-
       struct mali_uniform_buffer_packed *ubos = set->ubos;
 
-      panvk_per_arch(emit_ubo)(set->desc_bo->ptr.gpu,
+      panvk_per_arch(emit_ubo)(set->desc_ubo.gpu,
                                layout->desc_ubo_size,
                                &ubos[layout->desc_ubo_index]);
    }
@@ -331,19 +316,6 @@ panvk_per_arch(descriptor_set_create)(struct panvk_device *device,
 
    *out_set = set;
    return VK_SUCCESS;
-
-err_free_set:
-   vk_free(&device->vk.alloc, set->textures);
-   vk_free(&device->vk.alloc, set->samplers);
-   vk_free(&device->vk.alloc, set->ubos);
-   vk_free(&device->vk.alloc, set->dyn_ubos);
-   vk_free(&device->vk.alloc, set->dyn_ssbos);
-   vk_free(&device->vk.alloc, set->img_fmts);
-   vk_free(&device->vk.alloc, set->img_attrib_bufs);
-   if (set->desc_bo)
-      panfrost_bo_unreference(set->desc_bo);
-   vk_object_free(&device->vk, NULL, set);
-   return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
 }
 
 VkResult
@@ -385,7 +357,7 @@ panvk_desc_ubo_data(struct panvk_descriptor_set *set,
    const struct panvk_descriptor_set_binding_layout *binding_layout =
       &set->layout->bindings[binding];
 
-   return (char *)set->desc_bo->ptr.cpu +
+   return (char *)set->desc_ubo.cpu +
           binding_layout->desc_ubo_offset +
           elem * binding_layout->desc_ubo_stride;
 }
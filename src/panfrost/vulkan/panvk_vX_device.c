@@ -29,6 +29,7 @@
 #include "genxml/gen_macros.h"
 
 #include "decode.h"
+#include "pan_indirect_draw.h"
 
 #include "panvk_private.h"
 #include "panvk_cs.h"
@@ -36,37 +37,248 @@
 #include "vk_drm_syncobj.h"
 
 static void
-panvk_queue_submit_batch(struct panvk_queue *queue,
-                         struct panvk_batch *batch,
-                         uint32_t *bos, unsigned nr_bos,
-                         uint32_t *in_fences,
-                         unsigned nr_in_fences)
+panvk_queue_transfer_sync(struct panvk_queue *queue, uint32_t syncobj)
+{
+   const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
+   int ret;
+
+   struct drm_syncobj_handle handle = {
+      .handle = queue->sync,
+      .flags = DRM_SYNCOBJ_HANDLE_TO_FD_FLAGS_EXPORT_SYNC_FILE,
+      .fd = -1,
+   };
+
+   ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_HANDLE_TO_FD, &handle);
+   assert(!ret);
+   assert(handle.fd >= 0);
+
+   handle.handle = syncobj;
+   ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_FD_TO_HANDLE, &handle);
+   assert(!ret);
+
+   close(handle.fd);
+}
+
+static void
+panvk_add_wait_event_syncobjs(struct panvk_batch *batch, uint32_t *in_fences, unsigned *nr_in_fences)
+{
+   util_dynarray_foreach(&batch->event_ops, struct panvk_event_op, op) {
+      switch (op->type) {
+      case PANVK_EVENT_OP_SET:
+         /* Nothing to do yet */
+         break;
+      case PANVK_EVENT_OP_RESET:
+         /* Nothing to do yet */
+         break;
+      case PANVK_EVENT_OP_WAIT:
+         in_fences[(*nr_in_fences)++] = op->event->syncobj;
+         break;
+      default:
+         unreachable("bad panvk_event_op type\n");
+      }
+   }
+}
+
+static void
+panvk_signal_event_syncobjs(struct panvk_queue *queue, struct panvk_batch *batch)
+{
+   const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
+
+   util_dynarray_foreach(&batch->event_ops, struct panvk_event_op, op) {
+      switch (op->type) {
+      case PANVK_EVENT_OP_SET: {
+         panvk_queue_transfer_sync(queue, op->event->syncobj);
+         break;
+      }
+      case PANVK_EVENT_OP_RESET: {
+         struct panvk_event *event = op->event;
+
+         struct drm_syncobj_array objs = {
+            .handles = (uint64_t) (uintptr_t) &event->syncobj,
+            .count_handles = 1
+         };
+
+         int ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_RESET, &objs);
+         assert(!ret);
+         break;
+      }
+      case PANVK_EVENT_OP_WAIT:
+         /* Nothing left to do */
+         break;
+      default:
+         unreachable("bad panvk_event_op type\n");
+      }
+   }
+}
+
+static void
+panvk_queue_reset_batch(struct panvk_queue *queue, struct panvk_batch *batch)
+{
+   util_dynarray_foreach(&batch->jobs, void *, job)
+      memset((*job), 0, 4 * 4);
+
+   /* Reset the tiler before re-issuing the batch */
+   if (batch->tiler.descs.cpu) {
+      memcpy(batch->tiler.descs.cpu, batch->tiler.templ,
+             pan_size(TILER_CONTEXT) + pan_size(TILER_HEAP));
+   }
+
+   /* Restore the descriptors patched by indirect draw jobs, and rewind
+    * the varying heap.
+    */
+   util_dynarray_foreach(&batch->indirect_draw.templs,
+                         struct panvk_batch_templ, templ) {
+      memcpy(templ->cpu,
+             batch->indirect_draw.templ_data.data + templ->offset,
+             templ->size);
+   }
+
+#if PANVK_GPU_INDIRECTS
+   if (batch->indirect_draw.ctx.cpu) {
+      GENX(panfrost_reset_indirect_draw_ctx)(&queue->device->physical_device->pdev,
+                                             &batch->indirect_draw.ctx);
+   }
+#endif
+}
+
+static void
+panvk_job_set_next(struct mali_job_header_packed *job, mali_ptr next)
+{
+   job->opaque[6] = next;
+   job->opaque[7] = next >> 32;
+}
+
+/* Job indices are only unique within a job chain. Shift the indices and
+ * dependencies of the vertex/tiler jobs of a batch so its chain can be
+ * appended to the chain of the previous batches.
+ */
+static void
+panvk_batch_rebase_jobs(struct panvk_batch *batch, unsigned base)
+{
+   if (batch->job_index_base == base)
+      return;
+
+   int delta = (int)base - (int)batch->job_index_base;
+
+   util_dynarray_foreach(&batch->jobs, void *, job) {
+      pan_unpack(*job, JOB_HEADER, header);
+
+      /* The fragment job is in a chain of its own */
+      if (header.type == MALI_JOB_TYPE_FRAGMENT)
+         continue;
+
+      header.index += delta;
+      if (header.dependency_1)
+         header.dependency_1 += delta;
+      if (header.dependency_2)
+         header.dependency_2 += delta;
+
+      pan_pack(*job, JOB_HEADER, cfg) {
+         cfg = header;
+      }
+   }
+
+   batch->job_index_base = base;
+}
+
+/* Consecutive batches are submitted as runs, whose vertex/tiler chains are
+ * linked together, so a run costs a single SUBMIT ioctl for its vertex/tiler
+ * jobs plus one for the fragment job of its last batch. Later batches might
+ * depend on the output of a fragment job or on a signaled event, so only the
+ * last batch of a run can have either. Similarly, only the first batch of a
+ * run can wait on events.
+ */
+struct panvk_submit_run {
+   /* GEM handles, as uint32_t */
+   struct util_dynarray bos;
+   mali_ptr first_job;
+   struct mali_job_header_packed *last_job;
+   unsigned job_index;
+   struct panvk_batch *last_batch;
+   uint32_t *in_fences;
+   unsigned nr_in_fences;
+};
+
+static void
+panvk_submit_run_add_bos(struct panvk_submit_run *run,
+                         const struct panfrost_device *pdev,
+                         struct panvk_cmd_buffer *cmdbuf,
+                         const struct panvk_batch *batch)
+{
+   /* FIXME: should be done at the batch level */
+   unsigned nr_bos =
+      panvk_pool_num_bos(&cmdbuf->desc_pool) +
+      panvk_pool_num_bos(&cmdbuf->varying_pool) +
+      panvk_pool_num_bos(&cmdbuf->tls_pool);
+   uint32_t *bos = util_dynarray_grow(&run->bos, uint32_t, nr_bos);
+
+   panvk_pool_get_bo_handles(&cmdbuf->desc_pool, bos);
+   bos += panvk_pool_num_bos(&cmdbuf->desc_pool);
+
+   panvk_pool_get_bo_handles(&cmdbuf->varying_pool, bos);
+   bos += panvk_pool_num_bos(&cmdbuf->varying_pool);
+
+   panvk_pool_get_bo_handles(&cmdbuf->tls_pool, bos);
+
+   if (batch->fb.info) {
+      for (unsigned i = 0; i < batch->fb.info->attachment_count; i++) {
+         util_dynarray_append(&run->bos, uint32_t,
+                              batch->fb.info->attachments[i].iview->pview.image->data.bo->gem_handle);
+      }
+   }
+
+   if (batch->blit.src)
+      util_dynarray_append(&run->bos, uint32_t, batch->blit.src->gem_handle);
+
+   if (batch->blit.dst)
+      util_dynarray_append(&run->bos, uint32_t, batch->blit.dst->gem_handle);
+
+   if (batch->scoreboard.first_tiler)
+      util_dynarray_append(&run->bos, uint32_t, pdev->tiler_heap->gem_handle);
+
+   if (batch->indirect_draw.ctx.cpu) {
+      util_dynarray_append(&run->bos, uint32_t,
+                           pdev->indirect_draw_shaders.states->gem_handle);
+      util_dynarray_append(&run->bos, uint32_t,
+                           pdev->indirect_draw_shaders.varying_heap->gem_handle);
+   }
+}
+
+static void
+panvk_queue_submit_run(struct panvk_queue *queue,
+                       struct panvk_submit_run *run)
 {
    const struct panvk_device *dev = queue->device;
    unsigned debug = dev->physical_device->instance->debug_flags;
    const struct panfrost_device *pdev = &dev->physical_device->pdev;
+   struct panvk_batch *batch = run->last_batch;
    int ret;
 
-   /* Reset the batch if it's already been issued */
-   if (batch->issued) {
-      util_dynarray_foreach(&batch->jobs, void *, job)
-         memset((*job), 0, 4 * 4);
-
-      /* Reset the tiler before re-issuing the batch */
-      if (batch->tiler.descs.cpu) {
-         memcpy(batch->tiler.descs.cpu, batch->tiler.templ,
-                pan_size(TILER_CONTEXT) + pan_size(TILER_HEAP));
+   if (!batch)
+      return;
+
+   util_dynarray_append(&run->bos, uint32_t, pdev->sample_positions->gem_handle);
+
+   /* Merge identical BO entries. */
+   uint32_t *bos = run->bos.data;
+   unsigned nr_bos = util_dynarray_num_elements(&run->bos, uint32_t);
+   for (unsigned x = 0; x < nr_bos; x++) {
+      for (unsigned y = x + 1; y < nr_bos; ) {
+         if (bos[x] == bos[y])
+            bos[y] = bos[--nr_bos];
+         else
+            y++;
       }
    }
 
-   if (batch->scoreboard.first_job) {
+   if (run->first_job) {
       struct drm_panfrost_submit submit = {
          .bo_handles = (uintptr_t)bos,
          .bo_handle_count = nr_bos,
-         .in_syncs = (uintptr_t)in_fences,
-         .in_sync_count = nr_in_fences,
+         .in_syncs = (uintptr_t)run->in_fences,
+         .in_sync_count = run->nr_in_fences,
          .out_sync = queue->sync,
-         .jc = batch->scoreboard.first_job,
+         .jc = run->first_job,
       };
 
       ret = drmIoctl(pdev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
@@ -78,8 +290,8 @@ panvk_queue_submit_batch(struct panvk_queue *queue,
       }
 
       if (debug & PANVK_DEBUG_TRACE)
-         GENX(pandecode_jc)(batch->scoreboard.first_job, pdev->gpu_id);
-      
+         GENX(pandecode_jc)(run->first_job, pdev->gpu_id);
+
       if (debug & PANVK_DEBUG_DUMP)
          pandecode_dump_mappings();
    }
@@ -93,12 +305,12 @@ panvk_queue_submit_batch(struct panvk_queue *queue,
          .requirements = PANFROST_JD_REQ_FS,
       };
 
-      if (batch->scoreboard.first_job) {
+      if (run->first_job) {
          submit.in_syncs = (uintptr_t)(&queue->sync);
          submit.in_sync_count = 1;
       } else {
-         submit.in_syncs = (uintptr_t)in_fences;
-         submit.in_sync_count = nr_in_fences;
+         submit.in_syncs = (uintptr_t)run->in_fences;
+         submit.in_sync_count = run->nr_in_fences;
       }
 
       ret = drmIoctl(pdev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
@@ -118,82 +330,95 @@ panvk_queue_submit_batch(struct panvk_queue *queue,
    if (debug & PANVK_DEBUG_TRACE)
       pandecode_next_frame();
 
-   batch->issued = true;
-}
-
-static void
-panvk_queue_transfer_sync(struct panvk_queue *queue, uint32_t syncobj)
-{
-   const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
-   int ret;
-
-   struct drm_syncobj_handle handle = {
-      .handle = queue->sync,
-      .flags = DRM_SYNCOBJ_HANDLE_TO_FD_FLAGS_EXPORT_SYNC_FILE,
-      .fd = -1,
-   };
-
-   ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_HANDLE_TO_FD, &handle);
-   assert(!ret);
-   assert(handle.fd >= 0);
-
-   handle.handle = syncobj;
-   ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_FD_TO_HANDLE, &handle);
-   assert(!ret);
+   panvk_signal_event_syncobjs(queue, batch);
 
-   close(handle.fd);
+   util_dynarray_clear(&run->bos);
+   run->first_job = 0;
+   run->last_job = NULL;
+   run->job_index = 0;
+   run->last_batch = NULL;
 }
 
-static void
-panvk_add_wait_event_syncobjs(struct panvk_batch *batch, uint32_t *in_fences, unsigned *nr_in_fences)
+static bool
+panvk_batch_has_event_op(const struct panvk_batch *batch,
+                         bool wait)
 {
    util_dynarray_foreach(&batch->event_ops, struct panvk_event_op, op) {
-      switch (op->type) {
-      case PANVK_EVENT_OP_SET:
-         /* Nothing to do yet */
-         break;
-      case PANVK_EVENT_OP_RESET:
-         /* Nothing to do yet */
-         break;
-      case PANVK_EVENT_OP_WAIT:
-         in_fences[(*nr_in_fences)++] = op->event->syncobj;
-         break;
-      default:
-         unreachable("bad panvk_event_op type\n");
-      }
+      if ((op->type == PANVK_EVENT_OP_WAIT) == wait)
+         return true;
    }
+
+   return false;
 }
 
 static void
-panvk_signal_event_syncobjs(struct panvk_queue *queue, struct panvk_batch *batch)
+panvk_queue_add_batch(struct panvk_queue *queue,
+                      struct panvk_submit_run *run,
+                      struct panvk_cmd_buffer *cmdbuf,
+                      struct panvk_batch *batch,
+                      uint32_t *semaphores, unsigned nr_semaphores)
 {
    const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
+   unsigned nr_jobs = batch->scoreboard.job_index;
+
+   /* Start a new run if the batch waits on events, or if its job indices
+    * would overflow.
+    */
+   if (run->last_batch &&
+       (panvk_batch_has_event_op(batch, true) ||
+        run->job_index + 1 + nr_jobs > UINT16_MAX))
+      panvk_queue_submit_run(queue, run);
+
+   if (!run->last_batch) {
+      unsigned max_wait_event_syncobjs =
+         util_dynarray_num_elements(&batch->event_ops,
+                                    struct panvk_event_op);
+
+      run->in_fences = realloc(run->in_fences,
+                               sizeof(*run->in_fences) *
+                               (nr_semaphores + max_wait_event_syncobjs));
+      memcpy(run->in_fences, semaphores, nr_semaphores * sizeof(*run->in_fences));
+      run->nr_in_fences = nr_semaphores;
+      panvk_add_wait_event_syncobjs(batch, run->in_fences, &run->nr_in_fences);
+   }
 
-   util_dynarray_foreach(&batch->event_ops, struct panvk_event_op, op) {
-      switch (op->type) {
-      case PANVK_EVENT_OP_SET: {
-         panvk_queue_transfer_sync(queue, op->event->syncobj);
-         break;
-      }
-      case PANVK_EVENT_OP_RESET: {
-         struct panvk_event *event = op->event;
+   /* Reset the batch if it's already been issued */
+   if (batch->issued)
+      panvk_queue_reset_batch(queue, batch);
 
-         struct drm_syncobj_array objs = {
-            .handles = (uint64_t) (uintptr_t) &event->syncobj,
-            .count_handles = 1
-         };
+   if (batch->scoreboard.first_job) {
+      if (!run->first_job) {
+         panvk_batch_rebase_jobs(batch, 0);
+         run->first_job = batch->scoreboard.first_job;
+         run->job_index = nr_jobs;
+      } else {
+         /* The link job waits for all the jobs of the previous batches */
+         unsigned link_index = ++run->job_index;
+
+         pan_pack(batch->link_job.cpu, JOB_HEADER, cfg) {
+            cfg.type = MALI_JOB_TYPE_NULL;
+            cfg.barrier = true;
+            cfg.index = link_index;
+            cfg.next = batch->scoreboard.first_job;
+         }
 
-         int ret = drmIoctl(pdev->fd, DRM_IOCTL_SYNCOBJ_RESET, &objs);
-         assert(!ret);
-         break;
-      }
-      case PANVK_EVENT_OP_WAIT:
-         /* Nothing left to do */
-         break;
-      default:
-         unreachable("bad panvk_event_op type\n");
+         panvk_batch_rebase_jobs(batch, link_index);
+         panvk_job_set_next(run->last_job, batch->link_job.gpu);
+         run->job_index += nr_jobs;
       }
+
+      /* The batch might have been linked to another one last time */
+      assert(batch->scoreboard.prev_job);
+      run->last_job = batch->scoreboard.prev_job;
+      panvk_job_set_next(run->last_job, 0);
    }
+
+   panvk_submit_run_add_bos(run, pdev, cmdbuf, batch);
+   run->last_batch = batch;
+   batch->issued = true;
+
+   if (batch->fragment_job || panvk_batch_has_event_op(batch, false))
+      panvk_queue_submit_run(queue, run);
 }
 
 VkResult
@@ -202,7 +427,6 @@ panvk_per_arch(queue_submit)(struct vk_queue *vk_queue,
 {
    struct panvk_queue *queue =
       container_of(vk_queue, struct panvk_queue, vk);
-   const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
 
    unsigned nr_semaphores = submit->wait_count + 1;
    uint32_t semaphores[nr_semaphores];
@@ -216,76 +440,24 @@ panvk_per_arch(queue_submit)(struct vk_queue *vk_queue,
       semaphores[i + 1] = syncobj->syncobj;
    }
 
+   struct panvk_submit_run run = { 0 };
+
+   util_dynarray_init(&run.bos, NULL);
+
    for (uint32_t j = 0; j < submit->command_buffer_count; ++j) {
       struct panvk_cmd_buffer *cmdbuf =
          container_of(submit->command_buffers[j], struct panvk_cmd_buffer, vk);
 
       list_for_each_entry(struct panvk_batch, batch, &cmdbuf->batches, node) {
-         /* FIXME: should be done at the batch level */
-         unsigned nr_bos =
-            panvk_pool_num_bos(&cmdbuf->desc_pool) +
-            panvk_pool_num_bos(&cmdbuf->varying_pool) +
-            panvk_pool_num_bos(&cmdbuf->tls_pool) +
-            (batch->fb.info ? batch->fb.info->attachment_count : 0) +
-            (batch->blit.src ? 1 : 0) +
-            (batch->blit.dst ? 1 : 0) +
-            (batch->scoreboard.first_tiler ? 1 : 0) + 1;
-         unsigned bo_idx = 0;
-         uint32_t bos[nr_bos];
-
-         panvk_pool_get_bo_handles(&cmdbuf->desc_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->desc_pool);
-
-         panvk_pool_get_bo_handles(&cmdbuf->varying_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->varying_pool);
-
-         panvk_pool_get_bo_handles(&cmdbuf->tls_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->tls_pool);
-
-         if (batch->fb.info) {
-            for (unsigned i = 0; i < batch->fb.info->attachment_count; i++) {
-               bos[bo_idx++] = batch->fb.info->attachments[i].iview->pview.image->data.bo->gem_handle;
-            }
-         }
-
-         if (batch->blit.src)
-            bos[bo_idx++] = batch->blit.src->gem_handle;
-
-         if (batch->blit.dst)
-            bos[bo_idx++] = batch->blit.dst->gem_handle;
-
-         if (batch->scoreboard.first_tiler)
-            bos[bo_idx++] = pdev->tiler_heap->gem_handle;
-
-         bos[bo_idx++] = pdev->sample_positions->gem_handle;
-         assert(bo_idx == nr_bos);
-
-         /* Merge identical BO entries. */
-         for (unsigned x = 0; x < nr_bos; x++) {
-            for (unsigned y = x + 1; y < nr_bos; ) {
-               if (bos[x] == bos[y])
-                  bos[y] = bos[--nr_bos];
-               else
-                  y++;
-            }
-         }
-
-         unsigned nr_in_fences = 0;
-         unsigned max_wait_event_syncobjs =
-            util_dynarray_num_elements(&batch->event_ops,
-                                       struct panvk_event_op);
-         uint32_t in_fences[nr_semaphores + max_wait_event_syncobjs];
-         memcpy(in_fences, semaphores, nr_semaphores * sizeof(*in_fences));
-         nr_in_fences += nr_semaphores;
-
-         panvk_add_wait_event_syncobjs(batch, in_fences, &nr_in_fences);
-
-         panvk_queue_submit_batch(queue, batch, bos, nr_bos, in_fences, nr_in_fences);
-
-         panvk_signal_event_syncobjs(queue, batch);
+         panvk_queue_add_batch(queue, &run, cmdbuf, batch,
+                               semaphores, nr_semaphores);
       }
    }
 
+   panvk_queue_submit_run(queue, &run);
+   util_dynarray_fini(&run.bos);
+   free(run.in_fences);
+
    /* Transfer the out fence to signal semaphores */
    for (unsigned i = 0; i < submit->signal_count; i++) {
       assert(vk_sync_type_is_drm_syncobj(submit->signals[i].sync->type));
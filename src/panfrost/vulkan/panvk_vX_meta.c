@@ -25,6 +25,7 @@
 
 #include "nir/nir_builder.h"
 #include "pan_encoder.h"
+#include "pan_indirect_draw.h"
 #include "pan_shader.h"
 
 #include "panvk_private.h"
@@ -58,11 +59,23 @@ panvk_per_arch(meta_init)(struct panvk_physical_device *dev)
    panvk_per_arch(meta_blit_init)(dev);
    panvk_per_arch(meta_copy_init)(dev);
    panvk_per_arch(meta_clear_init)(dev);
+
+#if PANVK_GPU_INDIRECTS
+   panvk_pool_init(&dev->meta.indirect_draw.bin_pool, &dev->pdev, NULL,
+                   PAN_BO_EXECUTE, 16 * 1024,
+                   "panvk_meta indirect draw binary pool", false);
+   GENX(panfrost_init_indirect_draw_shaders)(&dev->pdev,
+                                             &dev->meta.indirect_draw.bin_pool.base);
+#endif
 }
 
 void
 panvk_per_arch(meta_cleanup)(struct panvk_physical_device *dev)
 {
+#if PANVK_GPU_INDIRECTS
+   GENX(panfrost_cleanup_indirect_draw_shaders)(&dev->pdev);
+   panvk_pool_cleanup(&dev->meta.indirect_draw.bin_pool);
+#endif
    panvk_per_arch(meta_blit_cleanup)(dev);
    panvk_pool_cleanup(&dev->meta.desc_pool);
    panvk_pool_cleanup(&dev->meta.bin_pool);
@@ -51,3 +51,18 @@ panvk_per_arch(meta_blit_cleanup)(struct panvk_physical_device *dev);
 
 void
 panvk_per_arch(meta_copy_init)(struct panvk_physical_device *dev);
+
+void
+panvk_per_arch(meta_fill)(struct panvk_cmd_buffer *cmdbuf,
+                          struct panfrost_bo *bo, mali_ptr start,
+                          uint64_t size, uint32_t val);
+
+void
+panvk_per_arch(meta_copy_query_results)(struct panvk_cmd_buffer *cmdbuf,
+                                        const struct panvk_query_pool *pool,
+                                        uint32_t first_query,
+                                        uint32_t query_count,
+                                        const struct panvk_buffer *dst,
+                                        VkDeviceSize offset,
+                                        VkDeviceSize stride,
+                                        VkQueryResultFlags flags);
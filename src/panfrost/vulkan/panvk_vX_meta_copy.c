@@ -1833,29 +1833,17 @@ panvk_meta_fill_buf_init(struct panvk_physical_device *dev)
                                    &dev->meta.desc_pool.base);
 }
 
-static void
-panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
-                    const struct panvk_buffer *dst,
-                    VkDeviceSize size, VkDeviceSize offset,
-                    uint32_t val)
+void
+panvk_per_arch(meta_fill)(struct panvk_cmd_buffer *cmdbuf,
+                          struct panfrost_bo *bo, mali_ptr start,
+                          uint64_t size, uint32_t val)
 {
    struct panvk_meta_fill_buf_info info = {
-      .start = panvk_buffer_gpu_ptr(dst, offset),
+      .start = start,
       .val = val,
    };
-   size = panvk_buffer_range(dst, offset, size);
-
-   /* From the Vulkan spec:
-    *
-    *    "size is the number of bytes to fill, and must be either a multiple
-    *    of 4, or VK_WHOLE_SIZE to fill the range from offset to the end of
-    *    the buffer. If VK_WHOLE_SIZE is used and the remaining size of the
-    *    buffer is not a multiple of 4, then the nearest smaller multiple is
-    *    used."
-    */
-   size &= ~3ull;
 
-   assert(!(offset & 3) && !(size & 3));
+   assert(!(start & 3) && !(size & 3));
 
    unsigned nwords = size / sizeof(uint32_t);
    mali_ptr rsd =
@@ -1882,10 +1870,32 @@ panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
 
    util_dynarray_append(&batch->jobs, void *, job.cpu);
 
-   batch->blit.dst = dst->bo;
+   batch->blit.dst = bo;
    panvk_per_arch(cmd_close_batch)(cmdbuf);
 }
 
+static void
+panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
+                    const struct panvk_buffer *dst,
+                    VkDeviceSize size, VkDeviceSize offset,
+                    uint32_t val)
+{
+   size = panvk_buffer_range(dst, offset, size);
+
+   /* From the Vulkan spec:
+    *
+    *    "size is the number of bytes to fill, and must be either a multiple
+    *    of 4, or VK_WHOLE_SIZE to fill the range from offset to the end of
+    *    the buffer. If VK_WHOLE_SIZE is used and the remaining size of the
+    *    buffer is not a multiple of 4, then the nearest smaller multiple is
+    *    used."
+    */
+   size &= ~3ull;
+
+   panvk_per_arch(meta_fill)(cmdbuf, dst->bo,
+                             panvk_buffer_gpu_ptr(dst, offset), size, val);
+}
+
 void
 panvk_per_arch(CmdFillBuffer)(VkCommandBuffer commandBuffer,
                               VkBuffer dstBuffer,
@@ -1953,6 +1963,192 @@ panvk_per_arch(CmdUpdateBuffer)(VkCommandBuffer commandBuffer,
    panvk_meta_update_buf(cmdbuf, dst, dstOffset, dataSize, pData);
 }
 
+struct panvk_meta_copy_query_info {
+   mali_ptr src;
+   mali_ptr dst;
+   uint32_t src_stride;
+   uint32_t dst_stride;
+   uint32_t result_count;
+   uint32_t flags;
+} PACKED;
+
+#define panvk_meta_copy_query_get_info_field(b, field) \
+        nir_load_push_constant((b), 1, \
+                     sizeof(((struct panvk_meta_copy_query_info *)0)->field) * 8, \
+                     nir_imm_int(b, 0), \
+                     .base = offsetof(struct panvk_meta_copy_query_info, field), \
+                     .range = ~0)
+
+static void
+panvk_meta_copy_query_store(nir_builder *b, nir_ssa_def *dst,
+                            nir_ssa_def *idx, nir_ssa_def *value,
+                            nir_ssa_def *is_64bit)
+{
+   nir_push_if(b, is_64bit);
+   {
+      nir_ssa_def *ptr =
+         nir_iadd(b, dst, nir_u2u64(b, nir_imul_imm(b, idx, sizeof(uint64_t))));
+      nir_store_global(b, ptr, sizeof(uint64_t),
+                       nir_unpack_64_2x32(b, value), 0x3);
+   }
+   nir_push_else(b, NULL);
+   {
+      nir_ssa_def *ptr =
+         nir_iadd(b, dst, nir_u2u64(b, nir_imul_imm(b, idx, sizeof(uint32_t))));
+      nir_store_global(b, ptr, sizeof(uint32_t), nir_u2u32(b, value), 0x1);
+   }
+   nir_pop_if(b, NULL);
+}
+
+/* One invocation per (query, result). Each result is the sum of sum_count
+ * 64-bit values, which lets us resolve the per-core occlusion counters on
+ * the GPU.
+ */
+static mali_ptr
+panvk_meta_copy_query_results_shader(struct panfrost_device *pdev,
+                                     struct pan_pool *bin_pool,
+                                     unsigned sum_count,
+                                     struct pan_shader_info *shader_info)
+{
+   nir_builder b =
+      nir_builder_init_simple_shader(MESA_SHADER_COMPUTE,
+                                     GENX(pan_shader_get_compiler_options)(),
+                                     "panvk_meta_copy_query_results(sum_count=%d)",
+                                     sum_count);
+
+   nir_ssa_def *coord = nir_load_global_invocation_id(&b, 32);
+   nir_ssa_def *query = nir_channel(&b, coord, 0);
+   nir_ssa_def *result = nir_channel(&b, coord, 1);
+   nir_ssa_def *flags = panvk_meta_copy_query_get_info_field(&b, flags);
+   nir_ssa_def *is_64bit = nir_test_mask(&b, flags, VK_QUERY_RESULT_64_BIT);
+
+   nir_ssa_def *src =
+      nir_iadd(&b, panvk_meta_copy_query_get_info_field(&b, src),
+               nir_u2u64(&b, nir_imul(&b, query,
+                                      panvk_meta_copy_query_get_info_field(&b, src_stride))));
+   nir_ssa_def *dst =
+      nir_iadd(&b, panvk_meta_copy_query_get_info_field(&b, dst),
+               nir_u2u64(&b, nir_imul(&b, query,
+                                      panvk_meta_copy_query_get_info_field(&b, dst_stride))));
+
+   /* The availability word is either 0 or 1, the low half is enough */
+   nir_ssa_def *available =
+      nir_ine_imm(&b, nir_load_global(&b, src, sizeof(uint64_t), 1, 32), 0);
+
+   nir_push_if(&b, nir_ior(&b, available,
+                           nir_test_mask(&b, flags, VK_QUERY_RESULT_PARTIAL_BIT)));
+   {
+      nir_ssa_def *first = nir_iadd_imm(&b, nir_imul_imm(&b, result, sum_count), 1);
+      nir_ssa_def *value = nir_imm_int64(&b, 0);
+
+      for (unsigned i = 0; i < sum_count; i++) {
+         nir_ssa_def *offset =
+            nir_imul_imm(&b, nir_iadd_imm(&b, first, i), sizeof(uint64_t));
+         nir_ssa_def *ptr = nir_iadd(&b, src, nir_u2u64(&b, offset));
+
+         value = nir_iadd(&b, value,
+                          nir_pack_64_2x32(&b, nir_load_global(&b, ptr, sizeof(uint64_t), 2, 32)));
+      }
+
+      panvk_meta_copy_query_store(&b, dst, result, value, is_64bit);
+   }
+   nir_pop_if(&b, NULL);
+
+   nir_push_if(&b, nir_iand(&b, nir_ieq_imm(&b, result, 0),
+                            nir_test_mask(&b, flags, VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)));
+   {
+      panvk_meta_copy_query_store(&b, dst,
+                                  panvk_meta_copy_query_get_info_field(&b, result_count),
+                                  nir_b2i64(&b, available), is_64bit);
+   }
+   nir_pop_if(&b, NULL);
+
+   struct panfrost_compile_inputs inputs = {
+      .gpu_id = pdev->gpu_id,
+      .is_blit = true,
+      .no_ubo_to_push = true,
+   };
+
+   struct util_dynarray binary;
+
+   util_dynarray_init(&binary, NULL);
+   GENX(pan_shader_compile)(b.shader, &inputs, &binary, shader_info);
+
+   shader_info->push.count = DIV_ROUND_UP(sizeof(struct panvk_meta_copy_query_info), 4);
+
+   mali_ptr shader =
+      pan_pool_upload_aligned(bin_pool, binary.data, binary.size, 128);
+
+   util_dynarray_fini(&binary);
+   ralloc_free(b.shader);
+
+   return shader;
+}
+
+static void
+panvk_meta_copy_query_results_init(struct panvk_physical_device *dev)
+{
+   for (unsigned i = 0; i < ARRAY_SIZE(dev->meta.copy.query_results); i++) {
+      struct pan_shader_info shader_info;
+      unsigned sum_count = i ? dev->pdev.core_count : 1;
+      mali_ptr shader =
+         panvk_meta_copy_query_results_shader(&dev->pdev, &dev->meta.bin_pool.base,
+                                              sum_count, &shader_info);
+      dev->meta.copy.query_results[i].rsd =
+         panvk_meta_copy_to_buf_emit_rsd(&dev->pdev, &dev->meta.desc_pool.base,
+                                         shader, &shader_info, false);
+   }
+}
+
+void
+panvk_per_arch(meta_copy_query_results)(struct panvk_cmd_buffer *cmdbuf,
+                                        const struct panvk_query_pool *pool,
+                                        uint32_t first_query,
+                                        uint32_t query_count,
+                                        const struct panvk_buffer *dst,
+                                        VkDeviceSize offset,
+                                        VkDeviceSize stride,
+                                        VkQueryResultFlags flags)
+{
+   struct panvk_meta_copy_query_info info = {
+      .src = panvk_query_gpu_ptr(pool, first_query),
+      .dst = panvk_buffer_gpu_ptr(dst, offset),
+      .src_stride = pool->query_stride,
+      .dst_stride = stride,
+      .result_count = pool->result_count,
+      .flags = flags,
+   };
+
+   /* Only occlusion queries have several values per result, one per core */
+   mali_ptr rsd =
+      cmdbuf->device->physical_device->meta.copy.query_results[pool->sum_count > 1].rsd;
+
+   mali_ptr pushconsts =
+      pan_pool_upload_aligned(&cmdbuf->desc_pool.base, &info, sizeof(info), 16);
+
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+
+   struct panvk_batch *batch = panvk_cmd_open_batch(cmdbuf);
+
+   panvk_per_arch(cmd_alloc_tls_desc)(cmdbuf, false);
+
+   mali_ptr tsd = batch->tls.gpu;
+
+   struct pan_compute_dim num_wg = { query_count, pool->result_count, 1 };
+   struct pan_compute_dim wg_sz = { 1, 1, 1};
+   struct panfrost_ptr job =
+     panvk_meta_copy_emit_compute_job(&cmdbuf->desc_pool.base,
+                                      &batch->scoreboard,
+                                      &num_wg, &wg_sz,
+                                      0, 0, pushconsts, rsd, tsd);
+
+   util_dynarray_append(&batch->jobs, void *, job.cpu);
+
+   batch->blit.src = pool->bo;
+   batch->blit.dst = dst->bo;
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+}
+
 void
 panvk_per_arch(meta_copy_init)(struct panvk_physical_device *dev)
 {
@@ -1962,4 +2158,5 @@ panvk_per_arch(meta_copy_init)(struct panvk_physical_device *dev)
    panvk_meta_copy_img2buf_init(dev);
    panvk_meta_copy_buf2buf_init(dev);
    panvk_meta_fill_buf_init(dev);
+   panvk_meta_copy_query_results_init(dev);
 }
@@ -46,7 +46,7 @@
 struct panvk_pipeline_builder
 {
    struct panvk_device *device;
-   struct panvk_pipeline_cache *cache;
+   struct vk_pipeline_cache *cache;
    const VkAllocationCallbacks *alloc;
    struct {
       const VkGraphicsPipelineCreateInfo *gfx;
@@ -95,7 +95,7 @@ panvk_pipeline_builder_finish(struct panvk_pipeline_builder *builder)
    for (uint32_t i = 0; i < MESA_SHADER_STAGES; i++) {
       if (!builder->shaders[i])
          continue;
-      panvk_shader_destroy(builder->device, builder->shaders[i], builder->alloc);
+      panvk_shader_destroy(builder->device, builder->shaders[i]);
    }
 }
 
@@ -139,7 +139,7 @@ panvk_pipeline_builder_compile_shaders(struct panvk_pipeline_builder *builder,
                                              &pipeline->blend.state,
                                              panvk_pipeline_static_state(pipeline,
                                                                          VK_DYNAMIC_STATE_BLEND_CONSTANTS),
-                                             builder->alloc);
+                                             builder->cache);
       if (!shader)
          return VK_ERROR_OUT_OF_HOST_MEMORY;
  
@@ -273,6 +273,11 @@ panvk_pipeline_builder_init_shaders(struct panvk_pipeline_builder *builder,
          pipeline->ia.writes_point_size = points;
       }
 
+      if (i == MESA_SHADER_VERTEX) {
+         pipeline->vs.idvs = shader->info.vs.idvs;
+         pipeline->vs.secondary_shader = shader->info.vs.secondary_enable;
+      }
+
       mali_ptr shader_ptr = 0;
 
       /* Handle empty shaders gracefully */
@@ -798,6 +803,14 @@ panvk_pipeline_builder_collect_varyings(struct panvk_pipeline_builder *builder,
       }
    }
 
+#if PANVK_GPU_INDIRECTS
+   /* The indirect draw job patches the general and position varying
+    * buffers at fixed indices, make sure both are always present.
+    */
+   pipeline->varyings.buf_mask |= BITFIELD_BIT(PANVK_VARY_BUF_GENERAL) |
+                                  BITFIELD_BIT(PANVK_VARY_BUF_POSITION);
+#endif
+
    /* TODO: Xfb */
    gl_varying_slot loc;
    BITSET_FOREACH_SET(loc, pipeline->varyings.active, VARYING_SLOT_MAX) {
@@ -917,7 +930,7 @@ panvk_pipeline_builder_build(struct panvk_pipeline_builder *builder,
 static void
 panvk_pipeline_builder_init_graphics(struct panvk_pipeline_builder *builder,
                                      struct panvk_device *dev,
-                                     struct panvk_pipeline_cache *cache,
+                                     struct vk_pipeline_cache *cache,
                                      const VkGraphicsPipelineCreateInfo *create_info,
                                      const VkAllocationCallbacks *alloc)
 {
@@ -967,7 +980,10 @@ panvk_per_arch(CreateGraphicsPipelines)(VkDevice device,
                                         VkPipeline *pPipelines)
 {
    VK_FROM_HANDLE(panvk_device, dev, device);
-   VK_FROM_HANDLE(panvk_pipeline_cache, cache, pipelineCache);
+   VK_FROM_HANDLE(vk_pipeline_cache, cache, pipelineCache);
+
+   if (!cache)
+      cache = dev->mem_cache;
 
    for (uint32_t i = 0; i < count; i++) {
       struct panvk_pipeline_builder builder;
@@ -996,7 +1012,7 @@ panvk_per_arch(CreateGraphicsPipelines)(VkDevice device,
 static void
 panvk_pipeline_builder_init_compute(struct panvk_pipeline_builder *builder,
                                     struct panvk_device *dev,
-                                    struct panvk_pipeline_cache *cache,
+                                    struct vk_pipeline_cache *cache,
                                     const VkComputePipelineCreateInfo *create_info,
                                     const VkAllocationCallbacks *alloc)
 {
@@ -1020,7 +1036,10 @@ panvk_per_arch(CreateComputePipelines)(VkDevice device,
                                        VkPipeline *pPipelines)
 {
    VK_FROM_HANDLE(panvk_device, dev, device);
-   VK_FROM_HANDLE(panvk_pipeline_cache, cache, pipelineCache);
+   VK_FROM_HANDLE(vk_pipeline_cache, cache, pipelineCache);
+
+   if (!cache)
+      cache = dev->mem_cache;
 
    for (uint32_t i = 0; i < count; i++) {
       struct panvk_pipeline_builder builder;
@@ -0,0 +1,193 @@
+/*
+ * Copyright © 2022 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "gen_macros.h"
+
+#include "panvk_private.h"
+
+/* Query writes are performed by WRITE_VALUE jobs once the current batch is
+ * complete. If there's no batch, one is created so they are ordered with
+ * respect to the previous commands.
+ */
+static void
+panvk_cmd_add_query_writes(struct panvk_cmd_buffer *cmdbuf,
+                           const struct panvk_query_write *writes,
+                           unsigned count)
+{
+   bool close_batch = !cmdbuf->state.batch;
+
+   if (close_batch)
+      panvk_cmd_open_batch(cmdbuf);
+
+   for (unsigned i = 0; i < count; i++) {
+      util_dynarray_append(&cmdbuf->state.batch->query_writes,
+                           struct panvk_query_write, writes[i]);
+   }
+
+   if (close_batch)
+      panvk_per_arch(cmd_close_batch)(cmdbuf);
+}
+
+void
+panvk_per_arch(CmdResetQueryPool)(VkCommandBuffer commandBuffer,
+                                  VkQueryPool queryPool,
+                                  uint32_t firstQuery,
+                                  uint32_t queryCount)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   /* vkCmdResetQueryPool cannot be called inside a render pass */
+   assert(cmdbuf->state.pass == NULL);
+
+   if (!queryCount)
+      return;
+
+   panvk_per_arch(meta_fill)(cmdbuf, pool->bo,
+                             panvk_query_gpu_ptr(pool, firstQuery),
+                             (uint64_t)pool->query_stride * queryCount, 0);
+}
+
+void
+panvk_per_arch(CmdBeginQuery)(VkCommandBuffer commandBuffer,
+                              VkQueryPool queryPool,
+                              uint32_t query,
+                              VkQueryControlFlags flags)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   switch (pool->type) {
+   case VK_QUERY_TYPE_OCCLUSION:
+      /* Counters are always precise, and were zeroed by the reset. Draws
+       * recorded from now on increment them.
+       */
+      cmdbuf->state.query.occlusion =
+         panvk_query_gpu_ptr(pool, query) + sizeof(uint64_t);
+      break;
+   case VK_QUERY_TYPE_PIPELINE_STATISTICS:
+      cmdbuf->state.query.stats_pool = pool;
+      memset(cmdbuf->state.query.stats, 0, sizeof(cmdbuf->state.query.stats));
+      break;
+   default:
+      unreachable("Unsupported query type");
+   }
+}
+
+void
+panvk_per_arch(CmdEndQuery)(VkCommandBuffer commandBuffer,
+                            VkQueryPool queryPool,
+                            uint32_t query)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   struct panvk_query_write writes[MAX_PIPELINE_STATISTICS + 1];
+   mali_ptr ptr = panvk_query_gpu_ptr(pool, query);
+   unsigned nwrites = 0;
+
+   switch (pool->type) {
+   case VK_QUERY_TYPE_OCCLUSION:
+      cmdbuf->state.query.occlusion = 0;
+      break;
+   case VK_QUERY_TYPE_PIPELINE_STATISTICS:
+      /* Statistics are known at record time, write them as immediates */
+      u_foreach_bit(stat, pool->pipeline_statistics) {
+         assert(stat < MAX_PIPELINE_STATISTICS);
+         writes[nwrites] = (struct panvk_query_write) {
+            .addr = ptr + ((nwrites + 1) * sizeof(uint64_t)),
+            .value = cmdbuf->state.query.stats[stat],
+         };
+         nwrites++;
+      }
+
+      cmdbuf->state.query.stats_pool = NULL;
+      break;
+   default:
+      unreachable("Unsupported query type");
+   }
+
+   writes[nwrites++] = (struct panvk_query_write) {
+      .addr = ptr,
+      .value = 1,
+      .availability = true,
+   };
+
+   panvk_cmd_add_query_writes(cmdbuf, writes, nwrites);
+}
+
+void
+panvk_per_arch(CmdWriteTimestamp2)(VkCommandBuffer commandBuffer,
+                                   VkPipelineStageFlags2 stage,
+                                   VkQueryPool queryPool,
+                                   uint32_t query)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   mali_ptr ptr = panvk_query_gpu_ptr(pool, query);
+
+   /* The timestamp is sampled once all the previous work is done, whatever
+    * the stage.
+    */
+   const struct panvk_query_write writes[] = {
+      {
+         .addr = ptr + sizeof(uint64_t),
+         .timestamp = true,
+      },
+      {
+         .addr = ptr,
+         .value = 1,
+         .availability = true,
+      },
+   };
+
+   panvk_cmd_add_query_writes(cmdbuf, writes, ARRAY_SIZE(writes));
+}
+
+void
+panvk_per_arch(CmdCopyQueryPoolResults)(VkCommandBuffer commandBuffer,
+                                        VkQueryPool queryPool,
+                                        uint32_t firstQuery,
+                                        uint32_t queryCount,
+                                        VkBuffer dstBuffer,
+                                        VkDeviceSize dstOffset,
+                                        VkDeviceSize stride,
+                                        VkQueryResultFlags flags)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   VK_FROM_HANDLE(panvk_buffer, dst, dstBuffer);
+
+   /* vkCmdCopyQueryPoolResults cannot be called inside a render pass */
+   assert(cmdbuf->state.pass == NULL);
+
+   if (!queryCount)
+      return;
+
+   /* Batches are executed in order, so the availability words of queries
+    * ended in previous commands are already written when the copy job runs,
+    * which makes VK_QUERY_RESULT_WAIT_BIT implicit.
+    */
+   panvk_per_arch(meta_copy_query_results)(cmdbuf, pool, firstQuery,
+                                           queryCount, dst, dstOffset,
+                                           stride, flags);
+}
@@ -91,6 +91,24 @@ panvk_inline_blend_constants(nir_builder *b, nir_instr *instr, void *data)
    return true;
 }
 
+/* Update the equation to force a color replacement, blending being done in
+ * the shader */
+static void
+panvk_force_blend_replace(struct pan_blend_rt_state *rt_state)
+{
+   rt_state->equation.color_mask = 0xf;
+   rt_state->equation.rgb_func = BLEND_FUNC_ADD;
+   rt_state->equation.rgb_src_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.rgb_invert_src_factor = true;
+   rt_state->equation.rgb_dst_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.rgb_invert_dst_factor = false;
+   rt_state->equation.alpha_func = BLEND_FUNC_ADD;
+   rt_state->equation.alpha_src_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.alpha_invert_src_factor = true;
+   rt_state->equation.alpha_dst_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.alpha_invert_dst_factor = false;
+}
+
 static void
 panvk_lower_blend(struct panfrost_device *pdev,
                   nir_shader *nir,
@@ -140,18 +158,7 @@ panvk_lower_blend(struct panfrost_device *pdev,
          options.rt[rt].alpha.invert_dst_factor = rt_state->equation.alpha_invert_dst_factor;
       }
 
-      /* Update the equation to force a color replacement */
-      rt_state->equation.color_mask = 0xf;
-      rt_state->equation.rgb_func = BLEND_FUNC_ADD;
-      rt_state->equation.rgb_src_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.rgb_invert_src_factor = true;
-      rt_state->equation.rgb_dst_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.rgb_invert_dst_factor = false;
-      rt_state->equation.alpha_func = BLEND_FUNC_ADD;
-      rt_state->equation.alpha_src_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.alpha_invert_src_factor = true;
-      rt_state->equation.alpha_dst_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.alpha_invert_dst_factor = false;
+      panvk_force_blend_replace(rt_state);
       lower_blend = true;
 
       inputs->bifrost.static_rt_conv = true;
@@ -215,6 +222,61 @@ shared_type_info(const struct glsl_type *type, unsigned *size, unsigned *align)
    *align = comp_size * (length == 3 ? 4 : length);
 }
 
+/* Hashes everything the compiled shader depends on */
+static void
+panvk_shader_compute_key(struct panvk_device *dev,
+                         gl_shader_stage stage,
+                         const VkPipelineShaderStageCreateInfo *stage_info,
+                         const struct panvk_pipeline_layout *layout,
+                         unsigned sysval_ubo,
+                         const struct pan_blend_state *blend_state,
+                         bool static_blend_constants,
+                         unsigned char *sha1)
+{
+   VK_FROM_HANDLE(vk_shader_module, module, stage_info->module);
+   const VkSpecializationInfo *spec = stage_info->pSpecializationInfo;
+   struct mesa_sha1 ctx;
+
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, &dev->physical_device->pdev.gpu_id,
+                     sizeof(dev->physical_device->pdev.gpu_id));
+   _mesa_sha1_update(&ctx, &stage, sizeof(stage));
+   _mesa_sha1_update(&ctx, module->sha1, sizeof(module->sha1));
+   _mesa_sha1_update(&ctx, stage_info->pName, strlen(stage_info->pName));
+
+   if (spec) {
+      _mesa_sha1_update(&ctx, spec->pMapEntries,
+                        spec->mapEntryCount * sizeof(*spec->pMapEntries));
+      _mesa_sha1_update(&ctx, spec->pData, spec->dataSize);
+   }
+
+   _mesa_sha1_update(&ctx, layout->sha1, sizeof(layout->sha1));
+   _mesa_sha1_update(&ctx, &sysval_ubo, sizeof(sysval_ubo));
+
+   bool robust = dev->vk.enabled_features.robustBufferAccess;
+   _mesa_sha1_update(&ctx, &robust, sizeof(robust));
+
+   if (stage == MESA_SHADER_FRAGMENT) {
+      _mesa_sha1_update(&ctx, &blend_state->logicop_enable,
+                        sizeof(blend_state->logicop_enable));
+      _mesa_sha1_update(&ctx, &blend_state->logicop_func,
+                        sizeof(blend_state->logicop_func));
+      _mesa_sha1_update(&ctx, &blend_state->rt_count,
+                        sizeof(blend_state->rt_count));
+      _mesa_sha1_update(&ctx, blend_state->rts,
+                        blend_state->rt_count * sizeof(blend_state->rts[0]));
+      _mesa_sha1_update(&ctx, &static_blend_constants,
+                        sizeof(static_blend_constants));
+
+      if (static_blend_constants) {
+         _mesa_sha1_update(&ctx, blend_state->constants,
+                           sizeof(blend_state->constants));
+      }
+   }
+
+   _mesa_sha1_final(&ctx, sha1);
+}
+
 struct panvk_shader *
 panvk_per_arch(shader_create)(struct panvk_device *dev,
                               gl_shader_stage stage,
@@ -223,19 +285,34 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                               unsigned sysval_ubo,
                               struct pan_blend_state *blend_state,
                               bool static_blend_constants,
-                              const VkAllocationCallbacks *alloc)
+                              struct vk_pipeline_cache *cache)
 {
    VK_FROM_HANDLE(vk_shader_module, module, stage_info->module);
    struct panfrost_device *pdev = &dev->physical_device->pdev;
    struct panvk_shader *shader;
+   unsigned char sha1[SHA1_DIGEST_LENGTH];
+
+   panvk_shader_compute_key(dev, stage, stage_info, layout, sysval_ubo,
+                            blend_state, static_blend_constants, sha1);
+
+   shader = panvk_shader_cache_lookup(cache, sha1);
+   if (shader) {
+      /* Blending lowered to the shader replaces the fixed-function
+       * equation, which the pipeline still needs to know about */
+      if (stage == MESA_SHADER_FRAGMENT) {
+         for (unsigned rt = 0; rt < blend_state->rt_count; rt++) {
+            if (panvk_per_arch(blend_needs_lowering)(pdev, blend_state, rt))
+               panvk_force_blend_replace(&blend_state->rts[rt]);
+         }
+      }
 
-   shader = vk_zalloc2(&dev->vk.alloc, alloc, sizeof(*shader), 8,
-                       VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+      return shader;
+   }
+
+   shader = panvk_shader_alloc(dev, sha1);
    if (!shader)
       return NULL;
 
-   util_dynarray_init(&shader->binary, NULL);
-
    /* TODO these are made-up */
    const struct spirv_to_nir_options spirv_options = {
       .caps = {
@@ -255,7 +332,7 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                                              GENX(pan_shader_get_compiler_options)(),
                                              NULL, &nir);
    if (result != VK_SUCCESS) {
-      vk_free2(&dev->vk.alloc, alloc, shader);
+      panvk_shader_destroy(dev, shader);
       return NULL;
    }
 
@@ -268,7 +345,6 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
    struct panfrost_compile_inputs inputs = {
       .gpu_id = pdev->gpu_id,
       .no_ubo_to_push = true,
-      .no_idvs = true, /* TODO */
       .fixed_sysval_ubo = sysval_ubo,
       .fixed_sysval_layout = &fixed_sysvals,
    };
@@ -392,5 +468,5 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
 
    ralloc_free(nir);
 
-   return shader;
+   return panvk_shader_cache_add(cache, shader);
 }